@@ -147,6 +147,10 @@ inline void arch_cpu::init_on_cpu()
     if (features().xsave) {
         cr4 |= cr4_osxsave;
     }
+    // Our single address space runs as PCID 0, which CR3 already says
+    if (features().pcid && features().invpcid) {
+        cr4 |= cr4_pcide;
+    }
     write_cr4(cr4);
 
     // We can't trust the FPU and the MXCSR to be always initialized to default values.
@@ -24,6 +24,7 @@ public:
     bool accessed() const { return x & 0x20; }
     bool dirty() const { return x & 0x40; }
     bool large() const { return x & 0x80; }
+    bool global() const { return x & 0x100; }
     bool nx() const { return x >> 63; }
     phys addr(bool large) const {
         auto v = x & ((u64(1) << (64-page_size_shift)) - 1);
@@ -40,6 +41,7 @@ public:
     void set_accessed(bool v) { set_bit(5, v); }
     void set_dirty(bool v) { set_bit(6, v); }
     void set_large(bool v) { set_bit(7, v); }
+    void set_global(bool v) { set_bit(8, v); }
     void set_nx(bool v) { set_bit(63, v); }
     void set_addr(phys addr, bool large) {
         auto mask = 0x8000000000000fff | (u64(large) << page_size_shift);
@@ -8,6 +8,8 @@
 #include "cpuid.hh"
 #include "processor.hh"
 #include "xen.hh"
+#include <osv/ilog2.hh>
+#include <algorithm>
 
 namespace processor {
 
@@ -18,6 +20,12 @@ const features_type& features()
     return f;
 }
 
+const topology_type& topology()
+{
+    static topology_type t;
+    return t;
+}
+
 namespace {
 
 struct signature {
@@ -45,6 +53,7 @@ cpuid_bit cpuid_bits[] = {
     { 1, 'c', 0, &f::sse3 },
     { 1, 'c', 9, &f::ssse3 },
     { 1, 'c', 13, &f::cmpxchg16b },
+    { 1, 'c', 17, &f::pcid },
     { 1, 'c', 19, &f::sse4_1 },
     { 1, 'c', 20, &f::sse4_2 },
     { 1, 'c', 21, &f::x2apic },
@@ -54,6 +63,7 @@ cpuid_bit cpuid_bits[] = {
     { 1, 'c', 30, &f::rdrand },
     { 7, 'b', 0, &f::fsgsbase, 0 },
     { 7, 'b', 9, &f::repmovsb, 0 },
+    { 7, 'b', 10, &f::invpcid, 0 },
     { 0x80000001, 'd', 26, &f::gbpage },
     { 0x80000007, 'd', 8, &f::invariant_tsc },
     { 0x40000001, 'a', 0, &f::kvm_clocksource, 0, &kvm_signature },
@@ -114,6 +124,65 @@ void process_cpuid(features_type& features)
     process_xen_bits(features);
 }
 
+// Leaf 0xb enumerates the levels of the APIC ID; level type 1 is SMT.
+bool smt_shift_from_cpuid(unsigned& shift)
+{
+    if (cpuid(0).a < 0xb) {
+        return false;
+    }
+    for (unsigned level = 0; level < 8; ++level) {
+        auto x = cpuid(0xb, level);
+        auto type = (x.c >> 8) & 0xff;
+        if (type == 0) {
+            break;
+        }
+        if (type == 1) {
+            shift = x.a & 0x1f;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The deterministic cache parameters leaves (4 on Intel, 0x8000001d on AMD)
+// list the caches, and how many logical cpus share each one.
+bool llc_shift_from_cpuid(unsigned leaf, unsigned& shift)
+{
+    unsigned llc_level = 0;
+    for (unsigned i = 0; i < 16; ++i) {
+        auto x = cpuid(leaf, i);
+        if ((x.a & 0x1f) == 0) {
+            break;
+        }
+        unsigned level = (x.a >> 5) & 7;
+        if (level > llc_level) {
+            llc_level = level;
+            shift = ilog2_roundup(((x.a >> 14) & 0xfff) + 1);
+        }
+    }
+    return llc_level != 0;
+}
+
+void process_topology(topology_type& t)
+{
+    if (!smt_shift_from_cpuid(t.smt_shift)) {
+        t.smt_shift = 0;
+    }
+    bool llc = false;
+    if (cpuid(0).a >= 4) {
+        llc = llc_shift_from_cpuid(4, t.llc_shift);
+    }
+    if (!llc && cpuid(0x80000000).a >= 0x8000001d
+            && (cpuid(0x80000001).c & (1 << 22))) {
+        llc = llc_shift_from_cpuid(0x8000001d, t.llc_shift);
+    }
+    if (!llc) {
+        // Unknown; assume all cpus share the cache.
+        t.llc_shift = 32;
+    }
+    t.llc_shift = std::max(t.llc_shift, t.smt_shift);
+}
+
 }
 
 features_type::features_type()
@@ -121,4 +190,9 @@ features_type::features_type()
     process_cpuid(*this);
 }
 
+topology_type::topology_type()
+{
+    process_topology(*this);
+}
+
 }
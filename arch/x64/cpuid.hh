@@ -20,10 +20,12 @@ struct features_type {
     bool x2apic;
     bool tsc_deadline;
     bool xsave;
+    bool pcid;
     bool avx;
     bool rdrand;
     bool fsgsbase;
     bool repmovsb;
+    bool invpcid;
     bool gbpage;
     bool invariant_tsc;
     bool kvm_clocksource;
@@ -37,6 +39,18 @@ struct features_type {
 
 extern const features_type& features();
 
+// Cpu topology, as seen in the APIC ID: logical cpus whose APIC IDs are equal
+// after shifting right by smt_shift are SMT siblings (hyperthreads of one
+// core), and those equal after shifting by llc_shift share the last level
+// cache.
+struct topology_type {
+    topology_type();
+    unsigned smt_shift;
+    unsigned llc_shift;
+};
+
+extern const topology_type& topology();
+
 }
 
 
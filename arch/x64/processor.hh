@@ -92,6 +92,25 @@ inline void write_cr3(ulong r) {
     asm volatile ("mov %0, %%cr3" : : "r"(r));
 }
 
+inline void invlpg(const void* addr) {
+    asm volatile ("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+enum class invpcid_type : ulong {
+    address = 0,        // one address, in one PCID
+    single_context = 1, // everything non-global, in one PCID
+    all_global = 2,     // everything, including global translations
+    all = 3,            // everything non-global, in all PCIDs
+};
+
+inline void invpcid(invpcid_type type, ulong pcid, const void* addr) {
+    struct {
+        u64 pcid;
+        const void* addr;
+    } desc = { pcid, addr };
+    asm volatile ("invpcid %0, %1" : : "m"(desc), "r"(ulong(type)) : "memory");
+}
+
 inline ulong read_cr4() {
     ulong r;
     asm volatile ("mov %%cr4, %0" : "=r"(r));
@@ -320,6 +339,12 @@ inline void cli_notrace()
     asm volatile ("cli" : : : "memory");
 }
 
+// Hint to the cpu that we are in a spin loop
+inline void pause()
+{
+    asm volatile ("pause" : : : "memory");
+}
+
 inline u64 rdtsc()
 {
     u32 lo, hi;
@@ -9,6 +9,7 @@
 #include "processor.hh"
 #include "msr.hh"
 #include "apic.hh"
+#include "cpuid.hh"
 #include <osv/mmu.hh>
 #include <string.h>
 extern "C" {
@@ -57,6 +58,8 @@ void parse_madt()
             auto c = new sched::cpu(nr_cpus++);
             c->arch.apic_id = lapic->Id;
             c->arch.acpi_id = lapic->ProcessorId;
+            c->core_id = lapic->Id >> topology().smt_shift;
+            c->llc_id = topology().llc_shift < 32 ? lapic->Id >> topology().llc_shift : 0;
             c->arch.initstack.next = smp_stack_free;
             smp_stack_free = &c->arch.initstack;
             sched::cpus.push_back(c);
@@ -78,7 +81,8 @@ void __attribute__((constructor(init_prio::sched))) smp_init()
         c->incoming_wakeups = new sched::cpu::incoming_wakeup_queue[sched::cpus.size()];
     }
     smpboot_cr0 = read_cr0();
-    smpboot_cr4 = read_cr4();
+    // CR4.PCIDE can only be set in long mode, init_on_cpu() does it
+    smpboot_cr4 = read_cr4() & ~cr4_pcide;
     smpboot_efer = rdmsr(msr::IA32_EFER);
     smpboot_cr3 = read_cr3();
     memcpy(mmu::phys_to_virt(0), smpboot, smpboot_end - smpboot);
@@ -111,9 +115,10 @@ void smp_launch()
         if (c == boot_cpu) {
             sched::thread::current()->_detached_state->_cpu = c;
             // c->init_on_cpu() already done in main().
+            // The balancer looks at the idle thread, so create it first.
+            c->init_idle_thread();
             (new sched::thread([c] { c->load_balance(); },
                     sched::thread::attr().pin(c).name(name)))->start();
-            c->init_idle_thread();
             c->idle_thread->start();
             continue;
         }
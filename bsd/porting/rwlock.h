@@ -46,11 +46,21 @@ __BEGIN_DECLS
  * be used instead.
  */
 
+/*
+ * Options passed to rw_init_flags().
+ */
+#define	RW_DUPOK	0x01
+#define	RW_NOPROFILE	0x02
+#define	RW_NOWITNESS	0x04
+#define	RW_QUIET	0x08
+#define	RW_RECURSE	0x10
+#define	RW_READ_MOSTLY	0x20	/* OSv: count readers per-cpu */
+
 #define rw_init(rw, name)   rw_init_flags((rw), (name), 0)
 #define rw_destroy(rw)      rwlock_destroy((rw))
 static inline
 void rw_init_flags(struct rwlock *rw, const char *name, int opts) {
-    rwlock_init(rw);
+    rwlock_init_flags(rw, (opts & RW_READ_MOSTLY) ? RWLOCK_READ_MOSTLY : 0);
 }
 
 /*
@@ -68,15 +78,6 @@ void rw_init_flags(struct rwlock *rw, const char *name, int opts) {
 #define	RW_SYSINIT(name, rw, desc)
 #define	RW_SYSINIT_FLAGS(name, rw, desc, flags)
 
-/*
- * Options passed to rw_init_flags().
- */
-#define	RW_DUPOK	0x01
-#define	RW_NOPROFILE	0x02
-#define	RW_NOWITNESS	0x04
-#define	RW_QUIET	0x08
-#define	RW_RECURSE	0x10
-
 #define	rw_assert(rw, what)
 
 __END_DECLS
@@ -0,0 +1,342 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ */
+
+/*
+ * LZ4 compression, compatible with the illumos "lz4_compress" pool feature.
+ *
+ * The data is a single LZ4 block: a sequence of tokens, each made of a run
+ * of literal bytes followed by a match (a copy of earlier output, given as
+ * a 16-bit little-endian backwards offset and a length of at least
+ * MINMATCH). The high nibble of the token byte is the literal run length
+ * and the low nibble is the match length minus MINMATCH; a nibble of 15
+ * means that more length bytes follow, each added to it, until a byte
+ * smaller than 255. The block ends with a token holding only literals, and
+ * the last LASTLITERALS bytes of input are always literals.
+ *
+ * The compressed block is preceded by its length, as a 32-bit big-endian
+ * integer, since the caller may pad the buffer it gives to lz4_decompress().
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/types.h>
+#include <sys/byteorder.h>
+
+#define	MINMATCH	4
+#define	LASTLITERALS	5
+#define	MFLIMIT		(8 + MINMATCH)	/* no match starts after end - this */
+#define	MINLENGTH	(MFLIMIT + 1)	/* shorter input is stored as literals */
+#define	MAX_DISTANCE	65535
+
+#define	ML_BITS		4
+#define	ML_MASK		((1U << ML_BITS) - 1)
+#define	RUN_BITS	(8 - ML_BITS)
+#define	RUN_MASK	((1U << RUN_BITS) - 1)
+
+#define	LZ4_HASHLOG	12
+#define	LZ4_HASHSIZE	(1 << LZ4_HASHLOG)
+
+/*
+ * Each failed attempt to find a match increases the step to the next
+ * attempt once per (1 << SKIPSTRENGTH) attempts, so that incompressible
+ * data is skipped over quickly.
+ */
+#define	SKIPSTRENGTH	6
+
+static inline uint32_t
+lz4_read32(const uchar_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof (v));
+	return (v);
+}
+
+static inline uint64_t
+lz4_read64(const uchar_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof (v));
+	return (v);
+}
+
+static inline uint32_t
+lz4_hash(const uchar_t *p)
+{
+	return ((lz4_read32(p) * 2654435761U) >> (32 - LZ4_HASHLOG));
+}
+
+/* Number of equal leading bytes, given the xor of two 64-bit words */
+static inline size_t
+lz4_common_bytes(uint64_t diff)
+{
+#ifdef _BIG_ENDIAN
+	return (__builtin_clzll(diff) >> 3);
+#else
+	return (__builtin_ctzll(diff) >> 3);
+#endif
+}
+
+static uchar_t *
+lz4_put_length(uchar_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uchar_t)len;
+	return (op);
+}
+
+/*
+ * Compress isize bytes at src into at most osize bytes at dst, using table
+ * (LZ4_HASHSIZE entries, zeroed) to find matches. Returns the compressed
+ * size, or 0 if it would be larger than osize.
+ */
+static size_t
+lz4_compress_block(const uchar_t *src, uchar_t *dst, size_t isize,
+    size_t osize, uint32_t *table)
+{
+	const uchar_t *ip = src;
+	const uchar_t *anchor = src;
+	const uchar_t *const iend = src + isize;
+	const uchar_t *const mflimit = iend - MFLIMIT;
+	const uchar_t *const matchlimit = iend - LASTLITERALS;
+	uchar_t *op = dst;
+	uchar_t *const oend = dst + osize;
+	size_t len;
+
+	if (isize < MINLENGTH)
+		goto last_literals;
+
+	table[lz4_hash(ip)] = 0;
+	ip++;
+
+	for (;;) {
+		const uchar_t *ref;
+		uchar_t *token;
+		unsigned attempts = 1U << SKIPSTRENGTH;
+
+		/* Find a match */
+		for (;;) {
+			uint32_t h = lz4_hash(ip);
+
+			ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+			if (ip - ref <= MAX_DISTANCE &&
+			    lz4_read32(ref) == lz4_read32(ip))
+				break;
+			ip += attempts++ >> SKIPSTRENGTH;
+			if (ip > mflimit)
+				goto last_literals;
+		}
+
+		/* Extend it backwards over the pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* Literals */
+		len = ip - anchor;
+		if (op + 1 + len / 255 + 1 + len + 2 + LASTLITERALS > oend)
+			return (0);
+		token = op++;
+		if (len >= RUN_MASK) {
+			*token = RUN_MASK << ML_BITS;
+			op = lz4_put_length(op, len - RUN_MASK);
+		} else {
+			*token = (uchar_t)(len << ML_BITS);
+		}
+		memcpy(op, anchor, len);
+		op += len;
+
+		/* Offset */
+		*op++ = (uchar_t)(ip - ref);
+		*op++ = (uchar_t)((ip - ref) >> 8);
+
+		/* Match length */
+		ip += MINMATCH;
+		ref += MINMATCH;
+		anchor = ip;
+		while (ip < matchlimit - (sizeof (uint64_t) - 1)) {
+			uint64_t diff = lz4_read64(ref) ^ lz4_read64(ip);
+			if (diff != 0) {
+				ip += lz4_common_bytes(diff);
+				goto counted;
+			}
+			ip += sizeof (uint64_t);
+			ref += sizeof (uint64_t);
+		}
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+counted:
+		len = ip - anchor;
+		if (op + len / 255 + 1 + 1 + LASTLITERALS > oend)
+			return (0);
+		if (len >= ML_MASK) {
+			*token |= ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else {
+			*token |= (uchar_t)len;
+		}
+		anchor = ip;
+
+		if (ip > mflimit)
+			break;
+		table[lz4_hash(ip - 2)] = (uint32_t)(ip - 2 - src);
+	}
+
+last_literals:
+	len = iend - anchor;
+	if (op + 1 + (len + 255 - RUN_MASK) / 255 + len > oend)
+		return (0);
+	if (len >= RUN_MASK) {
+		*op++ = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, len - RUN_MASK);
+	} else {
+		*op++ = (uchar_t)(len << ML_BITS);
+	}
+	memcpy(op, anchor, len);
+	op += len;
+
+	return (op - dst);
+}
+
+/*
+ * Decompress the isize bytes at src into at most osize bytes at dst,
+ * checking every length and offset against the buffers. Returns the
+ * decompressed size, or -1 if the input is malformed.
+ */
+static int
+lz4_decompress_block(const uchar_t *src, uchar_t *dst, size_t isize,
+    size_t osize)
+{
+	const uchar_t *ip = src;
+	const uchar_t *const iend = src + isize;
+	uchar_t *op = dst;
+	uchar_t *const oend = dst + osize;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		const uchar_t *ref;
+		size_t len, off;
+		unsigned s;
+
+		/* Literals */
+		len = token >> ML_BITS;
+		if (len == RUN_MASK) {
+			do {
+				if (ip >= iend)
+					return (-1);
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+			return (-1);
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip == iend)
+			break;
+
+		/* Match */
+		if (iend - ip < 2)
+			return (-1);
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - dst))
+			return (-1);
+		ref = op - off;
+		len = token & ML_MASK;
+		if (len == ML_MASK) {
+			do {
+				if (ip >= iend)
+					return (-1);
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		len += MINMATCH;
+		if (len > (size_t)(oend - op))
+			return (-1);
+		if (off >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* The match overlaps its own output */
+			while (len-- > 0)
+				*op++ = *ref++;
+		}
+	}
+
+	return (op - dst);
+}
+
+/*ARGSUSED*/
+size_t
+lz4_compress(void *s_start, void *d_start, size_t s_len, size_t d_len, int n)
+{
+	uchar_t *dst = d_start;
+	uint32_t *table;
+	uint32_t bufsiz;
+
+	ASSERT(d_len >= sizeof (bufsiz));
+
+	/* A failed allocation just means the block is stored uncompressed */
+	table = kmem_zalloc(LZ4_HASHSIZE * sizeof (uint32_t), KM_NOSLEEP);
+	if (table == NULL)
+		return (s_len);
+
+	bufsiz = lz4_compress_block(s_start, dst + sizeof (bufsiz), s_len,
+	    d_len - sizeof (bufsiz), table);
+
+	kmem_free(table, LZ4_HASHSIZE * sizeof (uint32_t));
+
+	if (bufsiz == 0)
+		return (s_len);
+
+	*(uint32_t *)dst = BE_32(bufsiz);
+
+	return (bufsiz + sizeof (bufsiz));
+}
+
+/*ARGSUSED*/
+int
+lz4_decompress(void *s_start, void *d_start, size_t s_len, size_t d_len, int n)
+{
+	const uchar_t *src = s_start;
+	uint32_t bufsiz;
+
+	if (s_len < sizeof (bufsiz))
+		return (1);
+	bufsiz = BE_32(*(const uint32_t *)src);
+	if (bufsiz + sizeof (bufsiz) > s_len)
+		return (1);
+
+	return (lz4_decompress_block(src + sizeof (bufsiz), d_start, bufsiz,
+	    d_len) < 0);
+}
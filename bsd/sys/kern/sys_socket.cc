@@ -36,6 +36,7 @@
 #include <osv/uio.h>
 #include <osv/types.h>
 #include <osv/ioctl.h>
+#include <osv/poll.h>
 #include <osv/socket.hh>
 #include <osv/initialize.hh>
 
@@ -244,6 +245,7 @@ socket_file::poll_install(pollreq& pr)
     SOCK_LOCK(so);
     if (so->so_nc) {
         so->so_nc->add_poller(pr);
+        pr._busy_poll_us = std::max(pr._busy_poll_us, so->so_busy_poll);
     }
     SOCK_UNLOCK(so);
 }
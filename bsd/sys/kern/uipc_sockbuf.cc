@@ -138,6 +138,43 @@ void sockbuf_iolock::unlock(mutex& mtx)
 	_wq.wake_all(mtx);
 }
 
+/*
+ * Spin for a packet on the socket's net channel, instead of sleeping.
+ * Spinning saves the producer a wakeup, and us the sleep, when the next
+ * packet is only a few microseconds away. The socket lock is dropped while
+ * spinning, so sosend(), timers and slow-path input can proceed; so_nc_busy
+ * keeps other waiters off the channel meanwhile. Returns true if the caller
+ * should recheck its condition rather than sleep.
+ */
+static bool
+sbwait_busy_poll(socket* so, struct sockbuf *sb, signal_catcher& sc)
+{
+	u64 max_us = so->so_busy_poll;
+	if (sb->sb_timeo) {
+		max_us = std::min(max_us, u64(ticks2ns(sb->sb_timeo)) / 1000);
+	}
+	if (!max_us) {
+		return false;
+	}
+	auto cc = sb->sb_cc;
+	auto sb_state = sb->sb_state;
+	auto so_state = so->so_state;
+	auto error = so->so_error;
+	bool ready;
+	so->so_nc_busy = true;
+	DROP_LOCK(so->so_mtx->_mutex) {
+		ready = so->so_nc->busy_poll(max_us, [&] { return sc.interrupted(); });
+	}
+	so->so_nc_busy = false;
+	so->so_nc_wq.wake_all(so->so_mtx->_mutex);
+	if (ready && !sc.interrupted()) {
+		so->so_nc->process_queue();
+	}
+	// A wakeup we missed while not holding the lock
+	return ready || cc != sb->sb_cc || sb_state != sb->sb_state ||
+	    so_state != so->so_state || error != so->so_error;
+}
+
 /*
  * Wait for data to arrive at/drain from a socket buffer.
  */
@@ -147,12 +184,17 @@ sbwait(socket* so, struct sockbuf *sb)
 
 	SOCK_LOCK_ASSERT(so);
 
+	signal_catcher sc;
+	if (so->so_nc && !so->so_nc_busy && so->so_busy_poll &&
+	    sbwait_busy_poll(so, sb, sc)) {
+		return sc.interrupted() ? EINTR : 0;
+	}
+
 	sb->sb_flags |= SB_WAIT;
 	sched::timer tmr(*sched::thread::current());
 	if (sb->sb_timeo) {
 	    tmr.set(std::chrono::nanoseconds(ticks2ns(sb->sb_timeo)));
 	}
-	signal_catcher sc;
 	if (so->so_nc && !so->so_nc_busy) {
 		so->so_nc_busy = true;
 		sched::thread::wait_for(so->so_mtx->_mutex, *so->so_nc, sb->sb_cc_wq, tmr, sc);
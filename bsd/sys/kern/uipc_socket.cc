@@ -2233,6 +2233,20 @@ sosetopt(struct socket *so, struct sockopt *sopt)
 			so->so_user_cookie = val32;
 			break;
 
+		case SO_BUSY_POLL:
+			error = sooptcopyin(sopt, &optval, sizeof optval,
+					    sizeof optval);
+			if (error)
+				goto bad;
+			if (optval < 0) {
+				error = EINVAL;
+				goto bad;
+			}
+			SOCK_LOCK(so);
+			so->so_busy_poll = optval;
+			SOCK_UNLOCK(so);
+			break;
+
 		case SO_SNDBUF:
 		case SO_RCVBUF:
 		case SO_SNDLOWAT:
@@ -2421,6 +2435,10 @@ integer:
 			optval = so->so_proto->pr_protocol;
 			goto integer;
 
+		case SO_BUSY_POLL:
+			optval = so->so_busy_poll;
+			goto integer;
+
 		case SO_ERROR:
 			SOCK_LOCK(so);
 			optval = so->so_error;
@@ -103,6 +103,9 @@ struct if_data {
 	u_long	ifi_hwassist;		/* HW offload capabilities, see IFCAP */
 	time_t	ifi_epoch;		/* uptime at attach or stat reset */
 	struct	timeval ifi_lastchange;	/* time of last administrative change */
+	/* OSv: receive coalescing (LRO) */
+	u_long	ifi_ilro_queued;	/* packets received into LRO */
+	u_long	ifi_ilro_flushed;	/* LRO packets passed up the stack */
 };
 
 /*-
@@ -97,7 +97,7 @@ struct pfil_head *pfil_head_get(int, u_long);
 
 #define	PFIL_HOOKED(p) ((p)->ph_nhooks > 0)
 #define	PFIL_LOCK_INIT(p) \
-    rw_init_flags(&(p)->ph_lock, "PFil hook read/write mutex", 0)
+    rw_init_flags(&(p)->ph_lock, "PFil hook read/write mutex", RW_READ_MOSTLY)
 #define	PFIL_LOCK_DESTROY(p) rw_destroy(&(p)->ph_lock)
 #define PFIL_RLOCK(p, t) rw_rlock(&(p)->ph_lock)
 #define PFIL_WLOCK(p) rw_wlock(&(p)->ph_lock)
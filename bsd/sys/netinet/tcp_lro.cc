@@ -281,7 +281,9 @@ tcp_lro_flush(struct lro_ctrl *lc, struct lro_entry *le)
 #endif
 	}
 
-	(*lc->ifp->if_input)(lc->ifp, le->m_head);
+	/* OSv: a net channel may take the packet instead of the stack. */
+	if (!lc->ifp->if_classifier.post_packet(le->m_head))
+		(*lc->ifp->if_input)(lc->ifp, le->m_head);
 	lc->lro_queued += le->append_cnt + 1;
 	lc->lro_flushed++;
 	bzero(le, sizeof(*le));
@@ -115,6 +115,7 @@
 #define	SO_PROTOCOL	0x1016		/* get socket protocol (Linux name) */
 #define	SO_PROTOTYPE	SO_PROTOCOL	/* alias for SO_PROTOCOL (SunOS name) */
 #endif
+#define	SO_BUSY_POLL	0x1017		/* OSv: busy-poll receive (usec) */
 
 #if __BSD_VISIBLE
 struct accept_filter_arg {
@@ -125,6 +125,8 @@ struct socket {
 	// a net channel only supports one consumer, so let others wait on a waitqueue instead
 	bool so_nc_busy = false;
 	waitqueue so_nc_wq;
+	// SO_BUSY_POLL: spin this many microseconds on so_nc before sleeping
+	u_int so_busy_poll = 0;
 	/* FIXME: this is done for poll,
 	 * make sure there's only 1 ref to a fp */
 	struct file* fp;
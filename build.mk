@@ -201,10 +201,13 @@ tests += tests/tst-tracepoint.so
 tests += tests/tst-hub.so
 tests += tests/misc-leak.so
 tests += tests/misc-mmap-anon-perf.so
+tests += tests/misc-tlb-flush.so
+tests += tests/misc-tlb-pcid.so
 tests += tests/tst-mmap-file.so
 tests += tests/tst-mmap.so
 tests += tests/tst-huge.so
 tests += tests/misc-mutex.so
+tests += tests/misc-rwlock.so
 tests += tests/misc-sockets.so
 tests += tests/tst-condvar.so
 tests += tests/tst-queue-mpsc.so
@@ -216,7 +219,16 @@ tests += tests/tst-readdir.so
 tests += tests/tst-remove.so
 tests += tests/misc-wake.so
 tests += tests/tst-epoll.so
+tests += tests/misc-epoll.so
 tests += tests/misc-lfring.so
+tests += tests/misc-malloc.so
+tests += tests/misc-malloc-large.so
+tests += tests/misc-malloc-efficiency.so
+tests += tests/misc-timer-wheel.so
+tests += tests/misc-rcu-sync.so
+tests += tests/misc-fd-alloc.so
+tests += tests/misc-stat.so
+tests += tests/misc-rx-pps.so
 tests += tests/tst-fsx.so
 tests += tests/tst-sleep.so
 tests += tests/tst-resolve.so
@@ -245,6 +257,9 @@ tests += tests/tst-chdir.so
 tests += tests/tst-hello.so
 tests += tests/tst-concurrent-init.so
 tests += tests/tst-ring-spsc-wraparound.so
+tests += tests/tst-rcu-hashtable.so
+tests += tests/tst-rcu.so
+tests += tests/tst-timer-wheel.so
 tests += tests/tst-shm.so
 
 tests/hello/Hello.class: javabase=tests/hello
@@ -466,6 +481,7 @@ zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/dsl_prop.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/dsl_scan.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/dsl_synctask.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/gzip.o
+zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/lz4.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/lzjb.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/metaslab.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/refcount.o
@@ -617,6 +633,7 @@ objects += core/debug.o
 objects += core/rcu.o
 objects += drivers/pci.o
 objects += core/mempool.o
+objects += core/pagecache.o
 objects += core/alloctracker.o
 objects += core/printf.o
 objects += arch/x64/elf-dl.o
@@ -667,6 +684,7 @@ loader.elf: arch/x64/boot.o arch/x64/loader.ld loader.o runtime.o $(drivers) \
 		bootfs.bin
 	$(call quiet, $(LD) -o $@ \
 		-Bdynamic --export-dynamic --eh-frame-hdr --enable-new-dtags \
+		--build-id \
 	    $(filter-out %.bin, $(^:%.ld=-T %.ld)) \
 	    --whole-archive \
 	      $(libstdc++.a) $(libgcc_s.a) $(libgcc_eh.a) \
@@ -22,6 +22,8 @@
 #include <iterator>
 #include <osv/sched.hh>
 #include <osv/trace.hh>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 TRACEPOINT(trace_elf_load, "%s", const char *);
 TRACEPOINT(trace_elf_unload, "%s", const char *);
@@ -118,6 +120,10 @@ void object::setprivate(bool priv)
 {
      _visibility.store(priv ? sched::thread::current() : nullptr,
              std::memory_order_release);
+     if (!priv) {
+         // Entries for lookups which could not see us are now wrong
+         _prog._lookup_gen.fetch_add(1);
+     }
 }
 
 
@@ -277,6 +283,34 @@ void object::load_segments()
             throw std::runtime_error("bad p_type");
         }
     }
+    read_build_id();
+}
+
+void object::read_build_id()
+{
+    for (auto& phdr : _phdrs) {
+        if (phdr.p_type != PT_NOTE) {
+            continue;
+        }
+        auto p = static_cast<const char*>(_base + phdr.p_vaddr);
+        auto end = p + phdr.p_filesz;
+        while (p + sizeof(Elf64_Nhdr) <= end) {
+            auto nhdr = reinterpret_cast<const Elf64_Nhdr*>(p);
+            auto name = p + sizeof(*nhdr);
+            auto desc = name + align_up(nhdr->n_namesz, 4u);
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4
+                    && !memcmp(name, "GNU", 4)) {
+                _build_id.assign(desc, nhdr->n_descsz);
+                return;
+            }
+            p = desc + align_up(nhdr->n_descsz, 4u);
+        }
+    }
+}
+
+const std::string& object::build_id() const
+{
+    return _build_id;
 }
 
 void file::unload_segment(const Elf64_Phdr& phdr)
@@ -375,8 +409,10 @@ symbol_module object::symbol(unsigned idx)
     auto symtab = dynamic_ptr<Elf64_Sym>(DT_SYMTAB);
     assert(dynamic_val(DT_SYMENT) == sizeof(Elf64_Sym));
     auto sym = &symtab[idx];
-    auto nameidx = sym->st_name;
-    auto name = dynamic_ptr<const char>(DT_STRTAB) + nameidx;
+    if (idx < _prelinked.size() && _prelinked[idx].sym) {
+        return symbol_module(_prelinked[idx].sym, _prelinked[idx].obj);
+    }
+    auto name = symbol_name(sym);
     auto ret = _prog.lookup(name);
     auto binding = sym->st_info >> 4;
     if (!ret.symbol && binding == STB_WEAK) {
@@ -484,11 +520,58 @@ void* object::resolve_pltgot(unsigned index)
     return ret;
 }
 
+// Use the prelink cache's definitions for our symbols, if it has a record
+// for us with the same objects (by build ID) as are loaded now, in the same
+// order. The record only holds for this list of objects, so it is dropped
+// after relocation: later lazy PLT resolutions do regular lookups.
+void object::prelink()
+{
+    if (_build_id.empty()) {
+        return;
+    }
+    std::vector<object*> scope;
+    _prog.with_modules([&](const program::modules_list& ml) {
+        scope = ml.objects;
+    });
+    auto rec = _prog.find_prelink(this, scope);
+    if (!rec) {
+        return;
+    }
+    auto symtab = dynamic_ptr<Elf64_Sym>(DT_SYMTAB);
+    auto n = std::min<size_t>(rec->symbols.size(), symbol_count());
+    std::vector<unsigned> counts(scope.size());
+    std::vector<prelinked_symbol> prelinked(n);
+    for (size_t i = 0; i < n; ++i) {
+        auto def = rec->symbols[i];
+        if (def.first == program::prelink_record::no_definition) {
+            prelinked[i] = { nullptr, nullptr };
+            continue;
+        }
+        auto obj = scope[def.first];
+        if (!counts[def.first]) {
+            counts[def.first] = obj->symbol_count();
+        }
+        // A stale or corrupt record: look everything up instead
+        if (def.second >= counts[def.first]) {
+            return;
+        }
+        auto sym = &obj->dynamic_ptr<Elf64_Sym>(DT_SYMTAB)[def.second];
+        if (sym->st_shndx == SHN_UNDEF
+                || strcmp(symbol_name(&symtab[i]), obj->symbol_name(sym))) {
+            return;
+        }
+        prelinked[i] = { sym, obj };
+    }
+    _prelinked = std::move(prelinked);
+}
+
 void object::relocate()
 {
     assert(!dynamic_exists(DT_REL));
     if (dynamic_exists(DT_RELA)) {
+        prelink();
         relocate_rela();
+        std::vector<prelinked_symbol>().swap(_prelinked);
     }
     if (dynamic_exists(DT_JMPREL)) {
         relocate_pltgot();
@@ -616,13 +699,62 @@ unsigned object::symtab_len()
     return len;
 }
 
-dladdr_info object::lookup_addr(const void* addr)
+// One past the last index in the symbol table
+unsigned object::symbol_count()
 {
-    dladdr_info ret;
-    if (addr < _base || addr >= _end) {
-        return ret;
+    if (dynamic_exists(DT_HASH)) {
+        return dynamic_ptr<Elf64_Word>(DT_HASH)[1];
     }
-    auto strtab = dynamic_ptr<char>(DT_STRTAB);
+    // Symbols below symndx are not in the GNU hash table
+    return dynamic_ptr<Elf64_Word>(DT_GNU_HASH)[1] + symtab_len();
+}
+
+const char* object::symbol_name(const Elf64_Sym* sym)
+{
+    return dynamic_ptr<const char>(DT_STRTAB) + sym->st_name;
+}
+
+void object::build_addr_index()
+{
+    WITH_LOCK(_addr_index_mutex) {
+        if (_addr_index_built.load(std::memory_order_relaxed)) {
+            return;
+        }
+        auto symtab = dynamic_ptr<Elf64_Sym>(DT_SYMTAB);
+        auto len = symtab_len();
+        for (unsigned i = 1; i < len; ++i) {
+            auto& sym = symtab[i];
+            auto type = sym.st_info & 15;
+            if (type != STT_OBJECT && type != STT_FUNC) {
+                continue;
+            }
+            auto bind = (sym.st_info >> 4) & 15;
+            if (bind != STB_GLOBAL && bind != STB_WEAK) {
+                continue;
+            }
+            symbol_module sm{&sym, this};
+            _addr_index.push_back({sm.relocated_addr(), &sym});
+        }
+        // Of several symbols at the same address, keep the first one in the
+        // symbol table.
+        std::stable_sort(_addr_index.begin(), _addr_index.end(),
+                [](const addr_symbol& a, const addr_symbol& b) {
+            return a.addr < b.addr;
+        });
+        auto last = std::unique(_addr_index.begin(), _addr_index.end(),
+                [](const addr_symbol& a, const addr_symbol& b) {
+            return a.addr == b.addr;
+        });
+        _addr_index.erase(last, _addr_index.end());
+        _addr_index.shrink_to_fit();
+        _addr_index_built.store(true, std::memory_order_release);
+    }
+}
+
+// Find the symbol containing addr by scanning the whole symbol table
+dladdr_info object::scan_addr(const void* addr)
+{
+    dladdr_info ret;
     auto symtab = dynamic_ptr<Elf64_Sym>(DT_SYMTAB);
     auto len = symtab_len();
     symbol_module best;
@@ -641,13 +773,14 @@ dladdr_info object::lookup_addr(const void* addr)
         if (s_addr > addr) {
             continue;
         }
-        if (!best.symbol || sm.relocated_addr() > best.relocated_addr()) {
+        if (!best.symbol || s_addr > best.relocated_addr()) {
             best = sm;
         }
     }
     if (!best.symbol) {
         return ret;
     }
+    auto strtab = dynamic_ptr<char>(DT_STRTAB);
     ret.fname = _pathname.c_str();
     ret.base = _base;
     ret.sym = strtab + best.symbol->st_name;
@@ -655,6 +788,33 @@ dladdr_info object::lookup_addr(const void* addr)
     return ret;
 }
 
+dladdr_info object::lookup_addr(const void* addr, bool build_index)
+{
+    dladdr_info ret;
+    if (addr < _base || addr >= _end) {
+        return ret;
+    }
+    if (!_addr_index_built.load(std::memory_order_acquire)) {
+        if (!build_index) {
+            return scan_addr(addr);
+        }
+        build_addr_index();
+    }
+    // Find the last symbol at or below addr
+    auto it = std::upper_bound(_addr_index.begin(), _addr_index.end(), addr,
+            [](const void* a, const addr_symbol& s) { return a < s.addr; });
+    if (it == _addr_index.begin()) {
+        return ret;
+    }
+    --it;
+    auto strtab = dynamic_ptr<char>(DT_STRTAB);
+    ret.fname = _pathname.c_str();
+    ret.base = _base;
+    ret.sym = strtab + it->sym->st_name;
+    ret.addr = it->addr;
+    return ret;
+}
+
 static std::string dirname(std::string path)
 {
     auto pos = path.rfind('/');
@@ -931,18 +1091,163 @@ symbol_module program::lookup(const char* name)
 {
     trace_elf_lookup(name);
     symbol_module ret(nullptr,nullptr);
+    auto hash = dl_new_hash(name);
+    // Read before looking at the objects' visibility, so a result computed
+    // while an object becomes visible is not valid later.
+    auto gen = _lookup_gen.load();
     elf::get_program()->with_modules([&](const elf::program::modules_list &ml)
     {
+        auto& e = _lookup_cache[hash % lookup_cache_size];
+        bool cached = false;
+        WITH_LOCK(_lookup_cache_mutex) {
+            if (e.obj && e.hash == hash && e.gen == gen && e.adds == ml.adds
+                    && e.subs == ml.subs
+                    && !strcmp(e.obj->symbol_name(e.sym), name)) {
+                ret = symbol_module(e.sym, e.obj);
+                cached = true;
+            }
+        }
+        if (!cached) {
+            // The definition all threads see
+            for (auto module : ml.objects) {
+                if (module->_visibility.load(std::memory_order_acquire)) {
+                    continue;
+                }
+                if (auto sym = module->lookup_symbol(name)) {
+                    ret = symbol_module(sym, module);
+                    break;
+                }
+            }
+            if (ret.symbol) {
+                WITH_LOCK(_lookup_cache_mutex) {
+                    e.hash = hash;
+                    e.gen = gen;
+                    e.adds = ml.adds;
+                    e.subs = ml.subs;
+                    e.sym = ret.symbol;
+                    e.obj = ret.obj;
+                }
+            }
+        }
+        // Objects we are still loading, and only we can see, may come first
         for (auto module : ml.objects) {
-            if (auto sym = module->lookup_symbol(name)) {
-                ret = symbol_module(sym, module);
-                return;
+            if (module == ret.obj) {
+                break;
+            }
+            if (module->_visibility.load(std::memory_order_acquire)) {
+                if (auto sym = module->lookup_symbol(name)) {
+                    ret = symbol_module(sym, module);
+                    return;
+                }
             }
         }
     });
     return ret;
 }
 
+static const char prelink_cache_path[] = "/etc/prelink.cache";
+static const char prelink_magic[8] = { 'O', 'S', 'V', 'P', 'R', 'L', 'N', 'K' };
+static constexpr u32 prelink_version = 1;
+
+// Reads the prelink cache written by scripts/prelink.py, all little-endian:
+//
+//   8 bytes magic, u32 version, u32 number of records, then the records.
+//   A record is: u32 number of objects in the scope, then the build ID of
+//   each (u32 length, then the bytes), u32 index of its own object in the
+//   scope, u32 number of symbols, then for each symbol index: u32 index in
+//   the scope of the defining object (~0 if none was found), u32 the
+//   definition's symbol index there.
+//
+// A missing or malformed cache is just not used.
+void program::read_prelink_cache()
+{
+    _prelink_cache_read = true;
+    int fd = open(prelink_cache_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    std::vector<char> buf;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        buf.resize(st.st_size);
+        if (read(fd, buf.data(), buf.size()) != st.st_size) {
+            buf.clear();
+        }
+    }
+    close(fd);
+
+    size_t pos = 0;
+    auto get = [&] (void* p, size_t len) {
+        if (len > buf.size() - pos) {
+            throw std::runtime_error("truncated");
+        }
+        memcpy(p, &buf[pos], len);
+        pos += len;
+    };
+    auto get_u32 = [&] {
+        u32 v;
+        get(&v, sizeof(v));
+        return v;
+    };
+    std::vector<prelink_record> cache;
+    try {
+        char magic[sizeof(prelink_magic)];
+        get(magic, sizeof(magic));
+        if (memcmp(magic, prelink_magic, sizeof(magic))
+                || get_u32() != prelink_version) {
+            throw std::runtime_error("bad header");
+        }
+        cache.resize(get_u32());
+        for (auto& rec : cache) {
+            rec.scope.resize(get_u32());
+            for (auto& id : rec.scope) {
+                id.resize(get_u32());
+                get(&id[0], id.size());
+            }
+            rec.self = get_u32();
+            rec.symbols.resize(get_u32());
+            for (auto& sym : rec.symbols) {
+                sym.first = get_u32();
+                sym.second = get_u32();
+                if (sym.first != prelink_record::no_definition
+                        && sym.first >= rec.scope.size()) {
+                    throw std::runtime_error("bad definition");
+                }
+            }
+            if (rec.self >= rec.scope.size()) {
+                throw std::runtime_error("bad record");
+            }
+        }
+    } catch (std::exception& e) {
+        debug("elf: ignoring %s: %s\n", prelink_cache_path, e.what());
+        return;
+    }
+    _prelink_cache = std::move(cache);
+}
+
+auto program::find_prelink(object* obj, const std::vector<object*>& scope)
+    -> const prelink_record*
+{
+    SCOPE_LOCK(_mutex);
+    if (!_prelink_cache_read) {
+        read_prelink_cache();
+    }
+    for (auto& rec : _prelink_cache) {
+        if (rec.scope.size() != scope.size() || scope[rec.self] != obj) {
+            continue;
+        }
+        bool match = true;
+        for (size_t i = 0; match && i < scope.size(); ++i) {
+            match = !scope[i]->build_id().empty()
+                    && rec.scope[i] == scope[i]->build_id();
+        }
+        if (match) {
+            return &rec;
+        }
+    }
+    return nullptr;
+}
+
 void* program::do_lookup_function(const char* name)
 {
     auto sym = lookup(name);
@@ -955,23 +1260,68 @@ void* program::do_lookup_function(const char* name)
     return sym.relocated_addr();
 }
 
+// must be called from with_modules()
+dladdr_info program::lookup_addr(const modules_list& ml, const void* addr)
+{
+    auto h = reinterpret_cast<uintptr_t>(addr);
+    auto& e = _addr_cache[(h ^ (h >> 10) ^ (h >> 20)) % addr_cache_size];
+    WITH_LOCK(_addr_cache_mutex) {
+        if (e.addr == addr && e.adds == ml.adds && e.subs == ml.subs) {
+            return e.info;
+        }
+    }
+    dladdr_info ret;
+    for (auto module : ml.objects) {
+        ret = module->lookup_addr(addr);
+        if (ret.fname) {
+            break;
+        }
+    }
+    WITH_LOCK(_addr_cache_mutex) {
+        e.addr = addr;
+        e.adds = ml.adds;
+        e.subs = ml.subs;
+        e.info = ret;
+    }
+    return ret;
+}
+
 dladdr_info program::lookup_addr(const void* addr)
 {
     trace_elf_lookup_addr(addr);
     dladdr_info ret;
-    elf::get_program()->with_modules([&](const elf::program::modules_list &ml)
+    with_modules([&](const elf::program::modules_list &ml)
+    {
+        ret = lookup_addr(ml, addr);
+    });
+    return ret;
+}
+
+dladdr_info program::lookup_addr_safe(const void* addr)
+{
+    dladdr_info ret;
+    with_modules([&](const elf::program::modules_list &ml)
     {
         for (auto module : ml.objects) {
-            ret = module->lookup_addr(addr);
+            ret = module->lookup_addr(addr, false);
             if (ret.fname) {
-                return;
+                break;
             }
         }
-        ret = {};
     });
     return ret;
 }
 
+void program::lookup_addrs(const void* const* addrs, dladdr_info* out, size_t n)
+{
+    with_modules([&](const elf::program::modules_list &ml)
+    {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = lookup_addr(ml, addrs[i]);
+        }
+    });
+}
+
 program* get_program()
 {
     return s_program;
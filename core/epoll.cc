@@ -6,11 +6,18 @@
  */
 
 // Implement the Linux epoll(7) functions in OSV
-
-// NOTE: This is an inefficient implementation, in which epoll_wait() calls
-// poll(), thereby negating all the performance benefits of using epoll and
-// not poll. This is only a temporary implementation, for getting the
-// functionality of epoll which Java needs - but not its performance.
+//
+// Every file registered with an epoll keeps a pointer to it in its f_epolls
+// list. When the file's state changes, poll_wake() calls epoll_wake(), which
+// pushes the file onto the epoll's ready list and wakes any waiter. This
+// means epoll_wait() only needs to look at files which actually had some
+// activity since the last call, and not at every registered file: its cost
+// is O(ready), not O(registered).
+//
+// Level-triggered files which are still ready after being reported are put
+// back on the ready list, so the next epoll_wait() will check them again.
+// Edge-triggered (EPOLLET) and one-shot (EPOLLONESHOT) files are not, and
+// will only be reported again after the next poll_wake().
 
 #include <sys/epoll.h>
 #include <sys/poll.h>
@@ -23,6 +30,8 @@
 #include <fs/fs.hh>
 
 #include <osv/debug.hh>
+#include <osv/mutex.h>
+#include <osv/waitqueue.hh>
 #include <unordered_map>
 #include <boost/range/algorithm/find.hpp>
 
@@ -31,58 +40,86 @@ TRACEPOINT(trace_epoll_create, "returned fd=%d", int);
 TRACEPOINT(trace_epoll_ctl, "epfd=%d, fd=%d, op=%s", int, int, const char*);
 TRACEPOINT(trace_epoll_wait, "epfd=%d, maxevents=%d, timeout=%d", int, int, int);
 TRACEPOINT(trace_epoll_ready, "file=%p, event=0x%x", file*, int);
+TRACEPOINT(trace_epoll_wake, "epoll=%p, file=%p, event=0x%x", file*, file*, int);
 
-// We implement epoll using poll(), and therefore need to convert epoll's
-// event bits to and poll(). These are mostly the same, so the conversion
-// is trivial, but we verify this here with static_asserts. We additionally
-// support the epoll-only EPOLLET, but not EPOLLONESHOT.
+// We check readiness using each file's poll() method, and therefore need to
+// convert epoll's event bits to and from poll(). These are mostly the same,
+// so the conversion is trivial, but we verify this here with static_asserts.
+// We additionally support the epoll-only EPOLLET and EPOLLONESHOT flags,
+// which are handled by epoll itself. EPOLLET is still passed on to poll(),
+// because sockets use it to know they must keep calling poll_wake() even
+// after reporting the socket as ready (see sopoll_generic()).
 static_assert(POLLIN == EPOLLIN, "POLLIN!=EPOLLIN");
 static_assert(POLLOUT == EPOLLOUT, "POLLOUT!=EPOLLOUT");
 static_assert(POLLRDHUP == EPOLLRDHUP, "POLLRDHUP!=EPOLLRDHUP");
 static_assert(POLLPRI == EPOLLPRI, "POLLPRI!=EPOLLPRI");
 static_assert(POLLERR == EPOLLERR, "POLLERR!=EPOLLERR");
 static_assert(POLLHUP == EPOLLHUP, "POLLHUP!=EPOLLHUP");
-constexpr int SUPPORTED_EVENTS =
-        EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLPRI | EPOLLERR | EPOLLHUP |
-        EPOLLET;
+constexpr int POLL_EVENTS =
+        EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLPRI | EPOLLERR | EPOLLHUP;
+constexpr int SUPPORTED_EVENTS = POLL_EVENTS | EPOLLET | EPOLLONESHOT;
 inline uint32_t events_epoll_to_poll(uint32_t e)
 {
     assert (!(e & ~SUPPORTED_EVENTS));
-    return e;
+    return e & (POLL_EVENTS | EPOLLET);
 }
 inline uint32_t events_poll_to_epoll(uint32_t e)
 {
-    assert (!(e & ~SUPPORTED_EVENTS));
+    assert (!(e & ~POLL_EVENTS));
     return e;
 }
 
+// epoll_mutex serializes the teardown of an epoll against the teardown of
+// the files registered in it. Closing either side needs to unlink it from
+// the other, and without a common lock each could be freed while the other
+// is still following its pointer. It is only taken on close, and only for
+// files which were ever added to an epoll, so it is not contended.
+static mutex epoll_mutex;
+
 struct registered_epoll : epoll_event {
-    int last_poll_wake_count; // For implementing EPOLLET
-    registered_epoll(epoll_event e, int c) :
-        epoll_event(e), last_poll_wake_count(c) {}
+    // True while the file is on the epoll's ready list. Protects against
+    // queuing the same file twice when it is woken repeatedly.
+    bool queued = false;
+    // Set after an EPOLLONESHOT file was reported; it is ignored until it
+    // is re-armed with EPOLL_CTL_MOD.
+    bool disarmed = false;
+    explicit registered_epoll(epoll_event e) : epoll_event(e) {}
 };
 
 class epoll_file final : public special_file {
+    // _lock protects map, _ready and _waiters. It nests inside the f_lock of
+    // the registered files, because poll_wake() calls us with f_lock held.
+    mutex _lock;
     std::unordered_map<file*, registered_epoll> map;
+    std::vector<file*> _ready;
+    waitqueue _waiters;
 public:
     epoll_file() : special_file(0, DTYPE_UNSPEC) {}
     virtual int close() override {
-        for (auto& e : map) {
-            auto fp = e.first;
-            remove_me(fp);
+        // Nobody else holds a reference to us, so there can be no concurrent
+        // epoll_ctl() or epoll_wait(). But the registered files may be in
+        // the middle of being closed, and epoll_mutex protects us from that.
+        WITH_LOCK(epoll_mutex) {
+            for (auto& e : map) {
+                remove_me(e.first);
+            }
+            map.clear();
+            _ready.clear();
         }
         return 0;
     }
     int add(file* fp, struct epoll_event *event)
     {
-        if (map.count(fp)) {
-            return EEXIST;
-        }
         WITH_LOCK(fp->f_lock) {
-            // I used poll_wake_count-1, to ensure EPOLLET returns once when
-            // registering an epoll after data is already available.
-            map.emplace(std::move(fp),
-                    registered_epoll(*event, fp->poll_wake_count - 1));
+            WITH_LOCK(_lock) {
+                if (map.count(fp)) {
+                    return EEXIST;
+                }
+                map.emplace(fp, registered_epoll(*event));
+                // Queue the file immediately, so if it is already ready we
+                // will report it (once, for EPOLLET) in the next wait.
+                enqueue(fp, map.at(fp));
+            }
             if (!fp->f_epolls) {
                 fp->f_epolls.reset(new std::vector<file*>);
             }
@@ -92,56 +129,165 @@ public:
     }
     int mod(file* fp, struct epoll_event *event)
     {
-        try {
-            WITH_LOCK(fp->f_lock) {
-                map.at(fp) = registered_epoll(*event, fp->poll_wake_count - 1);
+        WITH_LOCK(_lock) {
+            auto i = map.find(fp);
+            if (i == map.end()) {
+                return ENOENT;
             }
-            return 0;
-        } catch (std::out_of_range &e) {
-            return ENOENT;
+            auto& reg = i->second;
+            bool queued = reg.queued;
+            reg = registered_epoll(*event);
+            reg.queued = queued;
+            enqueue(fp, reg);
         }
+        return 0;
     }
     int del(file* fp)
     {
-        if (map.erase(fp)) {
+        WITH_LOCK(fp->f_lock) {
+            WITH_LOCK(_lock) {
+                if (!forget(fp)) {
+                    return ENOENT;
+                }
+            }
             remove_me(fp);
-            return 0;
-        } else {
-            return ENOENT;
+        }
+        return 0;
+    }
+    // Called from poll_wake(), with fp->f_lock held
+    void wake(file* fp, int events)
+    {
+        WITH_LOCK(_lock) {
+            auto i = map.find(fp);
+            if (i == map.end()) {
+                return;
+            }
+            auto& reg = i->second;
+            if (!(events & (reg.events | POLLERR | POLLHUP))) {
+                return;
+            }
+            trace_epoll_wake(this, fp, events);
+            enqueue(fp, reg);
+        }
+    }
+    // Called when a registered file is destroyed, with epoll_mutex held.
+    // The file is going away anyway, so there is no need to clean its
+    // f_epolls list.
+    void closed(file* fp)
+    {
+        WITH_LOCK(_lock) {
+            forget(fp);
         }
     }
     int wait(struct epoll_event *events, int maxevents, int timeout_ms)
     {
-        std::vector<poll_file> pollfds;
-        pollfds.reserve(map.size());
-        for (auto &i : map) {
-            int eevents = i.second.events;
-            auto events = events_epoll_to_poll(eevents);
-            pollfds.emplace_back(i.first, events, 0,
-                    i.second.last_poll_wake_count);
+        sched::timer tmr(*sched::thread::current());
+        if (timeout_ms > 0) {
+            using namespace osv::clock::literals;
+            tmr.set(timeout_ms * 1_ms);
         }
-        int r = do_poll(pollfds, timeout_ms);
-        if (r > 0) {
-            r = std::min(r, maxevents);
-            int remain = r;
-            for (size_t i = 0; i < pollfds.size() && remain;  i++) {
-                if (pollfds[i].revents) {
-                    --remain;
-                    assert(pollfds[i].fp);
-                    events[remain].data = map.at(pollfds[i].fp.get()).data;
-                    events[remain].events =
-                            events_poll_to_epoll(pollfds[i].revents);
-                    trace_epoll_ready(pollfds[i].fp.get(), pollfds[i].revents);
-                    if (pollfds[i].events & EPOLLET) {
-                        map.at(pollfds[i].fp.get()).last_poll_wake_count =
-                                pollfds[i].last_poll_wake_count;
+        std::vector<fileref> scan;
+        int nr = 0;
+        while (true) {
+            WITH_LOCK(_lock) {
+                while (_ready.empty() && timeout_ms != 0 && !tmr.expired()) {
+                    sched::thread::wait_for(_lock, _waiters, tmr);
+                }
+                if (_ready.empty()) {
+                    return 0;
+                }
+                scan.reserve(_ready.size());
+                for (auto fp : _ready) {
+                    map.at(fp).queued = false;
+                    // A file whose f_count dropped to zero is being closed,
+                    // and will remove itself from the map shortly. We can't
+                    // use it after dropping _lock, so skip it.
+                    if (fhold_if_positive(fp)) {
+                        scan.emplace_back(fp, false);
                     }
                 }
+                _ready.clear();
             }
+            // Check the candidates without holding _lock: fp->poll() may
+            // take locks which are held while calling poll_wake().
+            std::vector<int> revents;
+            revents.reserve(scan.size());
+            for (auto& fp : scan) {
+                int pe = 0;
+                WITH_LOCK(_lock) {
+                    auto i = map.find(fp.get());
+                    if (i != map.end() && !i->second.disarmed) {
+                        pe = events_epoll_to_poll(i->second.events);
+                    }
+                }
+                int re = pe ? fp->poll(pe) : 0;
+                revents.push_back(re & (pe | POLLERR | POLLHUP) & POLL_EVENTS);
+            }
+            WITH_LOCK(_lock) {
+                for (size_t i = 0; i < scan.size(); i++) {
+                    auto fp = scan[i].get();
+                    auto it = map.find(fp);
+                    if (it == map.end()) {
+                        continue;
+                    }
+                    auto& reg = it->second;
+                    if (nr == maxevents) {
+                        // Could not report this one; leave it for next time
+                        // so we don't lose an edge.
+                        enqueue(fp, reg);
+                        continue;
+                    }
+                    if (!revents[i] || reg.disarmed) {
+                        continue;
+                    }
+                    events[nr].data = reg.data;
+                    events[nr].events = events_poll_to_epoll(revents[i]);
+                    trace_epoll_ready(fp, revents[i]);
+                    ++nr;
+                    if (reg.events & EPOLLONESHOT) {
+                        reg.disarmed = true;
+                    } else if (!(reg.events & EPOLLET)) {
+                        // Level-triggered: check it again next time
+                        enqueue(fp, reg);
+                    }
+                }
+            }
+            // Drop our references outside _lock; the last one may close
+            // the file, which calls back into us.
+            scan.clear();
+            if (nr || timeout_ms == 0 || tmr.expired()) {
+                return nr;
+            }
+            // All the woken files turned out not to be ready (e.g., data
+            // was already consumed); go back to sleep.
         }
-        return r;
     }
 private:
+    // Called with _lock held
+    void enqueue(file* fp, registered_epoll& reg)
+    {
+        if (reg.queued || reg.disarmed) {
+            return;
+        }
+        reg.queued = true;
+        _ready.push_back(fp);
+        _waiters.wake_all(_lock);
+    }
+    // Called with _lock held
+    bool forget(file* fp)
+    {
+        auto i = map.find(fp);
+        if (i == map.end()) {
+            return false;
+        }
+        if (i->second.queued) {
+            auto r = boost::range::find(_ready, fp);
+            assert(r != _ready.end());
+            _ready.erase(r);
+        }
+        map.erase(i);
+        return true;
+    }
     void remove_me(file* fp) {
         WITH_LOCK(fp->f_lock) {
             auto i = boost::range::find(*fp->f_epolls, this);
@@ -193,8 +339,17 @@ int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
         return -1;
     }
 
-    int error = 0;
     fileref fp = fileref_from_fd(fd);
+    if (!fp) {
+        errno = EBADF;
+        return -1;
+    }
+    if (fp == epfr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int error = 0;
 
     switch (op) {
     case EPOLL_CTL_ADD:
@@ -236,9 +391,17 @@ int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout_
     return epo->wait(events, maxevents, timeout_ms);
 }
 
-void epoll_file_closed(file* epoll_fd, file* client)
+void epoll_wake(file* epoll_fd, file* client, int events)
+{
+    static_cast<epoll_file*>(epoll_fd)->wake(client, events);
+}
+
+void epoll_file_closed(file* client)
 {
-    fileref epoll_ptr(epoll_fd);
-    auto epoll_obj = dynamic_cast<epoll_file*>(epoll_ptr.get());
-    epoll_obj->del(client);
+    WITH_LOCK(epoll_mutex) {
+        for (auto ep : *client->f_epolls) {
+            static_cast<epoll_file*>(ep)->closed(client);
+        }
+        client->f_epolls->clear();
+    }
 }
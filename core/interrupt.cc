@@ -135,7 +135,7 @@ static inline void set_affinity_and_wake(
     t->wake();
 }
 
-bool interrupt_manager::easy_register(std::initializer_list<msix_binding> bindings)
+bool interrupt_manager::easy_register(const std::vector<msix_binding>& bindings)
 {
     unsigned n = bindings.size();
 
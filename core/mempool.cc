@@ -122,7 +122,7 @@ static void free_worker_fn()
     for (unsigned i=0; i < sched::cpus.size(); i++) {
         void* obj = nullptr;
         while (pcpu_free_list[cpu_id][i]->pop(obj)) {
-            memory::pool::from_object(obj)->free(obj);
+            memory::pool::from_object(obj)->free_remote(obj);
         }
     }
 
@@ -137,7 +137,7 @@ static void free_worker_fn()
 
     if (free_obj) {
         sync._cond.wake_all();
-        memory::pool::from_object(free_obj)->free(free_obj);
+        memory::pool::from_object(free_obj)->free_remote(free_obj);
     }
 }
 
@@ -155,18 +155,41 @@ PCPU_WORKERITEM(free_worker, free_worker_fn);
 // or frees pages as needed.
 //
 // Large objects are rounded up to page size.  They have a page-sized header
-// in front that contains the page size.  The free list (free_page_ranges)
-// is an rbtree sorted by address.  Allocation strategy is first-fit.
+// in front that contains the page size.  The free page ranges are kept in an
+// rbtree sorted by address (free_page_ranges), to merge neighbours, and in
+// free lists by size (free_page_range_lists), to allocate from.  Each cpu
+// also caches a few freed large objects of the smallest sizes.
 //
 // Objects that are exactly page sized, and allocated by alloc_page(), come
 // from the same pool as large objects, except they don't have a header
 // (since we know the size already).
 
+static inline void* untracked_alloc_page();
+static inline void untracked_free_page(void *v);
+static void free_page_range(void *addr, size_t size);
+
+struct pool::magazine {
+    magazine* next;
+    unsigned nrounds;
+    void* rounds[0];
+};
+
+// A magazine takes a page, but we limit the memory cached in each one, so
+// pools of large objects have fewer rounds per magazine.
+static constexpr size_t magazine_max_rounds =
+        (page_size - sizeof(void*) * 2) / sizeof(void*);
+static constexpr size_t magazine_min_rounds = 8;
+static constexpr size_t magazine_bytes = 8192;
+
 pool::pool(unsigned size)
     : _size(size)
     , _free()
+    , _magazine_rounds(std::min(magazine_max_rounds,
+            std::max(magazine_min_rounds, magazine_bytes / size)))
 {
     assert(size + sizeof(page_header) <= page_size);
+    static_assert(sizeof(magazine) + magazine_max_rounds * sizeof(void*)
+            <= page_size, "magazine too large");
 }
 
 pool::~pool()
@@ -189,6 +212,196 @@ TRACEPOINT(trace_pool_free_same_cpu, "this=%p, obj=%p", void*, void*);
 TRACEPOINT(trace_pool_free_different_cpu, "this=%p, obj=%p, obj_cpu=%d", void*, void*, unsigned);
 
 void* pool::alloc()
+{
+    void* ret = nullptr;
+    bool add = false;
+    WITH_LOCK(preempt_lock) {
+        auto& c = *_cache;
+        ret = alloc_from_magazine(c);
+        std::swap(add, c.want_magazine);
+    }
+    if (!ret) {
+        ret = alloc_from_pages();
+    }
+    // free() lacked a magazine on this cpu; allocate it here rather than
+    // there, so that freeing memory never needs memory.
+    if (add) {
+        add_magazine();
+    }
+    trace_pool_alloc(this, ret);
+    return ret;
+}
+
+void* pool::alloc_from_magazine(cpu_cache& c)
+{
+    if (!c.previous) {
+        ++c.stats.alloc_misses;
+        return nullptr;
+    }
+    if (!c.loaded->nrounds) {
+        if (c.previous->nrounds) {
+            std::swap(c.loaded, c.previous);
+        } else {
+            // Exchange our empty magazine for a full one
+            WITH_LOCK(_depot_lock) {
+                auto full = _depot_full;
+                if (!full) {
+                    ++c.stats.alloc_misses;
+                    return nullptr;
+                }
+                _depot_full = full->next;
+                --_depot_nfull;
+                c.previous->next = _depot_empty;
+                _depot_empty = c.previous;
+                c.previous = c.loaded;
+                c.loaded = full;
+            }
+        }
+    }
+    ++c.stats.alloc_hits;
+    return c.loaded->rounds[--c.loaded->nrounds];
+}
+
+void pool::free(void* object)
+{
+    trace_pool_free(this, object);
+
+    free_result r;
+    WITH_LOCK(preempt_lock) {
+        r = free_to_magazine(*_cache, object);
+    }
+    if (r != free_result::freed) {
+        free_to_pages(object);
+    }
+}
+
+pool::free_result pool::free_to_magazine(cpu_cache& c, void* object)
+{
+    if (!c.previous) {
+        ++c.stats.free_misses;
+        c.want_magazine = true;
+        return free_result::no_magazine;
+    }
+    if (c.loaded->nrounds == _magazine_rounds) {
+        if (!c.previous->nrounds) {
+            std::swap(c.loaded, c.previous);
+        } else {
+            // Exchange our full magazine for an empty one. Don't let the
+            // depot hoard more than a magazine per cpu; objects nobody
+            // allocates go back to their pages.
+            WITH_LOCK(_depot_lock) {
+                if (_depot_nfull >= sched::cpus.size()) {
+                    ++c.stats.free_misses;
+                    return free_result::depot_full;
+                }
+                auto empty = _depot_empty;
+                if (!empty) {
+                    ++c.stats.free_misses;
+                    c.want_magazine = true;
+                    return free_result::no_magazine;
+                }
+                _depot_empty = empty->next;
+                c.previous->next = _depot_full;
+                _depot_full = c.previous;
+                ++_depot_nfull;
+                c.previous = c.loaded;
+                c.loaded = empty;
+            }
+        }
+    }
+    ++c.stats.free_hits;
+    c.loaded->rounds[c.loaded->nrounds++] = object;
+    return free_result::freed;
+}
+
+void pool::add_magazine()
+{
+    auto m = static_cast<magazine*>(untracked_alloc_page());
+    m->next = nullptr;
+    m->nrounds = 0;
+    WITH_LOCK(preempt_lock) {
+        auto& c = *_cache;
+        if (!c.loaded) {
+            c.loaded = m;
+        } else if (!c.previous) {
+            c.previous = m;
+        } else {
+            WITH_LOCK(_depot_lock) {
+                m->next = _depot_empty;
+                _depot_empty = m;
+            }
+        }
+    }
+}
+
+// Return a magazine's objects to their pages, and its page to
+// free_page_ranges. Returns the bytes freed.
+size_t pool::free_magazine(magazine* m)
+{
+    for (unsigned i = 0; i < m->nrounds; i++) {
+        free_to_pages(m->rounds[i]);
+    }
+    free_page_range(m, page_size);
+    return page_size;
+}
+
+void pool::flush_cpu()
+{
+    WITH_LOCK(preempt_lock) {
+        auto& c = *_cache;
+        WITH_LOCK(_depot_lock) {
+            for (auto m : { c.loaded, c.previous }) {
+                if (!m) {
+                    continue;
+                }
+                if (m->nrounds) {
+                    m->next = _depot_full;
+                    _depot_full = m;
+                    ++_depot_nfull;
+                } else {
+                    m->next = _depot_empty;
+                    _depot_empty = m;
+                }
+            }
+        }
+        c.loaded = c.previous = nullptr;
+    }
+}
+
+size_t pool::drain_depot()
+{
+    magazine* lists[2];
+    WITH_LOCK(_depot_lock) {
+        lists[0] = _depot_full;
+        lists[1] = _depot_empty;
+        _depot_full = _depot_empty = nullptr;
+        _depot_nfull = 0;
+    }
+    size_t freed = 0;
+    for (auto m : lists) {
+        while (m) {
+            auto next = m->next;
+            freed += free_magazine(m);
+            m = next;
+        }
+    }
+    return freed;
+}
+
+pool::stats_type pool::stats()
+{
+    stats_type ret;
+    for (auto cpu : sched::cpus) {
+        auto& s = _cache.for_cpu(cpu)->stats;
+        ret.alloc_hits += s.alloc_hits;
+        ret.alloc_misses += s.alloc_misses;
+        ret.free_hits += s.free_hits;
+        ret.free_misses += s.free_misses;
+    }
+    return ret;
+}
+
+void* pool::alloc_from_pages()
 {
     void * ret = nullptr;
     WITH_LOCK(preempt_lock) {
@@ -213,8 +426,6 @@ void* pool::alloc()
         }
         ret = obj;
     }
-
-    trace_pool_alloc(this, ret);
     return ret;
 }
 
@@ -223,9 +434,6 @@ unsigned pool::get_size()
     return _size;
 }
 
-static inline void* untracked_alloc_page();
-static inline void untracked_free_page(void *v);
-
 void pool::add_page()
 {
     // FIXME: this function allocated a page and set it up but on rare cases
@@ -318,10 +526,8 @@ void pool::free_different_cpu(free_object* obj, unsigned obj_cpu)
 }
 
 
-void pool::free(void* object)
+void pool::free_to_pages(void* object)
 {
-    trace_pool_free(this, object);
-
     WITH_LOCK(preempt_lock) {
 
         free_object* obj = static_cast<free_object*>(object);
@@ -341,12 +547,74 @@ void pool::free(void* object)
     }
 }
 
+void pool::free_remote(void* object)
+{
+    // The object already missed the magazines of the cpu which freed it.
+    // The free worker runs on the object's cpu, so this ends up in
+    // free_same_cpu().
+    free_to_pages(object);
+}
+
 pool* pool::from_object(void* object)
 {
     auto header = to_header(static_cast<free_object*>(object));
     return header->owner;
 }
 
+// Size classes of small malloc()s. Rounding every size up to a power of two
+// wastes up to half of each object (a 520 byte object takes 1024 bytes), so
+// like jemalloc, we have four classes per doubling, up to 2^n + 2^(n-2)
+// apart, but spaced at least 16 bytes apart so objects stay 16 byte aligned.
+// Waste is at most 20%, or 15 bytes for the smallest sizes.
+constexpr size_t malloc_class_sizes[] = {
+    8, 16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+
+constexpr unsigned nr_malloc_classes =
+        sizeof(malloc_class_sizes) / sizeof(malloc_class_sizes[0]);
+
+static_assert(malloc_class_sizes[nr_malloc_classes - 1] == page_size / 2,
+        "malloc classes must cover pool::max_object_size");
+
+constexpr unsigned malloc_class_constexpr(size_t size, unsigned i = 0)
+{
+    return malloc_class_sizes[i] >= size ? i : malloc_class_constexpr(size, i + 1);
+}
+
+// The class of each size, in steps of 8 bytes, computed at compile time
+template <unsigned... I> struct index_seq {};
+template <unsigned N, unsigned... I>
+struct make_index_seq : make_index_seq<N - 1, N - 1, I...> {};
+template <unsigned... I>
+struct make_index_seq<0, I...> { typedef index_seq<I...> type; };
+
+constexpr unsigned malloc_class_step = 8;
+constexpr unsigned nr_malloc_class_table = page_size / 2 / malloc_class_step;
+
+struct malloc_class_table {
+    u8 index[nr_malloc_class_table];
+};
+
+template <unsigned... I>
+constexpr malloc_class_table make_malloc_class_table(index_seq<I...>)
+{
+    return { { malloc_class_constexpr((I + 1) * malloc_class_step)... } };
+}
+
+constexpr malloc_class_table malloc_classes =
+        make_malloc_class_table(make_index_seq<nr_malloc_class_table>::type());
+
+static_assert(malloc_classes.index[(520 - 1) / malloc_class_step] == 17,
+        "520 bytes go in the 640 byte class");
+
+// For min_object_size <= size <= max_object_size
+static inline unsigned malloc_class(size_t size)
+{
+    return malloc_classes.index[(size - 1) / malloc_class_step];
+}
+
 class malloc_pool : public pool {
 public:
     malloc_pool();
@@ -354,7 +622,7 @@ private:
     static size_t compute_object_size(unsigned pos);
 };
 
-malloc_pool malloc_pools[ilog2_roundup_constexpr(page_size) + 1]
+malloc_pool malloc_pools[nr_malloc_classes]
     __attribute__((init_priority((int)init_prio::malloc_pools)));
 
 struct mark_smp_allocator_intialized {
@@ -388,11 +656,7 @@ malloc_pool::malloc_pool()
 
 size_t malloc_pool::compute_object_size(unsigned pos)
 {
-    size_t size = 1 << pos;
-    if (size > max_object_size) {
-        size = max_object_size;
-    }
-    return size;
+    return malloc_class_sizes[pos];
 }
 
 page_range::page_range(size_t _size)
@@ -416,8 +680,134 @@ bi::set<page_range,
                        &page_range::member_hook>
        > free_page_ranges __attribute__((init_priority((int)init_prio::fpranges)));
 
-// Our notion of free memory is "whatever is in the page ranges". Therefore it
-// starts at 0, and increases as we add page ranges.
+// Free page ranges are also kept in free lists by size, so allocating
+// doesn't search all of free_page_ranges, which grows to thousands of
+// ranges as memory fragments: list i holds the ranges of 2^i to 2^(i+1)-1
+// pages. Every range in list ilog2_roundup(n) or above has room for n
+// pages, so a mask of the non-empty lists finds one in O(1); only if there
+// is none do we search list ilog2(n), whose ranges may or may not fit.
+class page_range_lists {
+public:
+    static constexpr unsigned nr_lists = stats::page_ranges_type::nr_lists;
+    void insert(page_range& pr) {
+        auto i = index(pr.size);
+        _lists[i].push_front(pr);
+        _nonempty |= 1u << i;
+        _bytes[i] += pr.size;
+    }
+    void erase(page_range& pr) {
+        auto i = index(pr.size);
+        _lists[i].erase(_lists[i].iterator_to(pr));
+        if (_lists[i].empty()) {
+            _nonempty &= ~(1u << i);
+        }
+        _bytes[i] -= pr.size;
+    }
+    void resize(page_range& pr, size_t size) {
+        erase(pr);
+        pr.size = size;
+        insert(pr);
+    }
+    // A range with room for size bytes aligned to align, or nullptr
+    page_range* find(size_t size, size_t align = page_size) {
+        // A range this large surely has room
+        auto sure = index_roundup(size + align - page_size);
+        if (sure < nr_lists - 1) {
+            auto mask = _nonempty & ~((1u << sure) - 1);
+            if (mask) {
+                return &_lists[__builtin_ctz(mask)].front();
+            }
+        }
+        for (auto i = index(size); i <= std::min(sure, nr_lists - 1); i++) {
+            for (auto& pr : _lists[i]) {
+                if (aligned_end(pr, size, align)) {
+                    return &pr;
+                }
+            }
+        }
+        return nullptr;
+    }
+    // Where the last block of size bytes aligned to align in a range starts,
+    // or 0 if there is none
+    static uintptr_t aligned_end(page_range& pr, size_t size, size_t align) {
+        auto v = reinterpret_cast<uintptr_t>(&pr);
+        if (pr.size < size) {
+            return 0;
+        }
+        auto ret = (v + pr.size - size) & ~(align - 1);
+        return ret >= v ? ret : 0;
+    }
+    // One of the smallest ranges, or nullptr
+    page_range* smallest() {
+        if (!_nonempty) {
+            return nullptr;
+        }
+        return &_lists[__builtin_ctz(_nonempty)].front();
+    }
+    void get_stats(stats::page_ranges_type& s) {
+        s.ranges = 0;
+        s.largest = 0;
+        for (unsigned i = 0; i < nr_lists; i++) {
+            s.list_ranges[i] = _lists[i].size();
+            s.list_bytes[i] = _bytes[i];
+            s.ranges += s.list_ranges[i];
+        }
+        if (_nonempty) {
+            for (auto& pr : _lists[31 - __builtin_clz(_nonempty)]) {
+                s.largest = std::max(s.largest, pr.size);
+            }
+        }
+    }
+private:
+    static unsigned index(size_t size) {
+        auto pages = size / page_size;
+        return std::min(unsigned(63 - count_leading_zeros(pages)), nr_lists - 1);
+    }
+    static unsigned index_roundup(size_t size) {
+        return std::min(ilog2_roundup(size / page_size), nr_lists - 1);
+    }
+private:
+    typedef bi::list<page_range,
+                     bi::member_hook<page_range,
+                                     bi::list_member_hook<>,
+                                     &page_range::size_hook>
+                    > list_type;
+    list_type _lists[nr_lists];
+    unsigned _nonempty = 0;
+    size_t _bytes[nr_lists] = {};
+};
+
+page_range_lists free_page_range_lists
+    __attribute__((init_priority((int)init_prio::fpranges)));
+
+static void insert_free_page_range(page_range* pr)
+{
+    free_page_ranges.insert(*pr);
+    free_page_range_lists.insert(*pr);
+}
+
+static void erase_free_page_range(page_range* pr)
+{
+    free_page_ranges.erase(*pr);
+    free_page_range_lists.erase(*pr);
+}
+
+// Takes size bytes from the end of a free page range, keeping the rest free
+static void* shrink_free_page_range(page_range* pr, size_t size)
+{
+    void* v = pr;
+    auto rest = pr->size - size;
+    if (!rest) {
+        erase_free_page_range(pr);
+    } else {
+        free_page_range_lists.resize(*pr, rest);
+    }
+    return v + rest;
+}
+
+// Our notion of free memory is "whatever is in the page ranges", plus the
+// large objects cached per cpu. Therefore it starts at 0, and increases as we
+// add page ranges.
 //
 // Updates to total should be fairly rare. We only expect updates upon boot,
 // and eventually hotplug in an hypothetical future
@@ -457,6 +847,19 @@ namespace stats {
     size_t free() { return free_memory.load(std::memory_order_relaxed); }
     size_t total() { return total_memory.load(std::memory_order_relaxed); }
 
+    pool::stats_type malloc_pools()
+    {
+        pool::stats_type ret;
+        for (auto& p : memory::malloc_pools) {
+            auto s = p.stats();
+            ret.alloc_hits += s.alloc_hits;
+            ret.alloc_misses += s.alloc_misses;
+            ret.free_hits += s.free_hits;
+            ret.free_misses += s.free_misses;
+        }
+        return ret;
+    }
+
     void on_jvm_heap_alloc(size_t mem)
     {
         current_jvm_heap_memory.fetch_add(mem);
@@ -540,33 +943,181 @@ void reclaimer::wait_for_memory(size_t mem)
     }
 }
 
+// Each cpu keeps a few freed large objects of the smallest sizes (up to
+// max_pages, header included), so that malloc_large() and free_large() of
+// those usually don't take free_page_ranges_lock. This holds at most 140
+// pages per cpu, which count as free memory: the reclaimer gives them back
+// to free_page_ranges (drain_cpu_caches()) when memory is short.
+struct large_object_cache {
+    static constexpr unsigned max_pages = 8;
+    static constexpr unsigned per_size = 4;
+    struct bucket {
+        unsigned nr = 0;
+        page_range* objs[per_size];
+    };
+    bucket buckets[max_pages + 1];
+    u64 hits = 0;
+    u64 misses = 0;
+};
+
+PERCPU(large_object_cache, percpu_large_cache);
+
+static page_range* alloc_large_local(size_t size)
+{
+    auto pages = size / page_size;
+    if (!smp_allocator || pages > large_object_cache::max_pages) {
+        return nullptr;
+    }
+    page_range* header = nullptr;
+    WITH_LOCK(preempt_lock) {
+        auto& cache = *percpu_large_cache;
+        auto& b = cache.buckets[pages];
+        if (!b.nr) {
+            cache.misses++;
+            return nullptr;
+        }
+        cache.hits++;
+        header = b.objs[--b.nr];
+    }
+    on_alloc(size);
+    return header;
+}
+
+static bool free_large_local(page_range* header)
+{
+    auto size = header->size;
+    auto pages = size / page_size;
+    if (!smp_allocator || pages > large_object_cache::max_pages) {
+        return false;
+    }
+    WITH_LOCK(preempt_lock) {
+        auto& b = percpu_large_cache->buckets[pages];
+        if (b.nr == large_object_cache::per_size) {
+            return false;
+        }
+        b.objs[b.nr++] = header;
+    }
+    on_free(size);
+    return true;
+}
+
+static void insert_merge_free_page_range(page_range *range);
+
+// Empties this cpu's caches, for drain_cpu_caches(): the large objects go
+// to free_page_ranges (they already count as free memory), and the malloc
+// pools' magazines to their depots. Freeing the magazines' objects may wait
+// for other cpus' worker threads, so that's left to the reclaimer.
+struct cpu_caches_drain_sync {
+    mutex mtx;
+    condvar done;
+    unsigned pending = 0;
+    size_t drained = 0;
+} cpu_caches_drain;
+
+static void cpu_caches_drain_fn()
+{
+    page_range* objs[(large_object_cache::max_pages + 1) *
+                     large_object_cache::per_size];
+    unsigned nr = 0;
+    WITH_LOCK(preempt_lock) {
+        for (auto& b : percpu_large_cache->buckets) {
+            while (b.nr) {
+                objs[nr++] = b.objs[--b.nr];
+            }
+        }
+    }
+    size_t bytes = 0;
+    WITH_LOCK(free_page_ranges_lock) {
+        for (unsigned i = 0; i < nr; i++) {
+            bytes += objs[i]->size;
+            insert_merge_free_page_range(objs[i]);
+        }
+    }
+    for (auto& p : malloc_pools) {
+        p.flush_cpu();
+    }
+    auto& d = cpu_caches_drain;
+    WITH_LOCK(d.mtx) {
+        d.drained += bytes;
+        if (!--d.pending) {
+            d.done.wake_all();
+        }
+    }
+}
+
+PCPU_WORKERITEM(cpu_caches_drainer, cpu_caches_drain_fn);
+
+// Returns the large objects cached by all cpus to free_page_ranges, where
+// any cpu can allocate them, and the objects cached in the malloc pools'
+// magazines to their pages. Returns the bytes drained. Each cpu empties its
+// own caches, in its worker thread; we wait for all of them.
+static size_t drain_cpu_caches()
+{
+    if (!smp_allocator) {
+        return 0;
+    }
+    auto& d = cpu_caches_drain;
+    WITH_LOCK(d.mtx) {
+        d.pending = sched::cpus.size();
+        d.drained = 0;
+    }
+    for (auto cpu : sched::cpus) {
+        cpu_caches_drainer.signal(cpu);
+    }
+    size_t drained;
+    WITH_LOCK(d.mtx) {
+        while (d.pending) {
+            d.done.wait(&d.mtx);
+        }
+        drained = d.drained;
+    }
+    for (auto& p : malloc_pools) {
+        drained += p.drain_depot();
+    }
+    return drained;
+}
+
+namespace stats {
+    page_ranges_type page_ranges()
+    {
+        page_ranges_type ret;
+        WITH_LOCK(free_page_ranges_lock) {
+            free_page_range_lists.get_stats(ret);
+        }
+        ret.large_cache_hits = ret.large_cache_misses = 0;
+        for (auto cpu : sched::cpus) {
+            auto cache = percpu_large_cache.for_cpu(cpu);
+            ret.large_cache_hits += cache->hits;
+            ret.large_cache_misses += cache->misses;
+        }
+        return ret;
+    }
+}
+
 static void* malloc_large(size_t size)
 {
     size = (size + page_size - 1) & ~(page_size - 1);
     size += page_size;
 
+    if (auto header = alloc_large_local(size)) {
+        void* obj = header;
+        obj += page_size;
+        trace_memory_malloc_large(obj, size);
+        return obj;
+    }
+
     while (true) {
         WITH_LOCK(free_page_ranges_lock) {
             reclaimer_thread.wait_for_minimum_memory();
 
-            for (auto i = free_page_ranges.begin(); i != free_page_ranges.end(); ++i) {
-                auto header = &*i;
-                page_range* ret_header;
-                if (header->size >= size) {
-                    if (header->size == size) {
-                        free_page_ranges.erase(i);
-                        ret_header = header;
-                    } else {
-                        void *v = header;
-                        header->size -= size;
-                        ret_header = new (v + header->size) page_range(size);
-                    }
-                    on_alloc(size);
-                    void* obj = ret_header;
-                    obj += page_size;
-                    trace_memory_malloc_large(obj, size);
-                    return obj;
-                }
+            auto range = free_page_range_lists.find(size);
+            if (range) {
+                auto ret_header = new (shrink_free_page_range(range, size)) page_range(size);
+                on_alloc(size);
+                void* obj = ret_header;
+                obj += page_size;
+                trace_memory_malloc_large(obj, size);
+                return obj;
             }
             reclaimer_thread.wait_for_memory(size);
         }
@@ -675,6 +1226,11 @@ void reclaimer::_do_reclaim()
         target = bytes_until_normal();
     }
 
+    // The large objects cached by each cpu count as free, but only that cpu
+    // can allocate them, and the malloc pools' magazines hold on to pages.
+    // Make them available to everyone, before shrinking or giving up.
+    memory_freed += drain_cpu_caches();
+
     // FIXME: This simple loop works only because we have a single shrinker
     // When we have more, we need to probe them and decide how much to take from
     // each of them.
@@ -718,21 +1274,20 @@ static page_range* merge(page_range* a, page_range* b)
     void* vb = b;
 
     if (va + a->size == vb) {
-        a->size += b->size;
-        free_page_ranges.erase(*b);
+        erase_free_page_range(b);
+        free_page_range_lists.resize(*a, a->size + b->size);
         return a;
     } else {
         return b;
     }
 }
 
-// Return a page range back to free_page_ranges. Note how the size of the
-// page range is range->size, but its start is at range itself.
-static void free_page_range_locked(page_range *range)
+// Insert a page range into free_page_ranges, merging it with its
+// neighbours, without counting it as free memory.
+static void insert_merge_free_page_range(page_range *range)
 {
-    auto i = free_page_ranges.insert(*range).first;
-
-    on_free(range->size);
+    insert_free_page_range(range);
+    auto i = free_page_ranges.iterator_to(*range);
 
     if (i != free_page_ranges.begin()) {
         i = free_page_ranges.iterator_to(*merge(&*boost::prior(i), &*i));
@@ -742,6 +1297,14 @@ static void free_page_range_locked(page_range *range)
     }
 }
 
+// Return a page range back to free_page_ranges. Note how the size of the
+// page range is range->size, but its start is at range itself.
+static void free_page_range_locked(page_range *range)
+{
+    on_free(range->size);
+    insert_merge_free_page_range(range);
+}
+
 // Return a page range back to free_page_ranges. Note how the size of the
 // page range is range->size, but its start is at range itself.
 static void free_page_range(page_range *range)
@@ -759,7 +1322,10 @@ static void free_page_range(void *addr, size_t size)
 
 static void free_large(void* obj)
 {
-    free_page_range(static_cast<page_range*>(obj - page_size));
+    auto header = static_cast<page_range*>(obj - page_size);
+    if (!free_large_local(header)) {
+        free_page_range(header);
+    }
 }
 
 static unsigned large_object_size(void *obj)
@@ -797,17 +1363,13 @@ static void refill_page_buffer()
             auto limit = (pbuf.max + 1) / 2;
 
             while (pbuf.nr < limit) {
-                auto it = free_page_ranges.begin();
-                if (it == free_page_ranges.end())
+                // Take the smallest ranges, to leave the large ones whole
+                auto p = free_page_range_lists.smallest();
+                if (!p)
                     break;
-                auto p = &*it;
                 auto size = std::min(p->size, (limit - pbuf.nr) * page_size);
-                p->size -= size;
                 total_size += size;
-                void* pages = static_cast<void*>(p) + p->size;
-                if (!p->size) {
-                    free_page_ranges.erase(*p);
-                }
+                void* pages = shrink_free_page_range(p, size);
                 while (size) {
                     pbuf.free[pbuf.nr++] = pages;
                     pages += page_size;
@@ -863,18 +1425,13 @@ static bool free_page_local(void* v)
 static void* early_alloc_page()
 {
     WITH_LOCK(free_page_ranges_lock) {
-        if (free_page_ranges.empty()) {
+        auto p = free_page_range_lists.smallest();
+        if (!p) {
             abort("alloc_page(): out of memory\n");
         }
 
-        auto p = &*free_page_ranges.begin();
-        p->size -= page_size;
         on_alloc(page_size);
-        void* page = static_cast<void*>(p) + p->size;
-        if (!p->size) {
-            free_page_ranges.erase(*p);
-        }
-        return page;
+        return shrink_free_page_range(p, page_size);
     }
 }
 
@@ -931,25 +1488,20 @@ void free_page(void* v)
 void* alloc_huge_page(size_t N)
 {
     WITH_LOCK(free_page_ranges_lock) {
-        for (auto i = free_page_ranges.begin(); i != free_page_ranges.end(); ++i) {
-            page_range *range = &*i;
-            if (range->size < N)
-                continue;
+        if (page_range *range = free_page_range_lists.find(N, N)) {
             intptr_t v = (intptr_t) range;
             // Find the the beginning of the last aligned area in the given
             // page range. This will be our return value:
-            intptr_t ret = (v+range->size-N) & ~(N-1);
-            if (ret<v)
-                continue;
+            intptr_t ret = page_range_lists::aligned_end(*range, N, N);
             // endsize is the number of bytes in the page range *after* the
             // N bytes we will return. calculate it before changing header->size
-            int endsize = v+range->size-ret-N;
+            size_t endsize = v+range->size-ret-N;
             // Make the original page range smaller, pointing to the part before
             // our ret (if there's nothing before, remove this page range)
             size_t alloc_size;
             if (ret==v) {
                 alloc_size = range->size;
-                free_page_ranges.erase(*range);
+                erase_free_page_range(range);
             } else {
                 // Note that this is is done conditionally because we are
                 // operating page ranges. That is what is left on our page
@@ -958,7 +1510,7 @@ void* alloc_huge_page(size_t N)
                 // later on wiped by the on_free() call that exists within
                 // free_page_range in the conditional right below us.
                 alloc_size = range->size - (ret - v);
-                range->size = ret-v;
+                free_page_range_lists.resize(*range, ret-v);
             }
             on_alloc(alloc_size);
 
@@ -1056,8 +1608,7 @@ static inline void* std_malloc(size_t size)
             return memory::alloc_page() + memory::non_mempool_obj_offset;
         }
         size = std::max(size, memory::pool::min_object_size);
-        unsigned n = ilog2_roundup(size);
-        ret = memory::malloc_pools[n].alloc();
+        ret = memory::malloc_pools[memory::malloc_class(size)].alloc();
     } else {
         ret = memory::malloc_large(size);
     }
@@ -1257,6 +1808,14 @@ int posix_memalign(void **memptr, size_t alignment, size_t size)
     if (!is_power_of_two(alignment)) {
         return EINVAL;
     }
+    if (size <= memory::pool::max_object_size) {
+        // Small objects are aligned to 16 bytes (but the 8 byte class), and
+        // to their size class if it is a power of two
+        size = std::max(size, alignment);
+        if (alignment > 16) {
+            size = size_t(1) << ilog2_roundup(size);
+        }
+    }
     void *ret = malloc(size);
     if (!ret) {
         return ENOMEM;
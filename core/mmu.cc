@@ -27,6 +27,10 @@
 #include "java/jvm_balloon.hh"
 #include <fs/fs.hh>
 #include <osv/file.h>
+#include <osv/pagecache.hh>
+#include <osv/condvar.h>
+#include <osv/preempt-lock.hh>
+#include <osv/clock.hh>
 
 extern void* elf_start;
 extern size_t elf_size;
@@ -156,6 +160,17 @@ bool change_perm(hw_ptep ptep, unsigned int perm)
     return old & ~perm;
 }
 
+static std::atomic<u64> huge_pages_mapped;
+static std::atomic<u64> huge_page_fallbacks;
+static std::atomic<u64> huge_page_splits;
+
+huge_page_stats get_huge_page_stats()
+{
+    return { huge_pages_mapped.load(std::memory_order_relaxed),
+             huge_page_fallbacks.load(std::memory_order_relaxed),
+             huge_page_splits.load(std::memory_order_relaxed) };
+}
+
 void split_large_page(hw_ptep ptep, unsigned level)
 {
     pt_element pte_orig = ptep.read();
@@ -198,40 +213,227 @@ void debug_count_ptes(pt_element pte, int level, size_t &nsmall, size_t &nhuge)
 }
 
 
+// With PCID and INVPCID, the kernel's linear mappings (of physical memory,
+// the kernel itself and mmio), which never change once made, are global,
+// and flushes use INVPCID on our single address space's PCID (0), which
+// leaves global translations alone. Otherwise a flush reloads CR3.
+static bool pcid_enabled()
+{
+    static bool enabled = processor::features().pcid
+            && processor::features().invpcid;
+    return enabled;
+}
+
 void tlb_flush_this_processor()
 {
+    if (pcid_enabled()) {
+        processor::invpcid(processor::invpcid_type::single_context, 0, nullptr);
+        return;
+    }
     // TODO: we can use page_table_root instead of read_cr3(), can be faster
     // when shadow page tables are used.
     processor::write_cr3(processor::read_cr3());
 }
 
-// tlb_flush() does TLB flush on *all* processors, not returning before all
-// processors confirm flushing their TLB. This is slow, but necessary for
-// correctness so that, for example, after mprotect() returns, no thread on
-// no cpu can write to the protected page.
-mutex tlb_flush_mutex;
-sched::thread *tlb_flush_waiter;
-std::atomic<int> tlb_flush_pendingconfirms;
+// Ranges of up to this many pages are flushed page by page with invlpg,
+// instead of flushing the whole TLB.
+constexpr size_t tlb_flush_max_invlpg = 32;
 
-inter_processor_interrupt tlb_flush_ipi{[] {
+void tlb_flush_this_processor(uintptr_t start, uintptr_t end)
+{
+    if (end - start > tlb_flush_max_invlpg * page_size) {
+        tlb_flush_this_processor();
+        return;
+    }
+    for (auto addr = start; addr < end; addr += page_size) {
+        auto p = reinterpret_cast<void*>(addr);
+        if (pcid_enabled()) {
+            processor::invpcid(processor::invpcid_type::address, 0, p);
+        } else {
+            processor::invlpg(p);
+        }
+    }
+}
+
+TRACEPOINT(trace_mmu_tlb_shootdown, "start=%p, end=%p, ipis=%d, lazy=%d, us=%d",
+        uintptr_t, uintptr_t, unsigned, unsigned, unsigned);
+
+// tlb_flush() flushes a range of addresses (or everything) from the TLB on
+// *all* processors, not returning before all processors confirm the flush.
+// This is slow, but necessary for correctness so that, for example, after
+// mprotect() returns, no thread on no cpu can write to the protected page.
+//
+// To make it cheaper:
+//
+//  - Concurrent tlb_flush() calls are batched: while one thread waits for a
+//    round of IPIs to be confirmed, the ranges other threads ask to flush
+//    are merged, and all of them are covered by the next round.
+//
+//  - Idle cpus aren't interrupted. A cpu which halts marks itself lazy with
+//    lazy_tlb_enter(); a flush finding it so only marks it stale, and it
+//    flushes its whole TLB in lazy_tlb_exit(), before the scheduler switches
+//    to any thread. Interrupt handlers running on a halted cpu don't touch
+//    memory which is being unmapped, because it no longer belongs to anyone.
+enum : unsigned {
+    lazy_tlb_running,
+    lazy_tlb_idle,
+    lazy_tlb_stale,
+};
+
+struct lazy_tlb_state {
+    std::atomic<unsigned> state = { lazy_tlb_running };
+} CACHELINE_ALIGNED;
+
+static lazy_tlb_state lazy_tlb_states[sched::max_cpus];
+
+void lazy_tlb_enter(unsigned cpu_id)
+{
+    // A stale cpu which goes back to sleep stays stale
+    unsigned s = lazy_tlb_running;
+    lazy_tlb_states[cpu_id].state.compare_exchange_strong(s, lazy_tlb_idle);
+}
+
+void lazy_tlb_exit(unsigned cpu_id)
+{
+    auto& s = lazy_tlb_states[cpu_id].state;
+    if (s.load(std::memory_order_relaxed) != lazy_tlb_running
+            && s.exchange(lazy_tlb_running) == lazy_tlb_stale) {
         tlb_flush_this_processor();
+    }
+}
+
+static mutex tlb_flush_mutex;
+static condvar tlb_flush_done;
+// The batch being collected, to be flushed by the next round of IPIs
+static u64 tlb_flush_batch_gen = 1;
+static uintptr_t tlb_flush_batch_start = ~uintptr_t(0);
+static uintptr_t tlb_flush_batch_end = 0;
+// The last round confirmed by all cpus
+static u64 tlb_flush_done_gen = 0;
+static bool tlb_flush_in_progress = false;
+
+// The range the round in progress flushes, read by the IPI handler
+static uintptr_t tlb_shootdown_start, tlb_shootdown_end;
+static sched::thread *tlb_flush_waiter;
+static std::atomic<int> tlb_flush_pendingconfirms;
+
+static std::atomic<u64> tlb_flushes;
+static std::atomic<u64> tlb_flushes_ranged;
+static std::atomic<u64> tlb_flushes_batched;
+static std::atomic<u64> tlb_shootdowns;
+static std::atomic<u64> tlb_shootdown_ipis;
+static std::atomic<u64> tlb_shootdown_lazy;
+static std::atomic<u64> tlb_shootdown_latency[tlb_flush_stats::latency_buckets];
+
+tlb_flush_stats get_tlb_flush_stats()
+{
+    tlb_flush_stats ret;
+    ret.flushes = tlb_flushes.load(std::memory_order_relaxed);
+    ret.ranged = tlb_flushes_ranged.load(std::memory_order_relaxed);
+    ret.batched = tlb_flushes_batched.load(std::memory_order_relaxed);
+    ret.shootdowns = tlb_shootdowns.load(std::memory_order_relaxed);
+    ret.ipis = tlb_shootdown_ipis.load(std::memory_order_relaxed);
+    ret.lazy = tlb_shootdown_lazy.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < tlb_flush_stats::latency_buckets; i++) {
+        ret.latency[i] = tlb_shootdown_latency[i].load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+inter_processor_interrupt tlb_flush_ipi{[] {
+        tlb_flush_this_processor(tlb_shootdown_start, tlb_shootdown_end);
         if (tlb_flush_pendingconfirms.fetch_add(-1) == 1) {
             tlb_flush_waiter->wake();
         }
 }};
 
-void tlb_flush()
+// Flushes [start, end) on all cpus. Only one round runs at a time.
+static void tlb_shootdown(uintptr_t start, uintptr_t end)
 {
-    tlb_flush_this_processor();
-    if (sched::cpus.size() <= 1)
-        return;
-    std::lock_guard<mutex> guard(tlb_flush_mutex);
+    auto t0 = osv::clock::uptime::now();
+    tlb_shootdown_start = start;
+    tlb_shootdown_end = end;
     tlb_flush_waiter = sched::thread::current();
-    tlb_flush_pendingconfirms.store((int)sched::cpus.size() - 1);
-    tlb_flush_ipi.send_allbutself();
+    // Our own reference, so the count can't drop to zero while we send
+    tlb_flush_pendingconfirms.store(1);
+    unsigned ipis = 0, lazy = 0;
+    WITH_LOCK(preempt_lock) {
+        auto self = sched::cpu::current();
+        // The batch may hold other threads' ranges, not yet flushed here
+        tlb_flush_this_processor(start, end);
+        for (auto c : sched::cpus) {
+            if (c == self) {
+                continue;
+            }
+            unsigned s = lazy_tlb_idle;
+            auto& state = lazy_tlb_states[c->id].state;
+            if (state.compare_exchange_strong(s, lazy_tlb_stale) || s == lazy_tlb_stale) {
+                lazy++;
+                continue;
+            }
+            tlb_flush_pendingconfirms.fetch_add(1);
+            tlb_flush_ipi.send(c);
+            ipis++;
+        }
+    }
+    tlb_flush_pendingconfirms.fetch_add(-1);
     sched::thread::wait_until([] {
             return tlb_flush_pendingconfirms.load() == 0;
     });
+
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+            osv::clock::uptime::now() - t0).count();
+    unsigned bucket = us ? ilog2_roundup(u64(us) + 1) : 0;
+    bucket = std::min(bucket, tlb_flush_stats::latency_buckets - 1);
+    tlb_shootdowns.fetch_add(1, std::memory_order_relaxed);
+    tlb_shootdown_ipis.fetch_add(ipis, std::memory_order_relaxed);
+    tlb_shootdown_lazy.fetch_add(lazy, std::memory_order_relaxed);
+    tlb_shootdown_latency[bucket].fetch_add(1, std::memory_order_relaxed);
+    trace_mmu_tlb_shootdown(start, end, ipis, lazy, us);
+}
+
+static void tlb_flush(uintptr_t start, uintptr_t end)
+{
+    tlb_flushes.fetch_add(1, std::memory_order_relaxed);
+    if (end - start <= tlb_flush_max_invlpg * page_size) {
+        tlb_flushes_ranged.fetch_add(1, std::memory_order_relaxed);
+    }
+    tlb_flush_this_processor(start, end);
+    if (sched::cpus.size() <= 1)
+        return;
+    WITH_LOCK(tlb_flush_mutex) {
+        tlb_flush_batch_start = std::min(tlb_flush_batch_start, start);
+        tlb_flush_batch_end = std::max(tlb_flush_batch_end, end);
+        auto gen = tlb_flush_batch_gen;
+        if (tlb_flush_in_progress) {
+            tlb_flushes_batched.fetch_add(1, std::memory_order_relaxed);
+        }
+        while (tlb_flush_done_gen < gen) {
+            if (tlb_flush_in_progress) {
+                tlb_flush_done.wait(tlb_flush_mutex);
+                continue;
+            }
+            // Run the next round, for the whole batch collected so far
+            tlb_flush_in_progress = true;
+            auto round = tlb_flush_batch_gen++;
+            auto batch_start = tlb_flush_batch_start;
+            auto batch_end = tlb_flush_batch_end;
+            tlb_flush_batch_start = ~uintptr_t(0);
+            tlb_flush_batch_end = 0;
+            DROP_LOCK(tlb_flush_mutex) {
+                tlb_shootdown(batch_start, batch_end);
+            }
+            tlb_flush_in_progress = false;
+            tlb_flush_done_gen = round;
+            tlb_flush_done.wake_all();
+        }
+    }
+}
+
+void tlb_flush(void* start, size_t size)
+{
+    auto s = reinterpret_cast<uintptr_t>(start);
+    tlb_flush(align_down(s, page_size), align_up(s + size, page_size));
 }
 
 void clamp(uintptr_t& vstart1, uintptr_t& vend1,
@@ -311,6 +513,9 @@ public:
     // operation wants to do something special with sub-region of it since it disabled
     // splitting.
     void sub_page(hw_ptep ptep, int level, uintptr_t offset) { return; }
+    // split_done() is called after the page walker split a large page at the
+    // given level for this operation.
+    void split_done(int level) {}
 };
 
 template<typename PageOp, int ParentLevel> class map_level;
@@ -372,6 +577,7 @@ private:
                 // alloc_huge_page() with free_page(), so it is safe to do such a
                 // split.
                 split_large_page(parent, ParentLevel);
+                page_mapper.split_done(ParentLevel);
             } else {
                 // If page_mapper does not want to split, let it handle subpage by itself
                 page_mapper.sub_page(parent, ParentLevel, base_virt - vma_start);
@@ -422,12 +628,16 @@ public:
     void small_page(hw_ptep ptep, uintptr_t offset) {
         phys addr = start + offset;
         assert(addr < end);
-        ptep.write(make_normal_pte(addr));
+        auto pte = make_normal_pte(addr);
+        pte.set_global(pcid_enabled());
+        ptep.write(pte);
     }
     bool huge_page(hw_ptep ptep, uintptr_t offset) {
         phys addr = start + offset;
         assert(addr < end);
-        ptep.write(make_large_pte(addr));
+        auto pte = make_large_pte(addr);
+        pte.set_global(pcid_enabled());
+        ptep.write(pte);
         return true;
     }
 };
@@ -439,12 +649,21 @@ class vma_operation :
 public:
     // returns true if tlb flush is needed after address range processing is completed.
     bool tlb_flush_needed(void) { return false; }
+    // this function is called by operate_range() before walking the page table, with
+    // the address the offsets passed to small_page() and huge_page() are relative to.
+    void set_vma_start(uintptr_t vma_start) { }
     // this function is called at the very end of operate_range(). vma_operation may do
     // whatever cleanup is needed here.
     void finalize(void) { return; }
 
     ulong account_results(void) { return _total_operated; }
     void account(size_t size) { if (this->opt2bool(Account)) _total_operated += size; }
+    // Only count the huge pages of vmas we split, not those of the linear map
+    void split_done(int level) {
+        if (level == 1) {
+            huge_page_splits.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
 private:
     // We don't need locking because each walk will create its own instance, so
     // while two instances can operate over the same linear address (therefore
@@ -489,6 +708,7 @@ public:
         }
         void *vpage = _page_provider->alloc(huge_page_size, offset);
         if (!vpage) {
+            huge_page_fallbacks.fetch_add(1, std::memory_order_relaxed);
             return false;
         }
 
@@ -497,11 +717,34 @@ public:
             _page_provider->free(phys_to_virt(page), huge_page_size, offset);
         } else {
             this->account(mmu::huge_page_size);
+            huge_pages_mapped.fetch_add(1, std::memory_order_relaxed);
         }
         return true;
     }
 };
 
+/*
+ * populate_fault is used to service a page fault in a huge-page aligned part
+ * of a vma. It maps a huge page if one can be allocated; otherwise (memory is
+ * too fragmented) it only populates the small page which faulted, instead of
+ * all the small pages spanning the huge page, so that falling back to small
+ * pages does not make a single fault allocate 2MB of memory.
+ */
+template <account_opt T = account_opt::no>
+class populate_fault : public populate<T> {
+private:
+    uintptr_t _fault_offset; // relative to the vma, like small_page()'s offset
+public:
+    populate_fault(page_allocator* pops, unsigned int perm, bool map_dirty,
+            uintptr_t fault_offset) :
+        populate<T>(pops, perm, map_dirty), _fault_offset(fault_offset) { }
+    void small_page(hw_ptep ptep, uintptr_t offset) {
+        if (offset == _fault_offset) {
+            populate<T>::small_page(ptep, offset);
+        }
+    }
+};
+
 struct tlb_gather {
     explicit tlb_gather(page_allocator* provider) : page_provider(provider) {}
     ~tlb_gather() { flush(); }
@@ -512,19 +755,27 @@ struct tlb_gather {
         off_t offset; // FIXME: unneeded?
     };
     page_allocator* page_provider;
+    uintptr_t vma_start = 0;
     size_t nr_pages = 0;
     tlb_page pages[max_pages];
+    // The virtual addresses the pages were mapped at
+    uintptr_t start = ~uintptr_t(0);
+    uintptr_t end = 0;
     void push(void* addr, size_t size, off_t offset) {
         if (nr_pages == max_pages) {
             flush();
         }
         pages[nr_pages++] = { addr, size, offset };
+        start = std::min(start, vma_start + offset);
+        end = std::max(end, vma_start + offset + size);
     }
     void flush() {
         if (!nr_pages) {
             return;
         }
-        tlb_flush();
+        tlb_flush(reinterpret_cast<void*>(start), end - start);
+        start = ~uintptr_t(0);
+        end = 0;
         for (auto i = 0u; i < nr_pages; ++i) {
             auto&& tp = pages[i];
             if (tp.size == page_size) {
@@ -547,6 +798,9 @@ private:
     tlb_gather _tlb_gather;
 public:
     unpopulate(page_allocator* pops) : _tlb_gather(pops) {}
+    void set_vma_start(uintptr_t vma_start) {
+        _tlb_gather.vma_start = vma_start;
+    }
     void small_page(hw_ptep ptep, uintptr_t offset) {
         // Note: we free the page even if it is already marked "not present".
         // evacuate() makes sure we are only called for allocated pages, and
@@ -701,14 +955,13 @@ template<typename T> ulong operate_range(T mapper, void *vma_start, void *start,
     start = align_down(start, page_size);
     size = std::max(align_up(size, page_size), page_size);
     uintptr_t virt = reinterpret_cast<uintptr_t>(start);
+    mapper.set_vma_start(reinterpret_cast<uintptr_t>(vma_start));
     map_range(reinterpret_cast<uintptr_t>(vma_start), virt, size, mapper);
 
-    // TODO: consider if instead of requesting a full TLB flush, we should
-    // instead try to make more judicious use of INVLPG - e.g., in
-    // split_large_page() and other specific places where we modify specific
-    // page table entries.
+    // Only the range operated on needs flushing; tlb_flush() uses INVLPG
+    // when it is small enough.
     if (mapper.tlb_flush_needed()) {
-        tlb_flush();
+        tlb_flush(start, size);
     }
     mapper.finalize();
     return mapper.account_results();
@@ -900,6 +1153,59 @@ public:
     }
 };
 
+// Private mappings of regular files copy their pages from the page cache,
+// so faulting them in again, or mapping the file again, need not read it.
+class map_file_page_cache_read : public uninitialized_anonymous_page_provider {
+private:
+    file *_file;
+    f_offset _foffset;
+    pagecache::readahead _readahead;
+
+    virtual void* fill(void* addr, uint64_t offset, uintptr_t size) override {
+        if (addr) {
+            for (uintptr_t o = 0; o < size; o += page_size) {
+                auto off = _foffset + offset + o;
+                pagecache::copy(_file, off, static_cast<char*>(addr) + o,
+                        _readahead.update(off));
+            }
+        }
+        return addr;
+    }
+public:
+    map_file_page_cache_read(file *file, f_offset foffset) :
+        _file(file), _foffset(foffset) {}
+};
+
+// Shared mappings of regular files map the page cache's pages themselves,
+// so all mappings of the file share them.
+class map_file_page_cache : public page_allocator {
+private:
+    file *_file;
+    f_offset _foffset;
+    pagecache::readahead _readahead;
+
+public:
+    map_file_page_cache(file *file, f_offset foffset) :
+        _file(file), _foffset(foffset) {}
+
+    virtual void* alloc(uintptr_t offset) override {
+        auto off = _foffset + offset;
+        return pagecache::get(_file, off, _readahead.update(off));
+    }
+    virtual void* alloc(size_t size, uintptr_t offset) override {
+        // the page cache only holds small pages
+        return nullptr;
+    }
+    virtual void free(void *addr, uintptr_t offset) override {
+        pagecache::put(_file->f_dentry->d_vnode, _foffset + offset);
+    }
+    virtual void free(void *addr, size_t size, uintptr_t offset) override {
+        abort();
+    }
+    virtual void finalize() override {
+    }
+};
+
 class map_file_page_mmap : public page_allocator {
 private:
     file* _file;
@@ -985,7 +1291,16 @@ void* map_anon(const void* addr, size_t size, unsigned flags, unsigned perm)
 
 std::unique_ptr<file_vma> default_file_mmap(file* file, addr_range range, unsigned flags, unsigned perm, off_t offset)
 {
-    return std::unique_ptr<file_vma>(new file_vma(range, perm, file, offset, flags & mmu::mmap_shared, new map_file_page_read(file, offset)));
+    bool shared = flags & mmu::mmap_shared;
+    page_allocator* pa;
+    if (file->f_dentry->d_vnode->v_type != VREG) {
+        pa = new map_file_page_read(file, offset);
+    } else if (shared) {
+        pa = new map_file_page_cache(file, offset);
+    } else {
+        pa = new map_file_page_cache_read(file, offset);
+    }
+    return std::unique_ptr<file_vma>(new file_vma(range, perm, file, offset, shared, pa));
 }
 
 std::unique_ptr<file_vma> map_file_mmap(file* file, addr_range range, unsigned flags, unsigned perm, off_t offset)
@@ -1192,16 +1507,15 @@ void vma::fault(uintptr_t addr, exception_frame *ef)
 {
     auto hp_start = ::align_up(_range.start(), huge_page_size);
     auto hp_end = ::align_down(_range.end(), huge_page_size);
-    size_t size;
+    page_allocator *map = page_ops();
+    ulong total;
     if (hp_start <= addr && addr < hp_end) {
-        addr = ::align_down(addr, huge_page_size);
-        size = huge_page_size;
+        auto hp_addr = ::align_down(addr, huge_page_size);
+        total = operate_range(populate_fault<account_opt::yes>(map, _perm,
+                map_dirty(), addr - start()), (void*)hp_addr, huge_page_size);
     } else {
-        size = page_size;
+        total = operate_range(populate<account_opt::yes>(map, _perm, map_dirty()), (void*)addr, page_size);
     }
-
-    page_allocator *map = page_ops();
-    auto total = operate_range(populate<account_opt::yes>(map, _perm, map_dirty()), (void*)addr, size);
     map->finalize();
 
     if (_flags & mmap_jvm_heap) {
@@ -1329,7 +1643,7 @@ ulong map_jvm(const void* addr, size_t size, balloon *b)
 }
 
 file_vma::file_vma(addr_range range, unsigned perm, fileref file, f_offset offset, bool shared, page_allocator* page_ops)
-    : vma(range, perm, 0, !shared, page_ops)
+    : vma(range, perm, shared ? mmap_shared : 0, !shared, page_ops)
     , _file(file)
     , _offset(offset)
     , _shared(shared)
@@ -15,6 +15,15 @@
 #include <bsd/sys/net/ethernet.h>
 
 #include <osv/debug.hh>
+#include <osv/trace.hh>
+#include <osv/clock.hh>
+#include "processor.hh"
+
+TRACEPOINT(trace_net_busy_poll_hit, "spun=%d ns, budget=%d ns", u64, unsigned);
+TRACEPOINT(trace_net_busy_poll_miss, "budget=%d ns", unsigned);
+
+// Below this, spinning is not worth checking the clock for
+static constexpr unsigned busy_poll_min_ns = 1000;
 
 std::ostream& operator<<(std::ostream& os, in_addr ia)
 {
@@ -36,6 +45,27 @@ void net_channel::process_queue()
     }
 }
 
+u64 busy_poll_start(unsigned& budget_ns, unsigned max_us)
+{
+    u64 max_ns = u64(std::min(max_us, busy_poll_max_us)) * 1000;
+    max_ns = std::max(max_ns, u64(busy_poll_min_ns));
+    if (budget_ns == 0 || budget_ns > max_ns) {
+        budget_ns = max_ns;
+    }
+    return max_ns;
+}
+
+void busy_poll_done(unsigned& budget_ns, u64 max_ns, bool hit, u64 spun_ns)
+{
+    if (hit) {
+        trace_net_busy_poll_hit(spun_ns, budget_ns);
+        budget_ns = std::min(u64(budget_ns) * 2, max_ns);
+    } else {
+        trace_net_busy_poll_miss(budget_ns);
+        budget_ns = std::max(budget_ns / 2, busy_poll_min_ns);
+    }
+}
+
 void net_channel::wake_pollers()
 {
     WITH_LOCK(osv::rcu_read_lock) {
@@ -76,30 +106,29 @@ void net_channel::del_poller(pollreq& pr)
     }
 }
 
+// The seed only needs to be unpredictable to remote peers, so the boot
+// time TSC value is good enough.
+uint64_t ipv4_tcp_conn_id::hash_seed = ipv4_tcp_conn_id::mix(processor::ticks());
+
 classifier::classifier()
-    : _ipv4_tcp_channels(new ipv4_tcp_channels)
 {
 }
 
 void classifier::add(ipv4_tcp_conn_id id, net_channel* channel)
 {
     WITH_LOCK(_mtx) {
-        auto old = _ipv4_tcp_channels.read_by_owner();
-        std::unique_ptr<ipv4_tcp_channels> neww{new ipv4_tcp_channels(*old)};
-        neww->emplace(id, channel);
-        _ipv4_tcp_channels.assign(neww.release());
-        osv::rcu_dispose(old);
+        _ipv4_tcp_channels.emplace(ipv4_tcp_channel{id, channel});
     }
 }
 
-void classifier::remove(ipv4_tcp_conn_id id)
+void classifier::remove(ipv4_tcp_conn_id id, net_channel* channel)
 {
     WITH_LOCK(_mtx) {
-        auto old = _ipv4_tcp_channels.read_by_owner();
-        std::unique_ptr<ipv4_tcp_channels> neww{new ipv4_tcp_channels(*old)};
-        neww->erase(id);
-        _ipv4_tcp_channels.assign(neww.release());
-        osv::rcu_dispose(old);
+        _ipv4_tcp_channels.erase(ipv4_tcp_channel{id, channel},
+                ipv4_tcp_channel_hash(),
+                [] (const ipv4_tcp_channel& x, const ipv4_tcp_channel& y) {
+                    return x.id == y.id && x.chan == y.chan;
+                });
     }
 }
 
@@ -149,10 +178,10 @@ net_channel* classifier::classify_ipv4_tcp(mbuf* m)
     auto src_port = ntohs(tcp_hdr->th_sport);
     auto dst_port = ntohs(tcp_hdr->th_dport);
     auto id = ipv4_tcp_conn_id{src_addr, dst_addr, src_port, dst_port};
-    auto ht = _ipv4_tcp_channels.read();
-    auto i = ht->find(id);
-    if (i == ht->end()) {
+    auto i = _ipv4_tcp_channels.reader_find(id, ipv4_tcp_channel_hash(),
+            ipv4_tcp_channel_equal());
+    if (!i) {
         return nullptr;
     }
-    return i->second;
+    return i->chan;
 }
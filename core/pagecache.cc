@@ -0,0 +1,415 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/pagecache.hh>
+#include <osv/mempool.hh>
+#include <osv/mmu.hh>
+#include <osv/mutex.h>
+#include <osv/file.h>
+#include <osv/trace.hh>
+#include <osv/align.hh>
+#include "fs/vfs/vfs.h"
+#include <boost/intrusive/list.hpp>
+#include <unordered_map>
+#include <map>
+#include <vector>
+#include <string.h>
+
+TRACEPOINT(trace_pagecache_read, "vp=%p offset=%d pages=%d", void*, off_t, unsigned);
+TRACEPOINT(trace_pagecache_evict, "vp=%p offset=%d", void*, off_t);
+
+namespace bi = boost::intrusive;
+
+namespace pagecache {
+
+static constexpr off_t page_size = mmu::page_size;
+static constexpr unsigned max_readahead = 32;
+
+unsigned readahead::update(off_t offset)
+{
+    if (offset == _next) {
+        _window = std::min(std::max(_window * 2, 4u), max_readahead);
+    } else {
+        _window = 0;
+    }
+    _next = offset + page_size;
+    return _window;
+}
+
+struct cached_page {
+    cached_page(vnode* vp, off_t offset, void* page)
+        : vp(vp), offset(offset), page(page) {}
+    vnode* vp;
+    off_t offset;
+    void* page;
+    unsigned refs = 0;
+    bi::list_member_hook<> lru_link;
+};
+
+class page_cache : public memory::shrinker {
+public:
+    page_cache() : shrinker("pagecache") {}
+    void* get(file* fp, off_t offset, unsigned readahead);
+    void put(vnode* vp, off_t offset);
+    void copy(file* fp, off_t offset, void* dst, unsigned readahead);
+    void write(vnode* vp, const iovec* iov, int iovcnt, off_t offset, size_t count);
+    void truncate(vnode* vp, off_t length);
+    void release(vnode* vp);
+    bool cached(vnode* vp);
+    stats_type stats();
+    virtual size_t request_memory(size_t n) override;
+    virtual size_t release_memory(size_t n) override { return 0; }
+private:
+    typedef std::map<off_t, cached_page> file_pages;
+    cached_page* find(vnode* vp, off_t offset);
+    void read(file* fp, vnode* vp, off_t offset, unsigned readahead);
+    void evict(cached_page& cp);
+    void invalidate_reads(vnode* vp);
+private:
+    // Reads in progress on a vnode. A write or truncate while they read the
+    // file bumps gen, so they don't insert the stale data they read.
+    struct inflight {
+        unsigned readers = 0;
+        u64 gen = 0;
+    };
+    mutex _lock;
+    std::unordered_map<vnode*, file_pages> _files;
+    std::unordered_map<vnode*, inflight> _inflight;
+    // Unreferenced pages, most recently used first
+    bi::list<cached_page,
+             bi::member_hook<cached_page,
+                             bi::list_member_hook<>,
+                             &cached_page::lru_link>
+            > _lru;
+    stats_type _stats = {};
+};
+
+static page_cache cache;
+
+cached_page* page_cache::find(vnode* vp, off_t offset)
+{
+    auto f = _files.find(vp);
+    if (f == _files.end()) {
+        return nullptr;
+    }
+    auto p = f->second.find(offset);
+    if (p == f->second.end()) {
+        return nullptr;
+    }
+    return &p->second;
+}
+
+// Read the page at offset, and up to readahead pages after it, into the
+// cache. The pages are read with a single request, which stops short of the
+// first page already cached, and of the end of the file. Called without the
+// lock, as reading may block for a long time; if the file is written
+// meanwhile, nothing is inserted, and the caller retries.
+void page_cache::read(file* fp, vnode* vp, off_t offset, unsigned readahead)
+{
+    unsigned npages = 1;
+    u64 gen;
+    auto eof = align_up(vp->v_size, page_size);
+    WITH_LOCK(_lock) {
+        auto& r = _inflight[vp];
+        ++r.readers;
+        gen = r.gen;
+        auto f = _files.find(vp);
+        while (npages <= readahead) {
+            auto next = offset + npages * page_size;
+            if (next >= eof || (f != _files.end() && f->second.count(next))) {
+                break;
+            }
+            ++npages;
+        }
+    }
+    trace_pagecache_read(vp, offset, npages);
+
+    std::vector<iovec> iov(npages);
+    for (auto& v : iov) {
+        v.iov_base = memory::alloc_page();
+        v.iov_len = page_size;
+    }
+    uio data{iov.data(), int(npages), offset, ssize_t(npages * page_size), UIO_READ};
+    fp->read(&data, FOF_OFFSET);
+    // zero the tail of a short read
+    auto done = npages * page_size - data.uio_resid;
+    for (unsigned i = 0; i < npages; i++) {
+        auto start = i * page_size;
+        if (done < start + page_size) {
+            auto skip = done > start ? done - start : 0;
+            memset(static_cast<char*>(iov[i].iov_base) + skip, 0, page_size - skip);
+        }
+    }
+
+    WITH_LOCK(_lock) {
+        auto r = _inflight.find(vp);
+        bool stale = r->second.gen != gen;
+        if (!--r->second.readers) {
+            _inflight.erase(r);
+        }
+        if (stale) {
+            for (auto& v : iov) {
+                memory::free_page(v.iov_base);
+            }
+            return;
+        }
+        auto& pages = _files[vp];
+        for (unsigned i = 0; i < npages; i++) {
+            auto off = offset + i * page_size;
+            auto r = pages.emplace(std::piecewise_construct,
+                    std::forward_as_tuple(off),
+                    std::forward_as_tuple(vp, off, iov[i].iov_base));
+            if (!r.second) {
+                // lost a race with another reader
+                memory::free_page(iov[i].iov_base);
+                continue;
+            }
+            _lru.push_front(r.first->second);
+            ++_stats.pages;
+        }
+        _stats.readahead += npages - 1;
+    }
+}
+
+void* page_cache::get(file* fp, off_t offset, unsigned readahead)
+{
+    auto vp = fp->f_dentry->d_vnode;
+    bool miss = false;
+    while (true) {
+        WITH_LOCK(_lock) {
+            if (auto cp = find(vp, offset)) {
+                if (!cp->refs++) {
+                    _lru.erase(_lru.iterator_to(*cp));
+                }
+                ++(miss ? _stats.misses : _stats.hits);
+                return cp->page;
+            }
+        }
+        // Retry if the page was evicted before we could get to it
+        read(fp, vp, offset, readahead);
+        miss = true;
+    }
+}
+
+void page_cache::put(vnode* vp, off_t offset)
+{
+    WITH_LOCK(_lock) {
+        auto cp = find(vp, offset);
+        assert(cp && cp->refs);
+        if (!--cp->refs) {
+            _lru.push_front(*cp);
+        }
+    }
+}
+
+void page_cache::copy(file* fp, off_t offset, void* dst, unsigned readahead)
+{
+    auto vp = fp->f_dentry->d_vnode;
+    bool miss = false;
+    while (true) {
+        WITH_LOCK(_lock) {
+            if (auto cp = find(vp, offset)) {
+                memcpy(dst, cp->page, page_size);
+                if (!cp->refs) {
+                    _lru.erase(_lru.iterator_to(*cp));
+                    _lru.push_front(*cp);
+                }
+                ++(miss ? _stats.misses : _stats.hits);
+                return;
+            }
+        }
+        read(fp, vp, offset, readahead);
+        miss = true;
+    }
+}
+
+// Copy len bytes, starting skip bytes into the data described by iov, to dst
+static void copy_from_iov(const iovec* iov, int iovcnt, size_t skip, char* dst, size_t len)
+{
+    for (int i = 0; i < iovcnt && len; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        auto src = static_cast<const char*>(iov[i].iov_base) + skip;
+        auto n = std::min(len, iov[i].iov_len - skip);
+        // msync() writes shared mapped pages from the cached page itself
+        if (src != dst) {
+            memcpy(dst, src, n);
+        }
+        dst += n;
+        len -= n;
+        skip = 0;
+    }
+}
+
+void page_cache::write(vnode* vp, const iovec* iov, int iovcnt, off_t offset, size_t count)
+{
+    WITH_LOCK(_lock) {
+        invalidate_reads(vp);
+        auto f = _files.find(vp);
+        if (f == _files.end()) {
+            return;
+        }
+        auto end = offset + off_t(count);
+        auto& pages = f->second;
+        for (auto p = pages.lower_bound(align_down(offset, page_size));
+                p != pages.end() && p->first < end; ++p) {
+            auto from = std::max(offset, p->first);
+            auto to = std::min(end, p->first + page_size);
+            copy_from_iov(iov, iovcnt, from - offset,
+                    static_cast<char*>(p->second.page) + (from - p->first), to - from);
+        }
+    }
+}
+
+void page_cache::truncate(vnode* vp, off_t length)
+{
+    WITH_LOCK(_lock) {
+        invalidate_reads(vp);
+        auto f = _files.find(vp);
+        if (f == _files.end()) {
+            return;
+        }
+        auto& pages = f->second;
+        auto p = pages.lower_bound(align_down(length, page_size));
+        while (p != pages.end()) {
+            auto& cp = (p++)->second;
+            if (cp.offset >= length && !cp.refs) {
+                evict(cp);
+                continue;
+            }
+            // Mapped pages remain, but must read as zeros past the end of
+            // the file, in case it is extended again.
+            auto skip = std::max(length - cp.offset, off_t(0));
+            memset(static_cast<char*>(cp.page) + skip, 0, page_size - skip);
+        }
+        if (pages.empty()) {
+            _files.erase(f);
+        }
+    }
+}
+
+// Called with the lock held, when vp's data changed
+void page_cache::invalidate_reads(vnode* vp)
+{
+    auto r = _inflight.find(vp);
+    if (r != _inflight.end()) {
+        ++r->second.gen;
+    }
+}
+
+bool page_cache::cached(vnode* vp)
+{
+    WITH_LOCK(_lock) {
+        return _files.count(vp) || _inflight.count(vp);
+    }
+}
+
+// Called with the lock held, on an unreferenced page. Does not remove the
+// vnode's entry from _files, even if the page was its last.
+void page_cache::evict(cached_page& cp)
+{
+    auto vp = cp.vp;
+    auto offset = cp.offset;
+    trace_pagecache_evict(vp, offset);
+    _lru.erase(_lru.iterator_to(cp));
+    memory::free_page(cp.page);
+    ++_stats.evictions;
+    --_stats.pages;
+    _files[vp].erase(offset);
+}
+
+void page_cache::release(vnode* vp)
+{
+    WITH_LOCK(_lock) {
+        auto f = _files.find(vp);
+        if (f == _files.end()) {
+            return;
+        }
+        // A mapped page holds a reference to the file, and through it
+        // to the vnode, so no page can be in use.
+        for (auto& p : f->second) {
+            assert(!p.second.refs);
+            _lru.erase(_lru.iterator_to(p.second));
+            memory::free_page(p.second.page);
+            --_stats.pages;
+        }
+        _files.erase(f);
+    }
+}
+
+size_t page_cache::request_memory(size_t n)
+{
+    // Maintaining the cache allocates memory with the lock held, so
+    // waiting for it here could deadlock with an allocation waiting for us.
+    std::unique_lock<mutex> lock(_lock, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return 0;
+    }
+    size_t freed = 0;
+    while (freed < n && !_lru.empty()) {
+        auto& cp = _lru.back();
+        auto vp = cp.vp;
+        evict(cp);
+        auto f = _files.find(vp);
+        if (f->second.empty()) {
+            _files.erase(f);
+        }
+        freed += page_size;
+    }
+    return freed;
+}
+
+stats_type page_cache::stats()
+{
+    WITH_LOCK(_lock) {
+        return _stats;
+    }
+}
+
+void* get(file* fp, off_t offset, unsigned readahead)
+{
+    return cache.get(fp, offset, readahead);
+}
+
+void put(vnode* vp, off_t offset)
+{
+    cache.put(vp, offset);
+}
+
+void copy(file* fp, off_t offset, void* dst, unsigned readahead)
+{
+    cache.copy(fp, offset, dst, readahead);
+}
+
+void write(vnode* vp, const iovec* iov, int iovcnt, off_t offset, size_t count)
+{
+    cache.write(vp, iov, iovcnt, offset, count);
+}
+
+void truncate(vnode* vp, off_t length)
+{
+    cache.truncate(vp, length);
+}
+
+bool cached(vnode* vp)
+{
+    return cache.cached(vp);
+}
+
+stats_type stats()
+{
+    return cache.stats();
+}
+
+}
+
+extern "C" void pagecache_release_vnode(struct vnode* vp)
+{
+    pagecache::cache.release(vp);
+}
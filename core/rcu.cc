@@ -8,10 +8,33 @@
 #include <osv/rcu.hh>
 #include <osv/mutex.h>
 #include <osv/semaphore.hh>
+#include <osv/trace.hh>
 #include <vector>
-#include <boost/algorithm/cxx11/all_of.hpp>
+#include <algorithm>
+#include <iterator>
 #include <osv/debug.hh>
 
+// Grace periods
+//
+// Readers only disable preemption, so a cpu which passes through the
+// scheduler is known to have left any read-side critical section it was
+// in: the scheduler reports such quiescent states with
+// rcu::quiescent_state(). A grace period is over once every cpu has passed
+// a quiescent state after it started.
+//
+// rcu_defer() queues callbacks on the current cpu's list. A single thread,
+// rcu_gp, runs grace periods: each one takes all the callbacks queued on
+// every cpu so far, however many, and when it ends, hands them back to
+// each cpu's rcu%d thread to run. Most cpus pass through the scheduler on
+// their own during the short batching delay a grace period starts with; a
+// cpu which hasn't, because it is idle or runs a single thread, is kicked
+// by waking its rcu%d thread, which makes it reschedule.
+//
+// rcu_synchronize_expedited() skips the delay and kicks all cpus at once.
+
+TRACEPOINT(trace_rcu_grace_period_start, "gen=%d expedited=%d", u64, bool);
+TRACEPOINT(trace_rcu_grace_period_end, "gen=%d kicked=%d", u64, unsigned);
+
 namespace osv {
 
 rcu_lock_type rcu_read_lock;
@@ -20,102 +43,155 @@ rcu_lock_in_preempt_type rcu_read_lock_in_preempt_disabled;
 
 namespace rcu {
 
-mutex mtx;
-std::vector<std::function<void ()>> callbacks;
-void collect_garbage();
-sched::thread* garbage_collector_thread;
-
-class cpu_quiescent_state_thread {
-public:
-    cpu_quiescent_state_thread(sched::cpu* cpu);
-    void request(uint64_t generation);
-    bool check(uint64_t generation);
-private:
-    void work();
-private:
-    sched::thread _t;
-    std::atomic<uint64_t> _generation = { 0 };
-    std::atomic<uint64_t> _request = { 0 };
-};
-
-std::vector<cpu_quiescent_state_thread*> cpu_quiescent_state_threads;
-
-// FIXME: hot-remove cpus
-// FIXME: locking for the vector
-sched::cpu::notifier cpu_notifier([] {
-        cpu_quiescent_state_threads.push_back(new cpu_quiescent_state_thread(sched::cpu::current()));
-});
-
-cpu_quiescent_state_thread::cpu_quiescent_state_thread(sched::cpu* cpu)
-    : _t([=] { work(); }, sched::thread::attr().pin(cpu).name(osv::sprintf("rcu%d", cpu->id)))
+using namespace osv::clock::literals;
+
+// How long a grace period waits for cpus to pass through the scheduler on
+// their own, before kicking them. Also lets callbacks accumulate.
+constexpr auto batch_delay = 1_ms;
+
+typedef std::vector<std::function<void ()>> callback_list;
+
+struct cpu_state {
+    // The last grace period this cpu passed a quiescent state in
+    std::atomic<u64> quiescent_gen = { 0 };
+    std::atomic<bool> kicked = { false };
+    mutex mtx;
+    // Callbacks not yet in a grace period
+    callback_list next;
+    // Callbacks in the current grace period
+    callback_list waiting;
+    // Callbacks whose grace period is over, for the rcu%d thread to run
+    callback_list done;
+    sched::thread* thread = nullptr;
+} CACHELINE_ALIGNED;
+
+cpu_state cpu_states[sched::max_cpus];
+
+// The grace period in progress, or the last one
+std::atomic<u64> gp_gen = { 0 };
+// Callbacks queued since the current grace period started
+std::atomic<unsigned> pending = { 0 };
+std::atomic<unsigned> expedite = { 0 };
+sched::thread* gp_thread;
+
+void quiescent_state(unsigned cpu_id)
 {
-    _t.start();
-}
-
-void cpu_quiescent_state_thread::request(uint64_t generation)
-{
-    auto r = _request.load(std::memory_order_relaxed);
-    while (generation > r && !_request.compare_exchange_weak(r, generation, std::memory_order_relaxed)) {
-        // nothing to do
+    auto& s = cpu_states[cpu_id];
+    auto gen = gp_gen.load(std::memory_order_acquire);
+    if (s.quiescent_gen.load(std::memory_order_relaxed) < gen) {
+        s.quiescent_gen.store(gen, std::memory_order_release);
     }
-    _t.wake();
-}
-
-bool cpu_quiescent_state_thread::check(uint64_t generation)
-{
-    return _generation.load(std::memory_order_relaxed) >= generation;
 }
 
-void cpu_quiescent_state_thread::work()
+void cpu_thread(cpu_state& s)
 {
     while (true) {
-        sched::thread::wait_until([&] {
-            return _generation.load(std::memory_order_relaxed) <  _request.load(std::memory_order_relaxed);
-        });
-        auto r = _request.load(std::memory_order_relaxed);
-        _generation.store(r, std::memory_order_relaxed);
-        garbage_collector_thread->wake();
+        callback_list now;
+        WITH_LOCK(s.mtx) {
+            sched::thread::wait_until(s.mtx, [&] {
+                return !s.done.empty() || s.kicked.load(std::memory_order_relaxed);
+            });
+            now.swap(s.done);
+        }
+        // Switching to this thread was a quiescent state
+        if (s.kicked.exchange(false)) {
+            gp_thread->wake();
+        }
+        for (auto& c : now) {
+            c();
+        }
     }
 }
 
-bool all_at_generation(decltype(cpu_quiescent_state_threads)& cqsts,
-                       uint64_t generation)
+// FIXME: hot-remove cpus
+sched::cpu::notifier cpu_notifier([] {
+    auto c = sched::cpu::current();
+    auto& s = cpu_states[c->id];
+    s.thread = new sched::thread([&s] { cpu_thread(s); },
+            sched::thread::attr().pin(c).name(osv::sprintf("rcu%d", c->id)));
+    s.thread->start();
+});
+
+bool all_quiescent(u64 gen)
 {
-    for (auto cqst : cqsts) {
-        if (!cqst->check(generation)) {
+    for (auto c : sched::cpus) {
+        if (cpu_states[c->id].quiescent_gen.load(std::memory_order_acquire) < gen) {
             return false;
         }
     }
     return true;
 }
 
-void await_grace_period()
+void grace_period(bool expedited)
 {
-    static uint64_t generation = 0;
-    ++generation;
-    // copy cpu_quiescent_state_threads to prevent a hotplugged cpu
-    // from changing the number of cpus we request a new generation on,
-    // and the number of cpus we wait on
-    // FIXME: better locking
-    auto cqsts = cpu_quiescent_state_threads;
-    for (auto cqst : cqsts) {
-        cqst->request(generation);
+    // Callbacks queued from here on wait for the next grace period
+    pending.store(0);
+    bool any = false;
+    for (auto c : sched::cpus) {
+        auto& s = cpu_states[c->id];
+        WITH_LOCK(s.mtx) {
+            s.waiting.swap(s.next);
+            any |= !s.waiting.empty();
+        }
+    }
+    if (!any) {
+        return;
+    }
+    auto gen = gp_gen.fetch_add(1) + 1;
+    trace_rcu_grace_period_start(gen, expedited);
+
+    // Kicked cpus' rcu%d threads wake us up; the timer covers cpus which
+    // we couldn't kick, or which were busy in their rcu%d thread.
+    bool kick = expedited;
+    unsigned kicked = 0;
+    while (!all_quiescent(gen)) {
+        if (kick) {
+            for (auto c : sched::cpus) {
+                auto& s = cpu_states[c->id];
+                if (s.thread && s.quiescent_gen.load(std::memory_order_acquire) < gen) {
+                    s.kicked.store(true);
+                    s.thread->wake();
+                    kicked++;
+                }
+            }
+        }
+        sched::timer tmr(*sched::thread::current());
+        tmr.set(batch_delay);
+        sched::thread::wait_until([&] {
+            return tmr.expired() || all_quiescent(gen)
+                    || (!kick && expedite.load(std::memory_order_relaxed));
+        });
+        kick = true;
+    }
+    trace_rcu_grace_period_end(gen, kicked);
+
+    for (auto c : sched::cpus) {
+        auto& s = cpu_states[c->id];
+        WITH_LOCK(s.mtx) {
+            if (s.waiting.empty()) {
+                continue;
+            }
+            if (s.done.empty()) {
+                s.done.swap(s.waiting);
+            } else {
+                std::move(s.waiting.begin(), s.waiting.end(),
+                        std::back_inserter(s.done));
+                s.waiting.clear();
+            }
+            if (s.thread) {
+                s.thread->wake();
+            }
+        }
     }
-    sched::thread::wait_until([&cqsts] { return all_at_generation(cqsts, generation); });
 }
 
-void collect_garbage()
+void grace_period_thread()
 {
     while (true) {
-        std::vector<std::function<void ()>> now;
-        WITH_LOCK(mtx) {
-            sched::thread::wait_until(mtx, [] { return !callbacks.empty(); });
-            now = std::move(callbacks);
-        }
-        await_grace_period();
-        for (auto& c : now) {
-            c();
-        }
+        sched::thread::wait_until([] {
+            return pending.load(std::memory_order_relaxed) != 0;
+        });
+        grace_period(expedite.exchange(0) != 0);
     }
 }
 
@@ -125,10 +201,14 @@ using namespace rcu;
 
 void rcu_defer(std::function<void ()>&& func)
 {
-    WITH_LOCK(mtx) {
-        callbacks.push_back(func);
+    auto c = sched::cpu::current();
+    auto& s = cpu_states[c ? c->id : 0];
+    WITH_LOCK(s.mtx) {
+        s.next.push_back(std::move(func));
+    }
+    if (pending.fetch_add(1) == 0 && gp_thread) {
+        gp_thread->wake();
     }
-    garbage_collector_thread->wake();
 }
 
 void rcu_synchronize()
@@ -138,10 +218,20 @@ void rcu_synchronize()
     s.wait();
 }
 
+void rcu_synchronize_expedited()
+{
+    semaphore s{0};
+    expedite.fetch_add(1);
+    rcu_defer([](semaphore* s) { s->post(); }, &s);
+    // Cut short the batching delay of a grace period already in progress
+    gp_thread->wake();
+    s.wait();
+}
+
 void rcu_init()
 {
-    garbage_collector_thread = new sched::thread(collect_garbage, sched::thread::attr().name("rcu_gc"));
-    garbage_collector_thread->start();
+    gp_thread = new sched::thread(grace_period_thread, sched::thread::attr().name("rcu_gp"));
+    gp_thread->start();
 }
 
 }
@@ -6,35 +6,112 @@
  */
 
 #include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <stdlib.h>
+#include <errno.h>
 #include <osv/sched.hh>
 #include <osv/rwlock.h>
 
+// The readers of a RWLOCK_READ_MOSTLY lock are counted in per-cpu counters,
+// without taking _mtx. A reader increments its cpu's counter, and then
+// checks that no writer has blocked readers; a writer blocks readers (under
+// _mtx, and while it owns or waits for the lock), and waits for the sum of
+// the counters to drop to zero. A reader may migrate and decrement a
+// different cpu's counter than the one it incremented, so only the sum is
+// meaningful.
+struct rwlock_reader_counts {
+    struct counter {
+        std::atomic<long> readers;
+    } CACHELINE_ALIGNED;
+
+    rwlock_reader_counts()
+        : blocked(false)
+        , nr(std::max<size_t>(sched::cpus.size(), 1))
+        , counters(static_cast<counter*>(
+                aligned_alloc(alignof(counter), nr * sizeof(counter))))
+    {
+        for (unsigned i = 0; i < nr; i++) {
+            new (&counters[i]) counter{{0}};
+        }
+    }
+    ~rwlock_reader_counts()
+    {
+        free(counters);
+    }
+    std::atomic<long>& local()
+    {
+        return counters[sched::cpu::current()->id % nr].readers;
+    }
+
+    std::atomic<bool> blocked;
+    condvar drained;
+    unsigned nr;
+    counter* counters;
+};
+
 rwlock::rwlock()
     : _readers(0),
       _read_waiters(0),
       _write_waiters(0),
       _wowner(nullptr),
-      _wrecurse(0)
+      _wrecurse(0),
+      _counts(nullptr)
 { }
 
+rwlock::rwlock(unsigned flags)
+    : rwlock()
+{
+    if (flags & RWLOCK_READ_MOSTLY) {
+        _counts = new rwlock_reader_counts;
+    }
+}
+
 rwlock::~rwlock()
 {
     assert(_wowner == nullptr);
     assert(_readers == 0);
     assert(_read_waiters == 0);
     assert(_write_waiters == 0);
+    if (_counts) {
+        assert(counted_readers() == 0);
+        delete _counts;
+    }
 }
 
 void rwlock::rlock()
 {
+    rlock(nullptr);
+}
+
+int rwlock::rlock(sched::timer* tmr)
+{
+    if (_counts) {
+        while (!try_rlock_counted()) {
+            WITH_LOCK(_mtx) {
+                if (reader_wait_lockable(tmr)) {
+                    return ETIMEDOUT;
+                }
+            }
+        }
+        return 0;
+    }
+
     std::lock_guard<mutex> guard(_mtx);
-    reader_wait_lockable();
+    if (reader_wait_lockable(tmr)) {
+        return ETIMEDOUT;
+    }
 
     _readers++;
+    return 0;
 }
 
 bool rwlock::try_rlock()
 {
+    if (_counts) {
+        return try_rlock_counted();
+    }
+
     std::lock_guard<mutex> guard(_mtx);
     if (!read_lockable()) {
         return false;
@@ -46,6 +123,11 @@ bool rwlock::try_rlock()
 
 void rwlock::runlock()
 {
+    if (_counts) {
+        runlock_counted();
+        return;
+    }
+
     bool need_wake = false;
 
     WITH_LOCK(_mtx) {
@@ -69,6 +151,22 @@ bool rwlock::try_upgrade()
 {
     std::lock_guard<mutex> guard(_mtx);
 
+    if (_counts) {
+        if (_wowner || _write_waiters) {
+            return false;
+        }
+        _counts->blocked.store(true);
+        if (counted_readers() != 1) {
+            unblock_counted_readers();
+            return false;
+        }
+        // Only the sum of the counters matters, so it doesn't matter which
+        // cpu's counter we incremented in rlock()
+        _counts->local().fetch_sub(1);
+        _wowner = sched::thread::current();
+        return true;
+    }
+
     // if we don't have any write waiters and we are the only reader
     if ((_readers == 1) && (!_write_waiters)) {
         assert(_wowner == nullptr);
@@ -81,16 +179,36 @@ bool rwlock::try_upgrade()
 }
 
 void rwlock::wlock()
+{
+    wlock(nullptr);
+}
+
+int rwlock::wlock(sched::timer* tmr)
 {
     std::lock_guard<mutex> guard(_mtx);
-    writer_wait_lockable();
+    if (_counts) {
+        // Block new readers already while we wait, so a steady stream of
+        // readers cannot starve us
+        _counts->blocked.store(true);
+    }
+    if (writer_wait_lockable(tmr)) {
+        writer_gave_up();
+        return ETIMEDOUT;
+    }
 
     // recursive write lock
     if (_wowner == sched::thread::current()) {
         _wrecurse++;
+        return 0;
     }
 
     _wowner = sched::thread::current();
+    if (_counts && drain_counted_readers(tmr)) {
+        _wowner = nullptr;
+        writer_gave_up();
+        return ETIMEDOUT;
+    }
+    return 0;
 }
 
 bool rwlock::try_wlock()
@@ -103,6 +221,15 @@ bool rwlock::try_wlock()
     // recursive write lock
     if (_wowner == sched::thread::current()) {
         _wrecurse++;
+        return true;
+    }
+
+    if (_counts) {
+        _counts->blocked.store(true);
+        if (counted_readers() != 0) {
+            unblock_counted_readers();
+            return false;
+        }
     }
 
     _wowner = sched::thread::current();
@@ -118,6 +245,7 @@ void rwlock::wunlock()
             _wrecurse--;
         } else {
             _wowner = nullptr;
+            unblock_counted_readers();
         }
     }
 
@@ -163,29 +291,115 @@ bool rwlock::write_lockable()
             ((!_readers) && (!_wowner)));
 }
 
-void rwlock::writer_wait_lockable()
+bool rwlock::try_rlock_counted()
+{
+    auto& readers = _counts->local();
+    readers.fetch_add(1);
+    if (!_counts->blocked.load()) {
+        return true;
+    }
+    // A writer owns or waits for the lock. Undo the increment on the same
+    // counter: a writer summing the counters must not see the decrement
+    // without the increment. It may have seen the increment, though, so it
+    // needs to be woken to recheck.
+    readers.fetch_sub(1);
+    WITH_LOCK(_mtx) {
+        _counts->drained.wake_all();
+    }
+    return false;
+}
+
+void rwlock::runlock_counted()
+{
+    _counts->local().fetch_sub(1);
+    if (_counts->blocked.load()) {
+        // Wake under _mtx, so the wakeup cannot fall between the writer
+        // checking the counters and going to sleep
+        WITH_LOCK(_mtx) {
+            _counts->drained.wake_all();
+        }
+    }
+}
+
+long rwlock::counted_readers()
+{
+    long sum = 0;
+    for (unsigned i = 0; i < _counts->nr; i++) {
+        sum += _counts->counters[i].readers.load();
+    }
+    return sum;
+}
+
+// Called with _mtx held, by a writer which already set _wowner and blocked
+// new readers, to wait for the readers already in the lock to leave.
+int rwlock::drain_counted_readers(sched::timer* tmr)
+{
+    while (counted_readers() != 0) {
+        if (_counts->drained.wait(&_mtx, tmr) == ETIMEDOUT &&
+                counted_readers() != 0) {
+            return ETIMEDOUT;
+        }
+    }
+    return 0;
+}
+
+// Called with _mtx held, let readers use the per-cpu counters again unless
+// a writer still owns or waits for the lock.
+void rwlock::unblock_counted_readers()
+{
+    if (_counts && !_wowner && !_write_waiters) {
+        _counts->blocked.store(false);
+    }
+}
+
+// Wait, with _mtx held, until the lock can be taken for writing, or until
+// tmr (if given) expires, returning ETIMEDOUT.
+int rwlock::writer_wait_lockable(sched::timer* tmr)
 {
     while (true) {
         if (write_lockable()) {
-            return;
+            return 0;
         }
 
         _write_waiters++;
-        _cond_writers.wait(&_mtx, nullptr);
+        auto ret = _cond_writers.wait(&_mtx, tmr);
         _write_waiters--;
+        if (ret == ETIMEDOUT && !write_lockable()) {
+            return ETIMEDOUT;
+        }
     }
 }
 
-void rwlock::reader_wait_lockable()
+// Wait, with _mtx held, until the lock can be taken for reading, or until
+// tmr (if given) expires, returning ETIMEDOUT.
+int rwlock::reader_wait_lockable(sched::timer* tmr)
 {
     while (true) {
         if (read_lockable()) {
-            return;
+            return 0;
         }
 
         _read_waiters++;
-        _cond_readers.wait(&_mtx, nullptr);
+        auto ret = _cond_readers.wait(&_mtx, tmr);
         _read_waiters--;
+        if (ret == ETIMEDOUT && !read_lockable()) {
+            return ETIMEDOUT;
+        }
+    }
+}
+
+// Called with _mtx held, by a writer which timed out: it no longer owns or
+// waits for the lock, so the readers it kept out may get in, or the next
+// writer may take over.
+void rwlock::writer_gave_up()
+{
+    if (_write_waiters) {
+        _cond_writers.wake_one();
+        return;
+    }
+    unblock_counted_readers();
+    if (!_wowner && _read_waiters) {
+        _cond_readers.wake_all();
     }
 }
 
@@ -194,6 +408,11 @@ void rwlock_init(rwlock_t* rw)
     new (rw) rwlock;
 }
 
+void rwlock_init_flags(rwlock_t* rw, unsigned flags)
+{
+    new (rw) rwlock(flags);
+}
+
 void rwlock_destroy(rwlock_t* rw)
 {
     rw->~rwlock();
@@ -18,6 +18,7 @@
 #include <osv/percpu.hh>
 #include <osv/prio.hh>
 #include <osv/elf.hh>
+#include <osv/mmu.hh>
 #include <stdlib.h>
 #include <unordered_map>
 
@@ -37,6 +38,8 @@ TRACEPOINT(trace_sched_wait, "");
 TRACEPOINT(trace_sched_wait_ret, "");
 TRACEPOINT(trace_sched_wake, "wake %p", thread*);
 TRACEPOINT(trace_sched_migrate, "thread=%p cpu=%d", thread*, unsigned);
+TRACEPOINT(trace_sched_load, "cpu=%d load=%g", unsigned, float);
+TRACEPOINT(trace_sched_balance_request, "cpu=%d", unsigned);
 TRACEPOINT(trace_sched_queue, "thread=%p", thread*);
 TRACEPOINT(trace_sched_preempt, "");
 TRACEPOINT(trace_timer_set, "timer=%p time=%d", timer_base*, s64);
@@ -73,6 +76,11 @@ constexpr thread_runtime::duration thyst = 2_ms;
 
 constexpr thread_runtime::duration context_switch_penalty = 10_us;
 
+// How often each cpu's balancer looks for a less loaded cpu to push threads
+// to, and how often an idle cpu may ask a loaded one to push a thread to it.
+constexpr thread_runtime::duration balance_interval = 100_ms;
+constexpr thread_runtime::duration steal_interval = 2_ms;
+
 constexpr float cmax = 0x1P63;
 constexpr float cinitial = 0x1P-63;
 
@@ -190,6 +198,12 @@ static constexpr bool scheduler_uses_fpu = true;
 
 void cpu::reschedule_from_interrupt(bool preempt)
 {
+    // Preemption is enabled, so no rcu read-side critical section is open
+    osv::rcu::quiescent_state(id);
+    // Flush TLB entries which went stale while we were idle, before
+    // switching to a thread which may use them
+    mmu::lazy_tlb_exit(id);
+
     if (scheduler_uses_fpu && preempt) {
         thread::current()->_fpu.save();
     }
@@ -323,23 +337,27 @@ void cpu::send_wakeup_ipi()
 void cpu::do_idle()
 {
     do {
+        osv::rcu::quiescent_state(id);
         idle_poll_lock_type idle_poll_lock{*this};
         WITH_LOCK(idle_poll_lock) {
             // spin for a bit before halting
             for (unsigned ctr = 0; ctr < 10000; ++ctr) {
-                // FIXME: can we pull threads from loaded cpus?
                 handle_incoming_wakeups();
                 if (!runqueue.empty()) {
                     return;
                 }
             }
         }
+        // Before halting, see if a loaded cpu can spare a thread. If it
+        // does, the migration will wake us up.
+        steal();
         std::unique_lock<irq_lock_type> guard(irq_lock);
         handle_incoming_wakeups();
         if (!runqueue.empty()) {
             return;
         }
         guard.release();
+        mmu::lazy_tlb_enter(id);
         arch::wait_for_interrupt(); // this unlocks irq_lock
         handle_incoming_wakeups();
     } while (runqueue.empty());
@@ -410,52 +428,151 @@ unsigned cpu::load()
     return runqueue.size();
 }
 
+// Moving a thread away from the cpus it shares caches with costs it its
+// cache footprint. To be worth it, a cpu further away in the topology (SMT
+// sibling, same last level cache, other) must be less loaded by this many
+// runnable threads.
+static constexpr float distance_penalty[] = { 0, 0.25, 0.5 };
+
+unsigned cpu::distance(const cpu* other) const
+{
+    if (other->core_id == core_id) {
+        return 0;
+    } else if (other->llc_id == llc_id) {
+        return 1;
+    }
+    return 2;
+}
+
+void cpu::update_load_avg()
+{
+    // We run on this cpu's balancer thread, so the idle thread is not running
+    // and its cpu time is up to date.
+    auto now = osv::clock::uptime::now();
+    auto interval = now - load_avg_updated;
+    auto idle = idle_thread->thread_clock();
+    auto idle_interval = idle - idle_time_seen;
+    load_avg_updated = now;
+    idle_time_seen = idle;
+    if (interval.count() <= 0) {
+        return;
+    }
+    float busy = 1.0f - std::min(1.0f, (float)idle_interval.count() / interval.count());
+    float sample = busy + load();
+    float decay = exp_tau(-interval);
+    load_avg = load_avg * decay + sample * (1.0f - decay);
+    trace_sched_load(id, load_avg);
+}
+
+cpu* cpu::find_balance_target()
+{
+    cpu* target = nullptr;
+    float target_load = load_avg;
+    for (auto c : cpus) {
+        // This CPU is temporarily running one extra thread (this thread),
+        // so don't migrate a thread away if the difference is only 1.
+        if (c == this || c->load() + 1 >= load()) {
+            continue;
+        }
+        // Comparing the decayed loads, rather than just the current queue
+        // lengths, avoids migrating threads to a cpu which only looks idle
+        // because its threads happen to be sleeping right now.
+        float c_load = c->load_avg + distance_penalty[distance(c)];
+        if (c_load < target_load) {
+            target = c;
+            target_load = c_load;
+        }
+    }
+    return target;
+}
+
+void cpu::migrate_one(cpu* target)
+{
+    auto i = std::find_if(runqueue.rbegin(), runqueue.rend(),
+            [](thread& t) { return !t._attr._pinned_cpu; });
+    if (i == runqueue.rend()) {
+        return;
+    }
+    auto& mig = *i;
+    trace_sched_migrate(&mig, target->id);
+    runqueue.erase(std::prev(i.base()));  // i.base() returns off-by-one
+    // we won't race with wake(), since we're not thread::waiting
+    assert(mig._detached_state->st.load() == thread::status::queued);
+    mig._detached_state->st.store(thread::status::waking);
+    mig.suspend_timers();
+    mig._detached_state->_cpu = target;
+    // Convert the CPU-local runtime measure to a globally meaningful
+    // measure
+    mig._runtime.export_runtime();
+    mig.remote_thread_local_var(::percpu_base) = target->percpu_base;
+    mig.remote_thread_local_var(current_cpu) = target;
+    target->incoming_wakeups[id].push_front(mig);
+    target->incoming_wakeups_mask.set(id);
+    // FIXME: avoid if the cpu is alive and if the priority does not
+    // FIXME: warrant an interruption
+    target->send_wakeup_ipi();
+}
+
 void cpu::load_balance()
 {
     notifier::fire();
+    balancer_thread.store(thread::current());
     timer tmr(*thread::current());
     while (true) {
-        tmr.set(osv::clock::uptime::now() + 100_ms);
-        thread::wait_until([&] { return tmr.expired(); });
+        tmr.set(osv::clock::uptime::now() + balance_interval);
+        thread::wait_until([&] {
+            return tmr.expired() || balance_requested.load(std::memory_order_relaxed);
+        });
+        tmr.cancel();
+        balance_requested.store(false, std::memory_order_relaxed);
+        update_load_avg();
         if (runqueue.empty()) {
             continue;
         }
-        auto min = *std::min_element(cpus.begin(), cpus.end(),
-                [](cpu* c1, cpu* c2) { return c1->load() < c2->load(); });
-        if (min == this) {
+        auto target = find_balance_target();
+        if (!target) {
             continue;
         }
-        // This CPU is temporarily running one extra thread (this thread),
-        // so don't migrate a thread away if the difference is only 1.
-        if (min->load() >= (load() - 1)) {
+        WITH_LOCK(irq_lock) {
+            migrate_one(target);
+        }
+    }
+}
+
+// Ask this cpu to run its balancer now, instead of at its next tick
+void cpu::request_balance()
+{
+    auto t = balancer_thread.load();
+    if (t && !balance_requested.exchange(true, std::memory_order_relaxed)) {
+        trace_sched_balance_request(id);
+        t->wake();
+    }
+}
+
+// Called when this cpu runs out of work. A runqueue may only be modified by
+// its own cpu, so rather than taking a thread we ask the busiest cpu (the
+// nearest one, on ties) to push one to us.
+void cpu::steal()
+{
+    auto now = osv::clock::uptime::now();
+    if (now < last_steal + steal_interval) {
+        return;
+    }
+    last_steal = now;
+    cpu* busiest = nullptr;
+    for (auto c : cpus) {
+        // a non-empty runqueue means a thread is waiting for the cpu
+        if (c == this || c->load() == 0) {
             continue;
         }
-        WITH_LOCK(irq_lock) {
-            auto i = std::find_if(runqueue.rbegin(), runqueue.rend(),
-                    [](thread& t) { return !t._attr._pinned_cpu; });
-            if (i == runqueue.rend()) {
-                continue;
-            }
-            auto& mig = *i;
-            trace_sched_migrate(&mig, min->id);
-            runqueue.erase(std::prev(i.base()));  // i.base() returns off-by-one
-            // we won't race with wake(), since we're not thread::waiting
-            assert(mig._detached_state->st.load() == thread::status::queued);
-            mig._detached_state->st.store(thread::status::waking);
-            mig.suspend_timers();
-            mig._detached_state->_cpu = min;
-            // Convert the CPU-local runtime measure to a globally meaningful
-            // measure
-            mig._runtime.export_runtime();
-            mig.remote_thread_local_var(::percpu_base) = min->percpu_base;
-            mig.remote_thread_local_var(current_cpu) = min;
-            min->incoming_wakeups[id].push_front(mig);
-            min->incoming_wakeups_mask.set(id);
-            // FIXME: avoid if the cpu is alive and if the priority does not
-            // FIXME: warrant an interruption
-            min->send_wakeup_ipi();
+        if (!busiest || c->load() > busiest->load() ||
+                (c->load() == busiest->load() && distance(c) < distance(busiest))) {
+            busiest = c;
         }
     }
+    if (busiest) {
+        busiest->request_balance();
+    }
 }
 
 cpu::notifier::notifier(std::function<void ()> cpu_up)
@@ -987,51 +1104,227 @@ timer_list::callback_dispatch::callback_dispatch()
     clock_event->set_callback(this);
 }
 
+unsigned long timer_list::to_tick(osv::clock::uptime::time_point t)
+{
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            t.time_since_epoch()).count();
+    return ns > 0 ? (unsigned long)ns >> tick_shift : 0;
+}
+
+osv::clock::uptime::time_point timer_list::from_tick(unsigned long tick)
+{
+    return osv::clock::uptime::time_point(
+            std::chrono::nanoseconds(tick << tick_shift));
+}
+
+bool timer_list::empty() const
+{
+    return _near.empty() && !_wheel_timers;
+}
+
+// The tick at which a wheel slot is due, and its timers need to be moved
+// to a lower level (or to _near). For the overflow list (level nr_levels),
+// this is the next time the wheel wraps around.
+unsigned long timer_list::slot_tick(unsigned level, unsigned slot) const
+{
+    auto shift = level * slot_shift;
+    if (level == nr_levels) {
+        auto mask = (1UL << shift) - 1;
+        return (_wheel_tick + mask) & ~mask;
+    }
+    auto block = _wheel_tick >> (shift + slot_shift) << (shift + slot_shift);
+    return block | (unsigned long)slot << shift;
+}
+
+// call with irq disabled, and with at least one timer in the wheel
+unsigned long timer_list::next_wheel_tick() const
+{
+    auto tick = ~0UL;
+    if (!_overflow.empty()) {
+        tick = slot_tick(nr_levels, 0);
+    }
+    for (unsigned level = 0; level < nr_levels; level++) {
+        auto idx = (_wheel_tick >> (level * slot_shift)) & (nr_slots - 1);
+        auto pending = _occupied[level] >> idx << idx;
+        if (pending) {
+            tick = std::min(tick, slot_tick(level, __builtin_ctzl(pending)));
+        }
+    }
+    return tick;
+}
+
+osv::clock::uptime::time_point timer_list::next_event() const
+{
+    auto t = osv::clock::uptime::time_point::max();
+    if (!_near.empty()) {
+        t = _near.begin()->_time;
+    }
+    if (_wheel_timers) {
+        t = std::min(t, from_tick(next_wheel_tick()));
+    }
+    return t;
+}
+
+// The time at which clock_event needs to fire for this timer: its
+// expiration time if it is near, otherwise the time its slot is due.
+osv::clock::uptime::time_point timer_list::event_time(const timer_base& t) const
+{
+    if (t._wheel_level < 0) {
+        return t._time;
+    }
+    return from_tick(slot_tick(t._wheel_level, t._wheel_slot));
+}
+
+// call with irq disabled
+void timer_list::add(timer_base& t)
+{
+    // When the wheel is empty its position is arbitrary; move it to the
+    // present, so new timers aren't hashed relative to a stale tick and
+    // immediately found to be due.
+    if (!_wheel_timers) {
+        _wheel_tick = std::max(_wheel_tick,
+                to_tick(osv::clock::uptime::now()) + 1);
+    }
+    insert(t);
+}
+
+// call with irq disabled
+void timer_list::insert(timer_base& t)
+{
+    auto tick = to_tick(t._time);
+    if (tick < _wheel_tick) {
+        t._wheel_level = -1;
+        _near.insert(t);
+        return;
+    }
+    // The level is that of the most significant slot index in which the
+    // timer's tick differs from the wheel's, so the slot is always ahead
+    // of the wheel's current slot in that level.
+    unsigned level = (63 - __builtin_clzl((tick ^ _wheel_tick) | 1)) / slot_shift;
+    ++_wheel_timers;
+    if (level >= nr_levels) {
+        t._wheel_level = nr_levels;
+        _overflow.push_back(t);
+        return;
+    }
+    auto slot = (tick >> (level * slot_shift)) & (nr_slots - 1);
+    t._wheel_level = level;
+    t._wheel_slot = slot;
+    _wheel[level][slot].push_back(t);
+    _occupied[level] |= 1UL << slot;
+}
+
+// call with irq disabled
+void timer_list::remove(timer_base& t)
+{
+    if (t._wheel_level < 0) {
+        _near.erase(_near.iterator_to(t));
+        return;
+    }
+    --_wheel_timers;
+    if (t._wheel_level == int(nr_levels)) {
+        _overflow.erase(_overflow.iterator_to(t));
+        return;
+    }
+    auto& slot = _wheel[t._wheel_level][t._wheel_slot];
+    slot.erase(slot.iterator_to(t));
+    if (slot.empty()) {
+        _occupied[t._wheel_level] &= ~(1UL << t._wheel_slot);
+    }
+}
+
+void timer_list::redistribute(slot_type& slot)
+{
+    // Take the timers off the slot first: a timer in _overflow which is
+    // still beyond the next wrap goes right back to it.
+    slot_type timers;
+    timers.splice(timers.end(), slot);
+    while (!timers.empty()) {
+        auto& t = timers.front();
+        timers.pop_front();
+        --_wheel_timers;
+        insert(t);
+    }
+}
+
+// Move all timers due up to and including now_tick from the wheel to _near
+void timer_list::advance(unsigned long now_tick)
+{
+    while (_wheel_timers) {
+        auto tick = next_wheel_tick();
+        if (tick > now_tick) {
+            break;
+        }
+        _wheel_tick = tick;
+        // Higher levels first, as their timers may move to the lower
+        // levels' current slots.
+        if (!_overflow.empty() && slot_tick(nr_levels, 0) == tick) {
+            redistribute(_overflow);
+        }
+        for (unsigned level = nr_levels - 1; level > 0; level--) {
+            auto slot = (tick >> (level * slot_shift)) & (nr_slots - 1);
+            if (_occupied[level] & (1UL << slot)) {
+                _occupied[level] &= ~(1UL << slot);
+                redistribute(_wheel[level][slot]);
+            }
+        }
+        _wheel_tick = tick + 1;
+        auto slot = tick & (nr_slots - 1);
+        _occupied[0] &= ~(1UL << slot);
+        redistribute(_wheel[0][slot]);
+    }
+    // No slot is due before the next tick, so we can skip to it
+    _wheel_tick = std::max(_wheel_tick, now_tick + 1);
+}
+
 void timer_list::fired()
 {
     auto now = osv::clock::uptime::now();
     _last = osv::clock::uptime::time_point::max();
+    advance(to_tick(now));
     // don't hold iterators across list iteration, since the list can change
-    while (!_list.empty() && _list.begin()->_time <= now) {
-        auto j = _list.begin();
+    while (!_near.empty() && _near.begin()->_time <= now) {
+        auto j = _near.begin();
         assert(j->_state == timer_base::state::armed);
-        _list.erase(j);
+        _near.erase(j);
         j->expire();
     }
-    if (!_list.empty()) {
+    if (!empty()) {
         rearm();
     }
 }
 
-void timer_list::rearm()
+void timer_list::set_event(osv::clock::uptime::time_point t)
 {
-    auto t = _list.begin()->_time;
     if (t < _last) {
         _last = t;
         clock_event->set(t);
     }
 }
 
+void timer_list::rearm()
+{
+    set_event(next_event());
+}
+
 // call with irq disabled
 void timer_list::suspend(bi::list<timer_base>& timers)
 {
     for (auto& t : timers) {
         assert(t._state == timer::state::armed);
-        _list.erase(_list.iterator_to(t));
+        remove(t);
     }
 }
 
 // call with irq disabled
 void timer_list::resume(bi::list<timer_base>& timers)
 {
-    bool rearm = false;
     for (auto& t : timers) {
         assert(t._state == timer::state::armed);
-        auto i = _list.insert(t).first;
-        rearm |= i == _list.begin();
+        add(t);
     }
-    if (rearm) {
-        clock_event->set(_list.begin()->_time);
+    if (!empty()) {
+        rearm();
     }
 }
 
@@ -1068,11 +1361,9 @@ void timer_base::set(osv::clock::uptime::time_point time)
     irq_save_lock_type irq_lock;
     WITH_LOCK(irq_lock) {
         auto& timers = cpu::current()->timers;
-        timers._list.insert(*this);
+        timers.add(*this);
         _t._active_timers.push_back(*this);
-        if (timers._list.iterator_to(*this) == timers._list.begin()) {
-            timers.rearm();
-        }
+        timers.set_event(timers.event_time(*this));
     }
 };
 
@@ -1086,7 +1377,7 @@ void timer_base::cancel()
     WITH_LOCK(irq_lock) {
         if (_state == state::armed) {
             _t._active_timers.erase(_t._active_timers.iterator_to(*this));
-            cpu::current()->timers._list.erase(cpu::current()->timers._list.iterator_to(*this));
+            cpu::current()->timers.remove(*this);
         }
         _state = state::free;
     }
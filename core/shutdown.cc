@@ -1,6 +1,7 @@
 #include <osv/shutdown.hh>
 #include <osv/power.hh>
 #include <osv/debug.hh>
+#include <osv/trace.hh>
 
 extern "C" {
     void unmount_rootfs();
@@ -10,6 +11,7 @@ namespace osv {
 
 void shutdown()
 {
+    flush_trace_stream();
     unmount_rootfs();
     debug("Powering off.\n");
     osv::poweroff();
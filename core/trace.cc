@@ -15,6 +15,13 @@
 #include <osv/debug.hh>
 #include <osv/prio.hh>
 #include <osv/execinfo.hh>
+#include <osv/mutex.h>
+#include <unordered_set>
+#include <unordered_map>
+#include <osv/elf.hh>
+#include <osv/demangle.hh>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -45,11 +52,34 @@ struct tracepoint_patch_sites_type {
 tracepoint_patch_sites_type tracepoint_patch_sites;
 
 constexpr size_t trace_page_size = 4096;  // need not match arch page size
-constexpr unsigned max_trace = trace_page_size * 1024;
 
-char *trace_log __attribute__((may_alias));
-std::atomic<size_t> trace_record_last;
+// Each cpu logs into a ring buffer of its own, so tracing on one cpu doesn't
+// bounce cache lines with the others. Records never cross a trace page; a
+// null tracepoint pointer marks the padding at the end of a page.
+//
+// Normally the buffers keep the most recent records, which can be extracted
+// with gdb. When a trace stream is set up, the buffers are instead drained to
+// it continuously, and a record which would overwrite data not yet written
+// out is dropped (and counted) instead.
+struct trace_buf {
+    char* _base;
+    size_t _size;
+    // Positions are byte offsets into an infinite log; they wrap around the
+    // buffer modulo _size. _alloc and _last are only modified by the owning
+    // cpu, with interrupts disabled.
+    size_t _alloc;
+    // end of the last complete record
+    std::atomic<size_t> _last;
+    // end of the data written to the trace stream
+    std::atomic<size_t> _consumed;
+    std::atomic<size_t> _lost;
+} CACHELINE_ALIGNED;
+
+trace_buf trace_buffers[sched::max_cpus];
+size_t trace_buffer_size = trace_page_size * 256;
 bool trace_enabled;
+static bool trace_streaming;
+static std::string trace_stream_path;
 
 typeof(tracepoint_base::tp_list) tracepoint_base::tp_list __attribute__((init_priority((int)init_prio::tracepoint_base)));
 
@@ -60,12 +90,26 @@ void enable_trace()
     trace_enabled = true;
 }
 
-void enable_tracepoint(std::string wildcard)
+void set_trace_buffer_size(size_t size)
 {
-    if (!trace_log) {
-        trace_log = (char *) aligned_alloc(sizeof(long), max_trace);
-        bzero(trace_log, max_trace);
+    trace_buffer_size = align_up(size, trace_page_size);
+}
+
+static void allocate_trace_buffers()
+{
+    for (unsigned i = 0; i < sched::cpus.size(); i++) {
+        auto& tb = trace_buffers[i];
+        if (!tb._base) {
+            tb._base = (char *) aligned_alloc(sizeof(long), trace_buffer_size);
+            bzero(tb._base, trace_buffer_size);
+            tb._size = trace_buffer_size;
+        }
     }
+}
+
+void enable_tracepoint(std::string wildcard)
+{
+    allocate_trace_buffers();
     wildcard = boost::algorithm::replace_all_copy(wildcard, std::string("*"), std::string(".*"));
     wildcard = boost::algorithm::replace_all_copy(wildcard, std::string("?"), std::string("."));
     std::regex re{wildcard};
@@ -235,24 +279,332 @@ void tracepoint_base::do_log_backtrace(trace_record* tr, u8*& buffer)
     buffer += backtrace_len * sizeof(void*);
 }
 
+// Called with interrupts disabled, so we are alone on this cpu's buffer.
+static trace_buf& this_cpu_trace_buf()
+{
+    auto c = sched::cpu::current();
+    return trace_buffers[c ? c->id : 0];
+}
+
 trace_record* allocate_trace_record(size_t size)
 {
+    auto& tb = this_cpu_trace_buf();
     size += sizeof(trace_record);
     size = align_up(size, sizeof(long));
-    size_t p = trace_record_last.load(std::memory_order_relaxed);
-    size_t pn;
-    do {
-        pn = p + size;
-        if (align_down(p, trace_page_size) != align_down(pn, trace_page_size)) {
-            // crossed page boundary
-            pn = align_up(p, trace_page_size) + size;
-        }
-    } while (!trace_record_last.compare_exchange_weak(p, pn, std::memory_order_relaxed));
-    char* pp = &trace_log[p % max_trace];
+    size_t p = tb._alloc;
+    size_t pn = p + size;
+    if (align_down(p, trace_page_size) != align_down(pn, trace_page_size)) {
+        // crossed page boundary
+        pn = align_up(p, trace_page_size) + size;
+    }
+    if (trace_streaming
+            && pn - tb._consumed.load(std::memory_order_acquire) > tb._size) {
+        tb._lost.store(tb._lost.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+        return nullptr;
+    }
+    tb._alloc = pn;
+    char* pp = &tb._base[p % tb._size];
     // clear the first word, do indicate an padding at the end of the page
     reinterpret_cast<trace_record*>(pp)->tp = nullptr;
     pn -= size;
-    return reinterpret_cast<trace_record*>(&trace_log[pn % max_trace]);
+    return reinterpret_cast<trace_record*>(&tb._base[pn % tb._size]);
+}
+
+void commit_trace_record()
+{
+    auto& tb = this_cpu_trace_buf();
+    tb._last.store(tb._alloc, std::memory_order_release);
+}
+
+namespace {
+
+// The trace stream, parsed by scripts/osv/trace.py, starts with a header:
+//
+//    "OSVTRSTR", u32 version, u32 trace page size, u32 backtrace length, u32 0
+//
+// followed by blocks, each starting with a u32 block type:
+//
+//    tracepoint: u64 key, u64 signature, then the name and the format, each
+//                a u16 length followed by the characters.
+//    data:       u32 cpu, u64 position, u64 length, u64 number of records
+//                lost since the previous block of this cpu, and then the
+//                given length of raw records from the cpu's buffer.
+//    symbols:    u32 count, then for each symbol: u64 address, u64 address
+//                of the symbol containing it (0 if none), then the symbol's
+//                (demangled) name and its object's path, as strings.
+//
+// Every tracepoint is described before the first record which uses it.
+// The return addresses in backtraces, minus one so that they fall in the
+// calling instruction, are described as symbols before the first data block
+// which uses them, so that addresses in shared objects can be resolved.
+enum : u32 {
+    trace_stream_version = 2,
+    trace_stream_tracepoint = 1,
+    trace_stream_data = 2,
+    trace_stream_symbols = 3,
+};
+
+struct [[gnu::packed]] trace_stream_header {
+    char magic[8];
+    u32 version;
+    u32 page_size;
+    u32 backtrace_len;
+    u32 reserved;
+};
+
+struct [[gnu::packed]] trace_stream_tracepoint_header {
+    u32 type;
+    u64 key;
+    u64 sig;
+};
+
+struct [[gnu::packed]] trace_stream_data_header {
+    u32 type;
+    u32 cpu;
+    u64 pos;
+    u64 len;
+    u64 lost;
+};
+
+struct [[gnu::packed]] trace_stream_symbols_header {
+    u32 type;
+    u32 count;
+};
+
+struct [[gnu::packed]] trace_stream_symbol {
+    u64 addr;
+    u64 sym_addr;
+};
+
+constexpr auto trace_stream_interval = std::chrono::milliseconds(10);
+
+class trace_streamer {
+public:
+    explicit trace_streamer(int fd);
+    void drain();
+private:
+    void run();
+    bool write(const void* data, size_t len);
+    bool write_string(const char* s);
+    bool describe_new_tracepoints();
+    bool describe_new_symbols(trace_buf& tb, size_t first, size_t last);
+    void fail();
+private:
+    ::mutex _mtx;
+    int _fd;
+    // described tracepoints, and their payload size
+    std::unordered_map<tracepoint_base*, size_t> _described;
+    std::unordered_set<const void*> _described_symbols;
+    size_t _lost_reported[sched::max_cpus] = {};
+    sched::thread _thread;
+};
+
+trace_streamer::trace_streamer(int fd)
+    : _fd(fd)
+    , _thread([=] { run(); }, sched::thread::attr().name("trace-stream"))
+{
+    trace_stream_header h = { { 'O', 'S', 'V', 'T', 'R', 'S', 'T', 'R' },
+            trace_stream_version, trace_page_size,
+            tracepoint_base::backtrace_len, 0 };
+    if (!write(&h, sizeof(h))) {
+        fail();
+        return;
+    }
+    _thread.start();
+}
+
+void trace_streamer::run()
+{
+    while (_fd >= 0) {
+        sched::thread::sleep(trace_stream_interval);
+        drain();
+    }
+}
+
+bool trace_streamer::write(const void* data, size_t len)
+{
+    auto p = static_cast<const char*>(data);
+    while (len) {
+        auto r = ::write(_fd, p, len);
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+bool trace_streamer::write_string(const char* s)
+{
+    u16 len = strlen(s);
+    return write(&len, sizeof(len)) && write(s, len);
+}
+
+bool trace_streamer::describe_new_tracepoints()
+{
+    for (auto& tp : tracepoint_base::tp_list) {
+        if (_described.count(&tp)) {
+            continue;
+        }
+        trace_stream_tracepoint_header h = { trace_stream_tracepoint,
+                reinterpret_cast<u64>(&tp), tp.sig };
+        if (!write(&h, sizeof(h)) || !write_string(tp.name)
+                || !write_string(tp.format)) {
+            return false;
+        }
+        _described.emplace(&tp, tp.payload_size);
+    }
+    return true;
+}
+
+// Walk the records from first to last, like scripts/osv/trace.py does, and
+// describe the backtrace addresses not described yet.
+bool trace_streamer::describe_new_symbols(trace_buf& tb, size_t first, size_t last)
+{
+    std::vector<const void*> addrs;
+    auto pos = first;
+    while (pos < last) {
+        // A record never crosses a page, so it doesn't wrap around either
+        auto tr = reinterpret_cast<trace_record*>(&tb._base[pos % tb._size]);
+        if (!tr->tp) {
+            pos = align_up(pos + sizeof(tr->tp), trace_page_size);
+            continue;
+        }
+        // The tracepoint may belong to an object which was unloaded since,
+        // so use what we saved when describing it.
+        auto d = _described.find(tr->tp);
+        if (d == _described.end()) {
+            break;
+        }
+        size_t size = sizeof(*tr) + d->second;
+        if (tr->backtrace) {
+            auto bt = reinterpret_cast<void**>(tr->buffer);
+            for (unsigned i = 0; i < tracepoint_base::backtrace_len && bt[i]; i++) {
+                auto addr = static_cast<const char*>(bt[i]) - 1;
+                if (_described_symbols.insert(addr).second) {
+                    addrs.push_back(addr);
+                }
+            }
+            size += tracepoint_base::backtrace_len * sizeof(void*);
+        }
+        pos += align_up(size, sizeof(long));
+    }
+    if (addrs.empty()) {
+        return true;
+    }
+
+    std::vector<elf::dladdr_info> infos(addrs.size());
+    elf::get_program()->lookup_addrs(addrs.data(), infos.data(), addrs.size());
+    trace_stream_symbols_header h = { trace_stream_symbols, u32(addrs.size()) };
+    if (!write(&h, sizeof(h))) {
+        return false;
+    }
+    for (size_t i = 0; i < addrs.size(); i++) {
+        auto& info = infos[i];
+        trace_stream_symbol sym = { reinterpret_cast<u64>(addrs[i]),
+                reinterpret_cast<u64>(info.addr) };
+        char demangled[1024];
+        auto name = info.sym ? info.sym : "";
+        if (info.sym && demangle(info.sym, demangled, sizeof(demangled))) {
+            name = demangled;
+        }
+        if (!write(&sym, sizeof(sym)) || !write_string(name)
+                || !write_string(info.fname ? info.fname : "")) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Stop streaming, letting the buffers wrap around again.
+void trace_streamer::fail()
+{
+    debug("trace stream: write failed, streaming stopped\n");
+    trace_streaming = false;
+    close(_fd);
+    _fd = -1;
+}
+
+void trace_streamer::drain()
+{
+    WITH_LOCK(_mtx) {
+        if (_fd < 0) {
+            return;
+        }
+        size_t last[sched::max_cpus];
+        for (unsigned i = 0; i < sched::cpus.size(); i++) {
+            last[i] = trace_buffers[i]._last.load(std::memory_order_acquire);
+        }
+        // A tracepoint is created before it can log anything, so describing
+        // the tracepoints now covers all the records up to last[].
+        if (!describe_new_tracepoints()) {
+            fail();
+            return;
+        }
+        for (unsigned i = 0; i < sched::cpus.size(); i++) {
+            auto& tb = trace_buffers[i];
+            if (!tb._base) {
+                continue;
+            }
+            auto first = tb._consumed.load(std::memory_order_relaxed);
+            auto lost = tb._lost.load(std::memory_order_relaxed);
+            if (first == last[i] && lost == _lost_reported[i]) {
+                continue;
+            }
+            if (tracepoint_base::logging_backtraces()
+                    && !describe_new_symbols(tb, first, last[i])) {
+                fail();
+                return;
+            }
+            auto len = last[i] - first;
+            trace_stream_data_header h = { trace_stream_data, i, first, len,
+                    lost - _lost_reported[i] };
+            // The data may wrap around the end of the buffer
+            auto off = first % tb._size;
+            auto len1 = std::min(len, tb._size - off);
+            if (!write(&h, sizeof(h))
+                    || !write(tb._base + off, len1)
+                    || !write(tb._base, len - len1)) {
+                fail();
+                return;
+            }
+            _lost_reported[i] = lost;
+            tb._consumed.store(last[i], std::memory_order_release);
+        }
+    }
+}
+
+}
+
+static trace_streamer* trace_stream;
+
+void set_trace_stream(std::string path)
+{
+    trace_stream_path = path;
+    trace_streaming = true;
+}
+
+void start_trace_stream()
+{
+    if (trace_stream_path.empty()) {
+        return;
+    }
+    int fd = open(trace_stream_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        debug("trace stream: cannot open %s\n", trace_stream_path.c_str());
+        trace_streaming = false;
+        return;
+    }
+    trace_stream = new trace_streamer(fd);
+}
+
+void flush_trace_stream()
+{
+    if (trace_stream) {
+        trace_stream->drain();
+    }
 }
 
 static __thread unsigned func_trace_nesting;
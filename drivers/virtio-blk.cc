@@ -199,20 +199,23 @@ void blk::req_done()
         u32 len;
         while((req = static_cast<blk_req*>(queue->get_buf_elem(&len))) != nullptr) {
             if (req->bio) {
+                bool ok = false;
                 switch (req->res.status) {
                 case VIRTIO_BLK_S_OK:
                     trace_virtio_blk_req_ok(req->bio, req->hdr.sector, req->bio->bio_bcount, req->hdr.type);
-                    biodone(req->bio, true);
+                    ok = true;
                     break;
                 case VIRTIO_BLK_S_UNSUPP:
                     trace_virtio_blk_req_unsupp(req->bio, req->hdr.sector, req->bio->bio_bcount, req->hdr.type);
-                    biodone(req->bio, false);
                     break;
                 default:
                     trace_virtio_blk_req_err(req->bio, req->hdr.sector, req->bio->bio_bcount, req->hdr.type);
-                    biodone(req->bio, false);
                     break;
                }
+               biodone(req->bio, ok);
+               for (auto bio : req->merged) {
+                   biodone(bio, ok);
+               }
             }
 
             delete req;
@@ -231,6 +234,33 @@ int64_t blk::size()
 
 static const int sector_size = 512;
 
+static blk::blk_request_type request_type(struct bio* bio)
+{
+    switch (bio->bio_cmd) {
+    case BIO_READ:
+        return blk::VIRTIO_BLK_T_IN;
+    case BIO_WRITE:
+        return blk::VIRTIO_BLK_T_OUT;
+    default:
+        return blk::VIRTIO_BLK_T_FLUSH;
+    }
+}
+
+// The number of segments we allow a bio to take
+static u32 segments(struct bio* bio)
+{
+    return bio->bio_bcount/mmu::page_size + 1;
+}
+
+// Whether b follows a on disk, and can be transferred in the same request
+static bool can_merge(struct bio* a, struct bio* b)
+{
+    return (a->bio_cmd == BIO_READ || a->bio_cmd == BIO_WRITE)
+        && b->bio_cmd == a->bio_cmd
+        && a->bio_bcount && b->bio_bcount
+        && a->bio_offset + off_t(a->bio_bcount) == b->bio_offset;
+}
+
 int blk::make_request(struct bio* bio)
 {
     // The lock is here for parallel requests protection
@@ -238,17 +268,14 @@ int blk::make_request(struct bio* bio)
 
         if (!bio) return EIO;
 
-        if (bio->bio_bcount/mmu::page_size + 1 > _config.seg_max) {
+        if (segments(bio) > _config.seg_max) {
             trace_virtio_blk_make_request_seg_max(bio->bio_bcount, _config.seg_max);
             return EIO;
         }
 
-        auto* queue = get_virt_queue(0);
-        blk_request_type type;
-
         switch (bio->bio_cmd) {
         case BIO_READ:
-            type = VIRTIO_BLK_T_IN;
+        case BIO_FLUSH:
             break;
         case BIO_WRITE:
             if (is_readonly()) {
@@ -256,40 +283,91 @@ int blk::make_request(struct bio* bio)
                 biodone(bio, false);
                 return EROFS;
             }
-            type = VIRTIO_BLK_T_OUT;
-            break;
-        case BIO_FLUSH:
-            type = VIRTIO_BLK_T_FLUSH;
             break;
         default:
             return ENOTBLK;
         }
 
-        auto* req = new blk_req(bio);
-        blk_outhdr* hdr = &req->hdr;
-        hdr->type = type;
-        hdr->ioprio = 0;
-        hdr->sector = bio->bio_offset / sector_size;
+        // Requests are always submitted in order, so a bio which isn't
+        // held back also submits the ones held back before it. So does a
+        // bio from another thread than the one holding them back.
+        auto self = sched::thread::current();
+        bool other = !_pending.empty() && _pending_owner != self;
+        _pending.push_back(bio);
+        if (other || !bio_plugged(unplug, this) || _pending.size() >= max_pending) {
+            submit_pending();
+        } else {
+            _pending_owner = self;
+        }
+        return 0;
+    }
+}
 
-        queue->init_sg();
-        queue->add_out_sg(hdr, sizeof(struct blk_outhdr));
+void blk::unplug(void* arg)
+{
+    auto* drv = static_cast<blk*>(arg);
+    WITH_LOCK(drv->_lock) {
+        // Another thread's bios, if any, are up to its own plug
+        if (!drv->_pending.empty() &&
+                drv->_pending_owner == sched::thread::current()) {
+            drv->submit_pending();
+        }
+    }
+}
 
-        if (bio->bio_data && bio->bio_bcount > 0) {
-            if (type == VIRTIO_BLK_T_OUT)
-                queue->add_out_sg(bio->bio_data, bio->bio_bcount);
-            else
-                queue->add_in_sg(bio->bio_data, bio->bio_bcount);
+// Add requests for the pending bios, merging runs of reads or writes of
+// adjacent sectors into one request, and notify the host once (or not at
+// all, if it tells us through the event index that it is still processing
+// the ring). Called with _lock held.
+void blk::submit_pending()
+{
+    auto first = _pending.data();
+    auto end = first + _pending.size();
+    while (first != end) {
+        auto last = first + 1;
+        auto segs = segments(*first);
+        while (last != end && can_merge(last[-1], *last)
+                && segs + segments(*last) <= _config.seg_max) {
+            segs += segments(*last);
+            ++last;
         }
+        add_request(first, last);
+        first = last;
+    }
+    _pending.clear();
+    _pending_owner = nullptr;
+    get_virt_queue(0)->kick();
+}
 
-        req->res.status = 0;
-        queue->add_in_sg(&req->res, sizeof (struct blk_res));
+void blk::add_request(struct bio** first, struct bio** last)
+{
+    auto* queue = get_virt_queue(0);
+    auto* bio = *first;
+    auto type = request_type(bio);
 
-        queue->add_buf_wait(req);
+    auto* req = new blk_req(bio);
+    req->merged.assign(first + 1, last);
+    blk_outhdr* hdr = &req->hdr;
+    hdr->type = type;
+    hdr->ioprio = 0;
+    hdr->sector = bio->bio_offset / sector_size;
 
-        queue->kick();
+    queue->init_sg();
+    queue->add_out_sg(hdr, sizeof(struct blk_outhdr));
 
-        return 0;
+    for (auto b = first; b != last; ++b) {
+        if ((*b)->bio_data && (*b)->bio_bcount > 0) {
+            if (type == VIRTIO_BLK_T_OUT)
+                queue->add_out_sg((*b)->bio_data, (*b)->bio_bcount);
+            else
+                queue->add_in_sg((*b)->bio_data, (*b)->bio_bcount);
+        }
     }
+
+    req->res.status = 0;
+    queue->add_in_sg(&req->res, sizeof (struct blk_res));
+
+    queue->add_buf_wait(req);
 }
 
 u32 blk::get_driver_features()
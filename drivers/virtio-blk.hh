@@ -10,6 +10,7 @@
 #include "drivers/virtio.hh"
 #include "drivers/pci-device.hh"
 #include <osv/bio.h>
+#include <vector>
 
 namespace virtio {
 
@@ -127,6 +128,7 @@ public:
     virtual u32 get_driver_features();
 
     int make_request(struct bio*);
+    static void unplug(void* arg);
 
     void req_done();
     int64_t size();
@@ -146,8 +148,13 @@ private:
         blk_outhdr hdr;
         blk_res res;
         struct bio* bio;
+        // bios following bio on disk, merged into the same request
+        std::vector<struct bio*> merged;
     };
 
+    void add_request(struct bio** first, struct bio** last);
+    void submit_pending();
+
     std::string _driver_name;
     blk_config _config;
 
@@ -157,6 +164,13 @@ private:
     bool _ro;
     // This mutex protects parallel make_request invocations
     mutex _lock;
+    // bios held back by a plugged thread, in submission order. They all
+    // belong to _pending_owner's plug: a bio from any other thread submits
+    // them, so they never wait for the plug of a thread which didn't
+    // submit them.
+    std::vector<struct bio*> _pending;
+    sched::thread* _pending_owner = nullptr;
+    static constexpr size_t max_pending = 64;
     gsi_level_interrupt _gsi;
 };
 
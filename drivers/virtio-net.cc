@@ -43,13 +43,14 @@ TRACEPOINT(trace_virtio_net_rx_packet, "if=%d, len=%d", int, int);
 TRACEPOINT(trace_virtio_net_rx_wake, "");
 TRACEPOINT(trace_virtio_net_fill_rx_ring, "if=%d", int);
 TRACEPOINT(trace_virtio_net_fill_rx_ring_added, "if=%d, added=%d", int, int);
+TRACEPOINT(trace_virtio_net_rx_pool_miss, "pool=%p", void*);
 TRACEPOINT(trace_virtio_net_tx_packet, "if=%d, len=%d", int, int);
 TRACEPOINT(trace_virtio_net_tx_failed_add_buf, "if=%d", int);
 TRACEPOINT(trace_virtio_net_tx_no_space_calling_gc, "if=%d", int);
+TRACEPOINT(trace_virtio_net_queue_pairs, "if=%d, pairs=%d", int, int);
 using namespace memory;
 
 // TODO list
-// irq thread affinity and tx affinity
 // tx zero copy
 // vlans?
 
@@ -123,17 +124,18 @@ static int if_transmit(struct ifnet* ifp, struct mbuf* m_head)
 
     net_d("%s_start", __FUNCTION__);
 
-    /* Process packets */
-    vnet->_tx_ring_lock.lock();
-
-    net_d("*** processing packet! ***");
+    auto& txq = vnet->select_txq();
+    int error;
 
-    int error = vnet->tx_locked(m_head);
+    /* Process packets */
+    WITH_LOCK(txq.tx_ring_lock) {
+        net_d("*** processing packet! ***");
 
-    if (!error)
-        vnet->kick(1);
+        error = vnet->tx_locked(txq, m_head);
 
-    vnet->_tx_ring_lock.unlock();
+        if (!error)
+            vnet->kick(txq);
+    }
 
     return error;
 }
@@ -161,9 +163,12 @@ static void if_getinfo(struct ifnet* ifp, struct if_data* out_data)
 
 void net::fill_stats(struct if_data* out_data) const
 {
-    // We currently support only a single Tx/Rx queue so no iteration so far
-    fill_qstats(_rxq, out_data);
-    fill_qstats(_txq, out_data);
+    for (auto& rxq : _rxq) {
+        fill_qstats(*rxq, out_data);
+    }
+    for (auto& txq : _txq) {
+        fill_qstats(*txq, out_data);
+    }
 }
 
 void net::fill_qstats(const struct rxq& rxq,
@@ -173,12 +178,13 @@ void net::fill_qstats(const struct rxq& rxq,
     out_data->ifi_ibytes   += rxq.stats.rx_bytes;
     out_data->ifi_iqdrops  += rxq.stats.rx_drops;
     out_data->ifi_ierrors  += rxq.stats.rx_csum_err;
+    out_data->ifi_ilro_queued  += rxq.stats.rx_lro_queued;
+    out_data->ifi_ilro_flushed += rxq.stats.rx_lro_flushed;
 }
 
 void net::fill_qstats(const struct txq& txq,
                              struct if_data* out_data) const
 {
-    assert(!out_data->ifi_oerrors && !out_data->ifi_obytes && !out_data->ifi_opackets);
     out_data->ifi_opackets += txq.stats.tx_packets;
     out_data->ifi_obytes   += txq.stats.tx_bytes;
     out_data->ifi_oerrors  += txq.stats.tx_err + txq.stats.tx_drops;
@@ -189,7 +195,8 @@ bool net::ack_irq()
     auto isr = virtio_conf_readb(VIRTIO_PCI_ISR);
 
     if (isr) {
-        _rxq.vqueue->disable_interrupts();
+        // Without MSI-X we only ever use a single queue pair
+        _rxq[0]->vqueue->disable_interrupts();
         return true;
     } else {
         return false;
@@ -198,12 +205,8 @@ bool net::ack_irq()
 }
 
 net::net(pci::device& dev)
-    : virtio_driver(dev),
-      _rxq(get_virt_queue(0), [this] { this->receiver(); }),
-      _txq(get_virt_queue(1))
+    : virtio_driver(dev)
 {
-    sched::thread* poll_task = &_rxq.poll_task;
-
     _driver_name = "virtio-net";
     virtio_i("VIRTIO NET INSTANCE");
     _id = _instance++;
@@ -213,6 +216,31 @@ net::net(pci::device& dev)
 
     _hdr_size = _mergeable_bufs ? sizeof(net_hdr_mrg_rxbuf) : sizeof(net_hdr);
 
+    // Use one queue pair per vCPU, as long as the host supports it and we
+    // can give each queue its own MSI-X vector. The control queue is always
+    // placed after the maximum number of pairs the host supports. We only
+    // probe up to max_virtqueues_nr queues, so we can't use more pairs than
+    // were probed, nor more than one if that left out the control queue,
+    // which is needed to enable them.
+    unsigned max_pairs = _mq ? _config.max_virtqueue_pairs : 1;
+    if (_ctrl_vq) {
+        _ctrlq = get_virt_queue(2 * max_pairs);
+    }
+    unsigned pairs = 1;
+    if (_mq && _ctrlq && dev.is_msix()) {
+        pairs = std::min<unsigned>({ max_pairs, unsigned(sched::cpus.size()),
+                                     _num_queues / 2 });
+    }
+    for (unsigned i = 0; i < pairs; i++) {
+        // When we have a queue per CPU, pin each receiver thread to its
+        // CPU, so Rx processing (and its interrupt, which follows the
+        // thread) is spread over all of them.
+        sched::cpu* cpu = pairs > 1 ? sched::cpus[i] : nullptr;
+        _rxq.emplace_back(new rxq(get_virt_queue(2 * i),
+                [this, i] { this->receiver(*_rxq[i]); }, cpu));
+        _txq.emplace_back(new txq(get_virt_queue(2 * i + 1)));
+    }
+
     //initialize the BSD interface _if
     _ifn = if_alloc(IFT_ETHER);
     if (_ifn == NULL) {
@@ -231,7 +259,7 @@ net::net(pci::device& dev)
     _ifn->if_qflush = if_qflush;
     _ifn->if_init = if_init;
     _ifn->if_getinfo = if_getinfo;
-    IFQ_SET_MAXLEN(&_ifn->if_snd, _txq.vqueue->size());
+    IFQ_SET_MAXLEN(&_ifn->if_snd, _txq[0]->vqueue->size());
 
     _ifn->if_capabilities = 0;
 
@@ -243,30 +271,100 @@ net::net(pci::device& dev)
         }
     }
 
+    // LRO is done in software, but only trusts checksums verified by the
+    // host.
     if (_guest_csum) {
-        _ifn->if_capabilities |= IFCAP_RXCSUM;
-        if (_guest_tso4)
-            _ifn->if_capabilities |= IFCAP_LRO;
+        _ifn->if_capabilities |= IFCAP_RXCSUM | IFCAP_LRO;
     }
 
     _ifn->if_capenable = _ifn->if_capabilities | IFCAP_HWSTATS;
 
-    //Start the polling thread before attaching it to the Rx interrupt
-    poll_task->start();
+    for (auto& rxq : _rxq) {
+        tcp_lro_init(&rxq->lro);
+        rxq->lro.ifp = _ifn;
+    }
+
+    //Start the polling threads before attaching them to the Rx interrupts
+    for (auto& rxq : _rxq) {
+        rxq->poll_task.start();
+    }
 
     ether_ifattach(_ifn, _config.mac);
     if (dev.is_msix()) {
-        _msi.easy_register({
-            { 0, [&] { _rxq.vqueue->disable_interrupts(); }, poll_task },
-            { 1, [&] { _txq.vqueue->disable_interrupts(); }, nullptr }
-        });
+        // MSI-X entry n serves virtqueue n (see probe_virt_queues()).
+        // Each Rx vector is steered to the CPU its receiver thread runs on.
+        std::vector<msix_binding> bindings;
+        for (unsigned i = 0; i < _rxq.size(); i++) {
+            auto rxq = _rxq[i].get();
+            auto txq = _txq[i].get();
+            bindings.push_back({ 2 * i, [=] { rxq->vqueue->disable_interrupts(); }, &rxq->poll_task });
+            bindings.push_back({ 2 * i + 1, [=] { txq->vqueue->disable_interrupts(); }, nullptr });
+        }
+        _msi.easy_register(bindings);
     } else {
+        sched::thread* poll_task = &_rxq[0]->poll_task;
         _gsi.set_ack_and_handler(dev.get_interrupt_line(), [=] { return this->ack_irq(); }, [=] { poll_task->wake(); });
     }
 
-    fill_rx_ring();
+    for (auto& rxq : _rxq) {
+        fill_rx_ring(*rxq);
+    }
 
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
+
+    // The device uses a single queue pair until told otherwise, which can
+    // only be done after DRIVER_OK.
+    if (_rxq.size() > 1) {
+        net_ctrl_mq mq = { static_cast<u16>(_rxq.size()) };
+        if (!ctrl_cmd(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                &mq, sizeof(mq))) {
+            net_w("failed to enable %d queue pairs", mq.virtqueue_pairs);
+        }
+    }
+    trace_virtio_net_queue_pairs(_ifn->if_index, _rxq.size());
+}
+
+bool net::ctrl_cmd(u8 cls, u8 cmd, const void* data, size_t len)
+{
+    if (!_ctrlq) {
+        return false;
+    }
+
+    // The buffers are handed to the host by physical address, so keep them
+    // off the stack.
+    struct ctrl_req {
+        net_ctrl_hdr hdr;
+        net_ctrl_ack ack;
+        u8 data[];
+    };
+    std::unique_ptr<ctrl_req, void (*)(void*)> req(
+            static_cast<ctrl_req*>(malloc(sizeof(ctrl_req) + len)), free);
+    req->hdr.class_t = cls;
+    req->hdr.cmd = cmd;
+    req->ack = VIRTIO_NET_ERR;
+    memcpy(req->data, data, len);
+
+    vring* vq = _ctrlq;
+    vq->init_sg();
+    vq->add_out_sg(&req->hdr, sizeof(req->hdr));
+    vq->add_out_sg(req->data, len);
+    vq->add_in_sg(&req->ack, sizeof(req->ack));
+    if (!vq->add_buf(req.get())) {
+        return false;
+    }
+    vq->kick();
+
+    // Control commands are rare (only during initialization), so simply
+    // poll for the completion rather than setting up an interrupt for it.
+    u32 used_len;
+    while (!vq->used_ring_not_empty()) {
+        sched::thread::yield();
+    }
+    vq->get_buf_elem(&used_len);
+    vq->get_buf_finalize();
+    vq->get_buf_gc();
+
+    return req->ack == VIRTIO_NET_OK;
 }
 
 net::~net()
@@ -307,11 +405,16 @@ void net::read_config()
     _guest_tso4 = get_guest_feature_bit(VIRTIO_NET_F_GUEST_TSO4);
     _host_tso4 = get_guest_feature_bit(VIRTIO_NET_F_HOST_TSO4);
     _guest_ufo = get_guest_feature_bit(VIRTIO_NET_F_GUEST_UFO);
+    _ctrl_vq = get_guest_feature_bit(VIRTIO_NET_F_CTRL_VQ);
+    _mq = _ctrl_vq && get_guest_feature_bit(VIRTIO_NET_F_MQ);
 
     net_i("Features: %s=%d,%s=%d", "Status", _status, "TSO_ECN", _tso_ecn);
     net_i("Features: %s=%d,%s=%d", "Host TSO ECN", _host_tso_ecn, "CSUM", _csum);
     net_i("Features: %s=%d,%s=%d", "Guest_csum", _guest_csum, "guest tso4", _guest_tso4);
-    net_i("Features: %s=%d", "host tso4", _host_tso4);
+    net_i("Features: %s=%d,%s=%d", "host tso4", _host_tso4, "MQ", _mq);
+    if (_mq) {
+        net_i("Max virtqueue pairs: %d", _config.max_virtqueue_pairs);
+    }
 }
 
 /**
@@ -386,10 +489,10 @@ void debug_limited(T&&... a)
     debug(std::forward<T>(a)...);
 }
 
-void net::receiver()
+void net::receiver(rxq& rxq)
 {
-    vring* vq = _rxq.vqueue;
-    std::vector<iovec> packet;
+    vring* vq = rxq.vqueue;
+    std::vector<rx_buffer*> packet;
 
     while (1) {
 
@@ -406,11 +509,12 @@ void net::receiver()
         // truncating it.
         net_hdr_mrg_rxbuf* mhdr;
 
-        while (void* page = vq->get_buf_elem(&len)) {
+        while (auto buf = static_cast<rx_buffer*>(vq->get_buf_elem(&len))) {
 
             // TODO: should get out of the loop
             vq->get_buf_finalize();
 
+            void* page = buf->page;
             debug_limited("packet @ %p len %d\n", page, len);
             for (auto i = 0u; i < len && i < 400; ++i) {
                 debug_limited(" %02x", (int)((unsigned char*)page)[i]);
@@ -421,7 +525,7 @@ void net::receiver()
             if (len < _hdr_size + ETHER_HDR_LEN) {
                 debug("dropped\n");
                 rx_drops++;
-                memory::free_page(page);
+                rx_pool::put(buf);
 
                 continue;
             }
@@ -434,21 +538,29 @@ void net::receiver()
                 nbufs = mhdr->num_buffers;
             }
 
-            packet.push_back({page + _hdr_size, len - _hdr_size});
+            buf->data = static_cast<char*>(page) + _hdr_size;
+            buf->len = len - _hdr_size;
+            packet.push_back(buf);
 
             // Read the fragments
             while (--nbufs > 0) {
-                page = vq->get_buf_elem(&len);
-                if (!page) {
-                    rx_drops++;
-                    for (auto&& v : packet) {
-                        free_buffer(v);
-                    }
+                buf = static_cast<rx_buffer*>(vq->get_buf_elem(&len));
+                if (!buf) {
                     break;
                 }
-                packet.push_back({page, len});
+                buf->data = static_cast<char*>(buf->page);
+                buf->len = len;
+                packet.push_back(buf);
                 vq->get_buf_finalize();
             }
+            if (nbufs > 0) {
+                rx_drops++;
+                for (auto b : packet) {
+                    rx_pool::put(b);
+                }
+                packet.clear();
+                continue;
+            }
 
             auto m_head = packet_to_mbuf(packet);
             packet.clear();
@@ -469,10 +581,7 @@ void net::receiver()
             rx_packets++;
             rx_bytes += m_head->M_dat.MH.MH_pkthdr.len;
 
-            bool fast_path = _ifn->if_classifier.post_packet(m_head);
-            if (!fast_path) {
-                (*_ifn->if_input)(_ifn, m_head);
-            }
+            rx_input(rxq, m_head);
 
             trace_virtio_net_rx_packet(_ifn->if_index, rx_bytes);
 
@@ -482,75 +591,162 @@ void net::receiver()
                 break;
         }
 
+        lro_flush(rxq);
+
         if (vq->refill_ring_cond())
-            fill_rx_ring();
+            fill_rx_ring(rxq);
 
         // Update the stats
-        _rxq.stats.rx_drops      += rx_drops;
-        _rxq.stats.rx_packets    += rx_packets;
-        _rxq.stats.rx_csum       += csum_ok;
-        _rxq.stats.rx_csum_err   += csum_err;
-        _rxq.stats.rx_bytes      += rx_bytes;
+        rxq.stats.rx_drops      += rx_drops;
+        rxq.stats.rx_packets    += rx_packets;
+        rxq.stats.rx_csum       += csum_ok;
+        rxq.stats.rx_csum_err   += csum_err;
+        rxq.stats.rx_bytes      += rx_bytes;
+    }
+}
+
+void net::rx_input(rxq& rxq, mbuf* m)
+{
+    if ((_ifn->if_capenable & IFCAP_LRO) && rxq.lro.lro_cnt != 0 &&
+        (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_DATA_VALID)) {
+        int error = tcp_lro_rx(&rxq.lro, m, 0);
+        if (error == 0) {
+            return;
+        }
+        // A TCP packet which can't be coalesced (e.g., a FIN) must not
+        // overtake the segments held back for its flow.
+        if (error == TCP_LRO_CANNOT) {
+            lro_flush(rxq);
+        }
+    }
+
+    bool fast_path = _ifn->if_classifier.post_packet(m);
+    if (!fast_path) {
+        (*_ifn->if_input)(_ifn, m);
     }
 }
 
-mbuf* net::packet_to_mbuf(const std::vector<iovec>& packet)
+void net::lro_flush(rxq& rxq)
 {
-    auto m = m_gethdr(M_DONTWAIT, MT_DATA);
-    auto refcnt = new unsigned;
-    m->M_dat.MH.MH_dat.MH_ext.ref_cnt = refcnt;
-    m_extadd(m, static_cast<char*>(packet[0].iov_base), packet[0].iov_len,
-            &net::free_buffer_and_refcnt, packet[0].iov_base, refcnt, M_PKTHDR, EXT_EXTREF);
-    m->M_dat.MH.MH_pkthdr.len = packet[0].iov_len;
-    m->M_dat.MH.MH_pkthdr.rcvif = _ifn;
-    m->M_dat.MH.MH_pkthdr.csum_flags = 0;
-    m->m_hdr.mh_len = packet[0].iov_len;
-    m->m_hdr.mh_next = nullptr;
-
-    auto m_head = m;
-    auto m_tail = m;
-    for (size_t idx = 1; idx != packet.size(); ++idx) {
-        auto&& iov = packet[idx];
-        auto m = m_get(M_DONTWAIT, MT_DATA);
-        refcnt = new unsigned;
-        m->M_dat.MH.MH_dat.MH_ext.ref_cnt = refcnt;
-        m_extadd(m, static_cast<char*>(iov.iov_base), iov.iov_len,
-                &net::free_buffer_and_refcnt, iov.iov_base, refcnt, 0, EXT_EXTREF);
-        m->m_hdr.mh_len = iov.iov_len;
-        m->m_hdr.mh_next = nullptr;
-        m_tail->m_hdr.mh_next = m;
+    auto lro = &rxq.lro;
+    while (!SLIST_EMPTY(&lro->lro_active)) {
+        auto le = SLIST_FIRST(&lro->lro_active);
+        SLIST_REMOVE_HEAD(&lro->lro_active, next);
+        tcp_lro_flush(lro, le);
+    }
+    rxq.stats.rx_lro_queued += lro->lro_queued;
+    rxq.stats.rx_lro_flushed += lro->lro_flushed;
+    lro->lro_queued = 0;
+    lro->lro_flushed = 0;
+}
+
+// Each fragment is passed up in the mbuf embedded in its buffer. M_NOFREE
+// keeps m_free() from returning that mbuf to the mbuf zone, and the buffer
+// returns to its pool once the last mbuf referencing its page is freed.
+mbuf* net::packet_to_mbuf(const std::vector<rx_buffer*>& packet)
+{
+    mbuf* m_head = nullptr;
+    mbuf* m_tail = nullptr;
+    for (auto buf : packet) {
+        auto m = &buf->m;
+        m_init(m, nullptr, MSIZE, M_DONTWAIT, MT_DATA, m_head ? 0 : M_PKTHDR);
+        m->M_dat.MH.MH_dat.MH_ext.ref_cnt = &buf->refcnt;
+        m_extadd(m, buf->data, buf->len, &net::free_rx_buffer, buf, nullptr,
+                M_NOFREE, EXT_EXTREF);
+        m->m_hdr.mh_len = buf->len;
+        if (!m_head) {
+            m->M_dat.MH.MH_pkthdr.len = 0;
+            m->M_dat.MH.MH_pkthdr.rcvif = _ifn;
+            m->M_dat.MH.MH_pkthdr.csum_flags = 0;
+            m_head = m;
+        } else {
+            m_tail->m_hdr.mh_next = m;
+        }
         m_tail = m;
-        m_head->M_dat.MH.MH_pkthdr.len += iov.iov_len;
+        m_head->M_dat.MH.MH_pkthdr.len += buf->len;
     }
     return m_head;
 }
 
-// hook for EXT_EXTREF mbuf cleanup
-void net::free_buffer_and_refcnt(void* buffer, void* refcnt)
+void net::free_rx_buffer(void* buf, void* unused)
 {
-    do_free_buffer(buffer);
-    delete static_cast<unsigned*>(refcnt);
+    rx_pool::put(static_cast<rx_buffer*>(buf));
 }
 
-void net::do_free_buffer(void* buffer)
+net::rx_pool::~rx_pool()
 {
-    buffer = align_down(buffer, page_size);
-    memory::free_page(buffer);
+    auto buf = _returned.exchange(nullptr);
+    while (buf || _free) {
+        if (!buf) {
+            buf = _free;
+            _free = nullptr;
+        }
+        auto next = buf->next;
+        memory::free_page(buf->page);
+        delete buf;
+        buf = next;
+    }
 }
 
-void net::fill_rx_ring()
+net::rx_buffer* net::rx_pool::get(rxq_stats& stats)
+{
+    if (!_free) {
+        _free = _returned.exchange(nullptr, std::memory_order_acquire);
+    }
+    if (_free) {
+        auto buf = _free;
+        _free = buf->next;
+        stats.rx_pool_hits++;
+        return buf;
+    }
+    stats.rx_pool_misses++;
+    trace_virtio_net_rx_pool_miss(this);
+    auto buf = new rx_buffer;
+    buf->m.m_hdr.mh_flags = 0;
+    buf->page = memory::alloc_page();
+    buf->pool = this;
+    _allocated.fetch_add(1, std::memory_order_relaxed);
+    return buf;
+}
+
+void net::rx_pool::put(rx_buffer* buf)
+{
+    auto m = &buf->m;
+    if ((m->m_hdr.mh_flags & M_PKTHDR) &&
+        !SLIST_EMPTY(&m->M_dat.MH.MH_pkthdr.tags)) {
+        m_tag_delete_chain(m, nullptr);
+    }
+    m->m_hdr.mh_flags = 0;
+
+    auto pool = buf->pool;
+    if (pool->_allocated.load(std::memory_order_relaxed) > pool->_max) {
+        pool->_allocated.fetch_sub(1, std::memory_order_relaxed);
+        memory::free_page(buf->page);
+        delete buf;
+        return;
+    }
+    // Only the receiver thread pops, and it takes the whole list at once,
+    // so pushing can't suffer from ABA.
+    auto head = pool->_returned.load(std::memory_order_relaxed);
+    do {
+        buf->next = head;
+    } while (!pool->_returned.compare_exchange_weak(head, buf,
+            std::memory_order_release, std::memory_order_relaxed));
+}
+
+void net::fill_rx_ring(rxq& rxq)
 {
     trace_virtio_net_fill_rx_ring(_ifn->if_index);
     int added = 0;
-    vring* vq = _rxq.vqueue;
+    vring* vq = rxq.vqueue;
 
     while (vq->avail_ring_not_empty()) {
-        auto page = memory::alloc_page();
+        auto buf = rxq.pool.get(rxq.stats);
 
         vq->init_sg();
-        vq->add_in_sg(page, memory::page_size);
-        if (!vq->add_buf(page)) {
-            memory::free_page(page);
+        vq->add_in_sg(buf->page, memory::page_size);
+        if (!vq->add_buf(buf)) {
+            rx_pool::put(buf);
             break;
         }
         added++;
@@ -562,18 +758,31 @@ void net::fill_rx_ring()
         vq->kick();
 }
 
+net::txq& net::select_txq()
+{
+    if (_txq.size() == 1) {
+        return *_txq[0];
+    }
+    return *_txq[sched::cpu::current()->id % _txq.size()];
+}
+
+void net::kick(txq& txq)
+{
+    txq.vqueue->kick();
+}
+
 // TODO: Does it really have to be "locked"?
-int net::tx_locked(struct mbuf* m_head, bool flush)
+int net::tx_locked(txq& txq, struct mbuf* m_head, bool flush)
 {
-    DEBUG_ASSERT(_tx_ring_lock.owned(), "_tx_ring_lock is not locked!");
+    DEBUG_ASSERT(txq.tx_ring_lock.owned(), "tx_ring_lock is not locked!");
 
     debug("virtio::net::tx_locked\n");
     struct mbuf* m;
     net_req* req = new net_req;
-    vring* vq = _txq.vqueue;
+    vring* vq = txq.vqueue;
     auto vq_sg_vec = &vq->_sg_vec;
     int rc = 0;
-    struct txq_stats* stats = &_txq.stats;
+    struct txq_stats* stats = &txq.stats;
     u64 tx_bytes = 0;
 
     req->um.reset(m_head);
@@ -611,7 +820,7 @@ int net::tx_locked(struct mbuf* m_head, bool flush)
         // can't call it, this is a get buf thing
         if (vq->used_ring_not_empty()) {
             trace_virtio_net_tx_no_space_calling_gc(_ifn->if_index);
-            tx_gc();
+            tx_gc(txq);
         } else {
             net_d("%s: no room", __FUNCTION__);
             delete req;
@@ -739,11 +948,11 @@ net::tx_offload(struct mbuf* m, struct net_hdr* hdr)
     return m;
 }
 
-void net::tx_gc()
+void net::tx_gc(txq& txq)
 {
     net_req* req;
     u32 len;
-    vring* vq = _txq.vqueue;
+    vring* vq = txq.vqueue;
 
     req = static_cast<net_req*>(vq->get_buf_elem(&len));
 
@@ -769,6 +978,8 @@ u32 net::get_driver_features()
                  | (1 << VIRTIO_NET_F_HOST_TSO4)  \
                  | (1 << VIRTIO_NET_F_GUEST_ECN)
                  | (1 << VIRTIO_NET_F_GUEST_UFO)
+                 | (1 << VIRTIO_NET_F_CTRL_VQ)
+                 | (1 << VIRTIO_NET_F_MQ)
             );
 }
 
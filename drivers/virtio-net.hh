@@ -12,10 +12,17 @@
 #include <bsd/sys/net/if_var.h>
 #include <bsd/sys/net/if.h>
 #include <bsd/sys/sys/mbuf.h>
+#include <bsd/sys/netinet/in.h>
+#include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/tcp_lro.h>
 
 #include "drivers/virtio.hh"
 #include "drivers/pci-device.hh"
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 namespace virtio {
 
 /**
@@ -209,31 +216,53 @@ public:
 
     virtual u32 get_driver_features();
 
+    struct rxq;
+    struct txq;
+
     void wait_for_queue(vring* queue);
     bool bad_rx_csum(struct mbuf* m, struct net_hdr* hdr);
-    void receiver();
-    void fill_rx_ring();
-    mbuf* packet_to_mbuf(const std::vector<iovec>& iovec);
-    static void free_buffer_and_refcnt(void* buffer, void* refcnt);
-    static void free_buffer(iovec iov) { do_free_buffer(iov.iov_base); }
-    static void do_free_buffer(void* buffer);
+    void receiver(rxq& rxq);
+    void fill_rx_ring(rxq& rxq);
+    struct rx_buffer;
+    mbuf* packet_to_mbuf(const std::vector<rx_buffer*>& packet);
+
+    /**
+     * Pass a received packet up, coalescing it with the previous packets
+     * of its TCP flow if possible.
+     */
+    void rx_input(rxq& rxq, mbuf* m);
+
+    /**
+     * Pass up the packets coalesced so far.
+     */
+    void lro_flush(rxq& rxq);
+    // hook for EXT_EXTREF mbuf cleanup
+    static void free_rx_buffer(void* buf, void* unused);
 
     bool ack_irq();
 
+    /**
+     * Pick the Tx queue the current CPU should transmit on. With
+     * multiqueue each CPU has its own Tx queue, so CPUs don't contend on
+     * the same ring lock.
+     */
+    txq& select_txq();
+
     /**
      * Transmit a single mbuf.
+     * @param txq the Tx queue to transmit on
      * @param m_head a buffer to transmits
      * @param flush kick() if TRUE
-     * @note should be called under the _tx_ring_lock.
+     * @note should be called under the txq's tx_ring_lock.
      *
      * @return 0 in case of success and an appropriate error code
      *         otherwise
      */
-    int tx_locked(struct mbuf* m_head, bool flush = false);
+    int tx_locked(txq& txq, struct mbuf* m_head, bool flush = false);
 
     struct mbuf* tx_offload(struct mbuf* m, struct net_hdr* hdr);
-    void kick(int queue) {_queues[queue]->kick();}
-    void tx_gc();
+    void kick(txq& txq);
+    void tx_gc(txq& txq);
     static hw_driver* probe(hw_device* dev);
 
     /**
@@ -243,9 +272,6 @@ public:
      */
     void fill_stats(struct if_data* out_data) const;
 
-    // tx ring lock protects this ring for multiple access
-    mutex _tx_ring_lock;
-
 private:
 
     struct net_req {
@@ -281,6 +307,10 @@ private:
         u64 rx_drops;   /* if_iqdrops */
         u64 rx_csum;    /* number of packets with correct csum */
         u64 rx_csum_err;/* number of packets with a bad checksum */
+        u64 rx_pool_hits;   /* Rx buffers reused from the pool */
+        u64 rx_pool_misses; /* Rx buffers newly allocated */
+        u64 rx_lro_queued;  /* packets received into LRO */
+        u64 rx_lro_flushed; /* LRO packets passed up the stack */
     };
 
     struct txq_stats {
@@ -293,12 +323,67 @@ private:
         /* u64 tx_rescheduled; */ /* TODO when we implement xoff */
     };
 
+public:
+    class rx_pool;
+
+    /**
+     * A receive buffer: a page for the host to write a packet (or part of
+     * one) into, together with the mbuf header and reference count which
+     * pass it up the network stack, so receiving needs no allocation.
+     */
+    struct rx_buffer {
+        struct mbuf m;
+        u_int refcnt;
+        void* page;
+        rx_pool* pool;
+        rx_buffer* next;
+        // The received data, within page
+        char* data;
+        u32 len;
+    };
+
+    /**
+     * A pool of receive buffers for one Rx queue. Only the queue's
+     * receiver thread takes buffers from the pool, but buffers return to
+     * it on whichever CPU frees the last mbuf referencing them.
+     */
+    class rx_pool {
+    public:
+        explicit rx_pool(unsigned max) : _max(max) {}
+        ~rx_pool();
+
+        /**
+         * Take a buffer from the pool, allocating a new one if it is
+         * empty.
+         * @param stats the statistics of the queue owning the pool
+         */
+        rx_buffer* get(rxq_stats& stats);
+
+        /**
+         * Return a buffer to its pool, or free it if more than the pool's
+         * maximum are allocated.
+         */
+        static void put(rx_buffer* buf);
+    private:
+        // Only accessed by the receiver thread
+        rx_buffer* _free = nullptr;
+        // Buffers returned since, pushed from any CPU
+        std::atomic<rx_buffer*> _returned = { nullptr };
+        std::atomic<unsigned> _allocated = { 0 };
+        unsigned _max;
+    };
+
      /* Single Rx queue object */
     struct rxq {
-        rxq(vring* vq, std::function<void ()> poll_func)
-            : vqueue(vq), poll_task(poll_func, sched::thread::attr().name("virtio-net-rx")) {};
+        rxq(vring* vq, std::function<void ()> poll_func, sched::cpu* cpu)
+            : vqueue(vq), poll_task(poll_func, sched::thread::attr().pin(cpu).name("virtio-net-rx"))
+            , pool(vq->size() * 4) {};
         vring* vqueue;
         sched::thread  poll_task;
+        // Enough buffers for the ring, and for packets queued in sockets
+        rx_pool pool;
+        // Coalesces TCP segments received in one pass over the ring
+        struct lro_ctrl lro;
         struct rxq_stats stats = { 0 };
     };
 
@@ -306,9 +391,13 @@ private:
     struct txq {
         txq(vring* vq) : vqueue(vq) {};
         vring* vqueue;
+        // tx ring lock protects this ring for multiple access
+        mutex tx_ring_lock;
         struct txq_stats stats = { 0 };
     };
 
+private:
+
     /**
      * Fill the Rx queue statistics in the general info struct
      * @param rxq Rx queue handle
@@ -323,9 +412,25 @@ private:
      */
     void fill_qstats(const struct txq& txq, struct if_data* out_data) const;
 
-    /* We currently support only a single Rx+Tx queue */
-    struct rxq _rxq;
-    struct txq _txq;
+    /**
+     * Send a command on the control queue and wait for the host to ack it.
+     * @param cls command class (VIRTIO_NET_CTRL_*)
+     * @param cmd command within the class
+     * @param data command specific data
+     * @param len length of data
+     *
+     * @return true if the host acked the command with VIRTIO_NET_OK
+     */
+    bool ctrl_cmd(u8 cls, u8 cmd, const void* data, size_t len);
+
+    // One Rx/Tx queue pair per vCPU when VIRTIO_NET_F_MQ was negotiated,
+    // a single pair otherwise. Pair i uses virtqueues 2*i (Rx) and 2*i+1
+    // (Tx); the control queue follows the last pair the host supports.
+    std::vector<std::unique_ptr<rxq>> _rxq;
+    std::vector<std::unique_ptr<txq>> _txq;
+    vring* _ctrlq = nullptr;
+    bool _ctrl_vq = false;
+    bool _mq = false;
 
     //maintains the virtio instance number for multiple drives
     static int _instance;
@@ -12,6 +12,7 @@ fs +=	vfs/main.o \
 	vfs/vfs_bio.o \
 	vfs/vfs_conf.o \
 	vfs/vfs_lookup.o \
+	vfs/vfs_cache.o \
 	vfs/vfs_mount.o \
 	vfs/vfs_vnode.o \
 	vfs/vfs_task.o \
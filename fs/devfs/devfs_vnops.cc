@@ -201,6 +201,14 @@ devfs_readdir(struct vnode *vp, struct file *fp, struct dirent *dir)
 	return 0;
 }
 
+static int
+devfs_mount(struct mount *mp, char *dev, int flags, void *data)
+{
+	/* Devices come and go without going through the vfs */
+	mp->m_flags |= MNT_NONEGCACHE;
+	return 0;
+}
+
 static int
 devfs_unmount(struct mount *mp, int flags)
 {
@@ -222,7 +230,6 @@ devfs_getattr(struct vnode *vnode, struct vattr *attr)
 	return 0;
 }
 
-#define devfs_mount	((vfsop_mount_t)vfs_nullop)
 #define devfs_sync	((vfsop_sync_t)vfs_nullop)
 #define devfs_vget	((vfsop_vget_t)vfs_nullop)
 #define devfs_statfs	((vfsop_statfs_t)vfs_nullop)
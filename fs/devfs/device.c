@@ -108,7 +108,8 @@ void read_partition_table(struct device *dev)
 	unsigned long offset;
 	int index;
 
-	bread(dev, 0, &bp);
+	if (bread(dev, 0, &bp) != 0)
+		return;
 
 	sched_lock();
 	for (offset = 0x1be, index = 0; offset < 0x1fe; offset += 0x10, index++) {
@@ -174,6 +175,7 @@ void device_register(struct device *dev, const char *name, int flags)
 	dev->refcnt = 1;
 	dev->offset = 0;
 	dev->private_data = private;
+	dev->bcache = NULL;
 	dev->next = device_list;
 	dev->max_io_size = UINT_MAX;
 	device_list = dev;
@@ -11,10 +11,12 @@
 #include <osv/prex.h>
 #include <osv/sched.hh>
 #include <osv/mmu.hh>
+#include <osv/mempool.hh>
 
 #include <functional>
 #include <memory>
 #include <map>
+#include <sstream>
 
 namespace procfs {
 
@@ -203,6 +205,44 @@ procfs_readdir(vnode *vp, file *fp, dirent *dir)
     return ENOENT;
 }
 
+static string vfscache()
+{
+    dentry_stats ds;
+    vnode_stats vs;
+    dentry_get_stats(&ds);
+    vnode_get_stats(&vs);
+
+    ostringstream os;
+    os << "dentry_hits " << ds.ds_hits << "\n"
+       << "dentry_negative_hits " << ds.ds_negative_hits << "\n"
+       << "dentry_misses " << ds.ds_misses << "\n"
+       << "dentry_entries " << ds.ds_entries << "\n"
+       << "dentry_negative " << ds.ds_negative << "\n"
+       << "dentry_evictions " << ds.ds_evictions << "\n"
+       << "vnode_hits " << vs.vs_hits << "\n"
+       << "vnode_misses " << vs.vs_misses << "\n"
+       << "vnode_entries " << vs.vs_entries << "\n";
+    return os.str();
+}
+
+static string pageranges()
+{
+    auto s = memory::stats::page_ranges();
+
+    ostringstream os;
+    os << "free_ranges " << s.ranges << "\n"
+       << "largest_free_range " << s.largest << "\n"
+       << "large_cache_hits " << s.large_cache_hits << "\n"
+       << "large_cache_misses " << s.large_cache_misses << "\n";
+    for (unsigned i = 0; i < s.nr_lists; i++) {
+        if (s.list_ranges[i]) {
+            os << "free_ranges_" << (1ul << i) << "_pages " << s.list_ranges[i]
+               << " " << s.list_bytes[i] << "\n";
+        }
+    }
+    return os.str();
+}
+
 static int
 procfs_mount(mount* mp, char *dev, int flags, void* data)
 {
@@ -213,6 +253,8 @@ procfs_mount(mount* mp, char *dev, int flags, void* data)
 
     auto* root = new proc_dir_node(vp->v_ino);
     root->add("self", self);
+    root->add("vfscache", inode_count++, vfscache);
+    root->add("pageranges", inode_count++, pageranges);
 
     vp->v_data = static_cast<void*>(root);
 
@@ -15,17 +15,172 @@
 #include <osv/mutex.h>
 #include <osv/rcu.hh>
 
+#include <algorithm>
+#include <memory>
+#include <vector>
+
 #include <bsd/sys/sys/queue.h>
 
 using namespace osv;
 
+/*
+ * Tracks which descriptors are in use, so that the lowest free one can be
+ * found without scanning the table. Level 0 has a bit per descriptor, and
+ * bit i of level n+1 is set when word i of level n is full, so each word
+ * looked at on level n+1 skips 64 full words of level n.
+ */
+class fd_bitmap {
+public:
+    static constexpr int npos = -1;
+    // nbits must be a multiple of 64, and may only grow
+    void resize(size_t nbits);
+    // Returns the first clear bit >= from, or npos
+    int find_first_zero(size_t from) const {
+        return _levels.empty() ? npos : find_first_zero(0, from);
+    }
+    void set(size_t bit);
+    void clear(size_t bit);
+private:
+    int find_first_zero(size_t level, size_t from) const;
+private:
+    static constexpr u64 full = ~u64(0);
+    std::vector<std::vector<u64>> _levels;
+};
+
+void fd_bitmap::resize(size_t nbits)
+{
+    std::vector<u64> words;
+    if (!_levels.empty()) {
+        words = std::move(_levels[0]);
+    }
+    words.resize(nbits / 64);
+    _levels.clear();
+    _levels.push_back(std::move(words));
+    // Rebuild the summary levels from scratch; we only grow a few times.
+    while (_levels.back().size() > 1) {
+        auto& lower = _levels.back();
+        std::vector<u64> upper((lower.size() + 63) / 64);
+        for (size_t i = 0; i < lower.size(); i++) {
+            if (lower[i] == full) {
+                upper[i / 64] |= u64(1) << (i % 64);
+            }
+        }
+        _levels.push_back(std::move(upper));
+    }
+}
+
+int fd_bitmap::find_first_zero(size_t level, size_t from) const
+{
+    auto& words = _levels[level];
+    size_t w = from / 64;
+    if (w >= words.size()) {
+        return npos;
+    }
+    auto bits = words[w] | ((u64(1) << (from % 64)) - 1);
+    if (bits != full) {
+        return w * 64 + __builtin_ctzll(~bits);
+    }
+    // Nothing free in this word; find the next word which isn't full
+    if (level + 1 < _levels.size()) {
+        int next = find_first_zero(level + 1, w + 1);
+        if (next == npos) {
+            return npos;
+        }
+        w = next;
+    } else {
+        do {
+            ++w;
+        } while (w < words.size() && words[w] == full);
+    }
+    if (w >= words.size()) {
+        return npos;
+    }
+    return w * 64 + __builtin_ctzll(~words[w]);
+}
+
+void fd_bitmap::set(size_t bit)
+{
+    for (auto& words : _levels) {
+        auto& w = words[bit / 64];
+        w |= u64(1) << (bit % 64);
+        if (w != full) {
+            break;
+        }
+        bit /= 64;
+    }
+}
+
+void fd_bitmap::clear(size_t bit)
+{
+    for (auto& words : _levels) {
+        auto& w = words[bit / 64];
+        bool was_full = w == full;
+        w &= ~(u64(1) << (bit % 64));
+        if (!was_full) {
+            break;
+        }
+        bit /= 64;
+    }
+}
+
 /*
  * Global file descriptors table - in OSv we have a single process so file
  * descriptors are maintained globally.
+ *
+ * The table starts small and is replaced by a larger copy when it fills up.
+ * fget() finds it with rcu_read_lock only; everything else (including the
+ * bitmap of used descriptors) is protected by gfdt_lock.
  */
-rcu_ptr<file> gfdt[FDMAX] = {};
+struct fd_table {
+    explicit fd_table(size_t size)
+        : size(size), files(new rcu_ptr<file>[size]) {}
+    size_t size;
+    std::unique_ptr<rcu_ptr<file>[]> files;
+    fd_bitmap used;
+};
+
+static constexpr size_t fd_table_initial_size = 1024;
+
+rcu_ptr<fd_table> gfdt;
 mutex_t gfdt_lock = MUTEX_INITIALIZER;
 
+/*
+ * Returns a table with room for fd, growing it if needed, or nullptr if
+ * fd is beyond FDMAX. Must be called with gfdt_lock held.
+ *
+ * Readers may keep using the old table until a grace period has passed.
+ * They can only find in it files which were installed before it was
+ * copied, as if their lookup had happened just before the copy.
+ */
+static fd_table* fd_table_reserve(int fd)
+{
+    auto old = gfdt.read_by_owner();
+    if (old && size_t(fd) < old->size) {
+        return old;
+    }
+    if (fd >= FDMAX) {
+        return nullptr;
+    }
+    size_t size = old ? old->size : fd_table_initial_size;
+    while (size <= size_t(fd)) {
+        size *= 2;
+    }
+    size = std::min(size, size_t(FDMAX));
+    auto t = new fd_table(size);
+    if (old) {
+        for (size_t i = 0; i < old->size; i++) {
+            t->files[i].assign(old->files[i].read_by_owner());
+        }
+        t->used = old->used;
+    }
+    t->used.resize(size);
+    gfdt.assign(t);
+    if (old) {
+        rcu_dispose(old);
+    }
+    return t;
+}
+
 /*
  * Allocate a file descriptor and assign fd to it atomically.
  *
@@ -33,27 +188,28 @@ mutex_t gfdt_lock = MUTEX_INITIALIZER;
  */
 int _fdalloc(struct file *fp, int *newfd, int min_fd)
 {
-    int fd;
+    int fd = fd_bitmap::npos;
 
     fhold(fp);
 
-    for (fd = min_fd; fd < FDMAX; fd++) {
-        if (gfdt[fd])
-            continue;
-
-        WITH_LOCK(gfdt_lock) {
-            /* Now that we hold the lock,
-             * make sure the entry is still available */
-            if (gfdt[fd].read_by_owner()) {
-                continue;
-            }
-
+    WITH_LOCK(gfdt_lock) {
+        auto t = gfdt.read_by_owner();
+        if (t) {
+            fd = t->used.find_first_zero(min_fd);
+        }
+        if (fd == fd_bitmap::npos) {
+            /* Everything from min_fd up is in use; take the first
+             * descriptor past the end of the table */
+            fd = t ? std::max(int(t->size), min_fd) : min_fd;
+            t = fd_table_reserve(fd);
+        }
+        if (t) {
             /* Install */
-            gfdt[fd].assign(fp);
+            t->files[fd].assign(fp);
+            t->used.set(fd);
             *newfd = fd;
+            return 0;
         }
-
-        return 0;
     }
 
     fdrop(fp);
@@ -75,13 +231,18 @@ int fdclose(int fd)
     struct file* fp;
 
     WITH_LOCK(gfdt_lock) {
+        auto t = gfdt.read_by_owner();
+        if (fd < 0 || !t || size_t(fd) >= t->size) {
+            return EBADF;
+        }
 
-        fp = gfdt[fd].read_by_owner();
+        fp = t->files[fd].read_by_owner();
         if (fp == NULL) {
             return EBADF;
         }
 
-        gfdt[fd].assign(nullptr);
+        t->files[fd].assign(nullptr);
+        t->used.clear(fd);
     }
 
     fdrop(fp);
@@ -103,9 +264,11 @@ int fdset(int fd, struct file *fp)
     fhold(fp);
 
     WITH_LOCK(gfdt_lock) {
-        orig = gfdt[fd].read_by_owner();
+        auto t = fd_table_reserve(fd);
+        orig = t->files[fd].read_by_owner();
         /* Install new file structure in place */
-        gfdt[fd].assign(fp);
+        t->files[fd].assign(fp);
+        t->used.set(fd);
     }
 
     if (orig)
@@ -114,7 +277,7 @@ int fdset(int fd, struct file *fp)
     return 0;
 }
 
-static bool fhold_if_positive(file* f)
+bool fhold_if_positive(file* f)
 {
     auto c = f->f_count;
     // zero or negative f_count means that the file is being closed; don't
@@ -134,11 +297,16 @@ int fget(int fd, struct file **out_fp)
 {
     struct file *fp;
 
-    if (fd < 0 || fd >= FDMAX)
+    if (fd < 0)
         return EBADF;
 
     WITH_LOCK(rcu_read_lock) {
-        fp = gfdt[fd].read();
+        auto t = gfdt.read();
+        if (!t || size_t(fd) >= t->size) {
+            return EBADF;
+        }
+
+        fp = t->files[fd].read();
         if (fp == NULL) {
             return EBADF;
         }
@@ -190,9 +358,7 @@ file::~file()
 
     poll_drain(fp);
     if (f_epolls) {
-        for (auto ep : *f_epolls) {
-            epoll_file_closed(ep, this);
-        }
+        epoll_file_closed(this);
     }
 }
 
@@ -37,11 +37,71 @@ destroy_bio(struct bio *bio)
 	free(bio);
 }
 
+#define BIO_PLUG_MAX_DEVICES	8
+
+struct bio_plug {
+	int depth;
+	int ndevices;
+	struct {
+		void (*unplug)(void *);
+		void *arg;
+	} devices[BIO_PLUG_MAX_DEVICES];
+};
+
+static __thread struct bio_plug bio_plug_state;
+
+void
+bio_plug(void)
+{
+	bio_plug_state.depth++;
+}
+
+static void
+bio_flush_plug(void)
+{
+	struct bio_plug *plug = &bio_plug_state;
+
+	while (plug->ndevices > 0) {
+		plug->ndevices--;
+		plug->devices[plug->ndevices].unplug(plug->devices[plug->ndevices].arg);
+	}
+}
+
+void
+bio_unplug(void)
+{
+	assert(bio_plug_state.depth > 0);
+	if (--bio_plug_state.depth == 0)
+		bio_flush_plug();
+}
+
+bool
+bio_plugged(void (*unplug)(void *), void *arg)
+{
+	struct bio_plug *plug = &bio_plug_state;
+	int i;
+
+	if (!plug->depth)
+		return false;
+	for (i = 0; i < plug->ndevices; i++) {
+		if (plug->devices[i].unplug == unplug && plug->devices[i].arg == arg)
+			return true;
+	}
+	/* plugged into too many devices; don't hold back this one */
+	if (plug->ndevices == BIO_PLUG_MAX_DEVICES)
+		return false;
+	plug->devices[plug->ndevices].unplug = unplug;
+	plug->devices[plug->ndevices].arg = arg;
+	plug->ndevices++;
+	return true;
+}
+
 int
 bio_wait(struct bio *bio)
 {
 	int ret = 0;
 
+	bio_flush_plug();
 	pthread_mutex_lock(&bio->bio_mutex);
 	while (!(bio->bio_flags & BIO_DONE))
 		pthread_cond_wait(&bio->bio_wait, &bio->bio_mutex);
@@ -1079,6 +1079,11 @@ int dup3(int oldfd, int newfd, int flags)
         goto out_errno;
     }
 
+    if (newfd < 0 || newfd >= FDMAX) {
+        error = EBADF;
+        goto out_errno;
+    }
+
     error = fget(oldfd, &fp);
     if (error)
         goto out_errno;
@@ -1131,9 +1136,11 @@ int fcntl(int fd, int cmd, int arg)
 
     switch (cmd) {
     case F_DUPFD:
+        if (arg < 0 || arg >= FDMAX) {
+            error = EINVAL;
+            break;
+        }
         error = _fdalloc(fp, &ret, arg);
-        if (error)
-            goto out_errno;
         break;
     case F_GETFD:
         ret = fp->f_flags & FD_CLOEXEC;
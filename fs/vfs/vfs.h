@@ -138,8 +138,21 @@ int	 vfs_findroot(char *path, struct mount **mp, char **root);
 int	 fs_noop(void);
 
 struct dentry *dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path);
+struct dentry *dentry_lookup(struct mount *mp, char *path);
 void	dref(struct dentry *dp);
 void	drele(struct dentry *dp);
+void	dentry_invalidate(char *path, int subtree);
+void	dentry_evict_unused(struct vnode *vp);
+void	dentry_flush(struct mount *mp);
+void	dentry_cache_init(void);
+
+struct vnode *vn_cache_lookup(struct mount *mp, uint64_t ino);
+void	vn_cache_insert(struct vnode *vp);
+void	vn_cache_remove(struct vnode *vp);
+void	vn_cache_free(struct vnode *vp);
+void	vn_cache_foreach(void (*fn)(struct vnode *));
+
+void	pagecache_release_vnode(struct vnode *vp);
 
 #ifdef DEBUG_VFS
 void	 vnode_dump(void);
@@ -40,7 +40,8 @@ bdev_read(struct device *dev, struct uio *uio, int ioflags)
 		return 0;
     
 	while (uio->uio_resid > 0) {
-		ret = bread(dev, uio->uio_offset >> 9, &bp);
+		ret = breadn(dev, uio->uio_offset >> 9,
+			     uio->uio_resid / BSIZE, &bp);
 		if (ret)
 			return ret;
 
@@ -78,6 +79,8 @@ bdev_write(struct device *dev, struct uio *uio, int ioflags)
     
 	while (uio->uio_resid > 0) {
 		bp = getblk(dev, uio->uio_offset >> 9);
+		if (bp == NULL)
+			return ENOMEM;
 
 		ret = uiomove(bp->b_data, BSIZE, uio);
 		if (ret) {
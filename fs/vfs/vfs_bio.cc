@@ -0,0 +1,825 @@
+/*
+ * Copyright (c) 2005-2007, Kohsuke Ohtani
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * vfs_bio.cc - buffered I/O operations
+ */
+
+/*
+ * References:
+ *	Bach: The Design of the UNIX Operating System (Prentice Hall, 1986)
+ */
+
+/*
+ * Each block device gets its own buffer cache on first use: a hash table of
+ * buffers by block number, whose buckets are protected by a set of striped
+ * locks, so that I/O to different blocks doesn't serialize on one lock.
+ * A buffer which isn't busy sits on one of the two queues of its device,
+ * protected by a queue lock nested inside the bucket locks: clean buffers
+ * in LRU order, and dirty (delayed write) buffers in the order they were
+ * dirtied.
+ *
+ * Buffers are allocated on demand. Past bio_max_bufs, a miss recycles the
+ * least recently used clean buffer of the device, and the memory reclaimer
+ * may free clean buffers at any time. Dirty buffers are written back by the
+ * "bio-flusher" thread every second, or as soon as a device has more than
+ * bio_dirty_high of them; while no buffer is dirty, the flusher sleeps.
+ */
+
+#include <osv/prex.h>
+#include <osv/buf.h>
+#include <osv/bio.h>
+#include <osv/device.h>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
+#include <osv/sched.hh>
+#include <osv/mempool.hh>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <boost/intrusive/list.hpp>
+
+#include "vfs.h"
+
+namespace bi = boost::intrusive;
+
+/* minimum number of buffers to cache */
+#define NBUFS		256
+
+/* number of locks protecting the hash buckets of a device */
+#define BIO_NLOCKS	64
+
+/* maximum number of blocks read or written with one request */
+#define BIO_CLUSTER	32
+
+/* macros to clear/set/test flags. */
+#define	SET(t, f)	(t) |= (f)
+#define	CLR(t, f)	(t) &= ~(f)
+#define	ISSET(t, f)	((t) & (f))
+
+static size_t bio_max_bufs = NBUFS;
+static size_t bio_dirty_high = NBUFS / 16;
+static size_t bio_dirty_max = NBUFS / 4;
+static std::atomic<size_t> bio_nbufs;
+static std::atomic<size_t> bio_ndirty;	/* dirty buffers, all devices */
+
+static void bio_kick_flusher(bool now);
+
+LIST_HEAD(buf_list, buf);
+
+struct bio_lock {
+	mutex_t		lock;
+	condvar		wait;		/* for a busy buffer to be released */
+	unsigned	waiters = 0;
+};
+
+class bio_cache {
+public:
+    explicit bio_cache(struct device *dev);
+    struct buf *get(int blkno, bool create, bool wait);
+    void release(struct buf *bp);
+    size_t evict(size_t n);
+    void flush();
+    void invalidate();
+    size_t ndirty();
+    bi::list_member_hook<> link;
+private:
+    bio_lock& lock_of(int blkno) { return _locks[blkno & (BIO_NLOCKS - 1)]; }
+    buf_list& bucket(int blkno) { return _hash[blkno & _mask]; }
+    struct buf *lookup(int blkno);
+    bool enqueue(struct buf *bp, bool *now);
+    void dequeue(struct buf *bp);
+    bool first_dirty(int *blkno);
+private:
+    struct device *_dev;
+    bio_lock _locks[BIO_NLOCKS];
+    std::unique_ptr<buf_list[]> _hash;
+    unsigned _mask;
+    mutex _queue_lock;
+    TAILQ_HEAD(, buf) _clean;	/* least recently used first */
+    TAILQ_HEAD(, buf) _dirty;	/* least recently dirtied first */
+    size_t _ndirty = 0;
+};
+
+/*
+ * All buffer caches. Held by the reclaimer while evicting, but never
+ * across I/O, so that the reclaimer can always get it.
+ */
+static mutex bio_caches_lock;
+/* Keeps binval() from freeing a cache bio_sync() is writing back */
+static mutex bio_sync_lock;
+static bi::list<bio_cache,
+                bi::member_hook<bio_cache,
+                                bi::list_member_hook<>,
+                                &bio_cache::link>
+               > bio_caches;
+
+static struct buf *
+buf_alloc(struct device *dev, int blkno)
+{
+    struct buf *bp;
+
+    bp = static_cast<struct buf *>(malloc(sizeof(*bp)));
+    if (bp == NULL)
+        return NULL;
+    bp->b_data = malloc(BSIZE);
+    if (bp->b_data == NULL) {
+        free(bp);
+        return NULL;
+    }
+    bp->b_flags = B_BUSY;
+    bp->b_dev = dev;
+    bp->b_blkno = blkno;
+    bio_nbufs.fetch_add(1, std::memory_order_relaxed);
+    return bp;
+}
+
+static void
+buf_free(struct buf *bp)
+{
+    free(bp->b_data);
+    free(bp);
+    bio_nbufs.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static int
+rw_bufs(struct buf **bufs, int n, int rw)
+{
+    struct bio *bios[BIO_CLUSTER];
+    int error = 0;
+    int i, ret;
+
+    assert(n <= BIO_CLUSTER);
+
+    /*
+     * Submit all the bios before waiting for any, so that the
+     * driver can merge the ones for adjacent blocks.
+     */
+    bio_plug();
+    for (i = 0; i < n; i++) {
+        struct buf *bp = bufs[i];
+        struct bio *bio;
+
+        bio = alloc_bio();
+        if (!bio) {
+            error = ENOMEM;
+            break;
+        }
+        bio->bio_cmd = rw ? BIO_WRITE : BIO_READ;
+        bio->bio_dev = bp->b_dev;
+        bio->bio_data = bp->b_data;
+        bio->bio_offset = (off_t)bp->b_blkno << 9;
+        bio->bio_bcount = BSIZE;
+
+        bio->bio_dev->driver->devops->strategy(bio);
+        bios[i] = bio;
+    }
+    bio_unplug();
+
+    n = i;
+    for (i = 0; i < n; i++) {
+        ret = bio_wait(bios[i]);
+        if (ret && !error)
+            error = ret;
+        destroy_bio(bios[i]);
+    }
+    return error;
+}
+
+static int
+rw_buf(struct buf *bp, int rw)
+{
+    return rw_bufs(&bp, 1, rw);
+}
+
+bio_cache::bio_cache(struct device *dev)
+    : _dev(dev)
+{
+    size_t blocks, want;
+    unsigned n;
+
+    /* About one bucket per four buffers the device may use */
+    blocks = dev->size > 0 ? dev->size / BSIZE : bio_max_bufs;
+    want = std::min(blocks, bio_max_bufs) / 4;
+    for (n = BIO_NLOCKS; n < want && n < 65536; n *= 2)
+        ;
+    _hash.reset(new buf_list[n]());
+    _mask = n - 1;
+    TAILQ_INIT(&_clean);
+    TAILQ_INIT(&_dirty);
+}
+
+/*
+ * Determine if a block is in the cache.
+ * Called with the bucket lock held.
+ */
+struct buf *
+bio_cache::lookup(int blkno)
+{
+    struct buf *bp;
+
+    LIST_FOREACH(bp, &bucket(blkno), b_hash) {
+        if (bp->b_blkno == blkno)
+            return bp;
+    }
+    return NULL;
+}
+
+/*
+ * Queue a buffer which is no longer busy. Returns true if the flusher
+ * should be woken, either to start its periodic write back because this
+ * is the only dirty buffer, or to write back now (*now is set) because
+ * the device has too many. Called with the bucket lock held.
+ */
+bool
+bio_cache::enqueue(struct buf *bp, bool *now)
+{
+    WITH_LOCK(_queue_lock) {
+        if (ISSET(bp->b_flags, B_DELWRI)) {
+            TAILQ_INSERT_TAIL(&_dirty, bp, b_link);
+            *now = ++_ndirty > bio_dirty_high;
+            return bio_ndirty.fetch_add(1, std::memory_order_relaxed) == 0
+                || *now;
+        }
+        TAILQ_INSERT_TAIL(&_clean, bp, b_link);
+    }
+    return false;
+}
+
+/*
+ * Take a buffer off its queue, before making it busy.
+ * Called with the bucket lock held.
+ */
+void
+bio_cache::dequeue(struct buf *bp)
+{
+    WITH_LOCK(_queue_lock) {
+        if (ISSET(bp->b_flags, B_DELWRI)) {
+            TAILQ_REMOVE(&_dirty, bp, b_link);
+            _ndirty--;
+            bio_ndirty.fetch_sub(1, std::memory_order_relaxed);
+        } else {
+            TAILQ_REMOVE(&_clean, bp, b_link);
+        }
+    }
+}
+
+size_t
+bio_cache::ndirty()
+{
+    WITH_LOCK(_queue_lock) {
+        return _ndirty;
+    }
+}
+
+bool
+bio_cache::first_dirty(int *blkno)
+{
+    WITH_LOCK(_queue_lock) {
+        if (TAILQ_EMPTY(&_dirty))
+            return false;
+        *blkno = TAILQ_FIRST(&_dirty)->b_blkno;
+    }
+    return true;
+}
+
+/*
+ * Find the buffer for a block and make it busy. If the block isn't
+ * cached, return a new buffer for it if @create is set. If the buffer
+ * is busy, wait for it if @wait is set, or return NULL. Also returns
+ * NULL if a new buffer can't be allocated.
+ */
+struct buf *
+bio_cache::get(int blkno, bool create, bool wait)
+{
+    bio_lock& l = lock_of(blkno);
+    struct buf *bp, *nbp = NULL;
+
+    mutex_lock(&l.lock);
+    for (;;) {
+        bp = lookup(blkno);
+        if (bp == NULL) {
+            if (!create)
+                break;
+            if (nbp != NULL) {
+                bp = nbp;
+                nbp = NULL;
+                LIST_INSERT_HEAD(&bucket(blkno), bp, b_hash);
+                break;
+            }
+            /* Allocate with no lock held, then look again. */
+            mutex_unlock(&l.lock);
+            if (bio_nbufs.load(std::memory_order_relaxed) >= bio_max_bufs)
+                evict(1);
+            nbp = buf_alloc(_dev, blkno);
+            if (nbp == NULL)
+                return NULL;
+            mutex_lock(&l.lock);
+            continue;
+        }
+        if (!ISSET(bp->b_flags, B_BUSY)) {
+            dequeue(bp);
+            SET(bp->b_flags, B_BUSY);
+            break;
+        }
+        if (!wait) {
+            bp = NULL;
+            break;
+        }
+        l.waiters++;
+        l.wait.wait(&l.lock);
+        l.waiters--;
+    }
+    mutex_unlock(&l.lock);
+    if (nbp != NULL)
+        buf_free(nbp);
+    return bp;
+}
+
+/*
+ * Release a busy buffer. An invalid buffer is freed, others are
+ * queued for reuse or write back.
+ */
+void
+bio_cache::release(struct buf *bp)
+{
+    bio_lock& l = lock_of(bp->b_blkno);
+    bool drop, kick = false, now = false;
+
+    mutex_lock(&l.lock);
+    CLR(bp->b_flags, B_BUSY);
+    drop = ISSET(bp->b_flags, B_INVAL);
+    if (drop)
+        LIST_REMOVE(bp, b_hash);
+    else
+        kick = enqueue(bp, &now);
+    if (l.waiters)
+        l.wait.wake_all();
+    mutex_unlock(&l.lock);
+
+    if (drop)
+        buf_free(bp);
+    if (kick)
+        bio_kick_flusher(now);
+}
+
+/*
+ * Free up to @n of the least recently used clean buffers.
+ * Returns the number of buffers freed.
+ */
+size_t
+bio_cache::evict(size_t n)
+{
+    TAILQ_HEAD(, buf) victims = TAILQ_HEAD_INITIALIZER(victims);
+    struct buf *bp, *next;
+    size_t count = 0;
+
+    WITH_LOCK(_queue_lock) {
+        TAILQ_FOREACH_SAFE(bp, &_clean, b_link, next) {
+            if (count == n)
+                break;
+            bio_lock& l = lock_of(bp->b_blkno);
+            /* The bucket locks nest outside ours, don't wait for them. */
+            if (!mutex_trylock(&l.lock))
+                continue;
+            LIST_REMOVE(bp, b_hash);
+            TAILQ_REMOVE(&_clean, bp, b_link);
+            mutex_unlock(&l.lock);
+            TAILQ_INSERT_TAIL(&victims, bp, b_link);
+            count++;
+        }
+    }
+    while ((bp = TAILQ_FIRST(&victims)) != NULL) {
+        TAILQ_REMOVE(&victims, bp, b_link);
+        buf_free(bp);
+    }
+    return count;
+}
+
+/*
+ * Write back the buffers which are dirty when called, oldest first,
+ * in batches of up to BIO_CLUSTER sorted by block number. A buffer
+ * which fails to be written stays dirty, to be retried later.
+ */
+void
+bio_cache::flush()
+{
+    struct buf *batch[BIO_CLUSTER];
+    size_t todo = ndirty();
+    int blkno, error, i, n;
+
+    while (todo > 0) {
+        n = 0;
+        while (n < BIO_CLUSTER && todo > 0 && first_dirty(&blkno)) {
+            todo--;
+            struct buf *bp = get(blkno, false, true);
+            if (bp == NULL)
+                continue;
+            if (!ISSET(bp->b_flags, B_DELWRI)) {
+                release(bp);
+                continue;
+            }
+            CLR(bp->b_flags, (B_READ | B_DONE | B_DELWRI));
+            batch[n++] = bp;
+        }
+        if (n == 0)
+            break;
+        std::sort(batch, batch + n, [](struct buf *a, struct buf *b) {
+            return a->b_blkno < b->b_blkno;
+        });
+        error = rw_bufs(batch, n, 1);
+        for (i = 0; i < n; i++) {
+            if (error)
+                SET(batch[i]->b_flags, B_DELWRI);
+            else
+                SET(batch[i]->b_flags, B_DONE);
+            release(batch[i]);
+        }
+        if (error)
+            break;
+    }
+}
+
+/*
+ * Write back and free all the buffers, waiting for busy ones.
+ */
+void
+bio_cache::invalidate()
+{
+    struct buf *bp;
+    unsigned i;
+
+    flush();
+    for (i = 0; i <= _mask; i++) {
+        bio_lock& l = lock_of(i);
+        mutex_lock(&l.lock);
+        while ((bp = LIST_FIRST(&_hash[i])) != NULL) {
+            if (ISSET(bp->b_flags, B_BUSY)) {
+                l.waiters++;
+                l.wait.wait(&l.lock);
+                l.waiters--;
+                continue;
+            }
+            dequeue(bp);
+            SET(bp->b_flags, B_BUSY);
+            if (ISSET(bp->b_flags, B_DELWRI)) {
+                /* Dirtied again since flush() */
+                mutex_unlock(&l.lock);
+                bwrite(bp);
+                mutex_lock(&l.lock);
+                continue;
+            }
+            LIST_REMOVE(bp, b_hash);
+            buf_free(bp);
+        }
+        mutex_unlock(&l.lock);
+    }
+}
+
+static struct bio_cache *
+bio_cache_get(struct device *dev)
+{
+    struct bio_cache *c, *nc;
+
+    c = __atomic_load_n(&dev->bcache, __ATOMIC_ACQUIRE);
+    if (c != NULL)
+        return c;
+
+    nc = new bio_cache(dev);
+    WITH_LOCK(bio_caches_lock) {
+        c = dev->bcache;
+        if (c == NULL) {
+            c = nc;
+            nc = NULL;
+            bio_caches.push_back(*c);
+            __atomic_store_n(&dev->bcache, c, __ATOMIC_RELEASE);
+        }
+    }
+    delete nc;
+    return c;
+}
+
+/*
+ * Assign a buffer for the given block.
+ *
+ * If the appropriate block already exists in the cache,
+ * return it.  Otherwise, a new buffer is used, recycling
+ * the least recently used one if the cache is full.
+ * Returns NULL if out of memory.
+ */
+struct buf *
+getblk(struct device *dev, int blkno)
+{
+    struct buf *bp;
+
+    DPRINTF(VFSDB_BIO, ("getblk: dev=%x blkno=%d\n", dev, blkno));
+    bp = bio_cache_get(dev)->get(blkno, true, true);
+    DPRINTF(VFSDB_BIO, ("getblk: done bp=%x\n", bp));
+    return bp;
+}
+
+/*
+ * Release a buffer, with no I/O implied.
+ */
+void
+brelse(struct buf *bp)
+{
+    ASSERT(ISSET(bp->b_flags, B_BUSY));
+    DPRINTF(VFSDB_BIO, ("brelse: bp=%x dev=%x blkno=%d\n",
+                bp, bp->b_dev, bp->b_blkno));
+
+    bp->b_dev->bcache->release(bp);
+}
+
+/*
+ * Block read with cache.
+ * @dev:   device id to read from.
+ * @blkno: block number.
+ * @nblks: number of blocks the caller is going to read.
+ * @buf:   buffer pointer to be returned.
+ *
+ * An actual read operation is done only when the block
+ * isn't cached. It also reads up to @nblks - 1 of the
+ * following blocks which aren't cached, with the same
+ * request.
+ */
+int
+breadn(struct device *dev, int blkno, int nblks, struct buf **bpp)
+{
+    struct bio_cache *c = bio_cache_get(dev);
+    struct buf *bufs[BIO_CLUSTER];
+    struct buf *bp, *rbp;
+    int error, i, n;
+
+    DPRINTF(VFSDB_BIO, ("bread: dev=%x blkno=%d\n", dev, blkno));
+    bp = c->get(blkno, true, true);
+    if (bp == NULL)
+        return ENOMEM;
+
+    if (!ISSET(bp->b_flags, (B_DONE | B_DELWRI))) {
+        nblks = std::min(nblks, BIO_CLUSTER);
+        if (dev->size > 0)
+            nblks = std::min<off_t>(nblks, dev->size / BSIZE - blkno);
+        bufs[0] = bp;
+        for (n = 1; n < nblks; n++) {
+            rbp = c->get(blkno + n, true, false);
+            if (rbp == NULL)
+                break;
+            if (ISSET(rbp->b_flags, (B_DONE | B_DELWRI))) {
+                c->release(rbp);
+                break;
+            }
+            bufs[n] = rbp;
+        }
+        error = rw_bufs(bufs, n, 0);
+        for (i = n - 1; i > 0; i--) {
+            if (error) {
+                SET(bufs[i]->b_flags, B_INVAL);
+            } else {
+                CLR(bufs[i]->b_flags, B_INVAL);
+                SET(bufs[i]->b_flags, (B_READ | B_DONE));
+            }
+            c->release(bufs[i]);
+        }
+        if (error) {
+            DPRINTF(VFSDB_BIO, ("bread: i/o error\n"));
+            SET(bp->b_flags, B_INVAL);
+            brelse(bp);
+            return error;
+        }
+    }
+    CLR(bp->b_flags, B_INVAL);
+    SET(bp->b_flags, (B_READ | B_DONE));
+    DPRINTF(VFSDB_BIO, ("bread: done bp=%x\n\n", bp));
+    *bpp = bp;
+    return 0;
+}
+
+int
+bread(struct device *dev, int blkno, struct buf **bpp)
+{
+    return breadn(dev, blkno, 1, bpp);
+}
+
+/*
+ * Block write with cache.
+ * @buf:   buffer to write.
+ *
+ * The data is copied to the buffer.
+ * Then release the buffer.
+ */
+int
+bwrite(struct buf *bp)
+{
+    int error;
+
+    ASSERT(ISSET(bp->b_flags, B_BUSY));
+    DPRINTF(VFSDB_BIO, ("bwrite: dev=%x blkno=%d\n", bp->b_dev,
+                bp->b_blkno));
+
+    CLR(bp->b_flags, (B_READ | B_DONE | B_DELWRI));
+    error = rw_buf(bp, 1);
+    if (error) {
+        SET(bp->b_flags, B_INVAL);
+        brelse(bp);
+        return error;
+    }
+    SET(bp->b_flags, B_DONE);
+    brelse(bp);
+    return 0;
+}
+
+/*
+ * Delayed write.
+ *
+ * The buffer is marked dirty, but an actual I/O is not
+ * performed.  This routine should be used when the buffer
+ * is expected to be modified again soon.  The flusher
+ * thread writes it back later, unless the device already
+ * has too many dirty buffers, in which case it is written
+ * now.
+ */
+void
+bdwrite(struct buf *bp)
+{
+    ASSERT(ISSET(bp->b_flags, B_BUSY));
+
+    if (bp->b_dev->bcache->ndirty() >= bio_dirty_max) {
+        bwrite(bp);
+        return;
+    }
+    SET(bp->b_flags, B_DELWRI);
+    CLR(bp->b_flags, B_DONE);
+    brelse(bp);
+}
+
+/*
+ * Flush write-behind block
+ */
+void
+bflush(struct buf *bp)
+{
+    if (ISSET(bp->b_flags, B_DELWRI))
+        bwrite(bp);
+}
+
+/*
+ * Invalidate buffer for specified device.
+ * This is called when unmount.
+ */
+void
+binval(struct device *dev)
+{
+    struct bio_cache *c = dev->bcache;
+
+    if (c == NULL)
+        return;
+    c->invalidate();
+    WITH_LOCK(bio_sync_lock) {
+        WITH_LOCK(bio_caches_lock) {
+            bio_caches.erase(bio_caches.iterator_to(*c));
+            dev->bcache = NULL;
+        }
+    }
+    delete c;
+}
+
+/*
+ * Write back all dirty buffers.
+ * This is called by sync(), and by the flusher.
+ *
+ * The I/O is done without bio_caches_lock, which the reclaimer
+ * needs to evict clean buffers.
+ */
+void
+bio_sync(void)
+{
+    std::vector<bio_cache *> caches;
+
+    WITH_LOCK(bio_sync_lock) {
+        WITH_LOCK(bio_caches_lock) {
+            for (auto& c : bio_caches)
+                caches.push_back(&c);
+        }
+        for (auto c : caches)
+            c->flush();
+    }
+}
+
+static mutex bio_flusher_lock;
+static condvar bio_flusher_cond;
+static bool bio_flush_requested;
+
+/*
+ * Wake the flusher, to write back now if @now is set, or else in
+ * a second, if it was sleeping because nothing was dirty.
+ */
+static void
+bio_kick_flusher(bool now)
+{
+    WITH_LOCK(bio_flusher_lock) {
+        if (now)
+            bio_flush_requested = true;
+        bio_flusher_cond.wake_one();
+    }
+}
+
+static void
+bio_flusher(void)
+{
+    for (;;) {
+        WITH_LOCK(bio_flusher_lock) {
+            while (!bio_flush_requested &&
+                   bio_ndirty.load(std::memory_order_relaxed) == 0)
+                bio_flusher_cond.wait(&bio_flusher_lock);
+            if (!bio_flush_requested)
+                bio_flusher_cond.wait(&bio_flusher_lock,
+                                      std::chrono::seconds(1));
+            bio_flush_requested = false;
+        }
+        bio_sync();
+    }
+}
+
+class bio_shrinker : public memory::shrinker {
+public:
+    bio_shrinker() : shrinker("bio") {}
+    virtual size_t request_memory(size_t n) override;
+    virtual size_t release_memory(size_t n) override { return 0; }
+};
+
+size_t
+bio_shrinker::request_memory(size_t n)
+{
+    constexpr size_t bufsize = sizeof(struct buf) + BSIZE;
+    size_t freed = 0;
+
+    /* Never block the reclaimer; the lock is only held briefly. */
+    if (!bio_caches_lock.try_lock())
+        return 0;
+    for (auto& c : bio_caches) {
+        freed += c.evict((n - freed + bufsize - 1) / bufsize) * bufsize;
+        if (freed >= n)
+            break;
+    }
+    bio_caches_lock.unlock();
+    return freed;
+}
+
+/*
+ * Initialize the buffer I/O system.
+ */
+void
+bio_init(void)
+{
+    sched::thread *t;
+
+    /* Let the buffers take up to about 1/64th of memory */
+    bio_max_bufs = std::max<size_t>(NBUFS,
+                                    memory::phys_mem_size / 64 / BSIZE);
+    bio_dirty_high = bio_max_bufs / 16;
+    bio_dirty_max = bio_max_bufs / 4;
+
+    new bio_shrinker;
+    t = new sched::thread(bio_flusher,
+                          sched::thread::attr().name("bio-flusher"));
+    t->start();
+
+    DPRINTF(VFSDB_BIO, ("bio: Buffer cache size up to %dK bytes\n",
+                        BSIZE * bio_max_bufs / 1024));
+}
@@ -0,0 +1,681 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// The dentry cache (dentries by mount and path) and the vnode table (active
+// vnodes by mount and inode number).
+//
+// Both are rcu_hashtables, so lookups only take rcu_read_lock and then try
+// to grab a reference on what they found; updates are serialized by a
+// mutex. An object whose reference count has dropped to its "dead" value
+// (-1 for dentries, 0 for vnodes) is being freed, and lookups treat it as
+// missing. The memory is only freed after a grace period, so lookups can
+// safely look at an object which is being removed concurrently.
+//
+// A dentry stays cached after its last reference is dropped, together with
+// its vnode, until it is either evicted to bound the size of the cache, or
+// invalidated by a namespace change (see dentry_invalidate()). Eviction
+// picks dentries with a CLOCK approximation of LRU, which doesn't need a
+// lock on lookup. Failed lookups are cached as negative dentries, which
+// have a null d_vnode.
+//
+// Dentries are evicted and invalidated with the caller's locks held (a
+// namei() holds its directory's vnode lock), but freeing one releases
+// vnodes, which can call into the file system. So victims are handed to
+// a reaper thread, which frees them with no locks held.
+//
+// A hashed dentry's parent is always hashed too (a parent is referenced by
+// its children, so it can't be evicted first, and invalidating a directory
+// invalidates its subtree), so the hashed dentries below a directory are
+// found through the d_children lists.
+
+#include <sys/param.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <osv/dentry.h>
+#include <osv/vnode.h>
+#include <osv/mount.h>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
+#include <osv/rcu.hh>
+#include <osv/rcu-hashtable.hh>
+#include <osv/percpu.hh>
+#include <osv/preempt-lock.hh>
+#include <osv/sched.hh>
+#include <osv/mempool.hh>
+
+#include <algorithm>
+#include <vector>
+
+#include "vfs.h"
+
+using namespace osv;
+
+namespace {
+
+struct cache_counters {
+    u64 hits = 0;
+    u64 negative_hits = 0;
+    u64 misses = 0;
+};
+
+// Only updated with preemption disabled
+PERCPU(cache_counters, dentry_counters);
+PERCPU(cache_counters, vnode_counters);
+
+u64 sum(percpu<cache_counters>& counters, u64 cache_counters::*field)
+{
+    u64 ret = 0;
+    for (auto c : sched::cpus) {
+        ret += counters.for_cpu(c)->*field;
+    }
+    return ret;
+}
+
+size_t mix(size_t h, const void* p)
+{
+    return h ^ (reinterpret_cast<uintptr_t>(p) >> 4) * 0x9e3779b97f4a7c15ull;
+}
+
+size_t path_hash(mount* mp, const char* path)
+{
+    // FNV-1a
+    u64 h = 14695981039346656037ull;
+    for (; *path; path++) {
+        h = (h ^ static_cast<unsigned char>(*path)) * 1099511628211ull;
+    }
+    return mix(h, mp);
+}
+
+struct dentry_key {
+    mount* mp;
+    const char* path;
+};
+
+struct dentry_hash {
+    size_t operator()(dentry* dp) const {
+        return path_hash(dp->d_mount, dp->d_path);
+    }
+    size_t operator()(const dentry_key& k) const {
+        return path_hash(k.mp, k.path);
+    }
+};
+
+struct dentry_equal {
+    bool operator()(dentry* a, dentry* b) const {
+        return a == b;
+    }
+    bool operator()(dentry* dp, const dentry_key& k) const {
+        return dp->d_mount == k.mp && !strcmp(dp->d_path, k.path);
+    }
+};
+
+int dentry_flags(dentry* dp)
+{
+    return __atomic_load_n(&dp->d_flags, __ATOMIC_SEQ_CST);
+}
+
+// Take a reference on a dentry found by a lookup, unless it is being freed
+bool dref_if_alive(dentry* dp)
+{
+    auto c = __atomic_load_n(&dp->d_refcnt, __ATOMIC_RELAXED);
+    while (c >= 0 && !__atomic_compare_exchange_n(&dp->d_refcnt, &c, c + 1,
+            true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        // nothing to do
+    }
+    return c >= 0;
+}
+
+// Claim an unreferenced dentry for freeing; whoever succeeds frees it.
+bool dentry_claim(dentry* dp)
+{
+    int zero = 0;
+    return __atomic_compare_exchange_n(&dp->d_refcnt, &zero, -1, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+void dentry_free_memory(dentry* dp)
+{
+    free(dp->d_path);
+    free(dp);
+}
+
+void dentry_free(dentry* dp)
+{
+    if (dp->d_vnode) {
+        vn_del_name(dp->d_vnode, dp);
+    }
+    if (dp->d_parent) {
+        drele(dp->d_parent);
+    }
+    if (dp->d_vnode) {
+        vrele(dp->d_vnode);
+    }
+    rcu_defer(dentry_free_memory, dp);
+}
+
+class dentry_cache {
+    static constexpr size_t min_dentries = 1024;
+public:
+    dentry_cache();
+    dentry* lookup(mount* mp, const char* path);
+    void insert(dentry* dp);
+    void remove(dentry* dp);
+    void invalidate(mount* mp, const char* path, bool subtree);
+    void evict_unused(vnode* vp);
+    void flush(mount* mp);
+    void start_reaper();
+    void get_stats(dentry_stats* st);
+private:
+    void remove_locked(dentry* dp);
+    void unhash_locked(dentry* dp);
+    void unhash_subtree_locked(dentry* dp);
+    void shrink_locked(size_t target, std::vector<dentry*>& victims);
+    bool over_limit() const { return _table.size() > _max; }
+    void reap();
+private:
+    mutex _mtx;
+    rcu_hashtable<dentry*, dentry_hash, dentry_equal> _table;
+    // Every hashed dentry except mount roots, which are never evicted
+    TAILQ_HEAD(dentry_list, dentry) _lru;
+    // Claimed dentries waiting for the reaper to free them
+    std::vector<dentry*> _dead;
+    // Set while the reaper frees a batch it took from _dead or the LRU;
+    // _reap_gen counts the batches done.
+    bool _reaping = false;
+    u64 _reap_gen = 0;
+    condvar _reaped;
+    size_t _max = min_dentries;
+    // Set when shrinking found nothing to evict (everything is in use);
+    // cleared by the next insertion
+    bool _shrink_stalled = false;
+    size_t _negative = 0;
+    u64 _evictions = 0;
+    sched::thread* _reaper = nullptr;
+};
+
+dentry_cache::dentry_cache()
+    : _table(1024)
+{
+    TAILQ_INIT(&_lru);
+}
+
+dentry* dentry_cache::lookup(mount* mp, const char* path)
+{
+    WITH_LOCK(rcu_read_lock) {
+        auto p = _table.reader_find(dentry_key{mp, path}, dentry_hash(),
+                dentry_equal());
+        if (p && dref_if_alive(*p)) {
+            auto dp = *p;
+            if (!(dentry_flags(dp) & DF_REFERENCED)) {
+                __atomic_fetch_or(&dp->d_flags, DF_REFERENCED, __ATOMIC_RELAXED);
+            }
+            if (dp->d_vnode) {
+                dentry_counters->hits++;
+            } else {
+                dentry_counters->negative_hits++;
+            }
+            return dp;
+        }
+        dentry_counters->misses++;
+    }
+    return nullptr;
+}
+
+void dentry_cache::insert(dentry* dp)
+{
+    WITH_LOCK(_mtx) {
+        // Replaces a negative dentry, or one which raced with us
+        auto old = _table.owner_find(dentry_key{dp->d_mount, dp->d_path},
+                dentry_hash(), dentry_equal());
+        if (old) {
+            unhash_subtree_locked(*old);
+        }
+        dp->d_flags = DF_HASHED;
+        _table.emplace(dp);
+        _shrink_stalled = false;
+        if (dp->d_parent) {
+            LIST_INSERT_HEAD(&dp->d_parent->d_children, dp, d_child_link);
+            TAILQ_INSERT_TAIL(&_lru, dp, d_lru);
+            _negative += !dp->d_vnode;
+        }
+        if (over_limit() && _reaper) {
+            _reaper->wake();
+        }
+    }
+}
+
+void dentry_cache::remove_locked(dentry* dp)
+{
+    __atomic_fetch_and(&dp->d_flags, ~DF_HASHED, __ATOMIC_SEQ_CST);
+    _table.erase(dp);
+    if (dp->d_parent) {
+        LIST_REMOVE(dp, d_child_link);
+        TAILQ_REMOVE(&_lru, dp, d_lru);
+        _negative -= !dp->d_vnode;
+    }
+}
+
+// Remove a dentry from the cache. If it isn't in use, the reaper frees it;
+// otherwise, the last drele() does.
+void dentry_cache::unhash_locked(dentry* dp)
+{
+    remove_locked(dp);
+    if (dentry_claim(dp)) {
+        _dead.push_back(dp);
+        if (_reaper) {
+            _reaper->wake();
+        }
+    }
+}
+
+// Unhash dp and every hashed dentry below it. The children keep their
+// parents alive until they are freed, so walking them is safe.
+void dentry_cache::unhash_subtree_locked(dentry* dp)
+{
+    std::vector<dentry*> todo{dp};
+    while (!todo.empty()) {
+        auto d = todo.back();
+        todo.pop_back();
+        dentry* c;
+        LIST_FOREACH(c, &d->d_children, d_child_link) {
+            todo.push_back(c);
+        }
+        unhash_locked(d);
+    }
+}
+
+// Called by drele() after claiming a dentry which isn't cached
+void dentry_cache::remove(dentry* dp)
+{
+    WITH_LOCK(_mtx) {
+        if (dentry_flags(dp) & DF_HASHED) {
+            remove_locked(dp);
+        }
+    }
+}
+
+void dentry_cache::shrink_locked(size_t target, std::vector<dentry*>& victims)
+{
+    // Each dentry in use or recently looked up goes back to the tail,
+    // so two passes over the list are enough to find every victim.
+    auto scan = 2 * _table.size();
+    while (_table.size() > target && scan-- && !TAILQ_EMPTY(&_lru)) {
+        auto dp = TAILQ_FIRST(&_lru);
+        if (!(dentry_flags(dp) & DF_REFERENCED) && dentry_claim(dp)) {
+            remove_locked(dp);
+            victims.push_back(dp);
+            _evictions++;
+            continue;
+        }
+        __atomic_fetch_and(&dp->d_flags, ~DF_REFERENCED, __ATOMIC_RELAXED);
+        TAILQ_REMOVE(&_lru, dp, d_lru);
+        TAILQ_INSERT_TAIL(&_lru, dp, d_lru);
+    }
+}
+
+// Remove path, and if subtree is set, everything below it
+void dentry_cache::invalidate(mount* mp, const char* path, bool subtree)
+{
+    WITH_LOCK(_mtx) {
+        auto p = _table.owner_find(dentry_key{mp, path}, dentry_hash(),
+                dentry_equal());
+        // Nothing below an uncached path is cached
+        if (!p) {
+            return;
+        }
+        if (subtree) {
+            unhash_subtree_locked(*p);
+        } else {
+            unhash_locked(*p);
+        }
+    }
+}
+
+// Free the cached, unused dentries pointing at vp, so that they don't
+// count in vcount(). The caller must hold vp's lock.
+void dentry_cache::evict_unused(vnode* vp)
+{
+    std::vector<dentry*> victims;
+    WITH_LOCK(_mtx) {
+        dentry* dp;
+        LIST_FOREACH(dp, &vp->v_names, d_names_link) {
+            if (dp->d_parent && (dentry_flags(dp) & DF_HASHED) &&
+                    dentry_claim(dp)) {
+                remove_locked(dp);
+                victims.push_back(dp);
+            }
+        }
+    }
+    for (auto dp : victims) {
+        dentry_free(dp);
+    }
+}
+
+// Free every unused dentry of mp, before it is unmounted. Freeing a
+// dentry may leave its parent unused, so repeat until nothing is left.
+void dentry_cache::flush(mount* mp)
+{
+    for (;;) {
+        std::vector<dentry*> victims;
+        WITH_LOCK(_mtx) {
+            // A batch the reaper already took may hold dentries of mp, and
+            // freeing them still uses mp, so wait for it to be done
+            auto gen = _reap_gen;
+            while (_reaping && _reap_gen == gen) {
+                _reaped.wait(_mtx);
+            }
+            auto it = std::partition(_dead.begin(), _dead.end(),
+                    [=] (dentry* dp) { return dp->d_mount != mp; });
+            victims.assign(it, _dead.end());
+            _dead.erase(it, _dead.end());
+            dentry *dp, *next;
+            TAILQ_FOREACH_SAFE(dp, &_lru, d_lru, next) {
+                if (dp->d_mount == mp && dentry_claim(dp)) {
+                    remove_locked(dp);
+                    victims.push_back(dp);
+                }
+            }
+        }
+        if (victims.empty()) {
+            return;
+        }
+        for (auto dp : victims) {
+            dentry_free(dp);
+        }
+    }
+}
+
+void dentry_cache::reap()
+{
+    using namespace osv::clock::literals;
+    for (;;) {
+        std::vector<dentry*> victims;
+        WITH_LOCK(_mtx) {
+            // While shrinking is stalled, retry after an insertion, or
+            // after a while, as dropping the last reference to a dentry
+            // doesn't tell us
+            sched::timer tmr(*sched::thread::current());
+            if (_shrink_stalled) {
+                tmr.set(100_ms);
+            }
+            sched::thread::wait_until(_mtx, [&] {
+                return !_dead.empty() ||
+                        (over_limit() && (!_shrink_stalled || tmr.expired()));
+            });
+            victims.swap(_dead);
+            if (over_limit()) {
+                // Leave some room, so we aren't woken for every insertion
+                auto ndead = victims.size();
+                shrink_locked(_max - _max / 8, victims);
+                _shrink_stalled = victims.size() == ndead;
+            }
+            _reaping = true;
+        }
+        for (auto dp : victims) {
+            dentry_free(dp);
+        }
+        WITH_LOCK(_mtx) {
+            _reaping = false;
+            _reap_gen++;
+            _reaped.wake_all();
+        }
+    }
+}
+
+void dentry_cache::start_reaper()
+{
+    // Allow about one cached dentry (with its vnode and the file system's
+    // inode) per 16K of memory, but at least min_dentries
+    WITH_LOCK(_mtx) {
+        _max = std::max(size_t(min_dentries), memory::phys_mem_size / 16384);
+    }
+    _reaper = new sched::thread([this] { reap(); },
+            sched::thread::attr().name("dentry-reaper"));
+    _reaper->start();
+}
+
+void dentry_cache::get_stats(dentry_stats* st)
+{
+    st->ds_hits = sum(dentry_counters, &cache_counters::hits);
+    st->ds_negative_hits = sum(dentry_counters, &cache_counters::negative_hits);
+    st->ds_misses = sum(dentry_counters, &cache_counters::misses);
+    WITH_LOCK(_mtx) {
+        st->ds_entries = _table.size();
+        st->ds_negative = _negative;
+        st->ds_evictions = _evictions;
+    }
+}
+
+dentry_cache dcache;
+
+struct vnode_key {
+    mount* mp;
+    uint64_t ino;
+};
+
+struct vnode_hash {
+    size_t operator()(vnode* vp) const {
+        return mix(vp->v_ino, vp->v_mount);
+    }
+    size_t operator()(const vnode_key& k) const {
+        return mix(k.ino, k.mp);
+    }
+};
+
+struct vnode_equal {
+    bool operator()(vnode* a, vnode* b) const {
+        return a == b;
+    }
+    // Skips vnodes which are being freed; a new vnode for the same inode
+    // may be in the table next to them.
+    bool operator()(vnode* vp, const vnode_key& k) const {
+        return vp->v_mount == k.mp && vp->v_ino == k.ino &&
+                __atomic_load_n(&vp->v_refcnt, __ATOMIC_RELAXED) > 0;
+    }
+};
+
+// Updates are serialized by vnode_lock in vfs_vnode.c
+rcu_hashtable<vnode*, vnode_hash, vnode_equal> vnode_table(1024);
+
+void vnode_free_memory(vnode* vp)
+{
+    free(vp);
+}
+
+bool vref_if_positive(vnode* vp)
+{
+    auto c = __atomic_load_n(&vp->v_refcnt, __ATOMIC_RELAXED);
+    while (c > 0 && !__atomic_compare_exchange_n(&vp->v_refcnt, &c, c + 1,
+            true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        // nothing to do
+    }
+    return c > 0;
+}
+
+}
+
+struct dentry *
+dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path)
+{
+    auto dp = static_cast<dentry*>(calloc(sizeof(dentry), 1));
+    if (!dp) {
+        return nullptr;
+    }
+    dp->d_path = strdup(path);
+    if (!dp->d_path) {
+        free(dp);
+        return nullptr;
+    }
+
+    if (vp) {
+        vref(vp);
+    }
+
+    dp->d_refcnt = 1;
+    dp->d_vnode = vp;
+    dp->d_mount = vp ? vp->v_mount : parent_dp->d_mount;
+
+    if (parent_dp) {
+        dref(parent_dp);
+    }
+    dp->d_parent = parent_dp;
+
+    if (vp) {
+        vn_add_name(vp, dp);
+    }
+
+    dcache.insert(dp);
+    return dp;
+}
+
+/*
+ * Returns a referenced dentry for path, which may be negative, or NULL
+ * if nothing is cached.
+ */
+struct dentry *
+dentry_lookup(struct mount *mp, char *path)
+{
+    return dcache.lookup(mp, path);
+}
+
+void
+dref(struct dentry *dp)
+{
+    ASSERT(dp);
+    ASSERT(dp->d_refcnt > 0);
+
+    __atomic_add_fetch(&dp->d_refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void
+drele(struct dentry *dp)
+{
+    ASSERT(dp);
+    ASSERT(dp->d_refcnt > 0);
+
+    if (__atomic_sub_fetch(&dp->d_refcnt, 1, __ATOMIC_SEQ_CST) > 0) {
+        return;
+    }
+    /* Unused dentries stay cached, except for mount roots and dentries
+     * which were invalidated while in use. */
+    if (dp->d_parent && (dentry_flags(dp) & DF_HASHED)) {
+        return;
+    }
+    if (!dentry_claim(dp)) {
+        return;
+    }
+    dcache.remove(dp);
+    dentry_free(dp);
+}
+
+/*
+ * Drop the cached dentries for a path which was created, removed or
+ * renamed, and if subtree is set, for everything below it. Must be called
+ * with the parent directory's vnode locked, so namei() can't cache the
+ * path again before the change is visible.
+ */
+void
+dentry_invalidate(char *path, int subtree)
+{
+    struct mount *mp;
+    char *p;
+    char node[PATH_MAX];
+    size_t len;
+
+    if (vfs_findroot(path, &mp, &p)) {
+        return;
+    }
+    /* Same key as namei() uses */
+    strlcpy(node, "/", sizeof(node));
+    strlcat(node, p, sizeof(node));
+    len = strlen(node);
+    while (len > 1 && node[len - 1] == '/') {
+        node[--len] = '\0';
+    }
+    dcache.invalidate(mp, node, subtree);
+}
+
+void
+dentry_evict_unused(struct vnode *vp)
+{
+    dcache.evict_unused(vp);
+}
+
+void
+dentry_flush(struct mount *mp)
+{
+    dcache.flush(mp);
+}
+
+void
+dentry_cache_init(void)
+{
+    dcache.start_reaper();
+}
+
+void
+dentry_get_stats(struct dentry_stats *st)
+{
+    dcache.get_stats(st);
+}
+
+/*
+ * Returns a referenced vnode for the given mount point and inode number,
+ * or NULL if it isn't active.
+ */
+struct vnode *
+vn_cache_lookup(struct mount *mp, uint64_t ino)
+{
+    WITH_LOCK(rcu_read_lock) {
+        auto p = vnode_table.reader_find(vnode_key{mp, ino}, vnode_hash(),
+                vnode_equal());
+        if (p && vref_if_positive(*p)) {
+            vnode_counters->hits++;
+            return *p;
+        }
+    }
+    return nullptr;
+}
+
+void
+vn_cache_insert(struct vnode *vp)
+{
+    vnode_table.emplace(vp);
+    WITH_LOCK(preempt_lock) {
+        vnode_counters->misses++;
+    }
+}
+
+void
+vn_cache_remove(struct vnode *vp)
+{
+    vnode_table.erase(vp);
+}
+
+/*
+ * Free a vnode removed from the table, once lookups can no longer see it
+ */
+void
+vn_cache_free(struct vnode *vp)
+{
+    rcu_defer(vnode_free_memory, vp);
+}
+
+void
+vn_cache_foreach(void (*fn)(struct vnode *))
+{
+    vnode_table.owner_for_each(fn);
+}
+
+void
+vnode_get_stats(struct vnode_stats *st)
+{
+    st->vs_hits = sum(vnode_counters, &cache_counters::hits);
+    st->vs_misses = sum(vnode_counters, &cache_counters::misses);
+    st->vs_entries = vnode_table.size();
+}
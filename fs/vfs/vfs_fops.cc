@@ -13,6 +13,7 @@
 #include <fs/vfs/vfs.h>
 #include <osv/vfs_file.hh>
 #include <osv/mmu.hh>
+#include <osv/pagecache.hh>
 
 vfs_file::vfs_file(unsigned flags)
 	: file(flags, DTYPE_VNODE)
@@ -83,11 +84,21 @@ int vfs_file::write(struct uio *uio, int flags)
 	if ((flags & FOF_OFFSET) == 0)
 	        uio->uio_offset = fp->f_offset;
 
+	// The write consumes the iovecs, but we need them to update the
+	// page cache. A read into the cache which starts after this check
+	// waits for the vnode lock, so it will see this write.
+	std::vector<iovec> iov;
+	if (vp->v_type == VREG && pagecache::cached(vp))
+		iov.assign(uio->uio_iov, uio->uio_iov + uio->uio_iovcnt);
+
 	error = VOP_WRITE(vp, uio, ioflags);
 	if (!error) {
 		count = bytes - uio->uio_resid;
 		if ((flags & FOF_OFFSET) == 0)
 			fp->f_offset += count;
+		if (!iov.empty())
+			pagecache::write(vp, iov.data(), iov.size(),
+					 uio->uio_offset - count, count);
 	}
 
 	vn_unlock(vp);
@@ -36,113 +36,6 @@
 #include <osv/vnode.h>
 #include "vfs.h"
 
-#define DENTRY_BUCKETS 32
-
-static LIST_HEAD(dentry_hash_head, dentry) dentry_hash_table[DENTRY_BUCKETS];
-static struct mutex dentry_hash_lock;
-
-/*
- * Get the hash value from the mount point and path name.
- * XXX: replace with a better hash for 64-bit pointers.
- */
-static u_int
-dentry_hash(struct mount *mp, const char *path)
-{
-    u_int val = 0;
-
-    if (path) {
-        while (*path) {
-            val = ((val << 5) + val) + *path++;
-        }
-    }
-    return (val ^ (unsigned long) mp) & (DENTRY_BUCKETS - 1);
-}
-
-
-struct dentry *
-dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path)
-{
-    struct mount *mp = vp->v_mount;
-    struct dentry *dp = calloc(sizeof(*dp), 1);
-
-    if (!dp) {
-        return NULL;
-    }
-
-    vp->v_refcnt++;
-
-    dp->d_refcnt = 1;
-    dp->d_vnode = vp;
-    dp->d_mount = mp;
-    dp->d_path = strdup(path);
-
-    if (parent_dp) {
-        dref(parent_dp);
-    }
-    dp->d_parent = parent_dp;
-
-    vn_add_name(vp, dp);
-
-    mutex_lock(&dentry_hash_lock);
-    LIST_INSERT_HEAD(&dentry_hash_table[dentry_hash(mp, path)], dp, d_link);
-    mutex_unlock(&dentry_hash_lock);
-    return dp;
-};
-
-static struct dentry *
-dentry_lookup(struct mount *mp, char *path)
-{
-    struct dentry *dp;
-
-    mutex_lock(&dentry_hash_lock);
-    LIST_FOREACH(dp, &dentry_hash_table[dentry_hash(mp, path)], d_link) {
-        if (dp->d_mount == mp && !strncmp(dp->d_path, path, PATH_MAX)) {
-            dp->d_refcnt++;
-            mutex_unlock(&dentry_hash_lock);
-            return dp;
-        }
-    }
-    mutex_unlock(&dentry_hash_lock);
-    return NULL;                /* not found */
-}
-
-void
-dref(struct dentry *dp)
-{
-    ASSERT(dp);
-    ASSERT(dp->d_refcnt > 0);
-
-    mutex_lock(&dentry_hash_lock);
-    dp->d_refcnt++;
-    mutex_unlock(&dentry_hash_lock);
-}
-
-void
-drele(struct dentry *dp)
-{
-    ASSERT(dp);
-    ASSERT(dp->d_refcnt > 0);
-
-    mutex_lock(&dentry_hash_lock);
-    if (--dp->d_refcnt) {
-        mutex_unlock(&dentry_hash_lock);
-        return;
-    }
-    LIST_REMOVE(dp, d_link);
-    vn_del_name(dp->d_vnode, dp);
-
-    mutex_unlock(&dentry_hash_lock);
-
-    if (dp->d_parent) {
-        drele(dp->d_parent);
-    }
-
-    vrele(dp->d_vnode);
-
-    free(dp->d_path);
-    free(dp);
-}
-
 /*
  * Convert a pathname into a pointer to a dentry
  *
@@ -173,6 +66,11 @@ namei(char *path, struct dentry **dpp)
     strlcat(node, p, sizeof(node));
     dp = dentry_lookup(mp, node);
     if (dp) {
+        if (!dp->d_vnode) {
+            /* Cached failed lookup */
+            drele(dp);
+            return ENOENT;
+        }
         /* vnode is already active. */
         *dpp = dp;
         return 0;
@@ -218,10 +116,23 @@ namei(char *path, struct dentry **dpp)
         dvp = ddp->d_vnode;
         vn_lock(dvp);
         dp = dentry_lookup(mp, node);
+        if (dp && !dp->d_vnode) {
+            drele(dp);
+            vn_unlock(dvp);
+            drele(ddp);
+            return ENOENT;
+        }
         if (dp == NULL) {
             /* Find a vnode in this directory. */
             error = VOP_LOOKUP(dvp, name, &vp);
             if (error) {
+                /* Remember that it doesn't exist, with a negative dentry */
+                if (error == ENOENT && !(mp->m_flags & MNT_NONEGCACHE)) {
+                    dp = dentry_alloc(ddp, NULL, node);
+                    if (dp) {
+                        drele(dp);
+                    }
+                }
                 vn_unlock(dvp);
                 drele(ddp);
                 return error;
@@ -315,15 +226,11 @@ lookup(char *path, struct dentry **dpp, char **name)
 }
 
 /*
- * vnode_init() is called once (from vfs_init)
+ * lookup_init() is called once (from vfs_init)
  * in initialization.
  */
 void
 lookup_init(void)
 {
-    int i;
-
-    for (i = 0; i < DENTRY_BUCKETS; i++) {
-        LIST_INIT(&dentry_hash_table[i]);
-    }
+    dentry_cache_init();
 }
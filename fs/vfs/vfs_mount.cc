@@ -46,6 +46,7 @@
 #include <osv/prex.h>
 #include <osv/vnode.h>
 #include <osv/device.h>
+#include <osv/buf.h>
 #include <osv/debug.h>
 #include "vfs.h"
 
@@ -214,6 +215,9 @@ sys_mount(char *dev, char *dir, char *fsname, int flags, void *data)
 void
 release_mp_dentries(struct mount *mp)
 {
+    /* Drop the unused dentries which the cache keeps */
+    dentry_flush(mp);
+
     /* Decrement referece count of root vnode */
     if (mp->m_covered) {
         drele(mp->m_covered);
@@ -261,13 +265,11 @@ found:
         goto out;
     LIST_REMOVE(mp, m_link);
 
-#ifdef HAVE_BUFFERS
-    /* Flush all buffers */
-    binval(mp->m_dev);
-#endif
-
-    if (mp->m_dev)
+    if (mp->m_dev) {
+        /* Flush all buffers */
+        binval(mp->m_dev);
         device_close(mp->m_dev);
+    }
     free(mp);
  out:
     MOUNT_UNLOCK();
@@ -340,9 +342,7 @@ sys_sync(void)
     LIST_FOREACH(mp, &mount_list, m_link)
         VFS_SYNC(mp);
     MOUNT_UNLOCK();
-#ifdef HAVE_BUFFERS
     bio_sync();
-#endif
     return 0;
 }
 
@@ -53,6 +53,7 @@
 #include <osv/prex.h>
 #include <osv/vnode.h>
 #include <osv/vfs_file.hh>
+#include <osv/pagecache.hh>
 #include "vfs.h"
 #include <fs/fs.hh>
 
@@ -85,6 +86,8 @@ sys_open(char *path, int flags, mode_t mode, struct file **fpp)
 			mode &= ~S_IFMT;
 			mode |= S_IFREG;
 			error = VOP_CREATE(ddp->d_vnode, filename, mode);
+			if (!error)
+				dentry_invalidate(path, 0);
 			vn_unlock(ddp->d_vnode);
 			drele(ddp);
 
@@ -142,6 +145,7 @@ sys_open(char *path, int flags, mode_t mode, struct file **fpp)
 		error = VOP_TRUNCATE(vp, 0);
 		if (error)
 			goto out_vn_unlock;
+		pagecache::truncate(vp, 0);
 	}
 
 	try {
@@ -489,6 +493,8 @@ sys_mkdir(char *path, mode_t mode)
 	mode |= S_IFDIR;
 
 	error = VOP_MKDIR(ddp->d_vnode, name, mode);
+	if (!error)
+		dentry_invalidate(path, 0);
  out:
 	vn_unlock(ddp->d_vnode);
 	drele(ddp);
@@ -528,6 +534,8 @@ sys_rmdir(char *path)
 
 	vn_lock(ddp->d_vnode);
 	error = VOP_RMDIR(ddp->d_vnode, vp, name);
+	if (!error)
+		dentry_invalidate(path, 1);
 	vn_unlock(ddp->d_vnode);
 
 	vn_unlock(vp);
@@ -577,6 +585,8 @@ sys_mknod(char *path, mode_t mode)
 		error = VOP_MKDIR(ddp->d_vnode, name, mode);
 	else
 		error = VOP_CREATE(ddp->d_vnode, name, mode);
+	if (!error)
+		dentry_invalidate(path, 0);
  out:
 	vn_unlock(ddp->d_vnode);
 	drele(ddp);
@@ -620,6 +630,7 @@ sys_rename(char *src, char *dest)
 	struct dentry *dp1, *dp2 = 0, *ddp1, *ddp2;
 	struct vnode *vp1, *vp2 = 0, *dvp1, *dvp2;
 	char *sname, *dname;
+	char dest_path[PATH_MAX];
 	int error;
 	char root[] = "/";
 
@@ -635,7 +646,8 @@ sys_rename(char *src, char *dest)
 	if ((error = vn_access(vp1, VWRITE)) != 0)
 		goto err1;
 
-	/* Is the source busy ? */
+	/* Is the source busy ? Unused cached names don't count. */
+	dentry_evict_unused(vp1);
 	if (vcount(vp1) >= 2) {
 		error = EBUSY;
 		goto err1;
@@ -661,6 +673,7 @@ sys_rename(char *src, char *dest)
 			goto err2;
 		}
 
+		dentry_evict_unused(vp2);
 		if (vcount(vp2) >= 2) {
 			error = EBUSY;
 			goto err2;
@@ -690,6 +703,7 @@ sys_rename(char *src, char *dest)
 		goto err2;
 	}
 
+	strlcpy(dest_path, dest, sizeof(dest_path));
 	dname = strrchr(dest, '/');
 	if (dname == NULL) {
 		error = ENOTDIR;
@@ -720,6 +734,10 @@ sys_rename(char *src, char *dest)
 	}
 
 	error = VOP_RENAME(dvp1, vp1, sname, dvp2, vp2, dname);
+	if (!error) {
+		dentry_invalidate(src, vp1->v_type == VDIR);
+		dentry_invalidate(dest_path, vp1->v_type == VDIR);
+	}
  err4:
 	vn_unlock(dvp2);
 	drele(ddp2);
@@ -789,6 +807,8 @@ sys_link(char *oldpath, char *newpath)
 	}
 
 	error = VOP_LINK(newdirdp->d_vnode, vp, name);
+	if (!error)
+		dentry_invalidate(newpath, 0);
  out1:
 	vn_unlock(newdirdp->d_vnode);
 	drele(newdirdp);
@@ -831,6 +851,8 @@ sys_unlink(char *path)
 
 	vn_lock(ddp->d_vnode);
 	error = VOP_REMOVE(ddp->d_vnode, vp, name);
+	if (!error)
+		dentry_invalidate(path, 0);
 	vn_unlock(ddp->d_vnode);
 
 	vn_unlock(vp);
@@ -935,6 +957,8 @@ sys_truncate(char *path, off_t length)
 
 	vn_lock(dp->d_vnode);
 	error = VOP_TRUNCATE(dp->d_vnode, length);
+	if (!error)
+		pagecache::truncate(dp->d_vnode, length);
 	vn_unlock(dp->d_vnode);
 
 	drele(dp);
@@ -953,6 +977,8 @@ sys_ftruncate(struct file *fp, off_t length)
 	vp = fp->f_dentry->d_vnode;
 	vn_lock(vp);
 	error = VOP_TRUNCATE(vp, length);
+	if (!error)
+		pagecache::truncate(vp, length);
 	vn_unlock(vp);
 
 	return error;
@@ -65,56 +65,36 @@ int vttoif_tab[10] = {
  * vrele      -1        *
  */
 
-#define VNODE_BUCKETS 32		/* size of vnode hash table */
-
 /*
  * vnode table.
- * All active (opened) vnodes are stored on this hash table.
- * They can be accessed by its path name.
+ * All active (opened) vnodes are stored in a hash table (see
+ * vfs_cache.cc), which can be searched without a lock.
  */
-static LIST_HEAD(vnode_hash_head, vnode) vnode_table[VNODE_BUCKETS];
 
 /*
- * Global lock to access all vnodes and vnode table.
- * If a vnode is already locked, there is no need to
- * lock this global lock to access internal data.
+ * Global lock to add and remove vnodes from the vnode table. The
+ * reference count of a vnode is updated atomically; once it drops to
+ * zero, lookups can no longer find the vnode.
  */
 static mutex_t vnode_lock = MUTEX_INITIALIZER;
 #define VNODE_LOCK()	mutex_lock(&vnode_lock)
 #define VNODE_UNLOCK()	mutex_unlock(&vnode_lock)
-#define VNODE_OWNED()	mutex_owned(&vnode_lock)
-
-/*
- * Get the hash value from the mount point and path name.
- * XXX(hch): replace with a better hash for 64-bit pointers.
- */
-static u_int
-vn_hash(struct mount *mp, uint64_t ino)
-{
-	return (ino ^ (unsigned long)mp) & (VNODE_BUCKETS - 1);
-}
 
 /*
  * Returns locked vnode for specified mount point and path.
  * vn_lock() will increment the reference count of vnode.
- *
- * Locking: VNODE_LOCK must be held.
  */
 struct vnode *
 vn_lookup(struct mount *mp, uint64_t ino)
 {
 	struct vnode *vp;
 
-	assert(VNODE_OWNED());
-	LIST_FOREACH(vp, &vnode_table[vn_hash(mp, ino)], v_link) {
-		if (vp->v_mount == mp && vp->v_ino == ino) {
-			vp->v_refcnt++;
-			mutex_lock(&vp->v_lock);
-			vp->v_nrlocks++;
-			return vp;
-		}
+	vp = vn_cache_lookup(mp, ino);
+	if (vp) {
+		mutex_lock(&vp->v_lock);
+		vp->v_nrlocks++;
 	}
-	return NULL;		/* not found */
+	return vp;
 }
 
 /*
@@ -161,8 +141,15 @@ vget(struct mount *mp, uint64_t ino, struct vnode **vpp)
 
 	DPRINTF(VFSDB_VNODE, ("vget %LLu\n", ino));
 
+	vp = vn_lookup(mp, ino);
+	if (vp) {
+		*vpp = vp;
+		return 1;
+	}
+
 	VNODE_LOCK();
 
+	/* Somebody may have added it since we looked */
 	vp = vn_lookup(mp, ino);
 	if (vp) {
 		VNODE_UNLOCK();
@@ -198,7 +185,7 @@ vget(struct mount *mp, uint64_t ino, struct vnode **vpp)
 	mutex_lock(&vp->v_lock);
 	vp->v_nrlocks++;
 
-	LIST_INSERT_HEAD(&vnode_table[vn_hash(mp, ino)], vp, v_link);
+	vn_cache_insert(vp);
 	VNODE_UNLOCK();
 
 	*vpp = vp;
@@ -218,16 +205,16 @@ vput(struct vnode *vp)
 	DPRINTF(VFSDB_VNODE, ("vput: ref=%d %s\n", vp->v_refcnt,
 			      vp->v_path));
 
-	VNODE_LOCK();
-	vp->v_refcnt--;
-	if (vp->v_refcnt > 0) {
-	    VNODE_UNLOCK();
+	if (__atomic_sub_fetch(&vp->v_refcnt, 1, __ATOMIC_SEQ_CST) > 0) {
 		vn_unlock(vp);
 		return;
 	}
-	LIST_REMOVE(vp, v_link);
+	VNODE_LOCK();
+	vn_cache_remove(vp);
 	VNODE_UNLOCK();
 
+	pagecache_release_vnode(vp);
+
 	/*
 	 * Deallocate fs specific vnode data
 	 */
@@ -238,7 +225,7 @@ vput(struct vnode *vp)
 	ASSERT(vp->v_nrlocks == 0);
 	mutex_unlock(&vp->v_lock);
 	mutex_destroy(&vp->v_lock);
-	free(vp);
+	vn_cache_free(vp);
 }
 
 /*
@@ -250,10 +237,8 @@ vref(struct vnode *vp)
 	ASSERT(vp);
 	ASSERT(vp->v_refcnt > 0);	/* Need vget */
 
-	VNODE_LOCK();
 	DPRINTF(VFSDB_VNODE, ("vref: ref=%d\n", vp->v_refcnt));
-	vp->v_refcnt++;
-	VNODE_UNLOCK();
+	__atomic_add_fetch(&vp->v_refcnt, 1, __ATOMIC_RELAXED);
 }
 
 /*
@@ -268,23 +253,23 @@ vrele(struct vnode *vp)
 	ASSERT(vp);
 	ASSERT(vp->v_refcnt > 0);
 
-	VNODE_LOCK();
 	DPRINTF(VFSDB_VNODE, ("vrele: ref=%d\n", vp->v_refcnt));
-	vp->v_refcnt--;
-	if (vp->v_refcnt > 0) {
-		VNODE_UNLOCK();
+	if (__atomic_sub_fetch(&vp->v_refcnt, 1, __ATOMIC_SEQ_CST) > 0) {
 		return;
 	}
-	LIST_REMOVE(vp, v_link);
+	VNODE_LOCK();
+	vn_cache_remove(vp);
 	VNODE_UNLOCK();
 
+	pagecache_release_vnode(vp);
+
 	/*
 	 * Deallocate fs specific vnode data
 	 */
 	VOP_INACTIVE(vp);
 	vfs_unbusy(vp->v_mount);
 	mutex_destroy(&vp->v_lock);
-	free(vp);
+	vn_cache_free(vp);
 }
 
 /*
@@ -427,33 +412,31 @@ vn_access(struct vnode *vp, int flags)
 }
 
 #ifdef DEBUG_VFS
+static void
+vnode_dump_one(struct vnode *vp)
+{
+	struct mount *mp = vp->v_mount;
+	char type[][6] = { "VNON ", "VREG ", "VDIR ", "VBLK ", "VCHR ",
+			   "VLNK ", "VSOCK", "VFIFO" };
+
+	dprintf(" %08x %08x %s %6d %8d %s%s\n", (u_int)vp,
+		(u_int)mp, type[vp->v_type], vp->v_refcnt,
+		(strlen(mp->m_path) == 1) ? "\0" : mp->m_path,
+		vp->v_path);
+}
+
 /*
  * Dump all all vnode.
  */
 void
 vnode_dump(void)
 {
-	int i;
-	struct vnode *vp;
-	struct mount *mp;
-	char type[][6] = { "VNON ", "VREG ", "VDIR ", "VBLK ", "VCHR ",
-			   "VLNK ", "VSOCK", "VFIFO" };
-
 	VNODE_LOCK();
 	dprintf("Dump vnode\n");
 	dprintf(" vnode    mount    type  refcnt blkno    path\n");
 	dprintf(" -------- -------- ----- ------ -------- ------------------------------\n");
 
-	for (i = 0; i < VNODE_BUCKETS; i++) {
-	        LIST_FOREACH(vp, &vnode_table[i], v_link) {
-			mp = vp->v_mount;
-
-			dprintf(" %08x %08x %s %6d %8d %s%s\n", (u_int)vp,
-				(u_int)mp, type[vp->v_type], vp->v_refcnt,
-				(strlen(mp->m_path) == 1) ? "\0" : mp->m_path,
-				vp->v_path);
-		}
-	}
+	vn_cache_foreach(vnode_dump_one);
 	dprintf("\n");
 	VNODE_UNLOCK();
 }
@@ -487,10 +470,6 @@ vop_eperm(void)
 void
 vnode_init(void)
 {
-	int i;
-
-	for (i = 0; i < VNODE_BUCKETS; i++)
-		LIST_INIT(&vnode_table[i]);
 }
 
 void vn_add_name(struct vnode *vp, struct dentry *dp)
@@ -188,6 +188,7 @@ struct ucred
 #define SO_PEEK_OFF             42
 #define SO_NOFCS                43
 #define SO_LOCK_FILTER          44
+#define SO_BUSY_POLL            46
 
 #define SOL_RAW         255
 #define SOL_DECNET      261
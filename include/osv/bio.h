@@ -121,6 +121,18 @@ void		destroy_bio(struct bio *bio);
 
 int		bio_wait(struct bio *bio);
 void		biodone(struct bio *bio, bool ok);
+
+/*
+ * Plugging: between bio_plug() and the matching bio_unplug(), drivers may
+ * hold back the bios submitted by the current thread, so that a burst of
+ * them can be merged and handed to the device at once. A driver holding a
+ * bio back calls bio_plugged() with a function submitting its held bios,
+ * which is called by the outermost bio_unplug(), or by bio_wait(), so that
+ * a thread never waits for a bio it is holding back itself.
+ */
+void		bio_plug(void);
+void		bio_unplug(void);
+bool		bio_plugged(void (*unplug)(void *), void *arg);
 struct devstat;
 void    biofinish(struct bio *bp, struct devstat *stat, int error);
 
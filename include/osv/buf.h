@@ -40,11 +40,11 @@
  * Buffer header
  */
 struct buf {
-	TAILQ_ENTRY(buf) b_link;	/* link to block list */
+	TAILQ_ENTRY(buf) b_link;	/* link to clean or dirty queue */
+	LIST_ENTRY(buf)	b_hash;		/* link to hash chain */
 	int		b_flags;	/* see defines below */
 	struct device	*b_dev;		/* device */
 	int		b_blkno;	/* block # on device */
-	mutex_t		b_lock;		/* lock for access */
 	void		*b_data;	/* pointer to data buffer */
 };
 
@@ -60,6 +60,7 @@ struct buf {
 __BEGIN_DECLS
 struct buf *getblk(struct device *, int);
 int	bread(struct device *, int, struct buf **);
+int	breadn(struct device *, int, int, struct buf **);
 int	bwrite(struct buf *);
 void	bdwrite(struct buf *);
 void	binval(struct device *);
@@ -8,19 +8,48 @@
 #ifndef _OSV_DENTRY_H
 #define _OSV_DENTRY_H 1
 
+#include <sys/cdefs.h>
+#include <stdint.h>
 #include <osv/mutex.h>
 #include <bsd/sys/sys/queue.h>
 
 struct vnode;
 
+/*
+ * A dentry with a null d_vnode is negative: it records that the path
+ * did not exist when it was last looked up.
+ */
 struct dentry {
-	LIST_ENTRY(dentry) d_link;	/* link for hash list */
-	int		d_refcnt;	/* reference count */
+	TAILQ_ENTRY(dentry) d_lru;	/* link for the cache's LRU list */
+	int		d_refcnt;	/* reference count, -1 while being freed */
+	int		d_flags;	/* DF_* flags */
 	char		*d_path;	/* pointer to path in fs */
 	struct vnode	*d_vnode;
 	struct mount	*d_mount;
 	struct dentry   *d_parent; /* pointer to parent */
 	LIST_ENTRY(dentry) d_names_link; /* link fo vnode::d_names */
+	LIST_HEAD(, dentry) d_children;	/* hashed dentries below this one */
+	LIST_ENTRY(dentry) d_child_link; /* link for d_parent->d_children */
+};
+
+/* flags for dentry */
+#define DF_HASHED	0x0001		/* can be found by lookups */
+#define DF_REFERENCED	0x0002		/* looked up since last LRU scan */
+
+/*
+ * Dentry cache statistics, shown in /proc/vfscache
+ */
+struct dentry_stats {
+	uint64_t	ds_hits;	/* lookups which found a dentry */
+	uint64_t	ds_negative_hits; /* lookups which found a negative one */
+	uint64_t	ds_misses;	/* lookups which found nothing */
+	uint64_t	ds_entries;	/* dentries in the cache */
+	uint64_t	ds_negative;	/* negative dentries in the cache */
+	uint64_t	ds_evictions;	/* dentries evicted to bound the cache */
 };
 
+__BEGIN_DECLS
+void	dentry_get_stats(struct dentry_stats *st);
+__END_DECLS
+
 #endif /* _OSV_DENTRY_H */
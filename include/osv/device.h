@@ -41,6 +41,7 @@ __BEGIN_DECLS
 #define DO_RWMASK	0x3
 
 struct bio;
+struct bio_cache;
 struct device;
 
 /*
@@ -128,6 +129,7 @@ struct device {
 	off_t		offset; /* 0 for the main drive, if we have a partition, this is the start address */
 	size_t		max_io_size;
 	void		*private_data;	/* private storage */
+	struct bio_cache *bcache;	/* buffer cache, see vfs_bio.cc */
 
 	void *softc;
 	void *ivars;
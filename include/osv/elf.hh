@@ -168,6 +168,16 @@ struct Elf64_Dyn {
     } d_un;
 };
 
+struct Elf64_Nhdr {
+    Elf64_Word n_namesz; /* Length of the name, which follows */
+    Elf64_Word n_descsz; /* Length of the descriptor, after the name */
+    Elf64_Word n_type; /* Type of descriptor */
+};
+
+enum {
+    NT_GNU_BUILD_ID = 3, // Unique build ID, in a note named "GNU"
+};
+
 struct Elf64_Rela {
     Elf64_Addr r_offset; /* Address of reference */
     Elf64_Xword r_info; /* Symbol index and type of relocation */
@@ -289,9 +299,13 @@ public:
     void run_fini_funcs();
     template <typename T = void>
     T* lookup(const char* name);
-    dladdr_info lookup_addr(const void* addr);
+    // With build_index false, an object whose index isn't built yet is
+    // scanned instead, without taking locks or allocating memory.
+    dladdr_info lookup_addr(const void* addr, bool build_index = true);
     ulong module_index() const;
     void* tls_addr();
+    // The GNU build ID note's contents, or empty if there is none
+    const std::string& build_id() const;
 protected:
     virtual void load_segment(const Elf64_Phdr& segment) = 0;
     virtual void unload_segment(const Elf64_Phdr& segment) = 0;
@@ -311,7 +325,13 @@ private:
     void relocate_rela();
     void relocate_pltgot();
     unsigned symtab_len();
+    unsigned symbol_count();
+    const char* symbol_name(const Elf64_Sym* sym);
     ulong get_tls_size();
+    void build_addr_index();
+    dladdr_info scan_addr(const void* addr);
+    void read_build_id();
+    void prelink();
 protected:
     program& _prog;
     std::string _pathname;
@@ -331,6 +351,25 @@ protected:
     // TODO: we also need a set<shared_ptr<object>> for other objects used in
     // resolving symbols from this symbol.
 
+    // The symbols lookup_addr() considers, sorted by address. Built on the
+    // first lookup_addr(), as most objects never need it.
+    struct addr_symbol {
+        void* addr;
+        Elf64_Sym* sym;
+    };
+    std::vector<addr_symbol> _addr_index;
+    std::atomic<bool> _addr_index_built = { false };
+    mutex _addr_index_mutex;
+
+    std::string _build_id;
+    // While relocating, the definitions of our symbols (by index) recorded
+    // in the prelink cache, if it has a valid record for us; see prelink().
+    struct prelinked_symbol {
+        Elf64_Sym* sym;
+        object* obj;
+    };
+    std::vector<prelinked_symbol> _prelinked;
+
     // Allow objects on program->_modules to be usable for the threads
     // currently initializing them, but not yet visible for other threads.
     // This simplifies the code (the initializer can use the regular lookup
@@ -340,6 +379,8 @@ private:
     bool visible(void) const;
 public:
     void setprivate(bool);
+
+    friend class program;
 };
 
 class file : public object {
@@ -459,6 +500,19 @@ public:
     template <typename functor>
     void with_modules(functor f);
     dladdr_info lookup_addr(const void* addr);
+    /**
+     * Resolve n addresses at once, as lookup_addr() would, into out[].
+     *
+     * This is cheaper than calling lookup_addr() for each address, e.g.,
+     * for all the frames of a backtrace.
+     */
+    void lookup_addrs(const void* const* addrs, dladdr_info* out, size_t n);
+    /**
+     * Resolve addr like lookup_addr(), but without taking locks or
+     * allocating memory, so it can be used in abort(), e.g., with
+     * interrupts disabled or out of memory. Slower, and skips the cache.
+     */
+    dladdr_info lookup_addr_safe(const void* addr);
     void* tls_addr(ulong module);
 private:
     void add_debugger_obj(object* obj);
@@ -488,6 +542,55 @@ private:
     void module_delete_enable();
     std::vector <object*> _modules_to_delete;
 
+    // Recent lookup_addr() results, indexed by a hash of the address. An
+    // entry is only valid while the list of objects is unchanged since it
+    // was filled in (same modules_list::adds and subs), since it points into
+    // an object.
+    struct addr_cache_entry {
+        const void* addr = nullptr;
+        int adds = -1, subs = -1;
+        dladdr_info info;
+    };
+    static constexpr unsigned addr_cache_size = 1024;
+    addr_cache_entry _addr_cache[addr_cache_size];
+    mutex _addr_cache_mutex;
+    dladdr_info lookup_addr(const modules_list& ml, const void* addr);
+
+    // Recent lookup() results, indexed by the symbol name's GNU hash. Only
+    // definitions in objects visible to all threads are cached, and, like
+    // the address cache, an entry is only valid for the list of objects it
+    // was filled in for. _lookup_gen counts objects becoming visible to all
+    // threads, which changes results without changing the list.
+    struct lookup_cache_entry {
+        uint32_t hash = 0;
+        unsigned gen = 0;
+        int adds = -1, subs = -1;
+        Elf64_Sym* sym = nullptr;
+        object* obj = nullptr;
+    };
+    static constexpr unsigned lookup_cache_size = 2048;
+    lookup_cache_entry _lookup_cache[lookup_cache_size];
+    mutex _lookup_cache_mutex;
+    std::atomic<unsigned> _lookup_gen = { 0 };
+
+    // The prelink cache (see scripts/prelink.py), read from
+    // /etc/prelink.cache when the first object is relocated. Each record
+    // holds the definitions of one object's symbols, valid when that object
+    // is relocated with the given objects (by build ID) on the list.
+    struct prelink_record {
+        std::vector<std::string> scope;
+        unsigned self;
+        // For each symbol index: the index in scope of the object defining
+        // it (or no_definition), and the symbol index there.
+        std::vector<std::pair<u32, u32>> symbols;
+        static constexpr u32 no_definition = ~u32(0);
+    };
+    std::vector<prelink_record> _prelink_cache;
+    bool _prelink_cache_read = false;
+    void read_prelink_cache();
+    const prelink_record* find_prelink(object* obj,
+            const std::vector<object*>& scope);
+
     // debugger interface
     static object* s_objs[100];
 
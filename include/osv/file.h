@@ -67,7 +67,7 @@ struct vnode;
 struct file;
 struct pollreq;
 
-#define FDMAX       (0x4000)
+#define FDMAX       (0x100000)
 
 #ifdef __cplusplus
 
@@ -107,10 +107,7 @@ struct file {
 	filetype_t	f_type;		/* descriptor type */
 	TAILQ_HEAD(, poll_link) f_poll_list; /* poll request list */
 	mutex_t		f_lock;		/* lock */
-	std::unique_ptr<std::vector<file*>> f_epolls;
-	// poll_wake_count used for implementing epoll()'s EPOLLET using poll().
-	// Once we have a real epoll() implementation, it won't be needed.
-	int poll_wake_count = 0;
+	std::unique_ptr<std::vector<file*>> f_epolls; /* epolls watching us */
 };
 
 // struct file above is an abstract class; subclasses need to implement 8
@@ -164,6 +161,10 @@ void file_setoffset(struct file *fp, off_t off);
  */
 void fhold(struct file* fp);
 int fdrop(struct file* fp);
+#ifdef __cplusplus
+/* Like fhold(), but fails if the file is already being closed */
+bool fhold_if_positive(struct file* fp);
+#endif
 
 /* Get fp from fd and increment refcount */
 int fget(int fd, struct file** fp);
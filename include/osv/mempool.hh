@@ -14,6 +14,7 @@
 #include <boost/intrusive/set.hpp>
 #include <boost/intrusive/list.hpp>
 #include <osv/mutex.h>
+#include <osv/spinlock.h>
 #include <arch.hh>
 #include <osv/pagealloc.hh>
 #include <osv/percpu.hh>
@@ -44,12 +45,39 @@ public:
     ~pool();
     void* alloc();
     void free(void* object);
+    // Return an object which another cpu handed to this one's free worker
+    // straight to its page, bypassing the magazines
+    void free_remote(void* object);
     unsigned get_size();
     static pool* from_object(void* object);
+    struct stats_type {
+        uint64_t alloc_hits = 0;
+        uint64_t alloc_misses = 0;
+        uint64_t free_hits = 0;
+        uint64_t free_misses = 0;
+    };
+    // Magazine layer hits and misses, summed over all cpus
+    stats_type stats();
+    // Under memory pressure, return the objects cached in magazines to
+    // their pages, and free the magazines: flush_cpu() moves the current
+    // cpu's magazines to the depot, and drain_depot() frees those in the
+    // depot, returning the bytes freed.
+    void flush_cpu();
+    size_t drain_depot();
 private:
     struct page_header;
     struct free_object;
+    struct magazine;
+    struct cpu_cache;
+    enum class free_result { freed, no_magazine, depot_full };
 private:
+    // should get called with the preemption lock taken
+    void* alloc_from_magazine(cpu_cache& c);
+    free_result free_to_magazine(cpu_cache& c, void* object);
+    void add_magazine();
+    size_t free_magazine(magazine* m);
+    void* alloc_from_pages();
+    void free_to_pages(void* object);
     bool have_full_pages();
     void add_page();
     static page_header* to_header(free_object* object);
@@ -82,6 +110,26 @@ private:
     };
     // maintain a list of free pages percpu
     dynamic_percpu<free_list_type> _free;
+
+    // The magazine layer: each cpu caches free objects in two magazines
+    // (fixed size stacks of objects), so most alloc() and free() calls
+    // don't touch the pages at all, whichever cpu the object came from.
+    // Full and empty magazines are exchanged between cpus in the depot.
+    // See Bonwick and Adams, "Magazines and Vmem", USENIX 2001.
+    // free() never allocates a magazine: lacking one, it frees to the pages
+    // and sets want_magazine, and the cpu's next alloc() adds one.
+    struct cpu_cache {
+        magazine* loaded = nullptr;
+        magazine* previous = nullptr;
+        bool want_magazine = false;
+        stats_type stats;
+    };
+    dynamic_percpu<cpu_cache> _cache;
+    unsigned _magazine_rounds;
+    spinlock _depot_lock;
+    magazine* _depot_full = nullptr;
+    magazine* _depot_empty = nullptr;
+    unsigned _depot_nfull = 0;
 public:
     static const size_t max_object_size;
     static const size_t min_object_size;
@@ -95,6 +143,7 @@ struct page_range {
     explicit page_range(size_t size);
     size_t size;
     boost::intrusive::set_member_hook<> member_hook;
+    boost::intrusive::list_member_hook<> size_hook;
 };
 
 void free_initial_memory_range(void* addr, size_t size);
@@ -167,9 +216,26 @@ private:
 namespace stats {
     size_t free();
     size_t total();
+    pool::stats_type malloc_pools();
     size_t jvm_heap();
     void on_jvm_heap_alloc(size_t mem);
     void on_jvm_heap_free(size_t mem);
+
+    // Fragmentation of free memory: the number of free page ranges and the
+    // largest one, the number of ranges and bytes in each of the free lists
+    // by size (list i holding the ranges of 2^i to 2^(i+1)-1 pages, the last
+    // one all larger ones too), and how many large malloc()s were served from
+    // the per-cpu cache of large objects.
+    struct page_ranges_type {
+        static constexpr unsigned nr_lists = 32;
+        size_t ranges;
+        size_t largest;
+        size_t list_ranges[nr_lists];
+        size_t list_bytes[nr_lists];
+        uint64_t large_cache_hits;
+        uint64_t large_cache_misses;
+    };
+    page_ranges_type page_ranges();
 }
 }
 
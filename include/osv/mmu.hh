@@ -212,6 +212,42 @@ void vm_fault(uintptr_t addr, exception_frame* ef);
 
 std::string procfs_maps();
 
+// Counters for huge pages used to back virtual memory: regions mapped with
+// a huge page, regions which wanted a huge page but were populated with
+// small pages because none could be allocated, and huge pages later split
+// into small pages (by a partial mprotect() or munmap()).
+struct huge_page_stats {
+    u64 mapped;
+    u64 fallbacks;
+    u64 splits;
+};
+
+huge_page_stats get_huge_page_stats();
+
+// Counters for TLB flushes: tlb_flush() calls, those which flushed a range
+// small enough for invlpg, and those served by a round of IPIs another
+// thread started; then rounds of IPIs (shootdowns), IPIs sent, and idle cpus
+// left to flush lazily when they wake. latency[i] counts the shootdowns
+// which took less than 2^i microseconds (and at least 2^(i-1)), the last
+// bucket counting all the longer ones.
+struct tlb_flush_stats {
+    static constexpr unsigned latency_buckets = 16;
+    u64 flushes;
+    u64 ranged;
+    u64 batched;
+    u64 shootdowns;
+    u64 ipis;
+    u64 lazy;
+    u64 latency[latency_buckets];
+};
+
+tlb_flush_stats get_tlb_flush_stats();
+
+// Called by the scheduler around halting an idle cpu: TLB flushes meanwhile
+// skip the cpu, and it flushes its whole TLB when it exits.
+void lazy_tlb_enter(unsigned cpu_id);
+void lazy_tlb_exit(unsigned cpu_id);
+
 }
 
 #endif
@@ -91,6 +91,8 @@ struct mount {
 #define	MNT_LOCAL	0x00001000	/* filesystem is stored locally */
 #define	MNT_QUOTA	0x00002000	/* quotas are enabled on filesystem */
 #define	MNT_ROOTFS	0x00004000	/* identifies the root filesystem */
+#define	MNT_NONEGCACHE	0x00010000	/* names may appear behind vfs's back,
+					   don't cache failed lookups */
 
 /*
  * Mask of flags that are visible to statfs()
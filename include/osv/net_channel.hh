@@ -14,6 +14,9 @@
 #include <functional>
 #include <unordered_map>
 #include <osv/rcu.hh>
+#include <osv/rcu-hashtable.hh>
+#include <osv/clock.hh>
+#include "processor.hh"
 #include <bsd/porting/netport.h>
 #include <bsd/sys/netinet/in.h>
 #include <bsd/sys/netinet/ip.h>
@@ -21,6 +24,41 @@
 struct mbuf;
 struct pollreq;
 
+// Spin until ready() returns true, for up to budget_ns nanoseconds. The
+// budget adapts to how often spinning pays off: it doubles, up to max_us,
+// when ready() becomes true while spinning, and halves when it does not, so
+// that consumers whose packets rarely arrive quickly stop wasting cpu.
+// budget_ns is the caller's state, and starts at max_us if it is zero.
+// max_us is capped at busy_poll_max_us, as spinning longer than that costs
+// more than sleeping.
+constexpr unsigned busy_poll_max_us = 500;
+
+// busy_poll()'s out-of-line parts: pick the budget (returns the maximum,
+// in ns), and adapt it to the outcome.
+u64 busy_poll_start(unsigned& budget_ns, unsigned max_us);
+void busy_poll_done(unsigned& budget_ns, u64 max_ns, bool hit, u64 spun_ns);
+
+template <typename Ready>
+bool busy_poll(unsigned& budget_ns, unsigned max_us, Ready ready)
+{
+    auto max_ns = busy_poll_start(budget_ns, max_us);
+    auto start = osv::clock::uptime::now();
+    auto end = start + std::chrono::nanoseconds(budget_ns);
+    auto now = start;
+    do {
+        if (ready()) {
+            busy_poll_done(budget_ns, max_ns, true,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            now - start).count());
+            return true;
+        }
+        processor::pause();
+        now = osv::clock::uptime::now();
+    } while (now < end);
+    busy_poll_done(budget_ns, max_ns, false, 0);
+    return false;
+}
+
 // Lock-free queue for moving packets to a single consumer
 // Supports waiting via sched::thread::wait_for()
 class net_channel {
@@ -31,6 +69,8 @@ private:
     // extra list of threads to wake
     osv::rcu_ptr<std::vector<pollreq*>> _pollers;
     mutex _pollers_mutex;
+    // consumer: adaptive busy_poll() budget
+    unsigned _busy_poll_ns = 0;
 public:
     explicit net_channel(std::function<void (mbuf*)> process_packet)
         : _process_packet(std::move(process_packet)) {}
@@ -45,6 +85,15 @@ public:
     }
     // consumer: consume all available packets using process_packet()
     void process_queue();
+    // consumer: spin for a packet for up to max_us microseconds, instead of
+    // sleeping and having the producer wake us, or until stop() returns
+    // true. Returns true if either happened. Only looks at the queue, so
+    // the caller may spin without holding the consumer's lock.
+    template <typename Stop>
+    bool busy_poll(unsigned max_us, Stop stop) {
+        return ::busy_poll(_busy_poll_ns, max_us,
+                [&] { return _queue.size() || stop(); });
+    }
     // add/remove current thread from poller list
     void add_poller(pollreq& pr);
     void del_poller(pollreq& pr);
@@ -78,9 +127,23 @@ struct ipv4_tcp_conn_id {
     in_port_t src_port;
     in_port_t dst_port;
 
+    // Remote peers choose addresses and ports, so a simple function of them
+    // (like XOR) lets an attacker, or plain bad luck, put many flows in the
+    // same bucket. Mix them with a seed chosen at boot instead.
     size_t hash() const {
-        // FIXME: protection against hash attacks?
-        return src_addr.s_addr ^ dst_addr.s_addr ^ src_port ^ dst_port;
+        uint64_t addrs = uint64_t(src_addr.s_addr) << 32 | dst_addr.s_addr;
+        uint64_t ports = uint64_t(src_port) << 16 | dst_port;
+        return mix(mix(addrs ^ hash_seed) ^ ports);
+    }
+    static uint64_t hash_seed;
+    // 64-bit finalizer from MurmurHash3
+    static uint64_t mix(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
     }
     bool operator==(const ipv4_tcp_conn_id& x) const {
         return src_addr == x.src_addr
@@ -103,17 +166,36 @@ class classifier {
 public:
     classifier();
     // consumer side operations
+    // A channel added for the id of an existing one replaces it; remove()
+    // only removes the channel given, so removing a replaced channel doesn't
+    // remove its replacement.
     void add(ipv4_tcp_conn_id id, net_channel* channel);
-    void remove(ipv4_tcp_conn_id id);
+    void remove(ipv4_tcp_conn_id id, net_channel* channel);
     // producer side operations
     bool post_packet(mbuf* m);
 private:
     net_channel* classify_ipv4_tcp(mbuf* m);
 private:
-    using ipv4_tcp_channels = std::unordered_map<ipv4_tcp_conn_id, net_channel*>;
+    struct ipv4_tcp_channel {
+        ipv4_tcp_conn_id id;
+        net_channel* chan;
+    };
+    struct ipv4_tcp_channel_hash {
+        size_t operator()(const ipv4_tcp_channel& x) const { return x.id.hash(); }
+        size_t operator()(const ipv4_tcp_conn_id& id) const { return id.hash(); }
+    };
+    struct ipv4_tcp_channel_equal {
+        bool operator()(const ipv4_tcp_channel& x, const ipv4_tcp_channel& y) const {
+            return x.id == y.id;
+        }
+        bool operator()(const ipv4_tcp_channel& x, const ipv4_tcp_conn_id& id) const {
+            return x.id == id;
+        }
+    };
+    using ipv4_tcp_channels = osv::rcu_hashtable<ipv4_tcp_channel,
+            ipv4_tcp_channel_hash, ipv4_tcp_channel_equal>;
     mutex _mtx;
-    // FIXME: use a fine-grained rcu hash table
-    osv::rcu_ptr<ipv4_tcp_channels, osv::rcu_deleter<ipv4_tcp_channels>> _ipv4_tcp_channels;
+    ipv4_tcp_channels _ipv4_tcp_channels;
 };
 
 #endif /* NETCHANNEL_HH_ */
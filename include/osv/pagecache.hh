@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef PAGECACHE_HH_
+#define PAGECACHE_HH_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <osv/types.h>
+
+struct file;
+struct vnode;
+
+// A cache of file pages, shared by all mappings of a file.
+//
+// Pages are keyed by (vnode, page-aligned file offset). MAP_SHARED mappings
+// map the cached pages themselves, holding a reference on each page while it
+// is mapped; MAP_PRIVATE mappings copy from them. Unreferenced pages are kept
+// on an LRU list, and are freed when the system is low on memory, or when the
+// vnode goes away.
+//
+// write() and truncate() keep cached pages coherent with the file; the
+// filesystem itself never sees the cache, so it is only used for files whose
+// filesystem does not map pages of its own.
+namespace pagecache {
+
+// Tracks the faults of one mapping, to read ahead of sequential faults
+class readahead {
+public:
+    // Returns the number of pages to read after the page at offset
+    unsigned update(off_t offset);
+private:
+    off_t _next = -1;
+    unsigned _window = 0;
+};
+
+// Returns the cached page at the page-aligned offset of fp, reading it (and
+// the following readahead pages) from the file if needed. The page cannot be
+// evicted until released with put().
+void* get(file* fp, off_t offset, unsigned readahead);
+void put(vnode* vp, off_t offset);
+
+// Copy the page at the page-aligned offset of fp into dst
+void copy(file* fp, off_t offset, void* dst, unsigned readahead);
+
+// Called after count bytes of iov were written to vp at offset
+void write(vnode* vp, const iovec* iov, int iovcnt, off_t offset, size_t count);
+// Called after vp was truncated to length
+void truncate(vnode* vp, off_t length);
+// Whether vp has pages cached or being read into the cache. If not, and
+// the caller holds the vnode lock, the next write need not update the cache.
+bool cached(vnode* vp);
+
+struct stats_type {
+    u64 hits;
+    u64 misses;
+    u64 readahead;
+    u64 evictions;
+    size_t pages;
+};
+
+stats_type stats();
+
+}
+
+#endif
@@ -125,13 +125,11 @@ struct poll_file;
 
 struct poll_file {
     poll_file() = default;
-    // Note that events is int, not short, for EPOLLET support.
-    poll_file(fileref fp, int events, short revents, int c = 0)
-        : fp(fp), events(events), revents(revents), last_poll_wake_count(c) {}
+    poll_file(fileref fp, int events, short revents)
+        : fp(fp), events(events), revents(revents) {}
     fileref fp;
     int events;
     short revents;
-    int last_poll_wake_count;   // For implementing EPOLLET
 };
 
 /*
@@ -149,6 +147,8 @@ struct pollreq {
     int _timeout;
     std::atomic<bool> _awake = { false };
     sched::thread_handle _poll_thread = { *sched::thread::current() };
+    // largest SO_BUSY_POLL of the polled sockets, in microseconds
+    unsigned _busy_poll_us = 0;
 };
 
 #endif
@@ -172,7 +172,8 @@ __END_DECLS
 #ifdef __cplusplus
 
 int do_poll(std::vector<poll_file>& pfd, int _timeout);
-void epoll_file_closed(file* epoller, file* client);
+void epoll_wake(file* epoller, file* client, int events);
+void epoll_file_closed(file* client);
 
 #endif
 
@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef RCU_HASHTABLE_HH_
+#define RCU_HASHTABLE_HH_
+
+#include <osv/rcu.hh>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <utility>
+
+namespace osv {
+
+// A resizable hash table with RCU protected lookups.
+//
+// Readers (under rcu_read_lock) never block and never write to shared
+// memory. Writers must be serialized by the owner, typically with a mutex,
+// just like rcu_ptr::assign(). Unlike an rcu_ptr to a whole container,
+// inserting or removing an element only touches the chain of the bucket
+// it hashes to, so updates cost O(1) and not O(n).
+//
+// When the load factor gets too high (or too low) the bucket array is
+// rebuilt. Since nodes cannot be moved between chains while readers may be
+// traversing them, resizing copies the elements into a new table, publishes
+// it, and disposes of the old one after a grace period. Resizing is O(n),
+// but happens after O(n) updates, so it is still O(1) amortized.
+//
+// T must be copy-constructible (for resizing). Hash and Equal operate on
+// T; lookups can also use a different key type with matching hash and
+// comparison functors (see reader_find()).
+//
+// Usage:
+//
+//    mutex mtx;
+//    rcu_hashtable<my_object> ht;
+//
+//    Read-side:
+//
+//       WITH_LOCK(rcu_read_lock) {
+//          my_object* p = ht.reader_find(key, key_hash, key_equal);
+//          // do things with *p, but don't block!
+//       }
+//
+//    Write-side:
+//
+//       WITH_LOCK(mtx) {
+//          ht.emplace(args...);
+//          ht.erase(key, key_hash, key_equal);
+//       }
+//
+template <typename T,
+          typename Hash = std::hash<T>,
+          typename Equal = std::equal_to<T>>
+class rcu_hashtable {
+private:
+    struct node {
+        template <typename... Args>
+        explicit node(size_t hash, Args&&... args)
+            : hash(hash), value(std::forward<Args>(args)...) {}
+        size_t hash;
+        T value;
+        rcu_ptr<node> next;
+    };
+    struct table {
+        explicit table(size_t nbuckets)
+            : mask(nbuckets - 1), buckets(new rcu_ptr<node>[nbuckets]) {}
+        size_t mask;
+        std::unique_ptr<rcu_ptr<node>[]> buckets;
+        size_t nbuckets() const { return mask + 1; }
+        rcu_ptr<node>& bucket(size_t hash) { return buckets[hash & mask]; }
+    };
+public:
+    // nbuckets must be a power of two
+    explicit rcu_hashtable(size_t nbuckets = 16, Hash hash = Hash(),
+            Equal equal = Equal())
+        : _table(new table(nbuckets))
+        , _min_buckets(nbuckets)
+        , _hash(hash)
+        , _equal(equal)
+    {
+    }
+    ~rcu_hashtable();
+    rcu_hashtable(const rcu_hashtable&) = delete;
+    rcu_hashtable& operator=(const rcu_hashtable&) = delete;
+
+    // Find an element matching key. Must be called with rcu_read_lock
+    // held, and the result may only be used until it is released.
+    // key_equal(const T&, const Key&) compares an element with the key;
+    // key_hash(key) must agree with Hash for matching elements.
+    template <typename Key, typename KeyHash, typename KeyEqual>
+    T* reader_find(const Key& key, KeyHash key_hash, KeyEqual key_equal) const;
+    T* reader_find(const T& value) const {
+        return reader_find(value, _hash, _equal);
+    }
+
+    // Owner-side operations; must be serialized by the caller.
+    template <typename Key, typename KeyHash, typename KeyEqual>
+    T* owner_find(const Key& key, KeyHash key_hash, KeyEqual key_equal) const;
+    // Add an element constructed from args, replacing the element equal to
+    // it (by Equal), if any. Returns false if an element was replaced.
+    template <typename... Args>
+    bool emplace(Args&&... args);
+    // Remove the first element matching key. Returns false if not found.
+    template <typename Key, typename KeyHash, typename KeyEqual>
+    bool erase(const Key& key, KeyHash key_hash, KeyEqual key_equal);
+    bool erase(const T& value) { return erase(value, _hash, _equal); }
+    // Call func on every element, in no particular order. func must not
+    // modify the table.
+    template <typename Func>
+    void owner_for_each(Func func) const;
+    size_t size() const { return _size; }
+    size_t bucket_count() const { return _table.read_by_owner()->nbuckets(); }
+private:
+    void maybe_resize();
+    void resize(size_t nbuckets);
+    static void free_table(table* t);
+private:
+    rcu_ptr<table> _table;
+    size_t _size = 0;
+    size_t _min_buckets;
+    Hash _hash;
+    Equal _equal;
+};
+
+template <typename T, typename Hash, typename Equal>
+rcu_hashtable<T, Hash, Equal>::~rcu_hashtable()
+{
+    // there can no longer be any readers
+    free_table(_table.read_by_owner());
+}
+
+template <typename T, typename Hash, typename Equal>
+template <typename Key, typename KeyHash, typename KeyEqual>
+inline
+T* rcu_hashtable<T, Hash, Equal>::reader_find(const Key& key,
+        KeyHash key_hash, KeyEqual key_equal) const
+{
+    auto h = key_hash(key);
+    auto t = _table.read();
+    for (auto n = t->bucket(h).read(); n; n = n->next.read()) {
+        if (n->hash == h && key_equal(n->value, key)) {
+            return &n->value;
+        }
+    }
+    return nullptr;
+}
+
+template <typename T, typename Hash, typename Equal>
+template <typename Key, typename KeyHash, typename KeyEqual>
+inline
+T* rcu_hashtable<T, Hash, Equal>::owner_find(const Key& key,
+        KeyHash key_hash, KeyEqual key_equal) const
+{
+    auto h = key_hash(key);
+    auto t = _table.read_by_owner();
+    for (auto n = t->bucket(h).read_by_owner(); n; n = n->next.read_by_owner()) {
+        if (n->hash == h && key_equal(n->value, key)) {
+            return &n->value;
+        }
+    }
+    return nullptr;
+}
+
+template <typename T, typename Hash, typename Equal>
+template <typename... Args>
+bool rcu_hashtable<T, Hash, Equal>::emplace(Args&&... args)
+{
+    std::unique_ptr<node> n{new node(0, std::forward<Args>(args)...)};
+    n->hash = _hash(n->value);
+    auto& b = _table.read_by_owner()->bucket(n->hash);
+    for (rcu_ptr<node>* link = &b; auto old = link->read_by_owner();
+            link = &old->next) {
+        if (old->hash == n->hash && _equal(old->value, n->value)) {
+            // Take the old node's place in the chain; readers already on
+            // it still reach the rest of the chain through old->next.
+            n->next.assign(old->next.read_by_owner());
+            link->assign(n.release());
+            rcu_dispose(old);
+            return false;
+        }
+    }
+    // Fully initialize the node before publishing it at the chain head.
+    n->next.assign(b.read_by_owner());
+    b.assign(n.release());
+    ++_size;
+    maybe_resize();
+    return true;
+}
+
+template <typename T, typename Hash, typename Equal>
+template <typename Key, typename KeyHash, typename KeyEqual>
+bool rcu_hashtable<T, Hash, Equal>::erase(const Key& key,
+        KeyHash key_hash, KeyEqual key_equal)
+{
+    auto h = key_hash(key);
+    rcu_ptr<node>* link = &_table.read_by_owner()->bucket(h);
+    while (auto n = link->read_by_owner()) {
+        if (n->hash == h && key_equal(n->value, key)) {
+            // Readers already past this link keep following n->next, which
+            // we leave intact until n is freed after a grace period.
+            link->assign(n->next.read_by_owner());
+            rcu_dispose(n);
+            --_size;
+            maybe_resize();
+            return true;
+        }
+        link = &n->next;
+    }
+    return false;
+}
+
+template <typename T, typename Hash, typename Equal>
+template <typename Func>
+void rcu_hashtable<T, Hash, Equal>::owner_for_each(Func func) const
+{
+    auto t = _table.read_by_owner();
+    for (size_t i = 0; i < t->nbuckets(); i++) {
+        for (auto n = t->buckets[i].read_by_owner(); n; n = n->next.read_by_owner()) {
+            func(n->value);
+        }
+    }
+}
+
+template <typename T, typename Hash, typename Equal>
+void rcu_hashtable<T, Hash, Equal>::maybe_resize()
+{
+    auto nbuckets = _table.read_by_owner()->nbuckets();
+    if (_size > 2 * nbuckets) {
+        resize(nbuckets * 4);
+    } else if (nbuckets > _min_buckets && _size < nbuckets / 8) {
+        resize(std::max(_min_buckets, nbuckets / 4));
+    }
+}
+
+template <typename T, typename Hash, typename Equal>
+void rcu_hashtable<T, Hash, Equal>::resize(size_t nbuckets)
+{
+    auto old = _table.read_by_owner();
+    std::unique_ptr<table> neww{new table(nbuckets)};
+    for (size_t i = 0; i < old->nbuckets(); i++) {
+        for (auto n = old->buckets[i].read_by_owner(); n; n = n->next.read_by_owner()) {
+            auto& b = neww->bucket(n->hash);
+            auto copy = new node(n->hash, n->value);
+            copy->next.assign(b.read_by_owner());
+            b.assign(copy);
+        }
+    }
+    _table.assign(neww.release());
+    rcu_defer([=] { free_table(old); });
+}
+
+template <typename T, typename Hash, typename Equal>
+void rcu_hashtable<T, Hash, Equal>::free_table(table* t)
+{
+    for (size_t i = 0; i < t->nbuckets(); i++) {
+        auto n = t->buckets[i].read_by_owner();
+        while (n) {
+            auto next = n->next.read_by_owner();
+            delete n;
+            n = next;
+        }
+    }
+    delete t;
+}
+
+}
+
+#endif /* RCU_HASHTABLE_HH_ */
@@ -249,8 +249,21 @@ void rcu_defer(functor func, T* p)
     rcu_defer([=] { func(p); });
 }
 
+// Waits until all read-side critical sections in progress are over
 void rcu_synchronize();
 
+// Like rcu_synchronize(), but instead of letting cpus reach a quiescent
+// state on their own, which also batches other updaters' callbacks, forces
+// them to immediately. For latency-sensitive updaters; it costs an
+// interrupt on each cpu.
+void rcu_synchronize_expedited();
+
+namespace rcu {
+// Called by the scheduler on a cpu whenever it is outside of any read-side
+// critical section.
+void quiescent_state(unsigned cpu_id);
+}
+
 }
 
 #endif /* RCU_HH_ */
@@ -14,22 +14,37 @@
 
 #define RWLOCK_INITIALIZER {}
 
+// Flags for rwlock_init_flags()
+//
+// RWLOCK_READ_MOSTLY: count readers in per-cpu counters instead of under the
+// lock's mutex, so readers on different cpus don't contend. In exchange, a
+// writer needs to wait for the readers of all cpus to drain, and the lock
+// allocates a cache line per cpu.
+#define RWLOCK_READ_MOSTLY  0x1
+
+struct rwlock_reader_counts;
+
 typedef struct rwlock {
 
 #ifdef __cplusplus
 
 public:
     rwlock();
+    explicit rwlock(unsigned flags);
     ~rwlock();
 
     // Reader
     void rlock();
+    // As rlock(), but give up with ETIMEDOUT when tmr expires
+    int rlock(sched::timer* tmr);
     bool try_rlock();
     void runlock();
     bool try_upgrade();
 
     // Writer
     void wlock();
+    // As wlock(), but give up with ETIMEDOUT when tmr expires
+    int wlock(sched::timer* tmr);
     bool try_wlock();
     void wunlock();
     void downgrade();
@@ -37,12 +52,20 @@ public:
 
 private:
 
-    void writer_wait_lockable();
-    void reader_wait_lockable();
+    int writer_wait_lockable(sched::timer* tmr = nullptr);
+    int reader_wait_lockable(sched::timer* tmr = nullptr);
+    void writer_gave_up();
 
     bool read_lockable();
     bool write_lockable();
 
+    // Per-cpu reader counts of RWLOCK_READ_MOSTLY locks
+    bool try_rlock_counted();
+    void runlock_counted();
+    long counted_readers();
+    int drain_counted_readers(sched::timer* tmr);
+    void unblock_counted_readers();
+
 #endif // __cplusplus
 
     mutex_t _mtx;
@@ -56,10 +79,13 @@ private:
     void* _wowner;
     unsigned _wrecurse;
 
+    struct rwlock_reader_counts* _counts;
+
 } rwlock_t;
 
 __BEGIN_DECLS
 void rwlock_init(rwlock_t* rw);
+void rwlock_init_flags(rwlock_t* rw, unsigned flags);
 void rwlock_destroy(rwlock_t* rw);
 void rw_rlock(rwlock_t* rw);
 void rw_wlock(rwlock_t* rw);
@@ -54,6 +54,7 @@ class thread_handle;
 struct cpu;
 class timer;
 class timer_list;
+class timer_list_test;
 class cpu_mask;
 class thread_runtime_compare;
 template <typename T> class wait_object;
@@ -199,6 +200,11 @@ protected:
     };
     state _state = state::free;
     osv::clock::uptime::time_point _time;
+    // Where an armed timer is kept in its cpu's timer_list: -1 if it is
+    // in the sorted list of near timers, otherwise its timer wheel level.
+    int _wheel_level;
+    unsigned _wheel_slot;
+    bi::list_member_hook<> _wheel_link;
     friend class timer_list;
 };
 
@@ -586,6 +592,18 @@ private:
 
 void init_detached_threads_reaper();
 
+// The armed timers of one cpu.
+//
+// Most timers (timeouts of sleeps, waits and tcp retransmissions) are
+// cancelled long before they expire, so setting and cancelling a timer
+// should be cheap. Timers due in the next wheel tick (about a millisecond)
+// are kept sorted in _near, and the earliest of them programs clock_event
+// for its exact expiration time. Timers further in the future are hashed
+// into a hierarchical timing wheel, where set() and cancel() are O(1):
+// level l has nr_slots slots, each spanning nr_slots^l ticks. When the
+// wheel advances to a slot, its timers are moved to a lower level, or to
+// _near once they are due within the current tick. Timers beyond the last
+// level wait on _overflow, which is redistributed whenever the wheel wraps.
 class timer_list {
 public:
     void fired();
@@ -594,9 +612,40 @@ public:
     void rearm();
 private:
     friend class timer_base;
+    friend class timer_list_test;
+    static constexpr unsigned tick_shift = 20; // 2^20 ns, ~1ms
+    static constexpr unsigned slot_shift = 6;
+    static constexpr unsigned nr_slots = 1 << slot_shift;
+    static constexpr unsigned nr_levels = 4;
+    typedef bi::list<timer_base,
+                     bi::member_hook<timer_base,
+                                     bi::list_member_hook<>,
+                                     &timer_base::_wheel_link>,
+                     bi::constant_time_size<false>
+                    > slot_type;
+    static unsigned long to_tick(osv::clock::uptime::time_point t);
+    static osv::clock::uptime::time_point from_tick(unsigned long tick);
+    void add(timer_base& t);
+    void insert(timer_base& t);
+    void remove(timer_base& t);
+    bool empty() const;
+    unsigned long slot_tick(unsigned level, unsigned slot) const;
+    unsigned long next_wheel_tick() const;
+    osv::clock::uptime::time_point next_event() const;
+    osv::clock::uptime::time_point event_time(const timer_base& t) const;
+    void advance(unsigned long now_tick);
+    void redistribute(slot_type& slot);
+    void set_event(osv::clock::uptime::time_point t);
+private:
     osv::clock::uptime::time_point _last {
             osv::clock::uptime::time_point::max() };
-    bi::set<timer_base, bi::base_hook<bi::set_base_hook<>>> _list;
+    bi::set<timer_base, bi::base_hook<bi::set_base_hook<>>> _near;
+    // Timers due before this tick are in _near, the rest are in the wheel
+    unsigned long _wheel_tick = 0;
+    unsigned _wheel_timers = 0;
+    unsigned long _occupied[nr_levels] = {};
+    slot_type _wheel[nr_levels][nr_slots];
+    slot_type _overflow;
     class callback_dispatch : private clock_event_callback {
     public:
         callback_dispatch();
@@ -638,6 +687,19 @@ struct cpu : private timer_base::client {
     thread* terminating_thread;
     osv::clock::uptime::time_point running_since;
     char* percpu_base;
+    // Topology, filled in by the arch code: cpus with equal core_id are SMT
+    // siblings, and cpus with equal llc_id share the last level cache.
+    unsigned core_id = 0;
+    unsigned llc_id = 0;
+    // Exponentially decaying average of the number of runnable threads,
+    // counting the running one by the fraction of time it wasn't idle.
+    float load_avg = 0;
+    osv::clock::uptime::time_point load_avg_updated;
+    thread_runtime::duration idle_time_seen {0};
+    std::atomic<thread*> balancer_thread = { nullptr };
+    // set by idle cpus asking this cpu to push a thread to them
+    std::atomic<bool> balance_requested = { false };
+    osv::clock::uptime::time_point last_steal;
     static cpu* current();
     void init_on_cpu();
     void schedule();
@@ -650,6 +712,12 @@ struct cpu : private timer_base::client {
     void send_wakeup_ipi();
     void load_balance();
     unsigned load();
+    void update_load_avg();
+    cpu* find_balance_target();
+    unsigned distance(const cpu* other) const;
+    void migrate_one(cpu* target);
+    void request_balance();
+    void steal();
     void reschedule_from_interrupt(bool preempt = false);
     void enqueue(thread& t);
     void init_idle_thread();
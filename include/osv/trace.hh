@@ -25,6 +25,14 @@
 
 void enable_trace();
 void enable_tracepoint(std::string wildcard);
+// Size of each cpu's trace buffer; must be set before enabling tracepoints.
+void set_trace_buffer_size(size_t size);
+// Stream trace records to the named file, instead of letting the buffers
+// wrap around. The file is opened by start_trace_stream(), once file
+// systems are available; records logged before that are kept in the buffers.
+void set_trace_stream(std::string path);
+void start_trace_stream();
+void flush_trace_stream();
 
 class tracepoint_base;
 
@@ -41,7 +49,10 @@ struct trace_record {
     };
 };
 
+// Returns nullptr if the record has to be dropped. Must be followed by
+// commit_trace_record() once the record is filled in.
 trace_record* allocate_trace_record(size_t size);
+void commit_trace_record();
 
 template <size_t idx, size_t N, typename... args>
 struct tuple_formatter
@@ -242,12 +253,15 @@ public:
     ~tracepoint_base();
     void enable();
     static void log_backtraces();
+    static bool logging_backtraces() { return _log_backtrace; }
     void add_probe(probe* p);
     void del_probe(probe* p);
     tracepoint_id id;
     const char* name;
     const char* format;
     u64 sig;
+    // size of the arguments in a trace record
+    size_t payload_size = 0;
     typedef boost::intrusive::list_member_hook<> tp_list_link_type;
     tp_list_link_type tp_list_link;
     static boost::intrusive::list<
@@ -257,6 +271,7 @@ public:
                                       &tracepoint_base::tp_list_link>,
         boost::intrusive::constant_time_size<false>
         > tp_list;
+    static const size_t backtrace_len = 10;
 protected:
     bool active = false; // logging || !probes.empty()
     bool logging = false;
@@ -278,7 +293,6 @@ private:
     void update();
     static std::unordered_set<tracepoint_id>& known_ids();
     static bool _log_backtrace;
-    static const size_t backtrace_len = 10;
 };
 
 namespace {
@@ -297,6 +311,7 @@ public:
     explicit tracepointv(const char* name, const char* format)
         : tracepoint_base(_id, typeid(*this), name, format) {
         sig = signature();
+        payload_size = serializer<0, sizeof...(s_args), s_args...>::size(0);
     }
     void operator()(r_args... as) {
         asm goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00 \n\t"  // 5-byte nop
@@ -326,6 +341,9 @@ public:
             return;
         }
         auto tr = allocate_trace_record(size());
+        if (!tr) {
+            return;
+        }
         tr->tp = this;
         tr->thread = sched::thread::current();
         tr->thread_name = tr->thread->name_raw();
@@ -339,6 +357,7 @@ public:
         tr->backtrace = false;
         log_backtrace(tr, buffer);
         serialize(buffer, as);
+        commit_trace_record();
     }
     void serialize(void* buffer, std::tuple<s_args...> as) {
         return serializer<0, sizeof...(s_args), s_args...>::write(buffer, 0, as);
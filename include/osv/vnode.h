@@ -68,7 +68,6 @@ enum vtype {
  */
 struct vnode {
 	uint64_t	v_ino;		/* inode number */
-	LIST_ENTRY(vnode) v_link;	/* link for hash list */
 	struct mount	*v_mount;	/* mounted vfs pointer */
 	struct vnops	*v_op;		/* vnode operations */
 	int		v_refcnt;	/* reference count */
@@ -82,6 +81,15 @@ struct vnode {
 	void		*v_data;	/* private data for fs */
 };
 
+/*
+ * Vnode cache statistics, shown in /proc/vfscache
+ */
+struct vnode_stats {
+	uint64_t	vs_hits;	/* vget() found an active vnode */
+	uint64_t	vs_misses;	/* vget() allocated a new vnode */
+	uint64_t	vs_entries;	/* active vnodes */
+};
+
 /* flags for vnode */
 #define VROOT		0x0001		/* root of its file system */
 #define VISTTY		0x0002		/* device is tty */
@@ -206,6 +214,7 @@ int	 vcount(struct vnode *);
 void	 vflush(struct mount *);
 void vn_add_name(struct vnode *, struct dentry *);
 void vn_del_name(struct vnode *, struct dentry *);
+void	 vnode_get_stats(struct vnode_stats *);
 
 extern enum vtype iftovt_tab[];
 extern int vttoif_tab[];
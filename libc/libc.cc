@@ -24,6 +24,7 @@
 #include <sys/ioctl.h>
 #include <osv/clock.hh>
 #include <osv/mempool.hh>
+#include <osv/file.h>
 
 int libc_error(int err)
 {
@@ -54,7 +55,7 @@ int getrlimit(int resource, struct rlimit *rlim)
         break;
     }
     case RLIMIT_NOFILE:
-        set(1024*10); // FIXME: larger?
+        set(FDMAX);
         break;
     case RLIMIT_CORE:
         set(RLIM_INFINITY);
@@ -20,6 +20,7 @@
 
 #include <osv/mutex.h>
 #include <osv/condvar.h>
+#include <osv/rwlock.h>
 #include <osv/stubbing.hh>
 #include <osv/lazy_indirect.hh>
 
@@ -370,6 +371,149 @@ int pthread_cond_timedwait(pthread_cond_t *__restrict cond,
     return from_libc(cond)->wait(from_libc(mutex), &tmr);
 }
 
+// Applications use rwlocks for read-mostly data (otherwise a mutex would
+// do), so use the per-cpu reader counts, which let readers on different
+// cpus proceed without contending on the lock.
+struct read_mostly_rwlock : rwlock {
+    read_mostly_rwlock() : rwlock(RWLOCK_READ_MOSTLY) { }
+};
+typedef lazy_indirect<read_mostly_rwlock> indirect_rwlock;
+static_assert(sizeof(indirect_rwlock) <= sizeof(pthread_rwlock_t), "rwlock overflow");
+
+rwlock* from_libc(pthread_rwlock_t* rw)
+{
+    return reinterpret_cast<indirect_rwlock*>(rw)->get();
+}
+
+int pthread_rwlock_init(pthread_rwlock_t *__restrict rw,
+        const pthread_rwlockattr_t *__restrict attr)
+{
+    // The only attribute is pshared, which is irrelevant without processes
+    new (rw) indirect_rwlock;
+    return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t *rw)
+{
+    reinterpret_cast<indirect_rwlock*>(rw)->~indirect_rwlock();
+    return 0;
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *rw)
+{
+    from_libc(rw)->rlock();
+    return 0;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rw)
+{
+    if (!from_libc(rw)->try_rlock()) {
+        return EBUSY;
+    }
+    return 0;
+}
+
+// Arm tmr to expire at a pthread_rwlock_timed*lock() deadline, which is
+// measured by CLOCK_REALTIME.
+static int rwlock_set_timeout(sched::timer& tmr, const struct timespec* ts)
+{
+    if (ts->tv_nsec < 0 || ts->tv_nsec >= 1000000000) {
+        return EINVAL;
+    }
+    tmr.set(osv::clock::wall::time_point(
+            std::chrono::seconds(ts->tv_sec) +
+            std::chrono::nanoseconds(ts->tv_nsec)));
+    return 0;
+}
+
+int pthread_rwlock_timedrdlock(pthread_rwlock_t *__restrict rw,
+        const struct timespec *__restrict abs_timeout)
+{
+    auto l = from_libc(rw);
+    // As POSIX requires, don't fail on a bad timeout if we needn't wait
+    if (l->try_rlock()) {
+        return 0;
+    }
+    sched::timer tmr(*sched::thread::current());
+    if (auto err = rwlock_set_timeout(tmr, abs_timeout)) {
+        return err;
+    }
+    return l->rlock(&tmr);
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rw)
+{
+    auto l = from_libc(rw);
+    if (l->wowned()) {
+        return EDEADLK;
+    }
+    l->wlock();
+    return 0;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rw)
+{
+    auto l = from_libc(rw);
+    if (l->wowned() || !l->try_wlock()) {
+        return EBUSY;
+    }
+    return 0;
+}
+
+int pthread_rwlock_timedwrlock(pthread_rwlock_t *__restrict rw,
+        const struct timespec *__restrict abs_timeout)
+{
+    auto l = from_libc(rw);
+    if (l->wowned()) {
+        return EDEADLK;
+    }
+    if (l->try_wlock()) {
+        return 0;
+    }
+    sched::timer tmr(*sched::thread::current());
+    if (auto err = rwlock_set_timeout(tmr, abs_timeout)) {
+        return err;
+    }
+    return l->wlock(&tmr);
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t *rw)
+{
+    auto l = from_libc(rw);
+    if (l->wowned()) {
+        l->wunlock();
+    } else {
+        l->runlock();
+    }
+    return 0;
+}
+
+int pthread_rwlockattr_init(pthread_rwlockattr_t *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    return 0;
+}
+
+int pthread_rwlockattr_destroy(pthread_rwlockattr_t *attr)
+{
+    return 0;
+}
+
+int pthread_rwlockattr_setpshared(pthread_rwlockattr_t *attr, int pshared)
+{
+    if (pshared != PTHREAD_PROCESS_PRIVATE && pshared != PTHREAD_PROCESS_SHARED) {
+        return EINVAL;
+    }
+    return 0;
+}
+
+int pthread_rwlockattr_getpshared(const pthread_rwlockattr_t *__restrict attr,
+        int *__restrict pshared)
+{
+    *pshared = PTHREAD_PROCESS_PRIVATE;
+    return 0;
+}
+
 int pthread_attr_init(pthread_attr_t *attr)
 {
     new (attr) thread_attr;
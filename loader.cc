@@ -135,6 +135,8 @@ std::tuple<int, char**> parse_options(int ac, char** av)
         ("help", "show help text")
         ("trace", bpo::value<std::vector<std::string>>(), "tracepoints to enable")
         ("trace-backtrace", "log backtraces in the tracepoint log")
+        ("trace-buffer-size", bpo::value<size_t>(), "size of each cpu's tracepoint log, in bytes")
+        ("trace-stream", bpo::value<std::string>(), "continuously write the tracepoint log to this file")
         ("leak", "start leak detector after boot")
         ("nomount", "don't mount the file system")
         ("noshutdown", "continue running after main() returns")
@@ -182,6 +184,14 @@ std::tuple<int, char**> parse_options(int ac, char** av)
         opt_bootchart = true;
     }
 
+    if (vars.count("trace-buffer-size")) {
+        set_trace_buffer_size(vars["trace-buffer-size"].as<size_t>());
+    }
+
+    if (vars.count("trace-stream")) {
+        set_trace_stream(vars["trace-stream"].as<std::string>());
+    }
+
     if (vars.count("trace")) {
         auto tv = vars["trace"].as<std::vector<std::string>>();
         for (auto t : tv) {
@@ -317,6 +327,8 @@ void* do_main_thread(void *_commands)
     }
     boot_time.event("ZFS mounted");
 
+    start_trace_stream();
+
     bool has_if = false;
     osv::for_each_if([&has_if] (std::string if_name) {
         if (if_name == "lo0")
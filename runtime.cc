@@ -89,7 +89,7 @@ static void print_backtrace(void)
 
     /* Skip abort(const char *) and abort(void)  */
     for (int i = 2; i < len; i++) {
-        auto ei = elf::get_program()->lookup_addr(addrs[i]);
+        auto ei = elf::get_program()->lookup_addr_safe(addrs[i]);
         const char *sname = ei.sym;
         char demangled[1024];
 
@@ -20,6 +20,7 @@ external = os.path.join(osv_dir, 'external', arch)
 sys.path.append(os.path.join(osv_dir, 'scripts'))
 
 from osv.trace import Trace,TracePoint,BacktraceFormatter,format_time,format_duration
+from osv.trace import sig_to_string,align_up
 from osv import trace
 
 virtio_driver_type = gdb.lookup_type('virtio::virtio_driver')
@@ -816,21 +817,6 @@ def setup_libstdcxx():
     main = glob(gcc + '/usr/share/gdb/auto-load/usr/lib64/libstdc++.so.*.py')[0]
     exec(compile(open(main).read(), main, 'exec'))
 
-def sig_to_string(sig):
-    '''Convert a tracepoing signature encoded in a u64 to a string'''
-    ret = ''
-    while sig != 0:
-        ret += chr(sig & 255)
-        sig >>= 8
-    ret = ret.replace('p', '50p')
-    return ret
-
-def align_down(v, pagesize):
-    return v & ~(pagesize - 1)
-
-def align_up(v, pagesize):
-    return align_down(v + pagesize - 1, pagesize)
-
 class concat(object):
     def __init__(self, view1, view2):
         self.view1 = view1
@@ -858,52 +844,38 @@ def all_traces():
     gdb.lookup_global_symbol('gdb_trace_function_entry')
 
     inf = gdb.selected_inferior()
-    trace_log = gdb.lookup_global_symbol('trace_log').value()
-    if not trace_log:
-    	return
-    max_trace = ulong(gdb.parse_and_eval('max_trace'))
-    trace_log = inf.read_memory(trace_log, max_trace)
     trace_page_size = ulong(gdb.parse_and_eval('trace_page_size'))
-    last = ulong(gdb.lookup_global_symbol('trace_record_last').value()['_M_i'])
-    last %= max_trace
-    pivot = align_up(last, trace_page_size)
-    trace_log = concat(trace_log[pivot:], trace_log[:pivot])
-    last += max_trace - pivot
-
-    tp_ptr = gdb.lookup_type('tracepoint_base').pointer()
     backtrace_len = ulong(gdb.parse_and_eval('tracepoint_base::backtrace_len'))
+    tp_ptr = gdb.lookup_type('tracepoint_base').pointer()
     tracepoints = {}
 
-    i = 0
-    while i < last:
-        tp_key, = struct.unpack('Q', trace_log[i:i+8])
-        if tp_key == 0:
-            i = align_up(i + 8, trace_page_size)
-            continue
-
-        i += 8
-
-        thread, thread_name, time, cpu, flags = struct.unpack('Q16sQII', trace_log[i:i+40])
-        thread_name = thread_name.partition(b'\0')[0].decode()
-        i += 40
-
+    def lookup_tp(tp_key):
         tp = tracepoints.get(tp_key, None)
         if not tp:
             tp_ref = gdb.Value(tp_key).cast(tp_ptr)
             tp = TracePoint(tp_key, str(tp_ref["name"].string()),
                 sig_to_string(ulong(tp_ref['sig'])), str(tp_ref["format"].string()))
             tracepoints[tp_key] = tp
-
-        backtrace = None
-        if flags & 1:
-            backtrace = struct.unpack('Q' * backtrace_len, trace_log[i:i+8*backtrace_len])
-            i += 8 * backtrace_len
-
-        size = struct.calcsize(tp.signature)
-        data = struct.unpack(tp.signature, trace_log[i:i+size])
-        i += size
-        i = align_up(i, 8)
-        yield Trace(tp, thread, thread_name, time, cpu, data, backtrace=backtrace)
+        return tp
+
+    per_cpu = []
+    trace_buffers = gdb.lookup_global_symbol('trace_buffers').value()
+    for cpu in range(trace_buffers.type.range()[1] + 1):
+        tb = trace_buffers[cpu]
+        base = ulong(tb['_base'])
+        if not base:
+            continue
+        size = ulong(tb['_size'])
+        last = ulong(tb['_last']['_M_i'])
+        # Start at the oldest page, which is the one after the page holding
+        # the last record.
+        begin = max(0, align_up(last, trace_page_size) - size)
+        trace_log = inf.read_memory(base, size)
+        pivot = begin % size
+        trace_log = concat(trace_log[pivot:], trace_log[:pivot])
+        per_cpu.append(trace.parse_records(trace_log, begin, last,
+                trace_page_size, backtrace_len, lookup_tp))
+    return trace.merge_traces(per_cpu)
 
 def save_traces_to_file(filename):
     trace.write_to_file(filename, list(all_traces()))
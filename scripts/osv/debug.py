@@ -25,6 +25,24 @@ class DummyResolver(object):
             self.cache[addr] = src_addr
         return src_addr
 
+class FallbackResolver(object):
+    """
+    Resolves with delegate, and when it cannot, with symbols, a dictionary
+    of address -> (symbol address, name, object path).
+
+    """
+    def __init__(self, delegate, symbols):
+        self.delegate = delegate
+        self.symbols = symbols
+
+    def __call__(self, addr):
+        src_addr = self.delegate(addr)
+        if not src_addr.name and addr in self.symbols:
+            _, name, filename = self.symbols[addr]
+            if name:
+                src_addr = SourceAddress(addr, name, filename)
+        return src_addr
+
 class SymbolResolver(object):
     def __init__(self, object_path):
         if not os.path.exists(object_path):
@@ -2,10 +2,24 @@ import os
 import mmap
 import struct
 import sys
+import heapq
+from collections import defaultdict
 
 # version 2 introduced thread_name
 _format_version = 2
 
+# The trace stream written by the guest (see core/trace.cc)
+_stream_magic = b'OSVTRSTR'
+_stream_version = 2
+_stream_tracepoint = 1
+_stream_data = 2
+_stream_symbols = 3
+
+# Backtrace addresses (minus one) resolved by the guest, filled by
+# read_stream(): address -> (symbol address, symbol name, object path).
+# Covers shared objects, which the host cannot resolve from loader.elf.
+stream_symbols = {}
+
 def nanos_to_millis(nanos):
     return float(nanos) / 1000000
 
@@ -31,6 +45,21 @@ class BacktraceFormatter:
 
         return '   [' + ', '.join((str(self.resolver(x - 1)) for x in backtrace if x)) + ']'
 
+def sig_to_string(sig):
+    '''Convert a tracepoing signature encoded in a u64 to a string'''
+    ret = ''
+    while sig != 0:
+        ret += chr(sig & 255)
+        sig >>= 8
+    ret = ret.replace('p', '50p')
+    return ret
+
+def align_down(v, pagesize):
+    return v & ~(pagesize - 1)
+
+def align_up(v, pagesize):
+    return align_down(v + pagesize - 1, pagesize)
+
 def simple_symbol_formatter(addr):
     return '0x%x' % frame
 
@@ -196,6 +225,97 @@ def read(buffer_view):
         data = unpacker.unpack(tp.signature)
         yield Trace(tp, thread, thread_name, time, cpu, data, backtrace=backtrace)
 
+def parse_records(trace_log, begin, end, page_size, backtrace_len, lookup_tp):
+    """
+    Yields the traces in a cpu's trace log, as laid out in memory by the
+    guest. trace_log holds the log from position begin (page aligned) to
+    position end. lookup_tp() maps a tracepoint key to a TracePoint.
+
+    """
+    i = 0
+    end -= begin
+    while i < end:
+        tp_key, = struct.unpack('Q', trace_log[i:i+8])
+        if tp_key == 0:
+            i = align_up(i + 8, page_size)
+            continue
+
+        i += 8
+
+        thread, thread_name, time, cpu, flags = struct.unpack('Q16sQII', trace_log[i:i+40])
+        thread_name = thread_name.partition(b'\0')[0].decode()
+        i += 40
+
+        tp = lookup_tp(tp_key)
+
+        backtrace = None
+        if flags & 1:
+            backtrace = struct.unpack('Q' * backtrace_len, trace_log[i:i+8*backtrace_len])
+            i += 8 * backtrace_len
+
+        size = struct.calcsize(tp.signature)
+        data = struct.unpack(tp.signature, trace_log[i:i+size])
+        i += size
+        i = align_up(i, 8)
+        yield Trace(tp, thread, thread_name, time, cpu, data, backtrace=backtrace)
+
+def _keyed_by_time(traces, n):
+    for seq, trace in enumerate(traces):
+        yield (trace.time, n, seq, trace)
+
+def merge_traces(per_cpu_traces):
+    """Merges per-cpu sequences of traces, each ordered by time, into one."""
+    keyed = [_keyed_by_time(traces, n) for n, traces in enumerate(per_cpu_traces)]
+    for _, _, _, trace in heapq.merge(*keyed):
+        yield trace
+
+def read_stream(buffer_view):
+    unpacker = SlidingUnpacker(buffer_view)
+    magic, version, page_size, backtrace_len, _ = unpacker.unpack('=8sIIII')
+
+    if magic != _stream_magic:
+        raise Exception('Not a trace stream')
+    if version != _stream_version:
+        raise Exception('Version mismatch, current is %d got %d' % (_stream_version, version))
+
+    tracepoints = {}
+    chunks = defaultdict(list)
+    begin = {}
+    end = {}
+    lost = defaultdict(int)
+    while unpacker:
+        block_type, = unpacker.unpack('=I')
+        if block_type == _stream_tracepoint:
+            key, sig = unpacker.unpack('=QQ')
+            tracepoints[key] = TracePoint(key, unpacker.unpack_str(),
+                sig_to_string(sig), unpacker.unpack_str())
+        elif block_type == _stream_data:
+            cpu, pos, length, n_lost = unpacker.unpack('=IQQQ')
+            if unpacker.offset + length > len(buffer_view):
+                # The guest stopped in the middle of writing this block
+                break
+            begin.setdefault(cpu, pos)
+            end[cpu] = pos + length
+            chunks[cpu].append(buffer_view[unpacker.offset:unpacker.offset + length])
+            unpacker.offset += length
+            lost[cpu] += n_lost
+        elif block_type == _stream_symbols:
+            count, = unpacker.unpack('=I')
+            for i in range(count):
+                addr, sym_addr = unpacker.unpack('=QQ')
+                stream_symbols[addr] = (sym_addr, unpacker.unpack_str(),
+                    unpacker.unpack_str())
+        else:
+            raise Exception('Corrupt trace stream, unknown block type %d' % block_type)
+
+    for cpu in sorted(lost):
+        if lost[cpu]:
+            sys.stderr.write('cpu %d: %d trace records lost\n' % (cpu, lost[cpu]))
+
+    return merge_traces([parse_records(b''.join(chunks[cpu]), begin[cpu], end[cpu],
+                                       page_size, backtrace_len, tracepoints.__getitem__)
+                         for cpu in chunks])
+
 def write(traces, writer):
     packer = WritingPacker(writer)
     packer.pack('i', _format_version)
@@ -233,6 +353,8 @@ class read_file:
         self.file.close()
 
     def get_traces(self):
+        if self.map[:len(_stream_magic)] == _stream_magic:
+            return read_stream(self.map)
         return read(self.map)
 
 def write_to_file(filename, traces):
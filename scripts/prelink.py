@@ -0,0 +1,344 @@
+#!/usr/bin/python2
+
+# Resolves the symbols of the shared objects an image loads, the way the
+# OSv ELF loader would, and writes the results to a prelink cache. With the
+# cache in the image as /etc/prelink.cache, the loader takes the definitions
+# of an object's symbols from it instead of searching every loaded object,
+# as long as the same objects (by build ID) are loaded in the same order.
+# Otherwise the cache is just ignored, so a stale one is harmless.
+#
+# Usage:
+#
+#   scripts/prelink.py -o build/release/prelink.cache \
+#       -k build/release/loader.elf -m build/release/usr.manifest \
+#       [-D var=value ...] /first/loaded.so [/next/loaded.so ...]
+#
+# The objects given are the ones the image loads with osv::run() (e.g., the
+# command line's programs), in order, assuming none is unloaded in between.
+# Their dependencies are found through the manifests, like the loader finds
+# them in the image. Then add the cache to the image's manifest:
+#
+#   /etc/prelink.cache: build/release/prelink.cache
+
+import os, sys, struct, optparse, ConfigParser
+
+defines = {}
+
+def add_var(option, opt, value, parser):
+    var, val = value.split('=')
+    defines[var] = val
+
+def expand(items):
+    for name, hostname in items:
+        if name.endswith('/**') and hostname.endswith('/**'):
+            name = name[:-2]
+            hostname = hostname[:-2]
+            for dirpath, dirnames, filenames in os.walk(hostname):
+                for filename in filenames:
+                    relpath = dirpath[len(hostname):]
+                    if relpath != "" :
+                        relpath += "/"
+                    yield (name + relpath + filename,
+                           hostname + relpath + filename)
+        elif '/&/' in name and hostname.endswith('/&'):
+            prefix, suffix = name.split('/&/', 1)
+            yield (prefix + '/' + suffix, hostname[:-1] + suffix)
+        else:
+            yield (name, hostname)
+
+# Must match core/elf.cc
+prelink_magic = 'OSVPRLNK'
+prelink_version = 1
+no_definition = 0xffffffff
+
+# Libraries the kernel provides, see program::program()
+supplied_modules = [
+    'libc.so.6',
+    'libm.so.6',
+    'ld-linux-x86-64.so.2',
+    'libpthread.so.0',
+    'libdl.so.2',
+    'librt.so.1',
+    'libstdc++.so.6',
+    'libboost_system-mt.so.1.53.0',
+    'libboost_program_options-mt.so.1.53.0',
+]
+
+search_path = ['/', '/usr/lib']
+
+PT_LOAD = 1
+PT_DYNAMIC = 2
+PT_NOTE = 4
+DT_NULL = 0
+DT_NEEDED = 1
+DT_HASH = 4
+DT_STRTAB = 5
+DT_SYMTAB = 6
+DT_RELA = 7
+DT_RELASZ = 8
+DT_SONAME = 14
+DT_RPATH = 15
+DT_GNU_HASH = 0x6ffffef5
+NT_GNU_BUILD_ID = 3
+SHN_UNDEF = 0
+R_X86_64_64 = 1
+R_X86_64_GLOB_DAT = 6
+R_X86_64_JUMP_SLOT = 7
+R_X86_64_DPTMOD64 = 16
+R_X86_64_DTPOFF64 = 17
+R_X86_64_TPOFF64 = 18
+
+# Relocation types for which object::relocate_rela() looks up the symbol
+symbol_relocations = set([R_X86_64_64, R_X86_64_GLOB_DAT, R_X86_64_JUMP_SLOT,
+                          R_X86_64_DPTMOD64, R_X86_64_DTPOFF64,
+                          R_X86_64_TPOFF64])
+
+def align_up(v, a):
+    return (v + a - 1) & ~(a - 1)
+
+class ElfObject(object):
+    def __init__(self, pathname, hostname):
+        self.pathname = pathname
+        self.data = open(hostname, 'rb').read()
+        if self.data[:4] != '\x7fELF':
+            raise Exception('%s: not an ELF file' % hostname)
+        (phoff, ) = struct.unpack_from('<Q', self.data, 32)
+        phentsize, phnum = struct.unpack_from('<HH', self.data, 54)
+        self.loads = []
+        self.build_id = ''
+        dynamic = None
+        notes = []
+        for i in range(phnum):
+            (p_type, p_flags, p_offset, p_vaddr, p_paddr, p_filesz,
+             p_memsz, p_align) = struct.unpack_from('<IIQQQQQQ', self.data,
+                                                    phoff + i * phentsize)
+            if p_type == PT_LOAD:
+                self.loads.append((p_vaddr, p_offset, p_filesz))
+            elif p_type == PT_DYNAMIC:
+                dynamic = p_offset
+            elif p_type == PT_NOTE:
+                notes.append((p_offset, p_filesz))
+        for offset, size in notes:
+            self.read_build_id(offset, size)
+        if dynamic is None:
+            raise Exception('%s: not a shared object' % hostname)
+        self.dynamic = []
+        while True:
+            tag, val = struct.unpack_from('<qQ', self.data, dynamic)
+            if tag == DT_NULL:
+                break
+            self.dynamic.append((tag, val))
+            dynamic += 16
+        self.strtab = self.offset(self.dynamic_val(DT_STRTAB))
+        self.read_symbols()
+
+    def read_build_id(self, offset, size):
+        end = offset + size
+        while offset + 12 <= end:
+            namesz, descsz, type = struct.unpack_from('<III', self.data, offset)
+            name = self.data[offset + 12:offset + 12 + namesz]
+            desc = offset + 12 + align_up(namesz, 4)
+            if type == NT_GNU_BUILD_ID and name == 'GNU\0':
+                self.build_id = self.data[desc:desc + descsz]
+                return
+            offset = desc + align_up(descsz, 4)
+
+    def offset(self, vaddr):
+        for start, offset, size in self.loads:
+            if start <= vaddr < start + size:
+                return offset + vaddr - start
+        raise Exception('%s: address 0x%x not in the file' % (self.pathname, vaddr))
+
+    def dynamic_val(self, tag):
+        for t, v in self.dynamic:
+            if t == tag:
+                return v
+        return None
+
+    def dynamic_vals(self, tag):
+        return [v for t, v in self.dynamic if t == tag]
+
+    def string(self, index):
+        start = self.strtab + index
+        return self.data[start:self.data.index('\0', start)]
+
+    def symbol_count(self):
+        # Like object::symbol_count()
+        if self.dynamic_val(DT_HASH) is not None:
+            return struct.unpack_from('<I', self.data,
+                                      self.offset(self.dynamic_val(DT_HASH)) + 4)[0]
+        hashtab = self.offset(self.dynamic_val(DT_GNU_HASH))
+        nbucket, symndx, maskwords = struct.unpack_from('<III', self.data, hashtab)
+        buckets = hashtab + 16 + 8 * maskwords
+        chains = buckets + 4 * nbucket
+        count = symndx
+        for b in range(nbucket):
+            (idx, ) = struct.unpack_from('<I', self.data, buckets + 4 * b)
+            if idx == 0:
+                continue
+            while True:
+                (h, ) = struct.unpack_from('<I', self.data, chains + 4 * (idx - symndx))
+                count = max(count, idx + 1)
+                idx += 1
+                if h & 1:
+                    break
+        self.symndx = symndx
+        return count
+
+    def read_symbols(self):
+        self.symndx = 0
+        count = self.symbol_count()
+        symtab = self.offset(self.dynamic_val(DT_SYMTAB))
+        self.names = []
+        # Symbols object::lookup_symbol() can find, by name
+        self.defined = {}
+        for i in range(count):
+            st_name, st_info, st_other, st_shndx = struct.unpack_from(
+                '<IBBH', self.data, symtab + 24 * i)
+            name = self.string(st_name)
+            self.names.append(name)
+            if name and st_shndx != SHN_UNDEF and i >= self.symndx:
+                self.defined.setdefault(name, i)
+
+    def needed(self):
+        return [self.string(v) for v in self.dynamic_vals(DT_NEEDED)]
+
+    def soname(self):
+        v = self.dynamic_val(DT_SONAME)
+        return self.string(v) if v is not None else ''
+
+    def rpath(self):
+        v = self.dynamic_val(DT_RPATH)
+        if v is None:
+            return []
+        origin = os.path.dirname(self.pathname)
+        return self.string(v).replace('$ORIGIN', origin).split(':')
+
+    def referenced_symbols(self):
+        rela = self.dynamic_val(DT_RELA)
+        if rela is None:
+            return set()
+        rela = self.offset(rela)
+        ret = set()
+        for i in range(self.dynamic_val(DT_RELASZ) / 24):
+            r_offset, r_info, r_addend = struct.unpack_from('<QQq', self.data,
+                                                            rela + 24 * i)
+            sym, type = r_info >> 32, r_info & 0xffffffff
+            if sym and type in symbol_relocations:
+                ret.add(sym)
+        return ret
+
+class Loader(object):
+    """Follows program::get_library(), recording what each relocation sees"""
+
+    def __init__(self, files, kernel):
+        self.files = files
+        self.kernel = kernel
+        self.modules = [kernel]
+        self.loaded = dict((name, kernel) for name in supplied_modules)
+        self.records = []
+
+    def get_library(self, name, extra_path=[]):
+        hostname = None
+        if '/' not in name:
+            for dir in extra_path + search_path:
+                dname = os.path.normpath(os.path.join(dir, name))
+                if dname in self.files:
+                    name, hostname = dname, self.files[dname]
+                    break
+        else:
+            name = os.path.normpath(name)
+            hostname = self.files.get(name)
+        if name in self.loaded:
+            return self.loaded[name]
+        if not hostname:
+            sys.stderr.write('warning: %s not found in the image\n' % name)
+            return None
+        obj = ElfObject(name, hostname)
+        self.modules.insert(len(self.modules) - 1, obj)
+        rpath = obj.rpath()
+        for lib in obj.needed():
+            self.get_library(lib, rpath)
+        self.relocate(obj)
+        self.loaded[name] = obj
+        self.loaded[obj.soname()] = obj
+        return obj
+
+    def lookup(self, name):
+        for scope_index, module in enumerate(self.modules):
+            sym = module.defined.get(name)
+            if sym is not None:
+                return scope_index, sym
+        return no_definition, 0
+
+    def relocate(self, obj):
+        missing = [m.pathname or 'the kernel' for m in self.modules if not m.build_id]
+        if missing:
+            sys.stderr.write('warning: not prelinking %s: no build ID in %s\n'
+                             % (obj.pathname, ', '.join(missing)))
+            return
+        symbols = [(no_definition, 0)] * len(obj.names)
+        for sym in obj.referenced_symbols():
+            symbols[sym] = self.lookup(obj.names[sym])
+        self.records.append(([m.build_id for m in self.modules],
+                             self.modules.index(obj), symbols))
+
+def write_cache(out, records):
+    out.write(prelink_magic)
+    out.write(struct.pack('<II', prelink_version, len(records)))
+    for scope, index, symbols in records:
+        out.write(struct.pack('<I', len(scope)))
+        for build_id in scope:
+            out.write(struct.pack('<I', len(build_id)) + build_id)
+        out.write(struct.pack('<II', index, len(symbols)))
+        for definition in symbols:
+            out.write(struct.pack('<II', *definition))
+
+def main():
+    opt = optparse.OptionParser(usage='%prog [options] object...', option_list = [
+            optparse.make_option('-o',
+                                 dest = 'output',
+                                 help = 'write the cache to FILE',
+                                 metavar = 'FILE'),
+            optparse.make_option('-k',
+                                 dest = 'kernel',
+                                 help = 'the kernel (loader.elf)',
+                                 metavar = 'FILE'),
+            optparse.make_option('-m',
+                                 dest = 'manifests',
+                                 help = 'read the image\'s files from manifest FILE',
+                                 metavar = 'FILE',
+                                 action = 'append',
+                                 default = []),
+            optparse.make_option('-D',
+                                 type = 'string',
+                                 help = 'define VAR=DATA',
+                                 metavar = 'VAR=DATA',
+                                 action = 'callback',
+                                 callback = add_var),
+    ])
+    (options, args) = opt.parse_args()
+    if not options.output or not options.kernel or not args:
+        opt.error('an output file, the kernel and objects to load are required')
+
+    files = {}
+    for filename in options.manifests:
+        manifest = ConfigParser.SafeConfigParser()
+        manifest.optionxform = str # avoid lowercasing
+        manifest.read(filename)
+        items = [(f, manifest.get('manifest', f, vars = defines))
+                 for f in manifest.options('manifest')]
+        files.update(expand(items))
+
+    kernel = ElfObject('', options.kernel)
+    loader = Loader(files, kernel)
+    for name in args:
+        if not loader.get_library(name):
+            sys.exit(1)
+
+    with open(options.output, 'wb') as out:
+        write_cache(out, loader.records)
+    print('%s: %d objects prelinked' % (options.output, len(loader.records)))
+
+if __name__ == '__main__':
+    main()
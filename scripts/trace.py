@@ -74,6 +74,11 @@ class BeautifyingResolver(object):
         return src_addr
 
 def symbol_resolver(args):
+    """
+    Symbols which are not in loader.elf are looked up in the ones described
+    in the trace stream, once it is read.
+
+    """
     if args.no_resolve:
         return debug.DummyResolver()
 
@@ -84,7 +89,8 @@ def symbol_resolver(args):
     else:
         elf_path = 'build/release/loader.elf'
 
-    return BeautifyingResolver(debug.SymbolResolver(elf_path))
+    return BeautifyingResolver(debug.FallbackResolver(
+        debug.SymbolResolver(elf_path), trace.stream_symbols))
 
 def get_backtrace_formatter(args):
     if not args.backtrace:
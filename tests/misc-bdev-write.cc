@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "stat.hh"
@@ -15,6 +16,7 @@
 #include <osv/bio.h>
 #include <osv/prex.h>
 #include <osv/mempool.hh>
+#include <osv/trace.hh>
 
 #define MB (1024*1024)
 #define KB (1024)
@@ -36,31 +38,42 @@ static void bio_done(struct bio* bio)
     }
 }
 
-int main(int argc, char const *argv[])
-{
-    struct device *dev;
-    if (argc < 2) {
-        printf("Usage: %s <dev-name>\n", argv[0]);
-        return 1;
-    }
-
-    if (device_open(argv[1], DO_RDWR, &dev)) {
-        printf("open failed\n");
-        return 1;
+// Counts the times virtio drivers notify the host, each costing an exit
+class kick_counter : public tracepoint_base::probe {
+public:
+    kick_counter() {
+        for (auto& tp : tracepoint_base::tp_list) {
+            if (!strcmp(tp.name, "virtio_kick")) {
+                _tp = &tp;
+                _tp->add_probe(this);
+            }
+        }
     }
-
-    long max_offset = 0;
-    if (argc > 2) {
-        max_offset = atol(argv[2]);
+    virtual ~kick_counter() {
+        if (_tp) {
+            _tp->del_probe(this);
+        }
     }
-
-    printf("bdev-write test offset limit: %ld byte(s)\n", max_offset);
-
+    virtual void hit() { _count.fetch_add(1, std::memory_order_relaxed); }
+    long read() { return _count.load(); }
+private:
+    tracepoint_base* _tp = nullptr;
+    std::atomic<long> _count{0};
+};
+
+// Write sequentially for test_duration, submitting bios in bursts of the
+// given size between bio_plug() and bio_unplug().
+static void run(struct device* dev, long max_offset, int burst)
+{
     const std::chrono::seconds test_duration(10);
     const int buf_size = 4*KB;
 
     long total = 0;
     long offset = 0;
+    long ios = 0;
+    kick_counter kicks;
+
+    printf("bursts of %d bio(s)\n", burst);
 
     auto test_start = s_clock.now();
     auto end_at = test_start + test_duration;
@@ -70,23 +83,28 @@ int main(int argc, char const *argv[])
     }, 1000);
 
     while (s_clock.now() < end_at) {
-        auto bio = alloc_bio();
-        bio_inflights++;
-        bio->bio_cmd = BIO_WRITE;
-        bio->bio_dev = dev;
-        bio->bio_data = memory::alloc_page();
-        bio->bio_offset = offset;
-        bio->bio_bcount = buf_size;
-        bio->bio_caller1 = bio;
-        bio->bio_done = bio_done;
-
-        dev->driver->devops->strategy(bio);
-
-        offset += buf_size;
-        total += buf_size;
-
-        if (max_offset != 0 && offset >= max_offset)
-            offset = 0;
+        bio_plug();
+        for (int i = 0; i < burst; i++) {
+            auto bio = alloc_bio();
+            bio_inflights++;
+            bio->bio_cmd = BIO_WRITE;
+            bio->bio_dev = dev;
+            bio->bio_data = memory::alloc_page();
+            bio->bio_offset = offset;
+            bio->bio_bcount = buf_size;
+            bio->bio_caller1 = bio;
+            bio->bio_done = bio_done;
+
+            dev->driver->devops->strategy(bio);
+
+            offset += buf_size;
+            total += buf_size;
+            ios++;
+
+            if (max_offset != 0 && offset >= max_offset)
+                offset = 0;
+        }
+        bio_unplug();
     }
 
     while (bio_inflights != 0) {
@@ -97,7 +115,34 @@ int main(int argc, char const *argv[])
     _stat_printer.stop();
 
     auto actual_test_duration = to_seconds(test_end - test_start);
-    printf("Wrote %.3f MB in %.2f s = %.3f Mb/s\n", (double) total / MB, actual_test_duration,
-            (double) total / MB / actual_test_duration);
+    printf("Wrote %.3f MB in %.2f s = %.3f Mb/s, %.0f IOPS, %.3f exits per IO\n",
+            (double) total / MB, actual_test_duration,
+            (double) total / MB / actual_test_duration,
+            ios / actual_test_duration, (double) kicks.read() / ios);
+}
+
+int main(int argc, char const *argv[])
+{
+    struct device *dev;
+    if (argc < 2) {
+        printf("Usage: %s <dev-name>\n", argv[0]);
+        return 1;
+    }
+
+    if (device_open(argv[1], DO_RDWR, &dev)) {
+        printf("open failed\n");
+        return 1;
+    }
+
+    long max_offset = 0;
+    if (argc > 2) {
+        max_offset = atol(argv[2]);
+    }
+
+    printf("bdev-write test offset limit: %ld byte(s)\n", max_offset);
+
+    for (int burst : { 1, 32 }) {
+        run(dev, max_offset, burst);
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure the latency of epoll_wait() as a function of the number of
+// registered, but idle, file descriptors. With a ready-list based epoll,
+// the latency should not depend on the number of idle descriptors.
+//
+// The idle descriptors are unconnected UDP sockets, which cost a single
+// file descriptor each and never become ready. One pipe is used to
+// generate the events we wait for.
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+static constexpr int iterations = 100000;
+
+static void bench(int nidle)
+{
+    int ep = epoll_create1(0);
+    if (ep < 0) {
+        perror("epoll_create1");
+        return;
+    }
+
+    std::vector<int> idle;
+    idle.reserve(nidle);
+    struct epoll_event event;
+    for (int i = 0; i < nidle; i++) {
+        int s = socket(AF_INET, SOCK_DGRAM, 0);
+        if (s < 0) {
+            std::cout << "could only create " << i << " idle sockets: "
+                      << strerror(errno) << "\n";
+            break;
+        }
+        idle.push_back(s);
+        event.events = EPOLLIN;
+        event.data.u32 = i + 1;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, s, &event) < 0) {
+            perror("epoll_ctl");
+            break;
+        }
+    }
+
+    int p[2];
+    if (pipe(p) < 0) {
+        perror("pipe");
+        return;
+    }
+    event.events = EPOLLIN;
+    event.data.u32 = 0;
+    epoll_ctl(ep, EPOLL_CTL_ADD, p[0], &event);
+
+    // The first wait reports the initial state of every newly registered
+    // file; don't count it.
+    struct epoll_event events[16];
+    epoll_wait(ep, events, 16, 0);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        char c = 'x';
+        if (write(p[1], &c, 1) != 1) {
+            perror("write");
+            break;
+        }
+        int r = epoll_wait(ep, events, 16, -1);
+        if (r != 1 || events[0].data.u32 != 0) {
+            std::cout << "unexpected epoll_wait result " << r << "\n";
+            break;
+        }
+        if (read(p[0], &c, 1) != 1) {
+            perror("read");
+            break;
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            end - start).count();
+
+    std::cout << idle.size() << " idle fds: " << ns / iterations
+              << " ns per write+epoll_wait+read\n";
+
+    close(p[0]);
+    close(p[1]);
+    for (auto s : idle) {
+        close(s);
+    }
+    close(ep);
+}
+
+int main(int ac, char** av)
+{
+    for (int n : { 1, 1000, 50000 }) {
+        bench(n);
+    }
+    return 0;
+}
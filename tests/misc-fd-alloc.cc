@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure the cost of allocating and freeing a file descriptor as a
+// function of the number of descriptors already open. Descriptors are
+// allocated with dup(), which costs nothing but a descriptor table slot.
+//
+// "append" closes and reopens the descriptor just past the open ones, so
+// the allocator has to skip all of them to find it. "hole" closes a random
+// descriptor among the open ones and expects dup() to reuse it (the lowest
+// free descriptor), as happens under connection churn. With an indexed
+// allocator, neither should depend much on the number of open descriptors.
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+static constexpr int iterations = 1000000;
+
+static void bench(int base, int nopen)
+{
+    std::vector<int> fds;
+    fds.reserve(nopen);
+    for (int i = 0; i < nopen; i++) {
+        int fd = dup(base);
+        if (fd < 0) {
+            std::cout << "could only open " << i << " fds: "
+                      << strerror(errno) << "\n";
+            break;
+        }
+        fds.push_back(fd);
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        int fd = dup(base);
+        if (fd < 0) {
+            perror("dup");
+            break;
+        }
+        close(fd);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto append = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            end - start).count();
+
+    long long hole = 0;
+    if (!fds.empty()) {
+        bool lowest = true;
+        start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            auto& slot = fds[rand() % fds.size()];
+            close(slot);
+            int fd = dup(base);
+            lowest &= fd == slot;
+            slot = fd;
+        }
+        end = std::chrono::high_resolution_clock::now();
+        hole = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                end - start).count();
+        if (!lowest) {
+            std::cout << "dup() did not return the lowest free fd\n";
+        }
+    }
+
+    std::cout << fds.size() << " open fds: append " << append / iterations
+              << " ns, hole " << hole / iterations
+              << " ns per close+dup\n";
+
+    for (auto fd : fds) {
+        close(fd);
+    }
+}
+
+int main(int ac, char** av)
+{
+    int p[2];
+    if (pipe(p) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    for (int n : { 0, 1000, 10000, 100000 }) {
+        bench(p[0], n);
+    }
+    close(p[0]);
+    close(p[1]);
+    return 0;
+}
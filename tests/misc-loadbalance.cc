@@ -61,11 +61,33 @@
 //    of time it takes for the load balancer to act. When starting 4 threads
 //    they all start on the same CPU and the load balancer might not migrate
 //    them right away.
+//
+// For each run we also report the throughput (how many loops worth of work
+// were done per loop time, ideally the smaller of the number of threads and
+// 2), and how many times each thread was migrated between CPUs. Migrations
+// are expected in the 3-loop cases, but with 2 or 4 loops a good balancer
+// should settle quickly and then leave the threads alone.
 
 #include <thread>
 #include <chrono>
 #include <iostream>
 #include <vector>
+#include <atomic>
+#include <algorithm>
+
+#ifdef __OSV__
+#include <osv/sched.hh>
+static unsigned current_cpu()
+{
+    return sched::cpu::current()->id;
+}
+#else
+#include <sched.h>
+static unsigned current_cpu()
+{
+    return sched_getcpu();
+}
+#endif
 
 void _loop(int iterations)
 {
@@ -77,10 +99,25 @@ void _loop(int iterations)
     }
 }
 
-double loop(int iterations)
+// Run the loop, counting in *migrations the number of times the thread
+// moved to a different cpu while doing it.
+double loop(int iterations, unsigned* migrations = nullptr)
 {
+    constexpr int chunk = 100;
     auto start = std::chrono::system_clock::now();
-    _loop(iterations);
+    unsigned cpu = current_cpu();
+    unsigned n = 0;
+    for (int i = 0; i < iterations; i += chunk) {
+        _loop(std::min(chunk, iterations - i));
+        auto c = current_cpu();
+        if (c != cpu) {
+            ++n;
+            cpu = c;
+        }
+    }
+    if (migrations) {
+        *migrations = n;
+    }
     auto end = std::chrono::system_clock::now();
     std::chrono::duration<double> sec = end - start;
     return sec.count();
@@ -92,10 +129,14 @@ void concurrent_loops(int looplen, int N, double secs, double expect)
             expect << ".\n";
     auto start = std::chrono::system_clock::now();
     std::vector<std::thread> threads;
+    std::atomic<unsigned> total_migrations(0);
     for (int i = 0; i < N; i++) {
-            threads.push_back(std::thread([=]() {
-                double d = loop(looplen);
-                std::cout << "thread " << i << ": " << d << " [x" << (d/secs) << "]\n";
+            threads.push_back(std::thread([=, &total_migrations]() {
+                unsigned migrations;
+                double d = loop(looplen, &migrations);
+                total_migrations += migrations;
+                std::cout << "thread " << i << ": " << d << " [x" << (d/secs) << "], "
+                        << migrations << " migrations\n";
             }));
     }
     for (auto &t : threads) {
@@ -104,12 +145,12 @@ void concurrent_loops(int looplen, int N, double secs, double expect)
     auto end = std::chrono::system_clock::now();
     std::chrono::duration<double> sec = end - start;
     double d = sec.count();
-    std::cout << "all done in " << d << " [x" << (d/secs) << "]\n";
+    std::cout << "all done in " << d << " [x" << (d/secs) << "], throughput "
+            << (N*secs/d) << ", " << total_migrations << " migrations\n";
 }
 
 #ifdef __OSV__
 
-#include <osv/sched.hh>
 void concurrent_loops_priority(int looplen, double secs)
 {
     std::cout << "\nRunning 3 concurrent loops, one with 0.5 priority and twice the length. Expecting x1.\n";
@@ -117,8 +158,10 @@ void concurrent_loops_priority(int looplen, double secs)
     std::vector<sched::thread*> threads;
     for (int i = 0; i < 3; i++) {
         auto t = new sched::thread([=]() {
-            double d = loop(looplen / (i == 0 ? 1 : 2));
-            std::cout << "thread " << i << ": " << d << " [x" << (d/secs) << "]\n";
+            unsigned migrations;
+            double d = loop(looplen / (i == 0 ? 1 : 2), &migrations);
+            std::cout << "thread " << i << ": " << d << " [x" << (d/secs) << "], "
+                    << migrations << " migrations\n";
         });
         t->set_priority(i == 0 ? 0.5 : 1.0);
         threads.push_back(t);
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure how much memory small malloc()s really consume, compared to the
+// bytes requested, for a few typical distributions of object sizes. For
+// comparison, also show what rounding each size up to a power of two would
+// need (not counting the pages' headers).
+
+#include <osv/mempool.hh>
+#include <osv/ilog2.hh>
+#include <osv/debug.hh>
+#include <stdlib.h>
+#include <math.h>
+#include <functional>
+#include <random>
+#include <vector>
+
+static constexpr unsigned nr_objects = 200000;
+
+static void measure(const char* name, std::function<size_t (std::mt19937&)> size)
+{
+    std::mt19937 rand;
+    std::vector<void*> objs;
+    objs.reserve(nr_objects);
+    size_t requested = 0, power_of_two = 0;
+    auto before = memory::stats::free();
+    for (unsigned i = 0; i < nr_objects; i++) {
+        auto s = size(rand);
+        requested += s;
+        power_of_two += size_t(1) << ilog2_roundup(std::max(s, size_t(8)));
+        objs.push_back(malloc(s));
+    }
+    auto consumed = before - memory::stats::free();
+    for (auto p : objs) {
+        free(p);
+    }
+    debug("%-24s requested %6.1f MB, consumed %6.1f MB (%3d%% used), "
+            "power of two classes %6.1f MB (%3d%% used)\n", name,
+            requested / 1e6, consumed / 1e6, requested * 100 / consumed,
+            power_of_two / 1e6, requested * 100 / power_of_two);
+}
+
+int main(int argc, char **argv)
+{
+    measure("uniform 1-2048 bytes", [] (std::mt19937& r) {
+        return std::uniform_int_distribution<size_t>(1, 2048)(r);
+    });
+    measure("log-uniform 8-2048 bytes", [] (std::mt19937& r) {
+        return size_t(exp2(std::uniform_real_distribution<double>(3, 11)(r)));
+    });
+    measure("records of 300-700 bytes", [] (std::mt19937& r) {
+        return std::uniform_int_distribution<size_t>(300, 700)(r);
+    });
+    measure("520 bytes", [] (std::mt19937& r) {
+        return size_t(520);
+    });
+    measure("power of two + 1", [] (std::mt19937& r) {
+        return (size_t(8) << std::uniform_int_distribution<unsigned>(0, 7)(r)) + 1;
+    });
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure the speed of large (multi-page) malloc()/free() once free memory
+// is fragmented into many page ranges, and show the fragmentation
+// statistics (also in /proc/pageranges).
+
+#include <osv/mempool.hh>
+#include <osv/clock.hh>
+#include <osv/debug.hh>
+#include <stdlib.h>
+#include <vector>
+
+static constexpr unsigned iterations = 100000;
+
+static s64 nanotime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+                (osv::clock::wall::now().time_since_epoch()).count();
+}
+
+static void show_fragmentation()
+{
+    auto s = memory::stats::page_ranges();
+    debug("%d free ranges, largest %d bytes, large object cache hits %d misses %d\n",
+            s.ranges, s.largest, s.large_cache_hits, s.large_cache_misses);
+}
+
+static void bench(size_t size)
+{
+    void* batch[16];
+    auto beg = nanotime();
+    for (unsigned i = 0; i < iterations; i += 16) {
+        for (auto& p : batch) {
+            p = malloc(size);
+        }
+        for (auto p : batch) {
+            free(p);
+        }
+    }
+    debug("%7d bytes: %6.2f Mops/s\n", size, iterations * 1000.0 / (nanotime() - beg));
+}
+
+int main(int argc, char **argv)
+{
+    show_fragmentation();
+    // Fragment free memory: allocate many objects, and free every other one
+    std::vector<void*> objs;
+    for (unsigned i = 0; i < 20000; i++) {
+        objs.push_back(malloc(4096 * (1 + i % 7)));
+    }
+    for (unsigned i = 0; i < objs.size(); i += 2) {
+        free(objs[i]);
+    }
+    show_fragmentation();
+    for (size_t size = 8192; size <= 1 << 20; size *= 2) {
+        bench(size);
+    }
+    show_fragmentation();
+    for (unsigned i = 1; i < objs.size(); i += 2) {
+        free(objs[i]);
+    }
+}
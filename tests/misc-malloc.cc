@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure the throughput of small object malloc()/free(), when each object
+// is freed on the cpu which allocated it, and when objects are allocated on
+// one cpu and freed on another (as happens with network buffers received on
+// one cpu and consumed by an application on another).
+//
+// Instructions: run this test with at least 2 vcpus
+
+#include <osv/sched.hh>
+#include <osv/mempool.hh>
+#include <osv/clock.hh>
+#include <osv/debug.hh>
+#include <lockfree/ring.hh>
+#include <stdlib.h>
+
+static constexpr unsigned iterations = 10000000;
+
+static s64 nanotime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+                (osv::clock::wall::now().time_since_epoch()).count();
+}
+
+static void report(const char* name, size_t size, s64 ns,
+        const memory::pool::stats_type& before)
+{
+    auto after = memory::stats::malloc_pools();
+    debug("%-10s %4d bytes: %6.1f Mops/s, alloc hits %d misses %d, "
+            "free hits %d misses %d\n", name, size, iterations * 1000.0 / ns,
+            after.alloc_hits - before.alloc_hits,
+            after.alloc_misses - before.alloc_misses,
+            after.free_hits - before.free_hits,
+            after.free_misses - before.free_misses);
+}
+
+static void same_cpu(size_t size)
+{
+    auto stats = memory::stats::malloc_pools();
+    void* batch[64];
+    auto beg = nanotime();
+    for (unsigned i = 0; i < iterations; i += 64) {
+        for (auto& p : batch) {
+            p = malloc(size);
+        }
+        for (auto p : batch) {
+            free(p);
+        }
+    }
+    report("same cpu", size, nanotime() - beg, stats);
+}
+
+static void cross_cpu(size_t size)
+{
+    auto stats = memory::stats::malloc_pools();
+    ring_spsc<void*, 4096> ring;
+    sched::thread producer([&] {
+        for (unsigned i = 0; i < iterations; i++) {
+            auto p = malloc(size);
+            while (!ring.push(p)) {
+                sched::thread::yield();
+            }
+        }
+    }, sched::thread::attr().pin(sched::cpus[0]));
+    sched::thread consumer([&] {
+        for (unsigned i = 0; i < iterations; i++) {
+            void* p;
+            while (!ring.pop(p)) {
+                sched::thread::yield();
+            }
+            free(p);
+        }
+    }, sched::thread::attr().pin(sched::cpus[1]));
+    auto beg = nanotime();
+    producer.start();
+    consumer.start();
+    producer.join();
+    consumer.join();
+    report("cross cpu", size, nanotime() - beg, stats);
+}
+
+int main(int argc, char **argv)
+{
+    if (sched::cpus.size() < 2) {
+        debug("this test requires at least 2 cpus\n");
+        return 0;
+    }
+    for (size_t size : { 16, 64, 256, 1024 }) {
+        same_cpu(size);
+        cross_cpu(size);
+    }
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <sys/mman.h>
 #include <cstdio>
 #include <chrono>
+#include <osv/mmu.hh>
 
 std::chrono::duration<double> mmap_and_write(size_t mb, int flags)
 {
@@ -17,18 +18,44 @@ std::chrono::duration<double> mmap_and_write(size_t mb, int flags)
 
 void mmap_bench(size_t mb)
 {
+    auto before = mmu::get_huge_page_stats();
     auto demand   = mmap_and_write(mb, 0);
     auto populate = mmap_and_write(mb, MAP_POPULATE);
+    auto after = mmu::get_huge_page_stats();
 
-    printf("%4lu %-6.3f %-6.3f\n", mb, demand.count(), populate.count());
+    printf("%4lu %-6.3f %-6.3f   %6lu %9lu\n", mb, demand.count(), populate.count(),
+            after.mapped - before.mapped, after.fallbacks - before.fallbacks);
+}
+
+// Changing the protection of part of a huge page, or unmapping it, must
+// split it into small pages.
+void split_bench()
+{
+    size_t size = 64*1024*1024;
+    auto before = mmu::get_huge_page_stats();
+    char *p = reinterpret_cast<char*>(mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0));
+    for (size_t i = 0; i < size; i += 4096) {
+        p[i] = 0xfe;
+    }
+    auto start = std::chrono::system_clock::now();
+    for (size_t i = 0; i < size; i += 2*1024*1024) {
+        mprotect(p + i, 4096, PROT_READ);
+    }
+    auto end = std::chrono::system_clock::now();
+    munmap(p, size);
+    auto after = mmu::get_huge_page_stats();
+    std::chrono::duration<double> t = end - start;
+    printf("partial mprotect of %lu MiB: %-6.3f seconds, %lu huge pages mapped, %lu split\n",
+            size >> 20, t.count(), after.mapped - before.mapped,
+            after.splits - before.splits);
 }
 
 int main()
 {
     for (auto i = 1; i <= 5; i++) {
         printf("Iteration %d\n\n", i);
-        printf("     time (seconds)\n");
-        printf(" MiB demand populate\n");
+        printf("     time (seconds)  huge pages\n");
+        printf(" MiB demand populate mapped fallbacks\n");
 
         for (auto mb = 1; mb <= 1024; mb *= 2) {
             mmap_bench(mb);
@@ -36,4 +63,5 @@ int main()
 
         printf("\n");
     }
+    split_bench();
 }
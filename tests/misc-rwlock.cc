@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure how read-lock throughput scales with the number of cpus, for the
+// default rwlock (which counts readers under its mutex), a RWLOCK_READ_MOSTLY
+// rwlock (per-cpu reader counts) and pthread_rwlock_t. Each reader thread is
+// pinned to its own cpu. The test is then repeated with a writer taking the
+// lock every millisecond, to show that readers do not starve it.
+//
+// Usage: misc-rwlock.so [iterations]
+
+#include <osv/rwlock.h>
+#include <osv/sched.hh>
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+struct plain_rwlock {
+    static const char* name() { return "rwlock"; }
+    rwlock l;
+    void rlock() { l.rlock(); }
+    void runlock() { l.runlock(); }
+    void wlock() { l.wlock(); }
+    void wunlock() { l.wunlock(); }
+};
+
+struct read_mostly_rwlock {
+    static const char* name() { return "rwlock read-mostly"; }
+    rwlock l{RWLOCK_READ_MOSTLY};
+    void rlock() { l.rlock(); }
+    void runlock() { l.runlock(); }
+    void wlock() { l.wlock(); }
+    void wunlock() { l.wunlock(); }
+};
+
+struct posix_rwlock {
+    static const char* name() { return "pthread_rwlock"; }
+    pthread_rwlock_t l = PTHREAD_RWLOCK_INITIALIZER;
+    ~posix_rwlock() { pthread_rwlock_destroy(&l); }
+    void rlock() { pthread_rwlock_rdlock(&l); }
+    void runlock() { pthread_rwlock_unlock(&l); }
+    void wlock() { pthread_rwlock_wrlock(&l); }
+    void wunlock() { pthread_rwlock_unlock(&l); }
+};
+
+template <typename T>
+static double bench(unsigned nthreads, long iterations, bool with_writer,
+        double base)
+{
+    T lock;
+    long shared = 0;
+    std::atomic<bool> done(false);
+    std::atomic<long> writes(0);
+    std::vector<sched::thread*> readers;
+    for (unsigned i = 0; i < nthreads; i++) {
+        readers.push_back(new sched::thread([&] {
+            long sum = 0;
+            for (long j = 0; j < iterations; j++) {
+                lock.rlock();
+                sum += shared;
+                lock.runlock();
+            }
+            // keep the compiler from optimizing away the reads
+            if (sum < 0) {
+                printf("impossible\n");
+            }
+        }, sched::thread::attr().pin(sched::cpus[i])));
+    }
+    std::unique_ptr<sched::thread> writer;
+    if (with_writer) {
+        writer.reset(new sched::thread([&] {
+            while (!done.load(std::memory_order_relaxed)) {
+                lock.wlock();
+                shared++;
+                lock.wunlock();
+                writes++;
+                sched::thread::sleep(std::chrono::milliseconds(1));
+            }
+        }));
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    if (writer) {
+        writer->start();
+    }
+    for (auto t : readers) {
+        t->start();
+    }
+    for (auto t : readers) {
+        t->join();
+        delete t;
+    }
+    std::chrono::duration<double> sec = std::chrono::high_resolution_clock::now() - start;
+    done = true;
+    if (writer) {
+        writer->join();
+    }
+
+    auto mops = nthreads * iterations / sec.count() / 1e6;
+    printf("%-20s %2u cpus: %8.1f Mreads/s (x%.1f)", T::name(), nthreads, mops,
+            base ? mops / base : 1.0);
+    if (with_writer) {
+        printf(", %ld writes/s", long(writes / sec.count()));
+    }
+    printf("\n");
+    return mops;
+}
+
+template <typename T>
+static void scale(long iterations, bool with_writer)
+{
+    double base = 0;
+    for (unsigned n = 1; n <= sched::cpus.size(); n *= 2) {
+        auto mops = bench<T>(n, iterations, with_writer, base);
+        if (n == 1) {
+            base = mops;
+        }
+    }
+}
+
+int main(int ac, char** av)
+{
+    long iterations = ac > 1 ? atol(av[1]) : 10000000;
+    for (bool with_writer : { false, true }) {
+        printf(with_writer ? "\nreaders and a writer:\n" : "readers only:\n");
+        scale<plain_rwlock>(iterations, with_writer);
+        scale<read_mostly_rwlock>(iterations, with_writer);
+        scale<posix_rwlock>(iterations, with_writer);
+    }
+}
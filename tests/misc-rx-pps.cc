@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure the rate of UDP packets received, and how often the virtio-net
+// receive path had to allocate a new buffer instead of reusing one from
+// its pool. In steady state, it should not need to allocate at all.
+//
+// Usage: misc-rx-pps.so [port [seconds]]
+//
+// Then flood the guest from the host with small UDP packets, e.g.:
+//
+// $ iperf -u -c <guest ip> -p 5001 -l 64 -b 1000M -t 30
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+
+#include <osv/trace.hh>
+
+// Counts the hits of a tracepoint, whether or not it is enabled
+class tracepoint_counter : public tracepoint_base::probe {
+public:
+    explicit tracepoint_counter(const char* name) {
+        for (auto& tp : tracepoint_base::tp_list) {
+            if (!strcmp(tp.name, name)) {
+                _tp = &tp;
+                _tp->add_probe(this);
+            }
+        }
+    }
+    virtual ~tracepoint_counter() {
+        if (_tp) {
+            _tp->del_probe(this);
+        }
+    }
+    virtual void hit() { _count.fetch_add(1, std::memory_order_relaxed); }
+    long read() { return _count.load(); }
+private:
+    tracepoint_base* _tp = nullptr;
+    std::atomic<long> _count{0};
+};
+
+int main(int ac, char** av)
+{
+    int port = ac > 1 ? atoi(av[1]) : 5001;
+    int seconds = ac > 2 ? atoi(av[2]) : 30;
+
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) {
+        perror("socket");
+        return 1;
+    }
+    int rcvbuf = 4 << 20;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    timeval tv = { 1, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        perror("bind");
+        return 1;
+    }
+    printf("receiving on port %d for %d seconds\n", port, seconds);
+
+    tracepoint_counter misses("virtio_net_rx_pool_miss");
+    char buf[2048];
+    long total = 0, total_misses = 0;
+    double total_sec = 0;
+    for (int i = 0; i < seconds; i++) {
+        long packets = 0;
+        long misses_before = misses.read();
+        auto start = std::chrono::high_resolution_clock::now();
+        auto end = start + std::chrono::seconds(1);
+        while (std::chrono::high_resolution_clock::now() < end) {
+            if (recv(s, buf, sizeof(buf), 0) > 0) {
+                packets++;
+            }
+        }
+        auto sec = std::chrono::duration<double>(
+                std::chrono::high_resolution_clock::now() - start).count();
+        long m = misses.read() - misses_before;
+        printf("%.0f pps, %ld rx buffer allocations\n", packets / sec, m);
+        if (packets) {
+            total += packets;
+            total_misses += m;
+            total_sec += sec;
+        }
+    }
+    if (total) {
+        printf("average %.0f pps, %.4f rx buffer allocations per packet\n",
+                total / total_sec, (double)total_misses / total);
+    }
+    close(s);
+    return 0;
+}
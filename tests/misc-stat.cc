@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure stat() throughput on a large directory tree, from one thread and
+// from one thread per cpu, for files which exist and for files which don't.
+// With a scalable dentry cache, throughput should grow with the number of
+// threads and not depend much on the size of the tree.
+//
+// Usage: misc-stat.so [directory [ndirs [files-per-dir]]]
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr int iterations = 200000;
+
+static std::string file_path(const std::string& root, int dir, int file)
+{
+    return root + "/d" + std::to_string(dir) + "/f" + std::to_string(file);
+}
+
+static void bench(const std::string& root, int ndirs, int nfiles,
+        unsigned nthreads, bool existing)
+{
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (unsigned t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            std::mt19937 rand(t);
+            struct stat st;
+            for (int i = 0; i < iterations; i++) {
+                auto dir = rand() % ndirs;
+                auto file = rand() % nfiles;
+                auto path = file_path(root, dir, existing ? file : file + nfiles);
+                if ((stat(path.c_str(), &st) == 0) != existing) {
+                    errors++;
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto sec = std::chrono::duration<double>(end - start).count();
+    std::cout << nthreads << " threads, " << (existing ? "existing" : "missing")
+              << " files: " << nthreads * iterations / sec / 1000
+              << " Kstat/s";
+    if (errors) {
+        std::cout << " (" << errors << " unexpected results)";
+    }
+    std::cout << "\n";
+}
+
+static void print_cache_stats()
+{
+    char buf[1024];
+    int fd = open("/proc/vfscache", O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    auto n = read(fd, buf, sizeof(buf) - 1);
+    if (n > 0) {
+        buf[n] = '\0';
+        std::cout << buf;
+    }
+    close(fd);
+}
+
+int main(int ac, char** av)
+{
+    std::string root = ac > 1 ? av[1] : "/tmp/misc-stat";
+    int ndirs = ac > 2 ? atoi(av[2]) : 100;
+    int nfiles = ac > 3 ? atoi(av[3]) : 1000;
+
+    std::cout << "creating " << ndirs * nfiles << " files in " << root << "\n";
+    mkdir(root.c_str(), 0755);
+    for (int d = 0; d < ndirs; d++) {
+        auto dir = root + "/d" + std::to_string(d);
+        if (mkdir(dir.c_str(), 0755) < 0) {
+            perror("mkdir");
+            return 1;
+        }
+        for (int f = 0; f < nfiles; f++) {
+            int fd = creat(file_path(root, d, f).c_str(), 0644);
+            if (fd < 0) {
+                perror("creat");
+                return 1;
+            }
+            close(fd);
+        }
+    }
+
+    auto ncpus = std::thread::hardware_concurrency();
+    for (auto existing : { true, false }) {
+        for (auto nthreads : { 1u, ncpus }) {
+            bench(root, ndirs, nfiles, nthreads, existing);
+        }
+    }
+    print_cache_stats();
+
+    for (int d = 0; d < ndirs; d++) {
+        for (int f = 0; f < nfiles; f++) {
+            unlink(file_path(root, d, f).c_str());
+        }
+        rmdir((root + "/d" + std::to_string(d)).c_str());
+    }
+    rmdir(root.c_str());
+    return 0;
+}
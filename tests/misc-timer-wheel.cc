@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure the cost of setting and cancelling timers when many timers are
+// outstanding, as happens with many tcp connections each having its
+// retransmission timer re-armed on every ack. Timers are mostly cancelled
+// before they expire, so this is what we churn here. Each cpu runs a thread
+// keeping 100,000 timers armed, randomly re-arming them. Afterwards, the
+// lateness of short sleeps is measured while all those timers are armed.
+
+#include <osv/sched.hh>
+#include <osv/clock.hh>
+#include <osv/debug.hh>
+
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace osv::clock::literals;
+
+static constexpr unsigned outstanding = 100000;
+static constexpr unsigned iterations = 10000000;
+static constexpr unsigned sleeps = 100;
+
+static s64 nanotime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+                (osv::clock::uptime::now().time_since_epoch()).count();
+}
+
+static void churn(unsigned cpu)
+{
+    std::minstd_rand rand(cpu);
+    auto& self = *sched::thread::current();
+    std::vector<std::unique_ptr<sched::timer>> timers;
+    // Timeouts between 1 and 100 seconds, so that none expires during
+    // the test.
+    auto timeout = [&] { return 1_s + std::chrono::milliseconds(rand() % 99000); };
+    auto now = osv::clock::uptime::now();
+    for (unsigned i = 0; i < outstanding; i++) {
+        timers.emplace_back(new sched::timer(self));
+        timers.back()->set(now + timeout());
+    }
+
+    auto beg = nanotime();
+    for (unsigned i = 0; i < iterations; i++) {
+        auto& t = timers[rand() % outstanding];
+        t->cancel();
+        t->set(osv::clock::uptime::now() + timeout());
+    }
+    auto ns = nanotime() - beg;
+
+    s64 late = 0;
+    for (unsigned i = 0; i < sleeps; i++) {
+        auto start = nanotime();
+        sched::thread::sleep(1_ms);
+        late += nanotime() - start - 1000000;
+    }
+
+    debug("cpu %d: %d ns per cancel+set with %d timers armed, "
+            "1ms sleeps %d ns late\n", cpu, ns / iterations, outstanding,
+            late / sleeps);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::unique_ptr<sched::thread>> threads;
+    for (auto c : sched::cpus) {
+        auto id = c->id;
+        threads.emplace_back(new sched::thread([=] { churn(id); },
+                sched::thread::attr().pin(c)));
+    }
+    for (auto& t : threads) {
+        t->start();
+    }
+    for (auto& t : threads) {
+        t->join();
+    }
+    return 0;
+}
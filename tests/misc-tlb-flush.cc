@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure the cost of munmap() of a single page, which needs a TLB
+// shootdown, with an increasing number of threads doing it concurrently,
+// and show the TLB flush counters: how many flushes used invlpg, how many
+// were batched into another thread's round of IPIs, how many idle cpus were
+// left to flush lazily, and how long the rounds of IPIs took.
+//
+// Usage: misc-tlb-flush.so [iterations]
+
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <osv/mmu.hh>
+#include <osv/sched.hh>
+
+void unmap_loop(int iterations)
+{
+    for (int i = 0; i < iterations; i++) {
+        char *p = reinterpret_cast<char*>(mmap(nullptr, 4096, PROT_READ|PROT_WRITE,
+                MAP_ANONYMOUS|MAP_PRIVATE, -1, 0));
+        p[0] = 0xfe;
+        munmap(p, 4096);
+    }
+}
+
+void bench(unsigned nthreads, int iterations)
+{
+    auto before = mmu::get_tlb_flush_stats();
+    auto start = std::chrono::system_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back([=] { unmap_loop(iterations); });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double> t = std::chrono::system_clock::now() - start;
+    auto after = mmu::get_tlb_flush_stats();
+
+    printf("%2u threads: %8.0f munmap/s, %lu flushes (%lu ranged, %lu batched), "
+            "%lu shootdowns, %lu ipis, %lu lazy\n",
+            nthreads, nthreads * iterations / t.count(),
+            after.flushes - before.flushes, after.ranged - before.ranged,
+            after.batched - before.batched, after.shootdowns - before.shootdowns,
+            after.ipis - before.ipis, after.lazy - before.lazy);
+    printf("    shootdown latency:");
+    for (unsigned i = 0; i < mmu::tlb_flush_stats::latency_buckets; i++) {
+        auto n = after.latency[i] - before.latency[i];
+        if (n && i + 1 == mmu::tlb_flush_stats::latency_buckets) {
+            printf(" >=%uus:%lu", 1u << (i - 1), n);
+        } else if (n) {
+            printf(" <%uus:%lu", 1u << i, n);
+        }
+    }
+    printf("\n");
+}
+
+int main(int ac, char** av)
+{
+    int iterations = ac > 1 ? atoi(av[1]) : 100000;
+    for (unsigned n = 1; n <= 2 * sched::cpus.size(); n *= 2) {
+        bench(n, iterations);
+    }
+}
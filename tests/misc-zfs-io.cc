@@ -7,6 +7,7 @@
 
 #include "stat.hh"
 #include <assert.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -15,6 +16,9 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 #include <chrono>
+#include <string>
+#include <vector>
+#include <osv/run.hh>
 
 #define MB (1024 * 1024)
 #define BUF_SIZE 4096
@@ -70,6 +74,85 @@ static void seq_read(int fd, char *buf, unsigned long size, unsigned long offset
         (double) size / MB, duration, (double) size / MB / duration);
 }
 
+// Text resembling a log file, which is what our compressed datasets mostly
+// hold. It is longer than a ZFS record, so records don't repeat.
+static std::vector<char> log_text(size_t size)
+{
+    std::vector<char> text(size);
+    size_t pos = 0;
+    std::srand(0);
+    while (pos < size) {
+        char line[128];
+        int n = snprintf(line, sizeof(line),
+            "2014-05-%02d %02d:%02d:%02d.%03d INFO [worker-%d] request %08x "
+            "GET /api/v1/items/%d took %d us\n", rand() % 28 + 1,
+            rand() % 24, rand() % 60, rand() % 60, rand() % 1000, rand() % 16,
+            rand(), rand() % 100000, rand() % 5000);
+        n = MIN((size_t)n, size - pos);
+        memcpy(&text[pos], line, n);
+        pos += n;
+    }
+    return text;
+}
+
+static bool zfs_cmd(std::vector<std::string> args)
+{
+    int ret;
+    args.insert(args.begin(), "zfs");
+    return osv::run("/zfs.so", args, &ret) && ret == 0;
+}
+
+// Write and read back a file of log text with each compression algorithm,
+// reporting throughput and the compression ratio achieved. The file is
+// larger than the ARC, so that reads have to decompress.
+static void compression_bench(const char *dataset, unsigned long size)
+{
+    const char *path = "/zfs-io-compress-file";
+    auto text = log_text(MB);
+    char buf[BUF_SIZE];
+
+    for (auto algo : { "off", "lzjb", "zle", "gzip-1", "gzip", "lz4" }) {
+        if (!zfs_cmd({"set", std::string("compression=") + algo, dataset})) {
+            printf("%-7s: not supported\n", algo);
+            continue;
+        }
+        int fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_LARGEFILE, 0644);
+        assert(fd > 0);
+
+        auto start_time = s_clock.now();
+        for (unsigned long pos = 0; pos < size; pos += BUF_SIZE) {
+            if (write(fd, &text[pos % text.size()], BUF_SIZE) != BUF_SIZE) {
+                perror("write");
+                exit(1);
+            }
+        }
+        // Compression happens when the transaction group is written out
+        fsync(fd);
+        sync();
+        auto write_time = to_seconds(s_clock.now() - start_time);
+
+        struct stat st;
+        fstat(fd, &st);
+
+        lseek(fd, 0, SEEK_SET);
+        start_time = s_clock.now();
+        for (unsigned long pos = 0; pos < size; pos += BUF_SIZE) {
+            if (read(fd, buf, BUF_SIZE) != BUF_SIZE) {
+                perror("read");
+                exit(1);
+            }
+        }
+        auto read_time = to_seconds(s_clock.now() - start_time);
+
+        printf("%-7s: write %8.3f MB/s, read %8.3f MB/s, ratio %.2fx\n", algo,
+            (double) size / MB / write_time, (double) size / MB / read_time,
+            (double) size / MAX(st.st_blocks * 512, 1));
+        close(fd);
+        unlink(path);
+    }
+    zfs_cmd({"inherit", "compression", dataset});
+}
+
 int main(int argc, char **argv)
 {
     char fpath[64] = "/zfs-io-file";
@@ -80,6 +163,7 @@ int main(int argc, char **argv)
     bool rdonly = false;
     bool all_cached = false;
     bool unlink_file = true;
+    const char *compression_dataset = nullptr;
 
     for (int i = 1; i < argc; i++) {
         if (!strcmp("--random", argv[i])) {
@@ -90,9 +174,21 @@ int main(int argc, char **argv)
             all_cached = true;
         } else if (!strcmp("--no-unlink", argv[i])) {
             unlink_file = false;
+        } else if (!strcmp("--compression", argv[i])) {
+            // defaults to the dataset holding "/"
+            compression_dataset = "osv/zfs";
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2)) {
+                compression_dataset = argv[++i];
+            }
         }
     }
 
+    if (compression_dataset) {
+        compression_bench(compression_dataset,
+            kmem_size() + (kmem_size() * 50U / 100U));
+        return 0;
+    }
+
     if (all_cached) {
         size = kmem_size() * 40U / 100U;
     } else if (random) {
@@ -143,6 +143,36 @@ int main(int ac, char** av)
     r = read(s[0], &c, 1);
     report(r == 1, "read the last byte on the pipe");
 
+    ////////////////////////////////////////////////////////////////////////////
+    // Test EPOLLONESHOT: after one event is reported, the fd is disabled
+    // until it is re-armed with EPOLL_CTL_MOD.
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u32 = 789;
+    r = epoll_ctl(ep, EPOLL_CTL_MOD, s[0], &event);
+    report(r == 0, "epoll_ctl_mod (EPOLLONESHOT)");
+    r = write(s[1], &c, 1);
+    report(r == 1, "write single character");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 1 && (events[0].events & EPOLLIN) &&
+            (events[0].data.u32 == 789), "epoll_wait finds fd (EPOLLONESHOT)");
+    r = write(s[1], &c, 1);
+    report(r == 1, "write single character");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 0, "epoll_wait doesn't find disarmed fd (EPOLLONESHOT)");
+    r = epoll_ctl(ep, EPOLL_CTL_MOD, s[0], &event);
+    report(r == 0, "epoll_ctl_mod re-arms fd");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 1 && (events[0].events & EPOLLIN) &&
+            (events[0].data.u32 == 789), "epoll_wait finds re-armed fd");
+    char buf[2];
+    r = read(s[0], buf, 2);
+    report(r == 2, "read the last bytes on the pipe");
+
+    r = epoll_ctl(ep, EPOLL_CTL_DEL, s[0], &event);
+    report(r == 0, "epoll_ctl_del");
+    r = epoll_ctl(ep, EPOLL_CTL_DEL, s[0], &event);
+    report(r == -1 && errno == ENOENT, "epoll_ctl_del of unregistered fd");
+
 
     std::cout << "SUMMARY: " << tests << ", " << fails << " failures\n";
 }
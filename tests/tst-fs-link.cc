@@ -111,8 +111,12 @@ int main(int argc, char *argv[])
     report(fd > 0, "create a file");
     report(close(fd) == 0, "close the file");
 
+    // Looking up the link's path first caches it as missing
+    report(stat(newpath, &st[1]) < 0 && errno == ENOENT, "stat returns ENOENT before the link exists");
+
     // Create a hard link
     report(link(oldpath, newpath) == 0, "create a hard link");
+    report(stat(newpath, &st[1]) == 0, "stat the hard link right after creating it");
 
     report(link(oldpath, newpath) < 0 && errno == EEXIST, "link returns EEXIST if destination path exists");
 
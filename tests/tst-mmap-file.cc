@@ -95,6 +95,39 @@ int main(int argc, char *argv[])
     report(verify_pattern(fd, size/2, 0xfe, MAP_PRIVATE, 0) == 0, "verify pattern didn't change in unmapped part");
     report(verify_pattern(fd, size/2, 0x0f, MAP_PRIVATE, size/2) == 0, "verify pattern changed in mapped part");
 
+    // Shared mappings of a file share its pages, and see write()s to it
+    auto* m1 = reinterpret_cast<unsigned char*>(mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0));
+    auto* m2 = reinterpret_cast<unsigned char*>(mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0));
+    report(m1 != MAP_FAILED && m2 != MAP_FAILED, "map file shared twice");
+    m1[100] = 0x42;
+    report(m2[100] == 0x42, "store to one shared mapping is seen by the other");
+    unsigned char c = 0x43;
+    report(pwrite(fd, &c, 1, size/2 + 1) == 1 && m1[size/2 + 1] == 0x43,
+            "write() is seen by shared mapping");
+    report(ftruncate(fd, size/2) == 0 && ftruncate(fd, size) == 0 && m2[size/2 + 1] == 0,
+            "truncated part of shared mapping reads as zeros");
+    report(munmap(m1, size) == 0 && munmap(m2, size) == 0, "unmap shared mappings");
+    report(pread(fd, &c, 1, 100) == 1 && c == 0x42, "store to shared mapping was written to file");
+
+    // Splitting a shared mapping (partial mprotect() or munmap()) must keep
+    // it shared, and not free the page cache's pages
+    m1 = reinterpret_cast<unsigned char*>(mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0));
+    m2 = reinterpret_cast<unsigned char*>(mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0));
+    report(m1 != MAP_FAILED && m2 != MAP_FAILED, "map file shared twice again");
+    m1[0] = 0x44;
+    m1[size/2] = 0x45;
+    report(mprotect(m1 + size/2, size/2, PROT_READ) == 0, "mprotect part of shared mapping");
+    report(munmap(m1, size/2) == 0, "unmap part of shared mapping");
+    report(m1[size/2] == 0x45 && m2[0] == 0x44 && m2[size/2] == 0x45,
+            "split shared mapping still maps the file's pages");
+    m2[size/2] = 0x46;
+    report(m1[size/2] == 0x46, "store is seen by the split mapping");
+    c = 0x47;
+    report(pwrite(fd, &c, 1, size/2) == 1 && m1[size/2] == 0x47 && m2[size/2] == 0x47,
+            "write() is seen by the split mapping");
+    report(munmap(m1 + size/2, size/2) == 0 && munmap(m2, size) == 0, "unmap split mappings");
+    report(pread(fd, &c, 1, 0) == 1 && c == 0x44, "store to split mapping was written to file");
+
     report(check_mapping(NULL, size, MAP_SHARED | MAP_PRIVATE, fd, 0, EINVAL) == 0,
         "force EINVAL by not passing neither MAP_PRIVATE nor MAP_SHARED.");
     report(check_mapping(NULL, size, 0, fd, 0, EINVAL) == 0,
@@ -158,6 +158,33 @@ int main(void)
     printf("ts2 = %ld,%ld\n",ts2.tv_sec, ts2.tv_nsec);
     printf("ns = %ld\n",ns);
 
+    // pthread_rwlock_timedrdlock() and pthread_rwlock_timedwrlock() give up
+    // at the deadline if the lock is held, and take it if it isn't.
+    pthread_rwlock_t rw;
+    pthread_rwlock_init(&rw, NULL);
+    clock_gettime(CLOCK_REALTIME, &to);
+    to.tv_nsec += 100000000;
+    if (to.tv_nsec >= 1000000000) {
+        to.tv_sec++;
+        to.tv_nsec -= 1000000000;
+    }
+    pthread_rwlock_wrlock(&rw);
+    r = pthread_rwlock_timedrdlock(&rw, &to);
+    report("pthread_rwlock_timedrdlock (write locked)", r == ETIMEDOUT);
+    pthread_rwlock_unlock(&rw);
+    r = pthread_rwlock_timedrdlock(&rw, &to);
+    report("pthread_rwlock_timedrdlock (unlocked)", r == 0);
+    r = pthread_rwlock_timedwrlock(&rw, &to);
+    report("pthread_rwlock_timedwrlock (read locked)", r == ETIMEDOUT);
+    pthread_rwlock_unlock(&rw);
+    r = pthread_rwlock_timedwrlock(&rw, &to);
+    report("pthread_rwlock_timedwrlock (unlocked)", r == 0);
+    pthread_rwlock_unlock(&rw);
+    r = pthread_rwlock_tryrdlock(&rw);
+    report("pthread_rwlock_tryrdlock after timeouts", r == 0);
+    pthread_rwlock_unlock(&rw);
+    pthread_rwlock_destroy(&rw);
+
     printf("SUMMARY: %u tests / %u failures\n", tests_total, tests_failed);
     return tests_failed == 0 ? 0 : 1;
 }
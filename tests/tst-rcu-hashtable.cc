@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests for osv::rcu_hashtable: basic operations, resizing, and lookups
+// running concurrently with updates.
+
+#include <osv/rcu-hashtable.hh>
+#include <osv/mutex.h>
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, std::string msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+struct entry {
+    int key;
+    int value;
+};
+
+struct entry_hash {
+    size_t operator()(const entry& e) const { return std::hash<int>()(e.key); }
+    size_t operator()(int key) const { return std::hash<int>()(key); }
+};
+
+struct entry_equal {
+    bool operator()(const entry& a, const entry& b) const { return a.key == b.key; }
+    bool operator()(const entry& a, int key) const { return a.key == key; }
+};
+
+using table = osv::rcu_hashtable<entry, entry_hash, entry_equal>;
+
+static bool lookup(table& ht, int key, int& value)
+{
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto e = ht.reader_find(key, entry_hash(), entry_equal());
+        if (!e) {
+            return false;
+        }
+        value = e->value;
+    }
+    return true;
+}
+
+int main(int ac, char** av)
+{
+    constexpr int n = 100000;
+    mutex mtx;
+    table ht;
+
+    int v;
+    report(!lookup(ht, 1, v), "lookup in empty table");
+
+    WITH_LOCK(mtx) {
+        for (int i = 0; i < n; i++) {
+            ht.emplace(entry{i, i * 2});
+        }
+    }
+    report(ht.size() == n, "size after inserts");
+    report(ht.bucket_count() >= n / 2, "table grew");
+
+    bool ok = true;
+    for (int i = 0; i < n; i++) {
+        ok &= lookup(ht, i, v) && v == i * 2;
+    }
+    report(ok, "find all inserted keys");
+    report(!lookup(ht, n, v), "don't find missing key");
+
+    // Readers looking up the keys we never remove must always find them,
+    // even while the table is resized under them.
+    std::atomic<bool> done(false);
+    std::atomic<bool> reader_ok(true);
+    std::thread reader([&] {
+        while (!done.load()) {
+            for (int i = 0; i < n; i += 2) {
+                if (!lookup(ht, i, v) || v != i * 2) {
+                    reader_ok.store(false);
+                }
+            }
+        }
+    });
+
+    WITH_LOCK(mtx) {
+        for (int i = 1; i < n; i += 2) {
+            ok &= ht.erase(i, entry_hash(), entry_equal());
+        }
+    }
+    report(ok, "erase odd keys");
+    report(ht.size() == n / 2, "size after erase");
+    WITH_LOCK(mtx) {
+        report(!ht.erase(1, entry_hash(), entry_equal()), "erase missing key");
+    }
+
+    ok = true;
+    for (int i = 0; i < n; i++) {
+        bool found = lookup(ht, i, v);
+        ok &= (i % 2) ? !found : (found && v == i * 2);
+    }
+    report(ok, "find only even keys");
+
+    done.store(true);
+    reader.join();
+    report(reader_ok.load(), "concurrent readers");
+
+    WITH_LOCK(mtx) {
+        for (int i = 0; i < n - 2; i += 2) {
+            ht.erase(entry{i, 0});
+        }
+    }
+    report(ht.size() == 1, "size after erasing almost everything");
+    report(ht.bucket_count() < n / 2, "table shrank");
+
+    // Adding an element equal to an existing one replaces it
+    WITH_LOCK(mtx) {
+        report(!ht.emplace(entry{n - 2, 7}), "emplace of an existing key");
+    }
+    report(ht.size() == 1 && lookup(ht, n - 2, v) && v == 7,
+            "existing key was replaced");
+    WITH_LOCK(mtx) {
+        ok = ht.erase(n - 2, entry_hash(), entry_equal());
+        ok &= !ht.erase(n - 2, entry_hash(), entry_equal());
+    }
+    report(ok && ht.size() == 0, "no duplicate left after erase");
+
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests for rcu grace periods: a grace period, normal or expedited, waits
+// for readers which are in progress, and callbacks queued from every cpu all
+// run. misc-rcu-sync compares the latency of the two kinds.
+
+#include <osv/rcu.hh>
+#include <osv/sched.hh>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, std::string msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+static void test_waits_for_readers(void (*sync)(), std::string name)
+{
+    std::atomic<bool> in_reader(false), reader_done(false);
+    std::thread reader([&] {
+        WITH_LOCK(osv::rcu_read_lock) {
+            in_reader = true;
+            auto end = std::chrono::high_resolution_clock::now()
+                    + std::chrono::milliseconds(50);
+            while (std::chrono::high_resolution_clock::now() < end) {
+                // busy wait, without leaving the read-side critical section
+            }
+            reader_done = true;
+        }
+    });
+    while (!in_reader) {
+        sched::thread::yield();
+    }
+    sync();
+    report(reader_done, name + " waits for readers");
+    reader.join();
+}
+
+// Callbacks may still run after the test returns if it fails, so what
+// they touch mustn't live on its stack
+static std::atomic<int> callbacks_ran;
+
+static void test_all_callbacks_run()
+{
+    constexpr int per_thread = 100000;
+    callbacks_ran = 0;
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < sched::cpus.size(); i++) {
+        threads.emplace_back([&] {
+            for (int j = 0; j < per_thread; j++) {
+                osv::rcu_defer([] { callbacks_ran++; });
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    // Each cpu's rcu thread runs its own callbacks when the grace period
+    // is over, and nothing waits for all of them, so poll.
+    int expected = per_thread * int(threads.size());
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (callbacks_ran < expected &&
+            std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    report(callbacks_ran == expected, "callbacks queued on all cpus run");
+}
+
+int main(int argc, char **argv)
+{
+    test_waits_for_readers(osv::rcu_synchronize, "rcu_synchronize");
+    test_waits_for_readers(osv::rcu_synchronize_expedited,
+            "rcu_synchronize_expedited");
+    test_all_callbacks_run();
+
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
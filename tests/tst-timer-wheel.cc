@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests for the timer wheel of sched::timer_list, on a private timer_list
+// whose ticks we advance by hand: timers further out than the wheel's span
+// wait on the overflow list, survive wheel wraps until they are within
+// reach, and then reach the near list when due.
+
+#include <osv/sched.hh>
+
+#include <iostream>
+#include <string>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, std::string msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+namespace sched {
+
+class timer_list_test {
+public:
+    // Never armed through set(), so destroying it doesn't touch the cpu's
+    // timer_list
+    struct test_timer : timer_base {
+        test_timer(client& c, unsigned long tick) : timer_base(c) {
+            _time = timer_list::from_tick(tick);
+        }
+        int level() const { return _wheel_level; }
+    };
+    struct test_client : timer_base::client {
+        virtual void timer_fired() override {}
+    };
+
+    static void run()
+    {
+        constexpr unsigned long wrap =
+                1UL << (timer_list::nr_levels * timer_list::slot_shift);
+        timer_list l;
+        test_client c;
+        test_timer near(c, 5), far(c, 3 * wrap + 5);
+
+        l._wheel_tick = 1;
+        l.insert(near);
+        l.insert(far);
+        report(far.level() == int(timer_list::nr_levels),
+                "timer beyond the wheel's span is on the overflow list");
+
+        l.advance(wrap + 1);
+        report(near.level() == -1, "due timer moved to the near list");
+        report(far.level() == int(timer_list::nr_levels) && l._wheel_timers == 1,
+                "timer beyond the next wrap stays on the overflow list");
+
+        l.advance(2 * wrap + 1);
+        report(far.level() == int(timer_list::nr_levels),
+                "timer stays on the overflow list over another wrap");
+
+        l.advance(3 * wrap);
+        report(far.level() >= 0 && far.level() < int(timer_list::nr_levels),
+                "timer within the wheel's span moved to the wheel");
+
+        l.advance(3 * wrap + 5);
+        report(far.level() == -1 && l._wheel_timers == 0,
+                "far timer reached the near list when due");
+
+        l.remove(near);
+        l.remove(far);
+        report(l.empty(), "timer list empty");
+    }
+};
+
+}
+
+int main(int argc, char **argv)
+{
+    sched::timer_list_test::run();
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
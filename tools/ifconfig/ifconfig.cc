@@ -285,6 +285,9 @@ int main(int argc, const char **argv)
                    bytes2str(cur_data.ifi_ibytes).c_str());
             printf("        Rx errors  %ld  dropped %ld\n",
                    cur_data.ifi_ierrors, cur_data.ifi_iqdrops) ;
+            if (cur_data.ifi_ilro_queued)
+                printf("        Rx LRO  %ld packets coalesced into %ld\n",
+                       cur_data.ifi_ilro_queued, cur_data.ifi_ilro_flushed) ;
             printf("        TX packets %ld  bytes %ld %s\n",
                    cur_data.ifi_opackets, cur_data.ifi_obytes,
                    bytes2str(cur_data.ifi_obytes).c_str());